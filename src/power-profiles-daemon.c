@@ -12,18 +12,30 @@
 
 #include "config.h"
 
+#include <gio/gunixfdlist.h>
 #include <glib-unix.h>
 #include <locale.h>
 #include <polkit/polkit.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <unistd.h>
 
 #include "power-profiles-daemon-resources.h"
 #include "power-profiles-daemon.h"
 #include "ppd-driver-cpu.h"
 #include "ppd-driver-platform.h"
 #include "ppd-action.h"
+#include "ppd-config.h"
+#include "ppd-custom-profile.h"
 #include "ppd-enums.h"
+#include "ppd-power-budget.h"
+#include "ppd-power-supply.h"
+#include "ppd-stats.h"
+#include "ppd-trace.h"
+#include "ppd-utils.h"
+#include "ppd-workload.h"
 
 #define POWER_PROFILES_DBUS_NAME          "org.freedesktop.UPower.PowerProfiles"
 #define POWER_PROFILES_DBUS_PATH          "/org/freedesktop/UPower/PowerProfiles"
@@ -37,6 +49,18 @@
 
 #define POWER_PROFILES_RESOURCES_PATH "/org/freedesktop/UPower/PowerProfiles"
 
+#define PROBE_CACHE_GROUP                 "ProbeCache"
+#define STATE_SAVE_DELAY                  500 /* ms */
+#define AUTO_MODE_GROUP                   "Auto"
+#define AUTO_MODE_DEFAULT_INTERVAL        1000 /* ms */
+#define AUTO_MODE_MAX_INTERVAL_FACTOR     8
+#define POWER_BUDGET_GROUP                "PowerBudget"
+#define POWER_BUDGET_DEFAULT_INTERVAL     1000 /* ms */
+#define POWER_BUDGET_MAX_INTERVAL_FACTOR  8
+#define OBJECTS_GROUP                     "Objects"
+#define CPUFREQ_POLICY_DIR                "/sys/devices/system/cpu/cpufreq/"
+#define POWER_SUPPLY_GROUP                "PowerSupply"
+
 #define UPOWER_DBUS_NAME                  "org.freedesktop.UPower"
 #define UPOWER_DBUS_PATH                  "/org/freedesktop/UPower"
 #define UPOWER_DBUS_INTERFACE             "org.freedesktop.UPower"
@@ -60,10 +84,23 @@ typedef struct {
   gboolean replace;
   gboolean disable_upower;
   gboolean disable_logind;
+  gboolean disable_probe_cache;
+  gint properties_changed_delay;
+  gboolean parallel_probe;
+  gdouble battery_hysteresis;
+  gint battery_min_interval;
   GStrv blocked_drivers;
   GStrv blocked_actions;
 } DebugOptions;
 
+typedef enum {
+  MONITOR_BATTERY_STATE  = 1 << 0,
+  MONITOR_BATTERY_CHANGE = 1 << 1,
+  MONITOR_SUSPEND        = 1 << 2,
+} MonitorFlags;
+
+typedef struct _Transition Transition;
+
 typedef struct {
   GMainLoop *main_loop;
   GDBusConnection *connection;
@@ -75,16 +112,36 @@ typedef struct {
 
   GKeyFile *config;
   char *config_path;
+  guint save_config_id; /* pending write of config */
 
   PolkitAuthority *auth;
 
   PpdProfile active_profile;
   PpdProfile selected_profile;
+  GPtrArray *custom_profiles;
+  PpdCustomProfile *selected_custom; /* applied whenever its base profile is */
+  PpdCustomProfile *active_custom;
   GPtrArray *probed_drivers;
   PpdDriverCpu *cpu_driver;
   PpdDriverPlatform *platform_driver;
   GPtrArray *actions;
+  gboolean drivers_probed;
+  MonitorFlags needed_monitors;
   GHashTable *profile_holds;
+  GHashTable *profile_holds_by_requester;
+  guint profile_hold_counts[NUM_PROFILES];
+  guint last_hold_cookie;
+
+  Transition *transition;
+  GQueue *pending_ops;
+
+  guint pending_properties;
+  guint properties_flush_id;
+  GVariant *profiles_variant;
+  GVariant *actions_variant;
+  GVariant *profile_holds_variant;
+  guint64 state_generation;
+  GVariant *state_variant;
 
   GDBusProxy *upower_proxy;
   GDBusProxy *upower_display_proxy;
@@ -92,10 +149,22 @@ typedef struct {
   gulong upower_display_watch_id;
   gulong upower_properties_id;
   gulong upower_display_properties_id;
+  PpdPowerSupplyMonitor *power_supply_monitor;
   PpdPowerChangedReason power_changed_reason;
+  gint64 last_battery_change;
+  gdouble pending_battery_level;
+  guint battery_timeout_id;
+
+  PpdWorkload *workload;
+  guint workload_timeout_id;
+
+  PpdPowerBudget *power_budget;
+  guint power_budget_timeout_id;
 
   guint logind_sleep_signal_id;
 
+  GUdevClient *cpu_udev_client;
+
   DebugOptions *debug_options;
 } PpdApp;
 
@@ -105,8 +174,39 @@ typedef struct {
   char *application_id;
   char *requester;
   char *requester_iface;
+  GArray *cpus; /* for holds scoped to some CPUs, or NULL */
+  GVariant *variant;
 } ProfileHold;
 
+/* All the holds of a D-Bus client, released together when it goes
+ * away, which a single watch on its name is enough to notice */
+typedef struct {
+  guint watch_id;
+  GArray *cookies;
+} RequesterHolds;
+
+/* Requests that arrived while a profile transition was in flight, and
+ * that will be handled in order once it completes */
+typedef enum {
+  PENDING_OP_SET_PROFILE,
+  PENDING_OP_HOLD_PROFILE,
+  PENDING_OP_RELEASE_PROFILE,
+  PENDING_OP_DRIVER_PROFILE_CHANGED,
+  PENDING_OP_POWER_CHANGED,
+  PENDING_OP_BATTERY_CHANGED,
+  PENDING_OP_PREPARE_FOR_SLEEP,
+  PENDING_OP_RESTART_DRIVERS,
+} PendingOpType;
+
+typedef struct {
+  PendingOpType type;
+  guint value;            /* profile, cookie, power changed reason or sleep state */
+  PpdCustomProfile *custom; /* custom profile to set along with the profile */
+  gdouble level;          /* battery level */
+  GArray *cpus;           /* CPUs a hold is scoped to */
+  GPtrArray *invocations; /* D-Bus calls to reply to once handled */
+} PendingOp;
+
 static void
 debug_options_free(DebugOptions *options)
 {
@@ -125,19 +225,59 @@ profile_hold_free (ProfileHold *hold)
   g_free (hold->application_id);
   g_free (hold->requester);
   g_free (hold->requester_iface);
+  g_clear_pointer (&hold->cpus, g_array_unref);
+  g_clear_pointer (&hold->variant, g_variant_unref);
   g_free (hold);
 }
 
+static void
+requester_holds_free (RequesterHolds *holds)
+{
+  g_bus_unwatch_name (holds->watch_id);
+  g_array_unref (holds->cookies);
+  g_free (holds);
+}
+
+static PendingOp *
+pending_op_new (PendingOpType          type,
+                guint                  value,
+                GDBusMethodInvocation *invocation)
+{
+  PendingOp *op;
+
+  op = g_new0 (PendingOp, 1);
+  op->type = type;
+  op->value = value;
+  op->invocations = g_ptr_array_new_with_free_func (g_object_unref);
+  if (invocation)
+    g_ptr_array_add (op->invocations, g_object_ref (invocation));
+
+  return op;
+}
+
+static void
+pending_op_free (PendingOp *op)
+{
+  g_clear_pointer (&op->cpus, g_array_unref);
+  g_ptr_array_unref (op->invocations);
+  g_free (op);
+}
+
 static PpdApp *ppd_app = NULL;
 
 static void stop_profile_drivers (PpdApp *data);
 static void start_profile_drivers (PpdApp *data);
 static void upower_battery_set_power_changed_reason (PpdApp *, PpdPowerChangedReason);
+static void run_or_queue_pending_op (PpdApp *data, PendingOp *op);
+static void process_pending_operations (PpdApp *data);
+static void holder_disappeared (GDBusConnection *connection, const gchar *name, gpointer user_data);
 
 /* profile drivers and actions */
 #include "ppd-action-trickle-charge.h"
 #include "ppd-action-amdgpu-panel-power.h"
 #include "ppd-action-amdgpu-dpm.h"
+#include "ppd-action-pcie-power.h"
+#include "ppd-action-gpu-freq.h"
 #include "ppd-driver-placeholder.h"
 #include "ppd-driver-platform-profile.h"
 #include "ppd-driver-intel-pstate.h"
@@ -146,20 +286,30 @@ static void upower_battery_set_power_changed_reason (PpdApp *, PpdPowerChangedRe
 
 typedef GType (*GTypeGetFunc) (void);
 
-static GTypeGetFunc objects[] = {
+/* The names match the driver and action names, so that blocked objects
+ * don't need to be created to be skipped. Drivers whose probe changes
+ * the hardware, or grabs the terminal, are never probed ahead of time
+ * with --parallel-probe, as a driver before them might get picked. */
+static const struct {
+  GTypeGetFunc get_type;
+  const char *name;
+  gboolean probe_side_effects;
+} objects[] = {
   /* Hardware specific profile drivers */
-  ppd_driver_fake_get_type,
-  ppd_driver_platform_profile_get_type,
-  ppd_driver_intel_pstate_get_type,
-  ppd_driver_amd_pstate_get_type,
+  { ppd_driver_fake_get_type, "fake", TRUE },
+  { ppd_driver_platform_profile_get_type, "platform_profile", FALSE },
+  { ppd_driver_intel_pstate_get_type, "intel_pstate", TRUE },
+  { ppd_driver_amd_pstate_get_type, "amd_pstate", TRUE },
 
   /* Generic profile driver */
-  ppd_driver_placeholder_get_type,
+  { ppd_driver_placeholder_get_type, "placeholder", FALSE },
 
   /* Actions */
-  ppd_action_trickle_charge_get_type,
-  ppd_action_amdgpu_panel_power_get_type,
-  ppd_action_amdgpu_dpm_get_type,
+  { ppd_action_trickle_charge_get_type, "trickle_charge", FALSE },
+  { ppd_action_amdgpu_panel_power_get_type, "amdgpu_panel_power", FALSE },
+  { ppd_action_amdgpu_dpm_get_type, "amdgpu_dpm", FALSE },
+  { ppd_action_pcie_power_get_type, "pcie_power", FALSE },
+  { ppd_action_gpu_freq_get_type, "gpu_freq", FALSE },
 };
 
 typedef enum {
@@ -170,6 +320,8 @@ typedef enum {
   PROP_DEGRADED                   = 1 << 4,
   PROP_ACTIVE_PROFILE_HOLDS       = 1 << 5,
   PROP_VERSION                    = 1 << 6,
+  PROP_CUSTOM_PROFILES            = 1 << 7,
+  PROP_ACTIVE_CUSTOM_PROFILE      = 1 << 8,
 } PropertiesMask;
 
 #define PROP_ALL (PROP_ACTIVE_PROFILE       | \
@@ -178,7 +330,9 @@ typedef enum {
                   PROP_ACTIONS              | \
                   PROP_DEGRADED             | \
                   PROP_ACTIVE_PROFILE_HOLDS | \
-                  PROP_VERSION)
+                  PROP_VERSION              | \
+                  PROP_CUSTOM_PROFILES      | \
+                  PROP_ACTIVE_CUSTOM_PROFILE)
 
 static gboolean
 driver_profile_support (PpdDriver *driver,
@@ -203,32 +357,39 @@ get_active_profile (PpdApp *data)
   return ppd_profile_to_str (data->active_profile);
 }
 
+static const char *
+get_active_custom_profile (PpdApp *data)
+{
+  if (data->active_custom == NULL)
+    return "";
+  return ppd_custom_profile_get_name (data->active_custom);
+}
+
 static char *
 get_performance_degraded (PpdApp *data)
 {
-  const gchar *cpu_degraded = NULL;
-  const gchar *platform_degraded = NULL;
-
-  if (driver_profile_support (PPD_DRIVER (data->platform_driver), PPD_PROFILE_PERFORMANCE))
-    platform_degraded = ppd_driver_get_performance_degraded (PPD_DRIVER (data->platform_driver));
+  const gchar *reasons[4] = { NULL, };
+  guint n_reasons = 0;
 
-  if (driver_profile_support (PPD_DRIVER (data->cpu_driver), PPD_PROFILE_PERFORMANCE))
-    cpu_degraded = ppd_driver_get_performance_degraded (PPD_DRIVER (data->cpu_driver));
+  if (driver_profile_support (PPD_DRIVER (data->cpu_driver), PPD_PROFILE_PERFORMANCE) &&
+      ppd_driver_is_performance_degraded (PPD_DRIVER (data->cpu_driver)))
+    reasons[n_reasons++] = ppd_driver_get_performance_degraded (PPD_DRIVER (data->cpu_driver));
 
-  if (!cpu_degraded && !platform_degraded)
-    return g_strdup ("");
+  if (driver_profile_support (PPD_DRIVER (data->platform_driver), PPD_PROFILE_PERFORMANCE) &&
+      ppd_driver_is_performance_degraded (PPD_DRIVER (data->platform_driver)))
+    reasons[n_reasons++] = ppd_driver_get_performance_degraded (PPD_DRIVER (data->platform_driver));
 
-  if (!cpu_degraded)
-    return g_strdup (platform_degraded);
+  /* Settings stepped down to stay within the power budget */
+  if (data->power_budget != NULL &&
+      ppd_power_budget_get_active_step () > 0 &&
+      ppd_power_budget_get_reason (data->power_budget) != NULL)
+    reasons[n_reasons++] = ppd_power_budget_get_reason (data->power_budget);
 
-  if (!platform_degraded)
-    return g_strdup (cpu_degraded);
-
-  return g_strjoin (",", cpu_degraded, platform_degraded, NULL);
+  return g_strjoinv (",", (char **) reasons);
 }
 
 static GVariant *
-get_profiles_variant (PpdApp *data)
+build_profiles_variant (PpdApp *data)
 {
   GVariantBuilder builder;
   guint i;
@@ -278,7 +439,7 @@ get_profiles_variant (PpdApp *data)
 }
 
 static GVariant *
-get_actions_variant (PpdApp *data)
+build_actions_variant (PpdApp *data)
 {
   GVariantBuilder builder;
   guint i;
@@ -295,7 +456,54 @@ get_actions_variant (PpdApp *data)
 }
 
 static GVariant *
-get_profile_holds_variant (PpdApp *data)
+build_custom_profiles_variant (PpdApp *data)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+
+  for (guint i = 0; i < data->custom_profiles->len; i++) {
+    PpdCustomProfile *custom = g_ptr_array_index (data->custom_profiles, i);
+    GVariantBuilder asv_builder;
+
+    g_variant_builder_init (&asv_builder, G_VARIANT_TYPE ("a{sv}"));
+    g_variant_builder_add (&asv_builder, "{sv}", "Profile",
+                           g_variant_new_string (ppd_custom_profile_get_name (custom)));
+    g_variant_builder_add (&asv_builder, "{sv}", "Inherits",
+                           g_variant_new_string (ppd_profile_to_str (ppd_custom_profile_get_base (custom))));
+    g_variant_builder_add (&builder, "a{sv}", &asv_builder);
+  }
+
+  return g_variant_builder_end (&builder);
+}
+
+static PpdCustomProfile *
+find_custom_profile (PpdApp     *data,
+                     const char *name)
+{
+  for (guint i = 0; i < data->custom_profiles->len; i++) {
+    PpdCustomProfile *custom = g_ptr_array_index (data->custom_profiles, i);
+
+    if (g_strcmp0 (ppd_custom_profile_get_name (custom), name) == 0)
+      return custom;
+  }
+
+  return NULL;
+}
+
+/* The selected custom profile, if @profile is the one it tweaks */
+static PpdCustomProfile *
+custom_for_profile (PpdApp     *data,
+                    PpdProfile  profile)
+{
+  if (data->selected_custom != NULL &&
+      ppd_custom_profile_get_base (data->selected_custom) == profile)
+    return data->selected_custom;
+  return NULL;
+}
+
+static GVariant *
+build_profile_holds_variant (PpdApp *data)
 {
   GVariantBuilder builder;
   GHashTableIter iter;
@@ -305,37 +513,187 @@ get_profile_holds_variant (PpdApp *data)
   g_hash_table_iter_init (&iter, data->profile_holds);
 
   while (g_hash_table_iter_next (&iter, NULL, &value)) {
-    GVariantBuilder asv_builder;
     ProfileHold *hold = value;
 
-    g_variant_builder_init (&asv_builder, G_VARIANT_TYPE ("a{sv}"));
-    g_variant_builder_add (&asv_builder, "{sv}", "ApplicationId",
-                           g_variant_new_string (hold->application_id));
-    g_variant_builder_add (&asv_builder, "{sv}", "Profile",
-                           g_variant_new_string (ppd_profile_to_str (hold->profile)));
-    g_variant_builder_add (&asv_builder, "{sv}", "Reason", g_variant_new_string (hold->reason));
-
-    g_variant_builder_add (&builder, "a{sv}", &asv_builder);
+    g_variant_builder_add_value (&builder, hold->variant);
   }
 
   return g_variant_builder_end (&builder);
 }
 
+/* The lists are only rebuilt when the drivers, actions or holds change,
+ * those getters return a new reference to the cached variant */
+static GVariant *
+get_profiles_variant (PpdApp *data)
+{
+  if (data->profiles_variant == NULL)
+    data->profiles_variant = g_variant_ref_sink (build_profiles_variant (data));
+  return g_variant_ref (data->profiles_variant);
+}
+
+static GVariant *
+get_actions_variant (PpdApp *data)
+{
+  if (data->actions_variant == NULL)
+    data->actions_variant = g_variant_ref_sink (build_actions_variant (data));
+  return g_variant_ref (data->actions_variant);
+}
+
+static GVariant *
+get_profile_holds_variant (PpdApp *data)
+{
+  if (data->profile_holds_variant == NULL)
+    data->profile_holds_variant = g_variant_ref_sink (build_profile_holds_variant (data));
+  return g_variant_ref (data->profile_holds_variant);
+}
+
 static void
-send_dbus_event_iface (PpdApp         *data,
-                       PropertiesMask  mask,
-                       const gchar    *iface,
-                       const gchar    *path)
+invalidate_drivers_variants (PpdApp *data)
 {
-  GVariantBuilder props_builder;
-  GVariant *props_changed = NULL;
+  g_clear_pointer (&data->profiles_variant, g_variant_unref);
+  g_clear_pointer (&data->actions_variant, g_variant_unref);
+}
 
-  g_return_if_fail (data->connection);
+static void
+invalidate_profile_holds_variant (PpdApp *data)
+{
+  g_clear_pointer (&data->profile_holds_variant, g_variant_unref);
+}
 
-  if (mask == 0)
-    return;
+/* Publishes the profile held for every CPU covered by a scoped hold,
+ * for the CPU driver to apply to their policies only */
+static void
+update_scoped_holds (PpdApp *data)
+{
+  g_autoptr(GArray) profiles = NULL;
+  GHashTableIter iter;
+  gpointer value;
 
-  g_return_if_fail ((mask & PROP_ALL) != 0);
+  profiles = g_array_new (FALSE, TRUE, sizeof (PpdProfile));
+  g_hash_table_iter_init (&iter, data->profile_holds);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    ProfileHold *hold = value;
+
+    for (guint i = 0; hold->cpus != NULL && i < hold->cpus->len; i++) {
+      guint cpu = g_array_index (hold->cpus, guint, i);
+      PpdProfile *held;
+
+      if (cpu >= profiles->len)
+        g_array_set_size (profiles, cpu + 1);
+      held = &g_array_index (profiles, PpdProfile, cpu);
+      /* power-saver holds win over performance ones */
+      if (*held != PPD_PROFILE_POWER_SAVER)
+        *held = hold->profile;
+    }
+  }
+
+  ppd_utils_set_scoped_holds (profiles->len > 0 ? profiles : NULL);
+}
+
+/* Holds are indexed by cookie, and by requester so that a client
+ * disconnecting doesn't require going through every hold. Per-profile
+ * counters give the effective hold profile, scoped holds aren't
+ * counted as they don't change the active profile. */
+static void
+profile_hold_insert (PpdApp      *data,
+                     guint        cookie,
+                     ProfileHold *hold)
+{
+  RequesterHolds *holds;
+  GVariantBuilder asv_builder;
+
+  g_variant_builder_init (&asv_builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&asv_builder, "{sv}", "ApplicationId",
+                         g_variant_new_string (hold->application_id));
+  g_variant_builder_add (&asv_builder, "{sv}", "Profile",
+                         g_variant_new_string (ppd_profile_to_str (hold->profile)));
+  g_variant_builder_add (&asv_builder, "{sv}", "Reason", g_variant_new_string (hold->reason));
+  if (hold->cpus != NULL) {
+    g_variant_builder_add (&asv_builder, "{sv}", "Cpus",
+                           g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32,
+                                                      hold->cpus->data, hold->cpus->len,
+                                                      sizeof (guint)));
+  }
+  hold->variant = g_variant_ref_sink (g_variant_builder_end (&asv_builder));
+
+  holds = g_hash_table_lookup (data->profile_holds_by_requester, hold->requester);
+  if (holds == NULL) {
+    holds = g_new0 (RequesterHolds, 1);
+    holds->cookies = g_array_new (FALSE, FALSE, sizeof (guint));
+    holds->watch_id = g_bus_watch_name_on_connection (data->connection, hold->requester,
+                                                      G_BUS_NAME_WATCHER_FLAGS_NONE, NULL,
+                                                      holder_disappeared, data, NULL);
+    g_hash_table_insert (data->profile_holds_by_requester,
+                         g_strdup (hold->requester), holds);
+  }
+  g_array_append_val (holds->cookies, cookie);
+
+  if (hold->cpus == NULL)
+    data->profile_hold_counts[g_bit_nth_lsf (hold->profile, -1)]++;
+  g_hash_table_insert (data->profile_holds, GUINT_TO_POINTER (cookie), hold);
+  if (hold->cpus != NULL)
+    update_scoped_holds (data);
+  invalidate_profile_holds_variant (data);
+  ppd_trace_hold_added (cookie, hold->profile, hold->application_id);
+}
+
+static void
+profile_hold_remove (PpdApp *data,
+                     guint   cookie)
+{
+  ProfileHold *hold;
+  RequesterHolds *holds;
+  gboolean scoped;
+
+  hold = g_hash_table_lookup (data->profile_holds, GUINT_TO_POINTER (cookie));
+  g_return_if_fail (hold != NULL);
+  scoped = hold->cpus != NULL;
+
+  holds = g_hash_table_lookup (data->profile_holds_by_requester, hold->requester);
+  for (guint i = 0; holds && i < holds->cookies->len; i++) {
+    if (g_array_index (holds->cookies, guint, i) == cookie) {
+      g_array_remove_index_fast (holds->cookies, i);
+      break;
+    }
+  }
+  /* Stops watching the requester with its last hold */
+  if (holds && holds->cookies->len == 0)
+    g_hash_table_remove (data->profile_holds_by_requester, hold->requester);
+
+  if (!scoped)
+    data->profile_hold_counts[g_bit_nth_lsf (hold->profile, -1)]--;
+  ppd_trace_hold_removed (cookie, hold->profile);
+  g_hash_table_remove (data->profile_holds, GUINT_TO_POINTER (cookie));
+  if (scoped)
+    update_scoped_holds (data);
+  invalidate_profile_holds_variant (data);
+}
+
+static void
+profile_hold_remove_all (PpdApp *data)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, data->profile_holds);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    ProfileHold *hold = value;
+
+    ppd_trace_hold_removed (GPOINTER_TO_UINT (key), hold->profile);
+  }
+
+  g_hash_table_remove_all (data->profile_holds);
+  g_hash_table_remove_all (data->profile_holds_by_requester);
+  memset (data->profile_hold_counts, 0, sizeof (data->profile_hold_counts));
+  ppd_utils_set_scoped_holds (NULL);
+  invalidate_profile_holds_variant (data);
+}
+
+static GVariant *
+build_properties_variant (PpdApp         *data,
+                          PropertiesMask  mask)
+{
+  GVariantBuilder props_builder;
 
   g_variant_builder_init (&props_builder, G_VARIANT_TYPE ("a{sv}"));
 
@@ -343,6 +701,10 @@ send_dbus_event_iface (PpdApp         *data,
     g_variant_builder_add (&props_builder, "{sv}", "ActiveProfile",
                            g_variant_new_string (get_active_profile (data)));
   }
+  if (mask & PROP_ACTIVE_CUSTOM_PROFILE) {
+    g_variant_builder_add (&props_builder, "{sv}", "ActiveCustomProfile",
+                           g_variant_new_string (get_active_custom_profile (data)));
+  }
   if (mask & PROP_INHIBITED) {
     g_variant_builder_add (&props_builder, "{sv}", "PerformanceInhibited",
                            g_variant_new_string (""));
@@ -353,24 +715,39 @@ send_dbus_event_iface (PpdApp         *data,
                            g_variant_new_take_string (g_steal_pointer (&degraded)));
   }
   if (mask & PROP_PROFILES) {
-    g_variant_builder_add (&props_builder, "{sv}", "Profiles",
-                           get_profiles_variant (data));
+    g_autoptr(GVariant) profiles = get_profiles_variant (data);
+    g_variant_builder_add (&props_builder, "{sv}", "Profiles", profiles);
   }
   if (mask & PROP_ACTIONS) {
-    g_variant_builder_add (&props_builder, "{sv}", "Actions",
-                           get_actions_variant (data));
+    g_autoptr(GVariant) actions = get_actions_variant (data);
+    g_variant_builder_add (&props_builder, "{sv}", "Actions", actions);
   }
   if (mask & PROP_ACTIVE_PROFILE_HOLDS) {
-    g_variant_builder_add (&props_builder, "{sv}", "ActiveProfileHolds",
-                           get_profile_holds_variant (data));
+    g_autoptr(GVariant) holds = get_profile_holds_variant (data);
+    g_variant_builder_add (&props_builder, "{sv}", "ActiveProfileHolds", holds);
   }
   if (mask & PROP_VERSION) {
     g_variant_builder_add (&props_builder, "{sv}", "Version",
                            g_variant_new_string (VERSION));
   }
+  if (mask & PROP_CUSTOM_PROFILES) {
+    g_variant_builder_add (&props_builder, "{sv}", "CustomProfiles",
+                           build_custom_profiles_variant (data));
+  }
+
+  return g_variant_ref_sink (g_variant_builder_end (&props_builder));
+}
+
+static void
+send_dbus_event_iface (PpdApp      *data,
+                       GVariant    *props,
+                       const gchar *iface,
+                       const gchar *path)
+{
+  GVariant *props_changed = NULL;
 
   props_changed = g_variant_new ("(s@a{sv}@as)", iface,
-                                 g_variant_builder_end (&props_builder),
+                                 props,
                                  g_variant_new_strv (NULL, 0));
 
   g_dbus_connection_emit_signal (data->connection,
@@ -381,23 +758,117 @@ send_dbus_event_iface (PpdApp         *data,
                                  props_changed, NULL);
 }
 
-static void
-send_dbus_event (PpdApp         *data,
-                 PropertiesMask  mask)
+static gboolean
+flush_dbus_events (gpointer user_data)
 {
-  send_dbus_event_iface (data, mask,
+  PpdApp *data = user_data;
+  g_autoptr(GVariant) props = NULL;
+  PropertiesMask mask = data->pending_properties;
+
+  data->properties_flush_id = 0;
+  data->pending_properties = 0;
+
+  g_return_val_if_fail (data->connection, G_SOURCE_REMOVE);
+
+  props = build_properties_variant (data, mask);
+  send_dbus_event_iface (data, props,
                          POWER_PROFILES_IFACE_NAME,
                          POWER_PROFILES_DBUS_PATH);
-  send_dbus_event_iface (data, mask,
+  send_dbus_event_iface (data, props,
                          POWER_PROFILES_LEGACY_IFACE_NAME,
                          POWER_PROFILES_LEGACY_DBUS_PATH);
+
+  return G_SOURCE_REMOVE;
 }
 
+/* Changes are batched, and sent once per main loop iteration, or after
+ * --properties-changed-delay milliseconds */
 static void
-save_configuration (PpdApp *data)
+send_dbus_event (PpdApp         *data,
+                 PropertiesMask  mask)
+{
+  g_return_if_fail (data->connection);
+
+  if (mask == 0)
+    return;
+
+  g_return_if_fail ((mask & PROP_ALL) != 0);
+
+  /* Every state change goes through here */
+  data->state_generation++;
+  g_clear_pointer (&data->state_variant, g_variant_unref);
+
+  data->pending_properties |= mask;
+  if (data->properties_flush_id != 0)
+    return;
+
+  if (data->debug_options->properties_changed_delay > 0)
+    data->properties_flush_id = g_timeout_add (data->debug_options->properties_changed_delay,
+                                               flush_dbus_events, data);
+  else
+    data->properties_flush_id = g_idle_add (flush_dbus_events, data);
+}
+
+/* All the properties in one dict, rebuilt only after they changed, for
+ * clients to get the whole state in a single call */
+static GVariant *
+get_state_variant (PpdApp  *data,
+                   guint64  if_changed_since)
+{
+  if (if_changed_since != 0 && if_changed_since == data->state_generation)
+    return g_variant_new ("(t@a{sv})", data->state_generation,
+                          g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0));
+
+  if (data->state_variant == NULL)
+    data->state_variant = build_properties_variant (data, PROP_ALL);
+  return g_variant_new ("(t@a{sv})", data->state_generation, data->state_variant);
+}
+
+static void
+write_configuration (PpdApp *data)
 {
   g_autoptr(GError) error = NULL;
 
+  /* Written to a temporary file, then renamed over the old one */
+  if (!g_key_file_save_to_file (data->config, data->config_path, &error))
+    g_warning ("Could not save configuration file '%s': %s", data->config_path, error->message);
+}
+
+static gboolean
+save_configuration_cb (gpointer user_data)
+{
+  PpdApp *data = user_data;
+
+  data->save_config_id = 0;
+  write_configuration (data);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Changes made in quick succession, such as scripts toggling profiles,
+ * get written out once */
+static void
+schedule_configuration_save (PpdApp *data)
+{
+  if (data->save_config_id != 0)
+    return;
+
+  data->save_config_id = g_timeout_add (STATE_SAVE_DELAY, save_configuration_cb, data);
+}
+
+static void
+flush_configuration (PpdApp *data)
+{
+  if (data->save_config_id == 0)
+    return;
+
+  g_clear_handle_id (&data->save_config_id, g_source_remove);
+  write_configuration (data);
+}
+
+static void
+save_configuration (PpdApp *data)
+{
   if (PPD_IS_DRIVER_CPU (data->cpu_driver)) {
     g_key_file_set_string (data->config, "State", "CpuDriver",
                            ppd_driver_get_driver_name (PPD_DRIVER (data->cpu_driver)));
@@ -410,9 +881,13 @@ save_configuration (PpdApp *data)
 
   g_key_file_set_string (data->config, "State", "Profile",
                          ppd_profile_to_str (data->active_profile));
+  if (data->active_custom != NULL)
+    g_key_file_set_string (data->config, "State", "CustomProfile",
+                           ppd_custom_profile_get_name (data->active_custom));
+  else
+    g_key_file_remove_key (data->config, "State", "CustomProfile", NULL);
 
-  if (!g_key_file_save_to_file (data->config, data->config_path, &error))
-    g_warning ("Could not save configuration file '%s': %s", data->config_path, error->message);
+  schedule_configuration_save (data);
 }
 
 static gboolean
@@ -420,7 +895,9 @@ apply_configuration (PpdApp *data)
 {
   g_autofree char *platform_driver = NULL;
   g_autofree char *profile_str = NULL;
+  g_autofree char *custom_str = NULL;
   g_autofree char *cpu_driver = NULL;
+  PpdCustomProfile *custom;
   PpdProfile profile;
 
   cpu_driver = g_key_file_get_string (data->config, "State", "CpuDriver", NULL);
@@ -447,6 +924,21 @@ apply_configuration (PpdApp *data)
 
   g_debug ("Applying profile '%s' from configuration file", profile_str);
   data->active_profile = profile;
+  data->selected_profile = profile;
+
+  custom_str = g_key_file_get_string (data->config, "State", "CustomProfile", NULL);
+  if (custom_str == NULL)
+    return TRUE;
+
+  custom = find_custom_profile (data, custom_str);
+  if (custom == NULL || ppd_custom_profile_get_base (custom) != profile) {
+    g_debug ("Resetting unknown configuration custom profile '%s'", custom_str);
+    g_key_file_remove_key (data->config, "State", "CustomProfile", NULL);
+    return TRUE;
+  }
+
+  g_debug ("Applying custom profile '%s' from configuration file", custom_str);
+  data->selected_custom = custom;
   return TRUE;
 }
 
@@ -465,8 +957,10 @@ load_configuration (PpdApp *data)
 }
 
 static void
-actions_activate_profile (GPtrArray *actions,
-                          PpdProfile profile)
+actions_activate_profile (GPtrArray        *actions,
+                          PpdProfile        profile,
+                          PpdCustomProfile *custom,
+                          PpdJournal       *journal)
 {
   guint i;
 
@@ -474,168 +968,798 @@ actions_activate_profile (GPtrArray *actions,
 
   for (i = 0; i < actions->len; i++) {
     g_autoptr(GError) error = NULL;
+    PpdProfile action_profile = profile;
     PpdAction *action;
+    guint savepoint;
 
     action = g_ptr_array_index (actions, i);
+    savepoint = ppd_journal_get_length (journal);
+
+    if (custom != NULL &&
+        ppd_custom_profile_get_action_profile (custom,
+                                               ppd_action_get_action_name (action),
+                                               &action_profile) &&
+        action_profile == PPD_PROFILE_UNSET) {
+      g_debug ("Custom profile '%s' leaves action '%s' alone",
+               ppd_custom_profile_get_name (custom),
+               ppd_action_get_action_name (action));
+      continue;
+    }
 
-    if (!ppd_action_activate_profile (action, profile, &error))
+    if (!ppd_action_activate_profile (action, action_profile, &error)) {
       g_warning ("Failed to activate action '%s' to profile %s: %s",
-                 ppd_profile_to_str (profile),
                  ppd_action_get_action_name (action),
+                 ppd_profile_to_str (action_profile),
                  error->message);
+      g_clear_error (&error);
+
+      /* Actions are optional, but shouldn't be left half-applied */
+      if (!ppd_journal_rollback (journal, savepoint, &error))
+        g_warning ("Failed to roll back action '%s': %s",
+                   ppd_action_get_action_name (action),
+                   error->message);
+    }
+  }
+}
+
+/* Profile transitions run each of their stages in a worker thread, so
+ * that slow firmware or GPU writes don't stall the main loop, and with
+ * it every other D-Bus client. Only one transition is in flight at any
+ * time, requests arriving in the meantime are queued in pending_ops. */
+typedef enum {
+  ACTIVATION_STAGE_CPU,
+  ACTIVATION_STAGE_PLATFORM,
+  ACTIVATION_STAGE_ACTIONS,
+  N_ACTIVATION_STAGES
+} ActivationStage;
+
+static const struct {
+  const char *name;
+  guint timeout; /* in seconds */
+} activation_stages[N_ACTIVATION_STAGES] = {
+  [ACTIVATION_STAGE_CPU] = { "CPU driver", 5 },
+  [ACTIVATION_STAGE_PLATFORM] = { "platform driver", 5 },
+  [ACTIVATION_STAGE_ACTIONS] = { "actions", 10 },
+};
+
+struct _Transition {
+  PpdApp *app;
+  GTask *task;
+  PpdProfile target_profile;
+  PpdProfile previous_profile;
+  PpdProfileActivationReason reason;
+  PpdDriver *cpu_driver;
+  PpdDriver *platform_driver;
+  GPtrArray *actions;
+  ActivationStage stage;
+  guint applied_stages;
+  GCancellable *stage_cancellable;
+  guint stage_timeout_id;
+  gboolean timed_out;
+  gboolean completed;
+  gint64 start_time;
+  PpdJournal *journal;
+  PpdCustomProfile *custom;
+  PpdCustomProfile *previous_custom;
+};
+
+static void transition_run_stage (Transition *transition);
+
+static void
+transition_free (Transition *transition)
+{
+  g_clear_handle_id (&transition->stage_timeout_id, g_source_remove);
+  g_clear_object (&transition->stage_cancellable);
+  g_clear_object (&transition->task);
+  g_clear_object (&transition->cpu_driver);
+  g_clear_object (&transition->platform_driver);
+  g_clear_pointer (&transition->actions, g_ptr_array_unref);
+  g_clear_pointer (&transition->journal, ppd_journal_free);
+  g_free (transition);
+}
+
+static gboolean
+activation_stage_needed (Transition      *transition,
+                         ActivationStage  stage)
+{
+  switch (stage) {
+  case ACTIVATION_STAGE_CPU:
+    return transition->cpu_driver != NULL;
+  case ACTIVATION_STAGE_PLATFORM:
+    return transition->platform_driver != NULL;
+  case ACTIVATION_STAGE_ACTIONS:
+    return transition->actions->len > 0;
+  default:
+    break;
   }
+
+  g_return_val_if_reached (FALSE);
 }
 
+/* Called from a worker thread */
 static gboolean
-activate_target_profile (PpdApp                      *data,
-                         PpdProfile                   target_profile,
-                         PpdProfileActivationReason   reason,
-                         GError                     **error)
+run_activation_stage (Transition                  *transition,
+                      ActivationStage              stage,
+                      PpdProfile                   profile,
+                      PpdCustomProfile            *custom,
+                      PpdProfileActivationReason   reason,
+                      GError                     **error)
+{
+  switch (stage) {
+  case ACTIVATION_STAGE_CPU:
+    if (!ppd_driver_activate_profile (transition->cpu_driver, profile, reason, error)) {
+      g_prefix_error (error, "Failed to activate CPU driver '%s': ",
+                      ppd_driver_get_driver_name (transition->cpu_driver));
+      return FALSE;
+    }
+    return TRUE;
+  case ACTIVATION_STAGE_PLATFORM:
+    if (!ppd_driver_activate_profile (transition->platform_driver, profile, reason, error)) {
+      g_prefix_error (error, "Failed to activate platform driver '%s': ",
+                      ppd_driver_get_driver_name (transition->platform_driver));
+      return FALSE;
+    }
+    return TRUE;
+  case ACTIVATION_STAGE_ACTIONS:
+    actions_activate_profile (transition->actions, profile, custom, transition->journal);
+    return TRUE;
+  default:
+    break;
+  }
+
+  g_return_val_if_reached (FALSE);
+}
+
+static void
+activation_stage_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
 {
-  PpdProfile current_profile = data->active_profile;
+  Transition *transition = task_data;
+  PpdJournal *previous;
+  GError *error = NULL;
+  gboolean ret;
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  previous = ppd_utils_journal_begin (transition->journal);
+  ret = run_activation_stage (transition,
+                              transition->stage,
+                              transition->target_profile,
+                              transition->custom,
+                              transition->reason,
+                              &error);
+  ppd_utils_journal_end (previous);
+
+  if (!ret) {
+    g_task_return_error (task, error);
+    return;
+  }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+activation_revert_thread (GTask        *task,
+                          gpointer      source_object,
+                          gpointer      task_data,
+                          GCancellable *cancellable)
+{
+  Transition *transition = task_data;
+  g_autoptr(GError) rollback_error = NULL;
+  PpdJournal *previous;
+
+  previous = ppd_utils_journal_begin (transition->journal);
+
+  g_debug ("Rolling back %u writes from profile '%s'",
+           ppd_journal_get_length (transition->journal),
+           ppd_profile_to_str (transition->target_profile));
+  if (!ppd_journal_rollback (transition->journal, 0, &rollback_error))
+    g_warning ("Failed to roll back profile '%s': %s",
+               ppd_profile_to_str (transition->target_profile),
+               rollback_error->message);
+
+  /* The hardware has its prior values back, but drivers and actions
+   * still need to know about the restored profile. The writes already
+   * done by the rollback are skipped by the journal. */
+  for (int stage = N_ACTIVATION_STAGES - 1; stage >= 0; stage--) {
+    g_autoptr(GError) error = NULL;
+
+    if (!(transition->applied_stages & (1 << stage)))
+      continue;
+
+    g_debug ("Reverting %s to profile '%s'",
+             activation_stages[stage].name,
+             ppd_profile_to_str (transition->previous_profile));
+
+    if (!run_activation_stage (transition, stage,
+                               transition->previous_profile,
+                               transition->previous_custom,
+                               PPD_PROFILE_ACTIVATION_REASON_INTERNAL,
+                               &error))
+      g_warning ("Failed to revert %s: %s",
+                 activation_stages[stage].name, error->message);
+  }
+
+  ppd_utils_journal_end (previous);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+transition_return (Transition *transition,
+                   GError     *error)
+{
+  g_autoptr(GTask) task = g_steal_pointer (&transition->task);
+
+  if (task == NULL) {
+    g_clear_error (&error);
+    return;
+  }
+
+  if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+transition_finish (Transition *transition)
+{
+  PpdApp *data = transition->app;
+
+  g_assert (data->transition == transition);
+  if (transition->completed)
+    ppd_trace_transition_end (PPD_TRACE_RESULT_COMPLETED);
+  else if (transition->timed_out)
+    ppd_trace_transition_end (PPD_TRACE_RESULT_TIMED_OUT);
+  else
+    ppd_trace_transition_end (PPD_TRACE_RESULT_FAILED);
+  data->transition = NULL;
+  transition_free (transition);
+
+  process_pending_operations (data);
+}
+
+static void
+transition_complete (Transition *transition)
+{
+  PpdApp *data = transition->app;
+
+  data->active_profile = transition->target_profile;
+  if (data->active_custom != transition->custom) {
+    data->active_custom = transition->custom;
+    send_dbus_event (data, PROP_ACTIVE_CUSTOM_PROFILE);
+  }
+  ppd_stats_record_timing_since ("transition", transition->start_time);
+  transition->completed = TRUE;
+
+  if (transition->reason == PPD_PROFILE_ACTIVATION_REASON_USER ||
+      transition->reason == PPD_PROFILE_ACTIVATION_REASON_INTERNAL)
+    save_configuration (data);
+
+  transition_return (transition, NULL);
+  transition_finish (transition);
+}
+
+static void
+activation_revert_done_cb (GObject      *source_object,
+                           GAsyncResult *res,
+                           gpointer      user_data)
+{
+  transition_finish (user_data);
+}
+
+static void
+transition_revert (Transition *transition)
+{
+  g_autoptr(GTask) task = NULL;
+
+  ppd_custom_profile_set_active (transition->previous_custom);
+
+  /* A failed stage might still have written some of its files */
+  if (transition->applied_stages == 0 &&
+      ppd_journal_get_length (transition->journal) == 0) {
+    transition_finish (transition);
+    return;
+  }
+
+  task = g_task_new (NULL, NULL, activation_revert_done_cb, transition);
+  g_task_set_source_tag (task, transition_revert);
+  g_task_set_task_data (task, transition, NULL);
+  g_task_run_in_thread (task, activation_revert_thread);
+}
+
+static gboolean
+activation_stage_timeout_cb (gpointer user_data)
+{
+  Transition *transition = user_data;
+  const char *stage_name = activation_stages[transition->stage].name;
+
+  transition->stage_timeout_id = 0;
+
+  g_warning ("Timed out activating %s for profile '%s'",
+             stage_name, ppd_profile_to_str (transition->target_profile));
+
+  /* The stage can't be interrupted, so the transition only finishes,
+   * and reverts, once the worker returns. The caller doesn't need
+   * to wait for that though. */
+  transition->timed_out = TRUE;
+  g_cancellable_cancel (transition->stage_cancellable);
+  transition_return (transition,
+                     g_error_new (G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                                  "Timed out activating %s", stage_name));
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+activation_stage_done_cb (GObject      *source_object,
+                          GAsyncResult *res,
+                          gpointer      user_data)
+{
+  Transition *transition = user_data;
+  g_autoptr(GError) error = NULL;
+
+  g_clear_handle_id (&transition->stage_timeout_id, g_source_remove);
+  g_clear_object (&transition->stage_cancellable);
+
+  if (g_task_propagate_boolean (G_TASK (res), &error))
+    transition->applied_stages |= 1 << transition->stage;
+
+  if (transition->timed_out) {
+    transition_revert (transition);
+    return;
+  }
+
+  if (error) {
+    transition_return (transition, g_steal_pointer (&error));
+    transition_revert (transition);
+    return;
+  }
+
+  transition->stage++;
+  transition_run_stage (transition);
+}
+
+static void
+transition_run_stage (Transition *transition)
+{
+  g_autoptr(GTask) task = NULL;
+
+  while (transition->stage < N_ACTIVATION_STAGES &&
+         !activation_stage_needed (transition, transition->stage))
+    transition->stage++;
+
+  if (transition->stage == N_ACTIVATION_STAGES) {
+    transition_complete (transition);
+    return;
+  }
+
+  transition->stage_cancellable = g_cancellable_new ();
+  task = g_task_new (NULL, transition->stage_cancellable,
+                     activation_stage_done_cb, transition);
+  g_task_set_source_tag (task, transition_run_stage);
+  g_task_set_task_data (task, transition, NULL);
+
+  transition->stage_timeout_id =
+    g_timeout_add_seconds (activation_stages[transition->stage].timeout,
+                           activation_stage_timeout_cb, transition);
+  g_task_run_in_thread (task, activation_stage_thread);
+}
+
+static void
+activate_target_profile (PpdApp                     *data,
+                         PpdProfile                  target_profile,
+                         PpdProfileActivationReason  reason,
+                         GAsyncReadyCallback         callback,
+                         gpointer                    user_data)
+{
+  PpdCustomProfile *custom;
+  Transition *transition;
+
+  g_return_if_fail (data->transition == NULL);
 
   g_info ("Setting active profile '%s' for reason '%s' (current: '%s')",
            ppd_profile_to_str (target_profile),
            ppd_profile_activation_reason_to_str (reason),
-           ppd_profile_to_str (current_profile));
-
-  /* Try CPU first */
-  if (driver_profile_support (PPD_DRIVER (data->cpu_driver), target_profile) &&
-      !ppd_driver_activate_profile (PPD_DRIVER (data->cpu_driver),
-                                    target_profile, reason, error)) {
-    g_prefix_error (error, "Failed to activate CPU driver '%s': ",
-                    ppd_driver_get_driver_name (PPD_DRIVER (data->cpu_driver)));
-    return FALSE;
+           ppd_profile_to_str (data->active_profile));
+  custom = custom_for_profile (data, target_profile);
+  if (custom != NULL)
+    g_info ("Using custom profile '%s'", ppd_custom_profile_get_name (custom));
+
+  /* Other tools might have changed attributes behind our back, and the
+   * user expects their choice to be applied in full */
+  if (reason == PPD_PROFILE_ACTIVATION_REASON_USER) {
+    guint drifted, checked;
+
+    drifted = ppd_utils_reconcile_write_cache (&checked);
+    g_debug ("%u of %u cached attributes changed since last written", drifted, checked);
+  }
+
+  transition = g_new0 (Transition, 1);
+  transition->app = data;
+  transition->start_time = g_get_monotonic_time ();
+  transition->task = g_task_new (NULL, NULL, callback, user_data);
+  g_task_set_source_tag (transition->task, activate_target_profile);
+  transition->target_profile = target_profile;
+  transition->previous_profile = data->active_profile;
+  transition->reason = reason;
+  transition->journal = ppd_journal_new ();
+  transition->custom = custom;
+  transition->previous_custom = data->active_custom;
+  ppd_trace_transition_begin (transition->previous_profile,
+                              transition->target_profile,
+                              ppd_profile_activation_reason_to_str (reason));
+
+  /* Drivers look the custom profile up from their workers */
+  ppd_custom_profile_set_active (transition->custom);
+
+  /* The workers get their own references, drivers might be
+   * reloaded before they return */
+  if (driver_profile_support (PPD_DRIVER (data->cpu_driver), target_profile))
+    transition->cpu_driver = g_object_ref (PPD_DRIVER (data->cpu_driver));
+  if (driver_profile_support (PPD_DRIVER (data->platform_driver), target_profile))
+    transition->platform_driver = g_object_ref (PPD_DRIVER (data->platform_driver));
+  transition->actions = g_ptr_array_new_with_free_func (g_object_unref);
+  for (guint i = 0; i < data->actions->len; i++)
+    g_ptr_array_add (transition->actions,
+                     g_object_ref (g_ptr_array_index (data->actions, i)));
+
+  data->transition = transition;
+  transition_run_stage (transition);
+}
+
+static gboolean
+activate_target_profile_finish (GAsyncResult  *res,
+                                GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (res, NULL), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+typedef struct {
+  PpdApp *data;
+  PpdProfile profile;
+  PpdProfileActivationReason reason;
+  guint mask;
+  GPtrArray *invocations;
+  GVariant *reply;
+} ActivationRequest;
+
+static void
+activation_request_free (ActivationRequest *request)
+{
+  g_clear_pointer (&request->invocations, g_ptr_array_unref);
+  g_clear_pointer (&request->reply, g_variant_unref);
+  g_free (request);
+}
+
+static void
+reply_invocations (GPtrArray *invocations,
+                   GVariant  *reply)
+{
+  for (guint i = 0; i < invocations->len; i++) {
+    GDBusMethodInvocation *invocation = g_ptr_array_index (invocations, i);
+
+    g_dbus_method_invocation_return_value (g_object_ref (invocation), reply);
+  }
+}
+
+static void
+profile_activation_done_cb (GObject      *source_object,
+                            GAsyncResult *res,
+                            gpointer      user_data)
+{
+  ActivationRequest *request = user_data;
+  PpdApp *data = request->data;
+  g_autoptr(GError) error = NULL;
+
+  if (!activate_target_profile_finish (res, &error)) {
+    if (request->reason == PPD_PROFILE_ACTIVATION_REASON_USER) {
+      for (guint i = 0; i < request->invocations->len; i++) {
+        GDBusMethodInvocation *invocation = g_ptr_array_index (request->invocations, i);
+
+        g_dbus_method_invocation_return_gerror (g_object_ref (invocation), error);
+      }
+      data->selected_custom = data->active_custom;
+      activation_request_free (request);
+      return;
+    }
+
+    g_warning ("Failed to activate profile '%s': %s",
+               ppd_profile_to_str (request->profile), error->message);
+  } else if (request->reason == PPD_PROFILE_ACTIVATION_REASON_USER ||
+             request->reason == PPD_PROFILE_ACTIVATION_REASON_INTERNAL) {
+    data->selected_profile = request->profile;
+  }
+
+  send_dbus_event (data, request->mask);
+  if (request->invocations)
+    reply_invocations (request->invocations, request->reply);
+  activation_request_free (request);
+}
+
+/* Activates @profile, then sends the @mask property changes, and
+ * replies @reply to @invocations */
+static void
+request_profile_activation (PpdApp                     *data,
+                            PpdProfile                  profile,
+                            PpdProfileActivationReason  reason,
+                            guint                       mask,
+                            GPtrArray                  *invocations,
+                            GVariant                   *reply)
+{
+  ActivationRequest *request;
+
+  request = g_new0 (ActivationRequest, 1);
+  request->data = data;
+  request->profile = profile;
+  request->reason = reason;
+  request->mask = mask;
+  if (invocations)
+    request->invocations = g_ptr_array_ref (invocations);
+  if (reply)
+    request->reply = g_variant_ref_sink (reply);
+
+  activate_target_profile (data, profile, reason,
+                           profile_activation_done_cb, request);
+}
+
+static void
+release_hold_notify (PpdApp      *data,
+                     ProfileHold *hold,
+                     guint        cookie)
+{
+  const char *req_path = POWER_PROFILES_DBUS_PATH;
+
+  if (g_strcmp0 (hold->requester_iface, POWER_PROFILES_LEGACY_IFACE_NAME) == 0)
+    req_path = POWER_PROFILES_LEGACY_DBUS_PATH;
+
+  g_dbus_connection_emit_signal (data->connection, hold->requester, req_path,
+                                 hold->requester_iface, "ProfileReleased",
+                                 g_variant_new ("(u)", cookie), NULL);
+}
+
+static void
+release_all_profile_holds (PpdApp *data)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, data->profile_holds);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    ProfileHold *hold = value;
+    guint cookie = GPOINTER_TO_UINT (key);
+
+    release_hold_notify (data, hold, cookie);
+  }
+  profile_hold_remove_all (data);
+}
+
+static void
+switch_active_profile (PpdApp           *data,
+                       PpdProfile        target_profile,
+                       PpdCustomProfile *custom,
+                       GPtrArray        *invocations)
+{
+  guint mask = PROP_ACTIVE_PROFILE;
+
+  if (target_profile == data->active_profile &&
+      custom == data->active_custom) {
+    data->selected_profile = target_profile;
+    data->selected_custom = custom;
+    reply_invocations (invocations, NULL);
+    return;
+  }
+
+  g_debug ("Transitioning active profile from '%s' to '%s' by user request",
+           ppd_profile_to_str (data->active_profile),
+           ppd_profile_to_str (target_profile));
+  data->selected_custom = custom;
+
+  if (g_hash_table_size (data->profile_holds) != 0 ) {
+    g_debug ("Releasing active profile holds");
+    release_all_profile_holds (data);
+    mask |= PROP_ACTIVE_PROFILE_HOLDS;
   }
 
-  /* Then try platform */
-  if (driver_profile_support (PPD_DRIVER (data->platform_driver), target_profile) &&
-      !ppd_driver_activate_profile (PPD_DRIVER (data->platform_driver),
-                                                target_profile, reason, error)) {
-    g_autoptr(GError) recovery_error = NULL;
+  request_profile_activation (data, target_profile, PPD_PROFILE_ACTIVATION_REASON_USER,
+                              mask, invocations, NULL);
+}
+
+static void
+set_active_profile (PpdApp                *data,
+                    const char            *profile,
+                    GDBusMethodInvocation *invocation)
+{
+  PpdProfile target_profile;
+
+  target_profile = ppd_profile_from_str (profile);
+  if (target_profile == PPD_PROFILE_UNSET) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                           "Invalid profile name '%s'", profile);
+    return;
+  }
+  if (!get_profile_available (data, target_profile)) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                           "Cannot switch to unavailable profile '%s'", profile);
+    return;
+  }
+
+  run_or_queue_pending_op (data, pending_op_new (PENDING_OP_SET_PROFILE, target_profile, invocation));
+  g_object_unref (invocation);
+}
+
+static void
+set_active_custom_profile (PpdApp                *data,
+                           const char            *name,
+                           GDBusMethodInvocation *invocation)
+{
+  PpdCustomProfile *custom;
+  PpdProfile base;
+  PendingOp *op;
+
+  /* An empty name goes back to the plain base profile */
+  if (*name == '\0') {
+    set_active_profile (data, ppd_profile_to_str (data->active_profile), invocation);
+    return;
+  }
+
+  custom = find_custom_profile (data, name);
+  if (custom == NULL) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                           "Invalid custom profile name '%s'", name);
+    return;
+  }
+  base = ppd_custom_profile_get_base (custom);
+  if (!get_profile_available (data, base)) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                           "Cannot switch to custom profile '%s', '%s' is unavailable",
+                                           name, ppd_profile_to_str (base));
+    return;
+  }
 
-    g_prefix_error (error, "Failed to activate platform driver '%s': ",
-                    ppd_driver_get_driver_name (PPD_DRIVER (data->platform_driver)));
+  op = pending_op_new (PENDING_OP_SET_PROFILE, base, invocation);
+  op->custom = custom;
+  run_or_queue_pending_op (data, op);
+  g_object_unref (invocation);
+}
 
-    if (!PPD_IS_DRIVER (data->cpu_driver))
-      return FALSE;
+static PpdProfile
+effective_hold_profile (PpdApp *data)
+{
+  /* power-saver holds win over performance ones */
+  if (data->profile_hold_counts[g_bit_nth_lsf (PPD_PROFILE_POWER_SAVER, -1)] > 0)
+    return PPD_PROFILE_POWER_SAVER;
+  if (data->profile_hold_counts[g_bit_nth_lsf (PPD_PROFILE_PERFORMANCE, -1)] > 0)
+    return PPD_PROFILE_PERFORMANCE;
+  return PPD_PROFILE_UNSET;
+}
 
-    g_debug ("Reverting CPU driver '%s' to profile '%s'",
-              ppd_driver_get_driver_name (PPD_DRIVER (data->cpu_driver)),
-              ppd_profile_to_str (current_profile));
+/* The automatic mode only picks profiles while the user left the
+ * default one selected, and no program holds one */
+static gboolean
+auto_mode_allowed (PpdApp *data)
+{
+  return data->selected_profile == PPD_PROFILE_BALANCED &&
+         data->selected_custom == NULL &&
+         g_hash_table_size (data->profile_holds) == 0;
+}
 
-    if (!ppd_driver_activate_profile (PPD_DRIVER (data->cpu_driver),
-                                      current_profile, PPD_PROFILE_ACTIVATION_REASON_INTERNAL,
-                                      &recovery_error)) {
-      g_warning ("Failed to revert CPU driver '%s': %s",
-                  ppd_driver_get_driver_name (PPD_DRIVER (data->cpu_driver)),
-                  recovery_error->message);
-    }
+static void schedule_auto_mode_sample (PpdApp *data, guint interval);
 
-    return FALSE;
-  }
+static gboolean
+auto_mode_sample_cb (gpointer user_data)
+{
+  PpdApp *data = user_data;
+  PpdProfile target_profile;
 
-  actions_activate_profile (data->actions, target_profile);
+  data->workload_timeout_id = 0;
 
-  data->active_profile = target_profile;
+  if (!auto_mode_allowed (data)) {
+    ppd_workload_reset (data->workload);
+    schedule_auto_mode_sample (data, AUTO_MODE_MAX_INTERVAL_FACTOR *
+                                     ppd_workload_get_interval (data->workload));
+    return G_SOURCE_REMOVE;
+  }
 
-  if (reason == PPD_PROFILE_ACTIVATION_REASON_USER ||
-      reason == PPD_PROFILE_ACTIVATION_REASON_INTERNAL)
-    save_configuration (data);
+  target_profile = ppd_workload_sample (data->workload, data->active_profile);
+  if (target_profile != data->active_profile &&
+      data->transition == NULL &&
+      get_profile_available (data, target_profile)) {
+    g_debug ("Workload calls for profile '%s'", ppd_profile_to_str (target_profile));
+    request_profile_activation (data, target_profile, PPD_PROFILE_ACTIVATION_REASON_AUTO,
+                                PROP_ACTIVE_PROFILE, NULL, NULL);
+  }
 
-  return TRUE;
+  schedule_auto_mode_sample (data, ppd_workload_get_interval (data->workload));
+  return G_SOURCE_REMOVE;
 }
 
 static void
-release_hold_notify (PpdApp      *data,
-                     ProfileHold *hold,
-                     guint        cookie)
+schedule_auto_mode_sample (PpdApp *data,
+                           guint   interval)
 {
-  const char *req_path = POWER_PROFILES_DBUS_PATH;
-
-  if (g_strcmp0 (hold->requester_iface, POWER_PROFILES_LEGACY_IFACE_NAME) == 0)
-    req_path = POWER_PROFILES_LEGACY_DBUS_PATH;
-
-  g_dbus_connection_emit_signal (data->connection, hold->requester, req_path,
-                                 hold->requester_iface, "ProfileReleased",
-                                 g_variant_new ("(u)", cookie), NULL);
+  data->workload_timeout_id = g_timeout_add (interval, auto_mode_sample_cb, data);
 }
 
 static void
-release_all_profile_holds (PpdApp *data)
+start_auto_mode (PpdApp *data)
 {
-  GHashTableIter iter;
-  gpointer key, value;
+  g_autoptr(GKeyFile) config = NULL;
+  gint interval;
 
-  g_hash_table_iter_init (&iter, data->profile_holds);
-  while (g_hash_table_iter_next (&iter, &key, &value)) {
-    ProfileHold *hold = value;
-    guint cookie = GPOINTER_TO_UINT (key);
+  config = ppd_config_get ();
+  if (!g_key_file_get_boolean (config, AUTO_MODE_GROUP, "Enabled", NULL))
+    return;
 
-    release_hold_notify (data, hold, cookie);
-    g_bus_unwatch_name (cookie);
-  }
-  g_hash_table_remove_all (data->profile_holds);
+  interval = g_key_file_get_integer (config, AUTO_MODE_GROUP, "SampleInterval", NULL);
+  if (interval <= 0)
+    interval = AUTO_MODE_DEFAULT_INTERVAL;
+
+  g_debug ("Automatic profile switching enabled, sampling every %d to %d ms",
+           interval, AUTO_MODE_MAX_INTERVAL_FACTOR * interval);
+  data->workload = ppd_workload_new (interval, AUTO_MODE_MAX_INTERVAL_FACTOR * interval);
+  schedule_auto_mode_sample (data, interval);
 }
 
+static void schedule_power_budget_sample (PpdApp *data, guint interval);
+
 static gboolean
-set_active_profile (PpdApp      *data,
-                    const char  *profile,
-                    GError     **error)
+power_budget_sample_cb (gpointer user_data)
 {
-  PpdProfile target_profile;
-  guint mask = PROP_ACTIVE_PROFILE;
-
-  target_profile = ppd_profile_from_str (profile);
-  if (target_profile == PPD_PROFILE_UNSET) {
-    g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                 "Invalid profile name '%s'", profile);
-    return FALSE;
-  }
-  if (!get_profile_available (data, target_profile)) {
-    g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                 "Cannot switch to unavailable profile '%s'", profile);
-    return FALSE;
-  }
-
-  if (target_profile == data->active_profile)
-    return TRUE;
-
-  g_debug ("Transitioning active profile from '%s' to '%s' by user request",
-           ppd_profile_to_str (data->active_profile), profile);
-
-  if (g_hash_table_size (data->profile_holds) != 0 ) {
-    g_debug ("Releasing active profile holds");
-    release_all_profile_holds (data);
-    mask |= PROP_ACTIVE_PROFILE_HOLDS;
+  PpdApp *data = user_data;
+  guint step;
+
+  data->power_budget_timeout_id = 0;
+
+  step = ppd_power_budget_sample (data->power_budget);
+  /* Retried on the next sample if a transition is in flight */
+  if (step != ppd_power_budget_get_active_step () &&
+      data->transition == NULL) {
+    g_debug ("Power budget calls for step %u of the active profile", step);
+    ppd_power_budget_set_active_step (step);
+    request_profile_activation (data, data->active_profile, PPD_PROFILE_ACTIVATION_REASON_POWER_BUDGET,
+                                PROP_DEGRADED, NULL, NULL);
   }
 
-  if (!activate_target_profile (data, target_profile, PPD_PROFILE_ACTIVATION_REASON_USER, error))
-    return FALSE;
-  data->selected_profile = target_profile;
-  send_dbus_event (data, mask);
+  schedule_power_budget_sample (data, ppd_power_budget_get_interval (data->power_budget));
+  return G_SOURCE_REMOVE;
+}
 
-  return TRUE;
+static void
+schedule_power_budget_sample (PpdApp *data,
+                              guint   interval)
+{
+  data->power_budget_timeout_id = g_timeout_add (interval, power_budget_sample_cb, data);
 }
 
-static PpdProfile
-effective_hold_profile (PpdApp *data)
+static void
+start_power_budget (PpdApp *data)
 {
-  GHashTableIter iter;
-  gpointer value;
-  PpdProfile profile = PPD_PROFILE_UNSET;
+  g_autoptr(GKeyFile) config = NULL;
+  gdouble power_limit, temperature_limit;
+  gint interval;
 
-  g_hash_table_iter_init (&iter, data->profile_holds);
-  while (g_hash_table_iter_next (&iter, NULL, &value)) {
-    ProfileHold *hold = value;
+  config = ppd_config_get ();
+  power_limit = g_key_file_get_double (config, POWER_BUDGET_GROUP, "PackagePowerLimit", NULL);
+  temperature_limit = g_key_file_get_double (config, POWER_BUDGET_GROUP, "TemperatureLimit", NULL);
+  if (power_limit <= 0 && temperature_limit <= 0)
+    return;
 
-    if (hold->profile == PPD_PROFILE_POWER_SAVER) {
-      profile = PPD_PROFILE_POWER_SAVER;
-      break;
-    }
-    profile = hold->profile;
-  }
-  return profile;
+  interval = g_key_file_get_integer (config, POWER_BUDGET_GROUP, "SampleInterval", NULL);
+  if (interval <= 0)
+    interval = POWER_BUDGET_DEFAULT_INTERVAL;
+
+  g_debug ("Power budget of %.1f W and %.1f C, sampling every %d to %d ms",
+           power_limit, temperature_limit, interval, POWER_BUDGET_MAX_INTERVAL_FACTOR * interval);
+  data->power_budget = ppd_power_budget_new (interval, POWER_BUDGET_MAX_INTERVAL_FACTOR * interval,
+                                             power_limit, temperature_limit);
+  schedule_power_budget_sample (data, interval);
 }
 
 static void
@@ -662,6 +1786,17 @@ driver_performance_degraded_changed_cb (GObject    *gobject,
   send_dbus_event (data, PROP_DEGRADED);
 }
 
+static void
+follow_driver_profile (PpdApp     *data,
+                       PpdProfile  new_profile)
+{
+  if (new_profile == data->active_profile)
+    return;
+
+  request_profile_activation (data, new_profile, PPD_PROFILE_ACTIVATION_REASON_INTERNAL,
+                              PROP_ACTIVE_PROFILE, NULL, NULL);
+}
+
 static void
 driver_profile_changed_cb (PpdDriver *driver,
                            PpdProfile new_profile,
@@ -673,48 +1808,58 @@ driver_profile_changed_cb (PpdDriver *driver,
            ppd_driver_get_driver_name (driver),
            ppd_profile_to_str (new_profile),
            ppd_profile_to_str (data->active_profile));
-  if (new_profile == data->active_profile)
-    return;
 
-  activate_target_profile (data, new_profile, PPD_PROFILE_ACTIVATION_REASON_INTERNAL, NULL);
-  send_dbus_event (data, PROP_ACTIVE_PROFILE);
+  run_or_queue_pending_op (data, pending_op_new (PENDING_OP_DRIVER_PROFILE_CHANGED, new_profile, NULL));
 }
 
 static void
-release_profile_hold (PpdApp *data,
-                      guint   cookie)
+release_profile_hold (PpdApp    *data,
+                      guint      cookie,
+                      GPtrArray *invocations)
 {
   guint mask = PROP_ACTIVE_PROFILE_HOLDS;
   ProfileHold *hold;
   PpdProfile hold_profile, next_profile;
+  gboolean scoped;
 
   hold = g_hash_table_lookup (data->profile_holds, GUINT_TO_POINTER (cookie));
   if (!hold) {
     g_debug ("No hold with cookie %d", cookie);
+    reply_invocations (invocations, NULL);
     return;
   }
 
-  g_bus_unwatch_name (cookie);
   hold_profile = hold->profile;
+  scoped = hold->cpus != NULL;
   release_hold_notify (data, hold, cookie);
-  g_hash_table_remove (data->profile_holds, GUINT_TO_POINTER (cookie));
+  profile_hold_remove (data, cookie);
+
+  if (scoped) {
+    /* Puts the CPUs of the hold back on the active profile */
+    request_profile_activation (data, data->active_profile, PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD,
+                                mask, invocations, NULL);
+    return;
+  }
 
-  if (g_hash_table_size (data->profile_holds) == 0 &&
+  if (effective_hold_profile (data) == PPD_PROFILE_UNSET &&
       hold_profile != data->selected_profile) {
     g_debug ("No profile holds anymore going back to last manually activated profile");
-    activate_target_profile (data, data->selected_profile, PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD, NULL);
-    mask |= PROP_ACTIVE_PROFILE;
+    request_profile_activation (data, data->selected_profile, PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD,
+                                mask | PROP_ACTIVE_PROFILE, invocations, NULL);
+    return;
   } else if (hold_profile == data->active_profile) {
     next_profile = effective_hold_profile (data);
     if (next_profile != PPD_PROFILE_UNSET &&
         next_profile != data->active_profile) {
       g_debug ("Next profile is %s", ppd_profile_to_str (next_profile));
-      activate_target_profile (data, next_profile, PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD, NULL);
-      mask |= PROP_ACTIVE_PROFILE;
+      request_profile_activation (data, next_profile, PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD,
+                                  mask | PROP_ACTIVE_PROFILE, invocations, NULL);
+      return;
     }
   }
 
   send_dbus_event (data, mask);
+  reply_invocations (invocations, NULL);
 }
 
 static void
@@ -723,59 +1868,45 @@ holder_disappeared (GDBusConnection *connection,
                     gpointer         user_data)
 {
   PpdApp *data = user_data;
-  GHashTableIter iter;
-  gpointer key, value;
-  GPtrArray *cookies;
-  guint i;
-
-  cookies = g_ptr_array_new ();
-  g_hash_table_iter_init (&iter, data->profile_holds);
-  while (g_hash_table_iter_next (&iter, &key, (gpointer *) &value)) {
-    guint cookie = GPOINTER_TO_UINT (key);
-    ProfileHold *hold = value;
+  g_autoptr(GArray) cookies = NULL;
+  RequesterHolds *holds;
 
-    if (g_strcmp0 (hold->requester, name) != 0)
-      continue;
+  holds = g_hash_table_lookup (data->profile_holds_by_requester, name);
+  if (holds == NULL)
+    return;
 
-    g_debug ("Holder %s with cookie %u disappeared, adding to list", name, cookie);
-    g_ptr_array_add (cookies, GUINT_TO_POINTER (cookie));
-  }
+  /* Releasing the holds modifies the index */
+  cookies = g_array_sized_new (FALSE, FALSE, sizeof (guint), holds->cookies->len);
+  g_array_append_vals (cookies, holds->cookies->data, holds->cookies->len);
 
-  for (i = 0; i < cookies->len; i++) {
-    guint cookie = GPOINTER_TO_UINT (cookies->pdata[i]);
-    g_debug ("Removing profile hold for cookie %u", cookie);
-    release_profile_hold (data, cookie);
+  for (guint i = 0; i < cookies->len; i++) {
+    guint cookie = g_array_index (cookies, guint, i);
+    g_debug ("Holder %s with cookie %u disappeared, removing profile hold", name, cookie);
+    run_or_queue_pending_op (data, pending_op_new (PENDING_OP_RELEASE_PROFILE, cookie, NULL));
   }
-  g_ptr_array_free (cookies, TRUE);
 }
 
 static void
-hold_profile (PpdApp                *data,
-              GVariant              *parameters,
-              GDBusMethodInvocation *invocation)
+add_profile_hold (PpdApp    *data,
+                  GArray    *cpus,
+                  GPtrArray *invocations)
 {
+  GDBusMethodInvocation *invocation = g_ptr_array_index (invocations, 0);
+  GVariant *parameters = g_dbus_method_invocation_get_parameters (invocation);
   const char *profile_name;
   const char *reason;
   const char *application_id;
   PpdProfile profile;
   ProfileHold *hold;
-  guint watch_id;
+  GVariant *reply;
+  guint cookie;
   guint mask;
 
-  g_variant_get (parameters, "(&s&s&s)", &profile_name, &reason, &application_id);
+  /* HoldProfileScoped() has the same first arguments */
+  g_variant_get_child (parameters, 0, "&s", &profile_name);
+  g_variant_get_child (parameters, 1, "&s", &reason);
+  g_variant_get_child (parameters, 2, "&s", &application_id);
   profile = ppd_profile_from_str (profile_name);
-  if (profile != PPD_PROFILE_PERFORMANCE &&
-      profile != PPD_PROFILE_POWER_SAVER) {
-    g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
-                                                   "Only profiles 'performance' and 'power-saver' can be a hold profile");
-    return;
-  }
-  if (!get_profile_available (data, profile)) {
-    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
-                                           "Cannot hold profile '%s' as it is not available",
-                                           profile_name);
-    return;
-  }
 
   hold = g_new0 (ProfileHold, 1);
   hold->profile = profile;
@@ -783,26 +1914,199 @@ hold_profile (PpdApp                *data,
   hold->application_id = g_strdup (application_id);
   hold->requester = g_strdup (g_dbus_method_invocation_get_sender (invocation));
   hold->requester_iface = g_strdup (g_dbus_method_invocation_get_interface_name (invocation));
-
-  g_debug ("%s (%s) requesting to hold profile '%s', reason: '%s'", application_id,
-           hold->requester, profile_name, reason);
-  watch_id = g_bus_watch_name_on_connection (data->connection, hold->requester,
-                                             G_BUS_NAME_WATCHER_FLAGS_NONE, NULL,
-                                             holder_disappeared, data, NULL);
-  g_hash_table_insert (data->profile_holds, GUINT_TO_POINTER (watch_id), hold);
-  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(u)", watch_id));
+  if (cpus != NULL)
+    hold->cpus = g_array_ref (cpus);
+
+  g_debug ("%s (%s) requesting to hold profile '%s'%s, reason: '%s'", application_id,
+           hold->requester, profile_name, cpus != NULL ? " on some CPUs" : "", reason);
+  /* 0 isn't a valid cookie */
+  cookie = ++data->last_hold_cookie;
+  if (cookie == 0)
+    cookie = ++data->last_hold_cookie;
+  profile_hold_insert (data, cookie, hold);
+  reply = g_variant_new ("(u)", cookie);
   mask = PROP_ACTIVE_PROFILE_HOLDS;
 
+  /* The rest of the machine stays on the active profile */
+  if (cpus != NULL) {
+    request_profile_activation (data, data->active_profile, PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD,
+                                mask, invocations, reply);
+    return;
+  }
+
   if (profile != data->active_profile) {
     PpdProfile target_profile = effective_hold_profile (data);
     if (target_profile != PPD_PROFILE_UNSET &&
         target_profile != data->active_profile) {
-      activate_target_profile (data, target_profile, PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD, NULL);
-      mask |= PROP_ACTIVE_PROFILE;
+      request_profile_activation (data, target_profile, PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD,
+                                  mask | PROP_ACTIVE_PROFILE, invocations, reply);
+      return;
     }
   }
 
   send_dbus_event (data, mask);
+  reply_invocations (invocations, reply);
+}
+
+static PpdProfile
+check_hold_profile (PpdApp                *data,
+                    const char            *profile_name,
+                    GDBusMethodInvocation *invocation)
+{
+  PpdProfile profile;
+
+  profile = ppd_profile_from_str (profile_name);
+  if (profile != PPD_PROFILE_PERFORMANCE &&
+      profile != PPD_PROFILE_POWER_SAVER) {
+    g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                                   "Only profiles 'performance' and 'power-saver' can be a hold profile");
+    return PPD_PROFILE_UNSET;
+  }
+  if (!get_profile_available (data, profile)) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                           "Cannot hold profile '%s' as it is not available",
+                                           profile_name);
+    return PPD_PROFILE_UNSET;
+  }
+
+  return profile;
+}
+
+static void
+hold_profile (PpdApp                *data,
+              GVariant              *parameters,
+              GDBusMethodInvocation *invocation)
+{
+  const char *profile_name;
+  PpdProfile profile;
+
+  g_variant_get (parameters, "(&s&s&s)", &profile_name, NULL, NULL);
+  profile = check_hold_profile (data, profile_name, invocation);
+  if (profile == PPD_PROFILE_UNSET)
+    return;
+
+  run_or_queue_pending_op (data, pending_op_new (PENDING_OP_HOLD_PROFILE, profile, invocation));
+  g_object_unref (invocation);
+}
+
+static void
+queue_scoped_hold (PpdApp                *data,
+                   GDBusMethodInvocation *invocation,
+                   GArray                *cpus)
+{
+  const char *profile_name;
+  PendingOp *op;
+
+  g_variant_get_child (g_dbus_method_invocation_get_parameters (invocation),
+                       0, "&s", &profile_name);
+  op = pending_op_new (PENDING_OP_HOLD_PROFILE, ppd_profile_from_str (profile_name), invocation);
+  op->cpus = g_array_ref (cpus);
+  run_or_queue_pending_op (data, op);
+  g_object_unref (invocation);
+}
+
+static void
+caller_credentials_cb (GObject      *source_object,
+                       GAsyncResult *res,
+                       gpointer      user_data)
+{
+  GDBusMethodInvocation *invocation = user_data;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) result = NULL;
+  g_autoptr(GVariant) credentials = NULL;
+  g_autoptr(GArray) cpus = NULL;
+  g_autoptr(GError) error = NULL;
+  guint32 pid;
+  gint32 fd_index;
+  int pidfd = -1;
+
+  /* Quitting */
+  if (ppd_app == NULL) {
+    g_object_unref (invocation);
+    return;
+  }
+
+  result = g_dbus_connection_call_with_unix_fd_list_finish (G_DBUS_CONNECTION (source_object),
+                                                            &fd_list, res, &error);
+  if (result == NULL) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                           "Could not find the caller's process: %s",
+                                           error->message);
+    return;
+  }
+
+  g_variant_get (result, "(@a{sv})", &credentials);
+  if (!g_variant_lookup (credentials, "ProcessID", "u", &pid)) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                           "Could not find the caller's process");
+    return;
+  }
+
+  /* Older buses don't pass a pidfd, and then the PID could get
+   * reused before its cgroup is read */
+  if (fd_list != NULL &&
+      g_variant_lookup (credentials, "ProcessFD", "h", &fd_index)) {
+    pidfd = g_unix_fd_list_get (fd_list, fd_index, &error);
+    if (pidfd < 0) {
+      g_debug ("Could not get the caller's pidfd: %s", error->message);
+      g_clear_error (&error);
+    }
+  }
+
+  cpus = ppd_utils_get_pid_cpus (pid, pidfd, &error);
+  if (pidfd >= 0)
+    close (pidfd);
+  if (cpus == NULL) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                           "Could not find the caller's CPUs: %s",
+                                           error->message);
+    return;
+  }
+
+  queue_scoped_hold (ppd_app, invocation, cpus);
+}
+
+/* Holds only applying to the CPUs listed in the "Cpus" option, or to
+ * the ones the caller's cgroup can run on */
+static void
+hold_profile_scoped (PpdApp                *data,
+                     GVariant              *parameters,
+                     GDBusMethodInvocation *invocation)
+{
+  g_autoptr(GVariant) options = NULL;
+  g_autoptr(GArray) cpus = NULL;
+  const char *profile_name;
+  const char *cpu_list;
+
+  g_variant_get (parameters, "(&s&s&s@a{sv})", &profile_name, NULL, NULL, &options);
+  if (check_hold_profile (data, profile_name, invocation) == PPD_PROFILE_UNSET)
+    return;
+
+  if (!g_variant_lookup (options, "Cpus", "&s", &cpu_list)) {
+    g_dbus_connection_call_with_unix_fd_list (data->connection,
+                                              "org.freedesktop.DBus",
+                                              "/org/freedesktop/DBus",
+                                              "org.freedesktop.DBus",
+                                              "GetConnectionCredentials",
+                                              g_variant_new ("(s)", g_dbus_method_invocation_get_sender (invocation)),
+                                              G_VARIANT_TYPE ("(a{sv})"),
+                                              G_DBUS_CALL_FLAGS_NONE,
+                                              -1,
+                                              NULL,
+                                              NULL,
+                                              caller_credentials_cb,
+                                              invocation);
+    return;
+  }
+
+  cpus = ppd_utils_parse_cpu_list (cpu_list);
+  if (cpus->len == 0) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                           "Invalid CPU list '%s'", cpu_list);
+    return;
+  }
+
+  queue_scoped_hold (data, invocation, cpus);
 }
 
 static void
@@ -817,8 +2121,8 @@ release_profile (PpdApp                *data,
                                            "No hold with cookie  %d", cookie);
     return;
   }
-  release_profile_hold (data, cookie);
-  g_dbus_method_invocation_return_value (invocation, NULL);
+  run_or_queue_pending_op (data, pending_op_new (PENDING_OP_RELEASE_PROFILE, cookie, invocation));
+  g_object_unref (invocation);
 }
 
 static gboolean
@@ -866,6 +2170,10 @@ handle_get_property (GDBusConnection *connection,
 
   if (g_strcmp0 (property_name, "ActiveProfile") == 0)
     return g_variant_new_string (get_active_profile (data));
+  if (g_strcmp0 (property_name, "ActiveCustomProfile") == 0)
+    return g_variant_new_string (get_active_custom_profile (data));
+  if (g_strcmp0 (property_name, "CustomProfiles") == 0)
+    return build_custom_profiles_variant (data);
   if (g_strcmp0 (property_name, "PerformanceInhibited") == 0)
     return g_variant_new_string ("");
   if (g_strcmp0 (property_name, "Profiles") == 0)
@@ -880,36 +2188,44 @@ handle_get_property (GDBusConnection *connection,
     return get_profile_holds_variant (data);
   if (g_strcmp0 (property_name, "Version") == 0)
     return g_variant_new_string (VERSION);
+  if (g_strcmp0 (property_name, "Stats") == 0)
+    return ppd_stats_get_variant ();
   return NULL;
 }
 
-static gboolean
-handle_set_property (GDBusConnection  *connection,
-                     const gchar      *sender,
-                     const gchar      *object_path,
-                     const gchar      *interface_name,
-                     const gchar      *property_name,
-                     GVariant         *value,
-                     GError          **error,
-                     gpointer          user_data)
+/* Set is routed through handle_method_call(), so that the reply can
+ * wait for the profile transition to complete */
+static void
+handle_set_property (PpdApp                *data,
+                     GVariant              *parameters,
+                     GDBusMethodInvocation *invocation)
 {
-  PpdApp *data = user_data;
+  g_autoptr(GVariant) value = NULL;
+  g_autoptr(GError) local_error = NULL;
+  const char *property_name;
   const char *profile;
 
-  g_return_val_if_fail (data->connection, FALSE);
+  g_variant_get (parameters, "(&s&sv)", NULL, &property_name, &value);
 
-  if (g_strcmp0 (property_name, "ActiveProfile") != 0) {
-    g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                 "No such property: %s", property_name);
-    return FALSE;
+  if (g_strcmp0 (property_name, "ActiveProfile") != 0 &&
+      g_strcmp0 (property_name, "ActiveCustomProfile") != 0) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                           "No such property: %s", property_name);
+    return;
   }
-  if (!check_action_permission (data, sender,
+  if (!check_action_permission (data,
+                                g_dbus_method_invocation_get_sender (invocation),
                                 POWER_PROFILES_POLICY_NAMESPACE ".switch-profile",
-                                error))
-    return FALSE;
+                                &local_error)) {
+    g_dbus_method_invocation_return_gerror (invocation, local_error);
+    return;
+  }
 
   g_variant_get (value, "&s", &profile);
-  return set_active_profile (data, profile, error);
+  if (g_strcmp0 (property_name, "ActiveCustomProfile") == 0)
+    set_active_custom_profile (data, profile, invocation);
+  else
+    set_active_profile (data, profile, invocation);
 }
 
 static void
@@ -925,6 +2241,12 @@ handle_method_call (GDBusConnection       *connection,
   PpdApp *data = user_data;
   g_return_if_fail (data->connection);
 
+  if (g_str_equal (interface_name, "org.freedesktop.DBus.Properties") &&
+      g_str_equal (method_name, "Set")) {
+    handle_set_property (data, parameters, invocation);
+    return;
+  }
+
   if (!g_str_equal (interface_name, POWER_PROFILES_IFACE_NAME) &&
       !g_str_equal (interface_name, POWER_PROFILES_LEGACY_IFACE_NAME)) {
     g_dbus_method_invocation_return_error (invocation,G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_INTERFACE,
@@ -932,7 +2254,8 @@ handle_method_call (GDBusConnection       *connection,
     return;
   }
 
-  if (g_strcmp0 (method_name, "HoldProfile") == 0) {
+  if (g_strcmp0 (method_name, "HoldProfile") == 0 ||
+      g_strcmp0 (method_name, "HoldProfileScoped") == 0) {
     g_autoptr(GError) local_error = NULL;
     if (!check_action_permission (data,
                                   g_dbus_method_invocation_get_sender (invocation),
@@ -941,9 +2264,21 @@ handle_method_call (GDBusConnection       *connection,
       g_dbus_method_invocation_return_gerror (invocation, local_error);
       return;
     }
-    hold_profile (data, parameters, invocation);
+    if (g_strcmp0 (method_name, "HoldProfile") == 0)
+      hold_profile (data, parameters, invocation);
+    else
+      hold_profile_scoped (data, parameters, invocation);
   } else if (g_strcmp0 (method_name, "ReleaseProfile") == 0) {
     release_profile (data, parameters, invocation);
+  } else if (g_strcmp0 (method_name, "GetTrace") == 0) {
+    g_dbus_method_invocation_return_value (invocation,
+                                           g_variant_new ("(@aa{sv})", ppd_trace_get_variant ()));
+  } else if (g_strcmp0 (method_name, "GetState") == 0) {
+    guint64 if_changed_since;
+
+    g_variant_get (parameters, "(t)", &if_changed_since);
+    g_dbus_method_invocation_return_value (invocation,
+                                           get_state_variant (data, if_changed_since));
   } else {
       g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
                                              "No such method %s in interface %s", interface_name,
@@ -956,7 +2291,7 @@ static const GDBusInterfaceVTable interface_vtable =
 {
   handle_method_call,
   handle_get_property,
-  handle_set_property
+  NULL
 };
 
 typedef struct {
@@ -1056,8 +2391,72 @@ upower_source_update (PpdApp *data)
   upower_source_update_from_value (data, battery_val);
 }
 
+static void
+dispatch_battery_level (PpdApp *data, gdouble level)
+{
+  PendingOp *op;
+
+  data->last_battery_change = g_get_monotonic_time ();
+  op = pending_op_new (PENDING_OP_BATTERY_CHANGED, 0, NULL);
+  op->level = level;
+  run_or_queue_pending_op (data, op);
+}
+
+static gboolean
+battery_timeout_cb (gpointer user_data)
+{
+  PpdApp *data = user_data;
+
+  data->battery_timeout_id = 0;
+  dispatch_battery_level (data, data->pending_battery_level);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 upower_battery_changed (PpdApp *data, gdouble level)
+{
+  gint64 interval, elapsed;
+
+  /* Coalesce level changes arriving faster than the minimum interval,
+   * only the latest one gets dispatched */
+  data->pending_battery_level = level;
+  if (data->battery_timeout_id != 0)
+    return;
+
+  interval = data->debug_options->battery_min_interval >= 0 ?
+             data->debug_options->battery_min_interval :
+             ppd_config_get_battery_min_interval ();
+  interval *= G_TIME_SPAN_MILLISECOND;
+  elapsed = g_get_monotonic_time () - data->last_battery_change;
+  if (data->last_battery_change != 0 && elapsed < interval) {
+    data->battery_timeout_id = g_timeout_add ((interval - elapsed) / G_TIME_SPAN_MILLISECOND + 1,
+                                              battery_timeout_cb, data);
+    return;
+  }
+
+  dispatch_battery_level (data, level);
+}
+
+static gboolean
+battery_level_crosses_band (PpdApp          *data,
+                            PpdBatteryBands *bands,
+                            gdouble          level)
+{
+  gdouble hysteresis;
+
+  /* Without declared thresholds, every change is of interest */
+  if (bands == NULL)
+    return TRUE;
+
+  hysteresis = data->debug_options->battery_hysteresis >= 0 ?
+               data->debug_options->battery_hysteresis :
+               ppd_config_get_battery_hysteresis ();
+  return ppd_battery_bands_update (bands, level, hysteresis);
+}
+
+static void
+set_battery_level (PpdApp *data, gdouble level)
 {
   g_info ("Battery level changed to %f", level);
 
@@ -1067,6 +2466,9 @@ upower_battery_changed (PpdApp *data, gdouble level)
 
     action = g_ptr_array_index (data->actions, i);
 
+    if (!battery_level_crosses_band (data, ppd_action_get_battery_bands (action), level))
+      continue;
+
     if (!ppd_action_battery_changed (action, level, &error)) {
       g_warning ("failed to update action %s: %s",
                  ppd_action_get_action_name (action),
@@ -1076,7 +2478,8 @@ upower_battery_changed (PpdApp *data, gdouble level)
     }
   }
 
-  if (PPD_IS_DRIVER_CPU (data->cpu_driver)) {
+  if (PPD_IS_DRIVER_CPU (data->cpu_driver) &&
+      battery_level_crosses_band (data, ppd_driver_get_battery_bands (PPD_DRIVER (data->cpu_driver)), level)) {
     g_autoptr(GError) error = NULL;
 
     if (!ppd_driver_battery_changed (PPD_DRIVER (data->cpu_driver), level, &error)) {
@@ -1086,7 +2489,8 @@ upower_battery_changed (PpdApp *data, gdouble level)
     }
   }
 
-  if (PPD_IS_DRIVER_PLATFORM (data->platform_driver)) {
+  if (PPD_IS_DRIVER_PLATFORM (data->platform_driver) &&
+      battery_level_crosses_band (data, ppd_driver_get_battery_bands (PPD_DRIVER (data->platform_driver)), level)) {
     g_autoptr(GError) error = NULL;
 
     if (!ppd_driver_battery_changed (PPD_DRIVER (data->platform_driver), level, &error)) {
@@ -1132,6 +2536,13 @@ upower_properties_changed (GDBusProxy *proxy,
 static void
 upower_battery_set_power_changed_reason (PpdApp                *data,
                                          PpdPowerChangedReason  reason)
+{
+  run_or_queue_pending_op (data, pending_op_new (PENDING_OP_POWER_CHANGED, reason, NULL));
+}
+
+static void
+set_power_changed_reason (PpdApp                *data,
+                          PpdPowerChangedReason  reason)
 {
   if (data->power_changed_reason == reason)
     return;
@@ -1271,6 +2682,59 @@ on_upower_display_proxy_cb (GObject *source_object,
   upower_battery_update (data);
 }
 
+static void
+power_supply_state_changed_cb (PpdPowerSupplyMonitor *monitor,
+                               gpointer               user_data)
+{
+  PpdApp *data = user_data;
+
+  upower_battery_set_power_changed_reason (data,
+                                           ppd_power_supply_monitor_get_power_state (monitor));
+}
+
+static void
+power_supply_level_changed_cb (PpdPowerSupplyMonitor *monitor,
+                               gpointer               user_data)
+{
+  PpdApp *data = user_data;
+  gdouble level;
+
+  level = ppd_power_supply_monitor_get_battery_level (monitor);
+  if (level >= 0)
+    upower_battery_changed (data, level);
+}
+
+/* Whether the power supplies should be tracked from udev, rather
+ * than through UPower */
+static gboolean
+power_supply_source_is_udev (void)
+{
+  g_autoptr(GKeyFile) config = NULL;
+  g_autofree char *source = NULL;
+
+  config = ppd_config_get ();
+  source = g_key_file_get_string (config, POWER_SUPPLY_GROUP, "Source", NULL);
+  return g_strcmp0 (source, "udev") == 0;
+}
+
+static void
+start_power_supply_monitor (PpdApp *data)
+{
+  data->power_supply_monitor = ppd_power_supply_monitor_get_default ();
+
+  if (data->needed_monitors & MONITOR_BATTERY_STATE) {
+    g_signal_connect (data->power_supply_monitor, "power-state-changed",
+                      G_CALLBACK (power_supply_state_changed_cb), data);
+    power_supply_state_changed_cb (data->power_supply_monitor, data);
+  }
+
+  if (data->needed_monitors & MONITOR_BATTERY_CHANGE) {
+    g_signal_connect (data->power_supply_monitor, "battery-level-changed",
+                      G_CALLBACK (power_supply_level_changed_cb), data);
+    power_supply_level_changed_cb (data->power_supply_monitor, data);
+  }
+}
+
 static void
 on_logind_prepare_for_sleep_cb (GDBusConnection *connection,
                                 const gchar     *sender_name,
@@ -1284,11 +2748,30 @@ on_logind_prepare_for_sleep_cb (GDBusConnection *connection,
   gboolean start;
 
   g_variant_get (parameters, "(b)", &start);
-
+  /* The system might not come back */
   if (start)
+    flush_configuration (data);
+  /* Energy used while asleep says nothing about the load */
+  else if (data->power_budget != NULL)
+    ppd_power_budget_reset (data->power_budget);
+  run_or_queue_pending_op (data, pending_op_new (PENDING_OP_PREPARE_FOR_SLEEP, start, NULL));
+}
+
+static void
+prepare_drivers_for_sleep (PpdApp   *data,
+                           gboolean  start)
+{
+  if (start) {
     g_debug ("System preparing for suspend");
-  else
+  } else {
+    guint checked, drifted;
+
     g_debug ("System woke up from suspend");
+    /* Firmware might have reset the attributes we wrote, only those
+     * get rewritten when the drivers re-apply the profile */
+    drifted = ppd_utils_reconcile_write_cache (&checked);
+    g_info ("Firmware reset %u of %u attributes during suspend", drifted, checked);
+  }
 
   if (PPD_IS_DRIVER_CPU (data->cpu_driver)) {
     g_autoptr(GError) error = NULL;
@@ -1325,12 +2808,95 @@ has_required_drivers (PpdApp *data)
 }
 
 static void
-restart_profile_drivers (PpdApp *data)
+reload_profile_drivers (PpdApp *data)
 {
   stop_profile_drivers (data);
   start_profile_drivers (data);
 }
 
+static void
+restart_profile_drivers (PpdApp *data)
+{
+  run_or_queue_pending_op (data, pending_op_new (PENDING_OP_RESTART_DRIVERS, 0, NULL));
+}
+
+static void
+run_pending_op (PpdApp    *data,
+                PendingOp *op)
+{
+  switch (op->type) {
+  case PENDING_OP_SET_PROFILE:
+    switch_active_profile (data, op->value, op->custom, op->invocations);
+    break;
+  case PENDING_OP_HOLD_PROFILE:
+    add_profile_hold (data, op->cpus, op->invocations);
+    break;
+  case PENDING_OP_RELEASE_PROFILE:
+    release_profile_hold (data, op->value, op->invocations);
+    break;
+  case PENDING_OP_DRIVER_PROFILE_CHANGED:
+    follow_driver_profile (data, op->value);
+    break;
+  case PENDING_OP_POWER_CHANGED:
+    set_power_changed_reason (data, op->value);
+    break;
+  case PENDING_OP_BATTERY_CHANGED:
+    set_battery_level (data, op->level);
+    break;
+  case PENDING_OP_PREPARE_FOR_SLEEP:
+    prepare_drivers_for_sleep (data, op->value);
+    break;
+  case PENDING_OP_RESTART_DRIVERS:
+    reload_profile_drivers (data);
+    break;
+  default:
+    g_assert_not_reached ();
+  }
+}
+
+static void
+run_or_queue_pending_op (PpdApp    *data,
+                         PendingOp *op)
+{
+  PendingOp *tail;
+
+  if (data->transition == NULL) {
+    run_pending_op (data, op);
+    pending_op_free (op);
+    return;
+  }
+
+  /* Only the latest of back-to-back user requests gets applied */
+  tail = g_queue_peek_tail (data->pending_ops);
+  if (op->type == PENDING_OP_SET_PROFILE &&
+      tail != NULL && tail->type == PENDING_OP_SET_PROFILE) {
+    g_debug ("Replacing queued request for profile '%s' with '%s'",
+             ppd_profile_to_str (tail->value),
+             ppd_profile_to_str (op->value));
+    tail->value = op->value;
+    tail->custom = op->custom;
+    for (guint i = 0; i < op->invocations->len; i++)
+      g_ptr_array_add (tail->invocations, g_object_ref (g_ptr_array_index (op->invocations, i)));
+    pending_op_free (op);
+    return;
+  }
+
+  g_debug ("Profile transition in progress, queueing request");
+  g_queue_push_tail (data->pending_ops, op);
+}
+
+static void
+process_pending_operations (PpdApp *data)
+{
+  PendingOp *op;
+
+  while (data->transition == NULL &&
+         (op = g_queue_pop_head (data->pending_ops)) != NULL) {
+    run_pending_op (data, op);
+    pending_op_free (op);
+  }
+}
+
 static void
 driver_probe_request_cb (PpdDriver *driver,
                          gpointer   user_data)
@@ -1361,6 +2927,19 @@ maybe_disconnect_object_by_data (void *object,
   g_signal_handlers_disconnect_by_data (object, data);
 }
 
+static void
+cpu_uevent_cb (GUdevClient *client,
+               gchar       *action,
+               GUdevDevice *device,
+               gpointer     user_data)
+{
+  g_debug ("CPU %s %s", g_udev_device_get_sysfs_path (device), action);
+
+  /* cpufreq policies come and go with CPUs being onlined and offlined */
+  ppd_utils_invalidate_write_cache ();
+  ppd_utils_invalidate_cpu_topology ();
+}
+
 static void
 stop_profile_drivers (PpdApp *data)
 {
@@ -1369,6 +2948,9 @@ stop_profile_drivers (PpdApp *data)
     data->logind_sleep_signal_id = 0;
   }
 
+  maybe_disconnect_object_by_data (data->cpu_udev_client, data);
+  g_clear_object (&data->cpu_udev_client);
+
   upower_battery_set_power_changed_reason (data, PPD_POWER_CHANGED_REASON_UNKNOWN);
   release_all_profile_holds (data);
   g_cancellable_cancel (data->cancellable);
@@ -1385,69 +2967,482 @@ stop_profile_drivers (PpdApp *data)
   g_clear_object (&data->upower_proxy);
   maybe_disconnect_object_by_data (data->upower_display_proxy, data);
   g_clear_object (&data->upower_display_proxy);
+  maybe_disconnect_object_by_data (data->power_supply_monitor, data);
+  g_clear_object (&data->power_supply_monitor);
   maybe_disconnect_object_by_data (data->cpu_driver, data);
   g_clear_object (&data->cpu_driver);
   maybe_disconnect_object_by_data (data->platform_driver, data);
   g_clear_object (&data->platform_driver);
+  g_clear_handle_id (&data->battery_timeout_id, g_source_remove);
+  data->last_battery_change = 0;
+  g_clear_handle_id (&data->workload_timeout_id, g_source_remove);
+  g_clear_pointer (&data->workload, ppd_workload_free);
+  g_clear_handle_id (&data->power_budget_timeout_id, g_source_remove);
+  g_clear_pointer (&data->power_budget, ppd_power_budget_free);
+  ppd_power_budget_set_active_step (0);
+  data->needed_monitors = 0;
+  data->drivers_probed = FALSE;
+  invalidate_drivers_variants (data);
+  ppd_utils_invalidate_write_cache ();
+  ppd_utils_invalidate_cpu_topology ();
+  ppd_config_invalidate ();
+}
+
+/* Objects are blocked by --block-driver and --block-action, or by the
+ * Allow and Deny lists of the configuration, which cover both drivers
+ * and actions */
+static gboolean
+object_blocked (PpdApp             *app,
+                const char         *name,
+                gboolean            is_action,
+                const char * const *allowed,
+                const char * const *denied)
+{
+  GStrv blocked;
+
+  blocked = is_action ? app->debug_options->blocked_actions : app->debug_options->blocked_drivers;
+  if (blocked != NULL && g_strv_contains ((const gchar *const *) blocked, name)) {
+    g_debug ("%s '%s' is blocked", is_action ? "Action" : "Driver", name);
+    return TRUE;
+  }
+
+  if (allowed != NULL && !g_strv_contains (allowed, name)) {
+    g_debug ("%s '%s' is not allowed by the configuration", is_action ? "Action" : "Driver", name);
+    return TRUE;
+  }
+
+  if (denied != NULL && g_strv_contains (denied, name)) {
+    g_debug ("%s '%s' is denied by the configuration", is_action ? "Action" : "Driver", name);
+    return TRUE;
+  }
+
+  return FALSE;
 }
 
-static gboolean
-action_blocked (PpdApp *app, PpdAction *action)
+static void
+initial_profile_activated_cb (GObject      *source_object,
+                              GAsyncResult *res,
+                              gpointer      user_data)
 {
-  const gchar *action_name = ppd_action_get_action_name (action);
-  gboolean blocked;
+  g_autoptr(GError) error = NULL;
 
-  if (app->debug_options->blocked_actions == NULL || g_strv_length (app->debug_options->blocked_actions) == 0)
-    return FALSE;
+  if (!activate_target_profile_finish (res, &error))
+    g_warning ("Failed to activate initial profile: %s", error->message);
+}
+
+typedef struct {
+  GObject *object;
+  PpdProbeResult result;
+  gboolean probed;
+  gboolean probe_side_effects;
+} ProbeCandidate;
+
+static void
+probe_candidate_free (ProbeCandidate *candidate)
+{
+  g_clear_object (&candidate->object);
+  g_free (candidate);
+}
 
-  blocked = g_strv_contains ((const gchar *const *) app->debug_options->blocked_actions, action_name);
+/* Called from a worker thread with --parallel-probe */
+static void
+probe_candidate (ProbeCandidate *candidate)
+{
+  g_autofree char *stats_name = NULL;
+  gint64 start_time;
 
-  if (blocked)
-    g_debug ("Action '%s' is blocked", action_name);
-  return blocked;
+  start_time = g_get_monotonic_time ();
+  if (PPD_IS_DRIVER (candidate->object)) {
+    candidate->result = ppd_driver_probe (PPD_DRIVER (candidate->object));
+    stats_name = g_strdup_printf ("probe:%s",
+                                  ppd_driver_get_driver_name (PPD_DRIVER (candidate->object)));
+  } else {
+    candidate->result = ppd_action_probe (PPD_ACTION (candidate->object));
+    stats_name = g_strdup_printf ("probe:%s",
+                                  ppd_action_get_action_name (PPD_ACTION (candidate->object)));
+  }
+  candidate->probed = TRUE;
+  ppd_stats_record_timing_since (stats_name, start_time);
 }
 
 static gboolean
-driver_blocked (PpdApp *app, PpdDriver *driver)
+probe_candidate_cb (gpointer   item,
+                    gpointer   user_data,
+                    GError   **error)
 {
-  const gchar *driver_name = ppd_driver_get_driver_name (driver);
-  gboolean blocked;
+  probe_candidate (item);
+  return TRUE;
+}
 
-  if (app->debug_options->blocked_drivers == NULL || g_strv_length (app->debug_options->blocked_drivers) == 0)
-    return FALSE;
+/* The others are only probed if they get their turn */
+static void
+probe_candidates_parallel (GPtrArray *candidates)
+{
+  g_autoptr(GPtrArray) harmless = NULL;
+
+  harmless = g_ptr_array_new ();
+  for (guint i = 0; i < candidates->len; i++) {
+    ProbeCandidate *candidate = g_ptr_array_index (candidates, i);
+
+    if (!candidate->probe_side_effects)
+      g_ptr_array_add (harmless, candidate);
+  }
 
-  blocked = g_strv_contains ((const gchar *const *) app->debug_options->blocked_drivers, driver_name);
-  if (blocked)
-    g_debug ("Driver '%s' is blocked", driver_name);
-  return blocked;
+  ppd_utils_foreach_parallel (harmless, probe_candidate_cb, NULL, NULL);
 }
 
-static void
-start_profile_drivers (PpdApp *data)
+/* Only the objects named in @only are created if it is not %NULL */
+static GPtrArray *
+create_probe_candidates (PpdApp             *data,
+                         const char * const *only)
 {
-  guint i;
-  g_autoptr(GError) initial_error = NULL;
-  gboolean needs_battery_state_monitor = FALSE;
-  gboolean needs_battery_change_monitor = FALSE;
-  gboolean needs_suspend_monitor = FALSE;
+  g_autoptr(GKeyFile) config = NULL;
+  g_auto(GStrv) allowed = NULL;
+  g_auto(GStrv) denied = NULL;
+  GPtrArray *candidates;
 
-  data->cancellable = g_cancellable_new ();
+  candidates = g_ptr_array_new_with_free_func ((GDestroyNotify) probe_candidate_free);
+
+  config = ppd_config_get ();
+  allowed = g_key_file_get_string_list (config, OBJECTS_GROUP, "Allow", NULL, NULL);
+  denied = g_key_file_get_string_list (config, OBJECTS_GROUP, "Deny", NULL, NULL);
 
-  for (i = 0; i < G_N_ELEMENTS (objects); i++) {
+  for (guint i = 0; i < G_N_ELEMENTS (objects); i++) {
     g_autoptr(GObject) object = NULL;
+    ProbeCandidate *candidate;
+    const char *name = objects[i].name;
+    GType type = objects[i].get_type ();
+    gboolean is_action = g_type_is_a (type, PPD_TYPE_ACTION);
+
+    if (only && !g_strv_contains (only, name))
+      continue;
 
-    object = g_object_new (objects[i] (), NULL);
+    g_debug ("Handling %s '%s'", is_action ? "action" : "driver", name);
+    if (object_blocked (data, name, is_action,
+                        (const char * const *) allowed,
+                        (const char * const *) denied))
+      continue;
+
+    object = g_object_new (type, NULL);
 
     if (PPD_IS_DRIVER (object)) {
-      g_autoptr(PpdDriver) driver = PPD_DRIVER (g_steal_pointer (&object));
+      PpdDriver *driver = PPD_DRIVER (object);
       PpdProfile profiles;
-      PpdProbeResult result;
 
-      g_debug ("Handling driver '%s'", ppd_driver_get_driver_name (driver));
-      if (driver_blocked (data, driver)) {
-        g_debug ("Driver '%s' is blocked, skipping", ppd_driver_get_driver_name (driver));
+      g_warn_if_fail (g_str_equal (ppd_driver_get_driver_name (driver), name));
+      profiles = ppd_driver_get_profiles (driver);
+      if (!(profiles & PPD_PROFILE_ALL)) {
+        g_warning ("Profile Driver '%s' implements invalid profiles '0x%X'",
+                   ppd_driver_get_driver_name (driver),
+                   profiles);
         continue;
       }
+    } else if (PPD_IS_ACTION (object)) {
+      g_warn_if_fail (g_str_equal (ppd_action_get_action_name (PPD_ACTION (object)), name));
+    } else {
+      g_return_val_if_reached (candidates);
+    }
+
+    candidate = g_new0 (ProbeCandidate, 1);
+    candidate->object = g_steal_pointer (&object);
+    candidate->probe_side_effects = objects[i].probe_side_effects;
+    g_ptr_array_add (candidates, candidate);
+  }
+
+  return candidates;
+}
+
+static void
+fingerprint_add_file (GString    *fingerprint,
+                      const char *path)
+{
+  g_autofree char *sysfs_path = NULL;
+  g_autofree char *contents = NULL;
+
+  sysfs_path = ppd_utils_get_sysfs_path (path);
+  if (g_file_get_contents (sysfs_path, &contents, NULL, NULL))
+    g_string_append_printf (fingerprint, "%s=%s\n", path, g_strstrip (contents));
+  else
+    g_string_append_printf (fingerprint, "%s missing\n", path);
+}
+
+static int
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+  return g_strcmp0 (*(const char **) a, *(const char **) b);
+}
+
+static void
+fingerprint_add_dir (GString    *fingerprint,
+                     const char *path)
+{
+  g_autofree char *sysfs_path = NULL;
+  g_autoptr(GDir) dir = NULL;
+  g_autoptr(GPtrArray) names = NULL;
+  const char *name;
+
+  sysfs_path = ppd_utils_get_sysfs_path (path);
+  dir = g_dir_open (sysfs_path, 0, NULL);
+  if (dir == NULL) {
+    g_string_append_printf (fingerprint, "%s missing\n", path);
+    return;
+  }
+
+  names = g_ptr_array_new_with_free_func (g_free);
+  while ((name = g_dir_read_name (dir)))
+    g_ptr_array_add (names, g_strdup (name));
+  g_ptr_array_sort (names, compare_strings);
+
+  g_string_append_printf (fingerprint, "%s:", path);
+  for (guint i = 0; i < names->len; i++)
+    g_string_append_printf (fingerprint, " %s", (char *) g_ptr_array_index (names, i));
+  g_string_append_c (fingerprint, '\n');
+}
+
+/* The fingerprint covers what the drivers and actions look at when
+ * probing, so that a probe cache is only reused on the same hardware,
+ * kernel and options */
+static char *
+compute_hardware_fingerprint (PpdApp *data)
+{
+  g_autoptr(GString) fingerprint = NULL;
+  g_autofree char *blocked_drivers = NULL;
+  g_autofree char *blocked_actions = NULL;
+  g_autofree char *allowed = NULL;
+  g_autofree char *denied = NULL;
+  g_autoptr(GKeyFile) config = NULL;
+  g_autoptr(PpdCpuTopology) topology = NULL;
+  const char *fake_driver;
+  struct utsname uts;
+
+  fingerprint = g_string_new (NULL);
+
+  /* A newer daemon might probe differently, or have new objects */
+  g_string_append_printf (fingerprint, "version=%s\nobjects=", VERSION);
+  for (guint i = 0; i < G_N_ELEMENTS (objects); i++)
+    g_string_append_printf (fingerprint, " %s", objects[i].name);
+  g_string_append_c (fingerprint, '\n');
+
+  if (uname (&uts) == 0)
+    g_string_append_printf (fingerprint, "kernel=%s\n", uts.release);
+  topology = ppd_utils_get_cpu_topology ();
+  g_string_append_printf (fingerprint, "cpu=%s %u %u, %u CPUs\n",
+                          ppd_cpu_topology_get_vendor (topology) ?
+                          ppd_cpu_topology_get_vendor (topology) : "unknown",
+                          ppd_cpu_topology_get_family (topology),
+                          ppd_cpu_topology_get_model (topology),
+                          ppd_cpu_topology_get_n_cpus (topology));
+  fingerprint_add_dir (fingerprint, CPUFREQ_POLICY_DIR);
+  fingerprint_add_file (fingerprint, "/sys/devices/system/cpu/intel_pstate/status");
+  fingerprint_add_file (fingerprint, "/sys/devices/system/cpu/amd_pstate/status");
+  fingerprint_add_file (fingerprint, "/sys/firmware/acpi/platform_profile_choices");
+  fingerprint_add_file (fingerprint, "/sys/firmware/acpi/pm_profile");
+  fingerprint_add_file (fingerprint, "/sys/class/dmi/id/sys_vendor");
+  fingerprint_add_file (fingerprint, "/sys/class/dmi/id/product_name");
+  fingerprint_add_file (fingerprint, "/sys/class/dmi/id/product_version");
+  fingerprint_add_file (fingerprint, "/sys/class/dmi/id/bios_version");
+  fingerprint_add_dir (fingerprint, "/sys/class/drm");
+  fingerprint_add_dir (fingerprint, "/sys/class/power_supply");
+  fingerprint_add_dir (fingerprint, "/sys/class/nvme");
+  fingerprint_add_dir (fingerprint, "/sys/bus/pci/devices");
+  fingerprint_add_dir (fingerprint, "/sys/class/thermal");
+  fingerprint_add_dir (fingerprint, "/sys/class/powercap");
+
+  if (data->debug_options->blocked_drivers)
+    blocked_drivers = g_strjoinv (",", data->debug_options->blocked_drivers);
+  if (data->debug_options->blocked_actions)
+    blocked_actions = g_strjoinv (",", data->debug_options->blocked_actions);
+  fake_driver = g_getenv ("POWER_PROFILE_DAEMON_FAKE_DRIVER");
+  config = ppd_config_get ();
+  allowed = g_key_file_get_value (config, OBJECTS_GROUP, "Allow", NULL);
+  denied = g_key_file_get_value (config, OBJECTS_GROUP, "Deny", NULL);
+  g_string_append_printf (fingerprint, "blocked=%s;%s\nallowed=%s\ndenied=%s\nfake=%s\n",
+                          blocked_drivers ? blocked_drivers : "",
+                          blocked_actions ? blocked_actions : "",
+                          allowed ? allowed : "*",
+                          denied ? denied : "",
+                          fake_driver ? fake_driver : "");
+
+  return g_compute_checksum_for_string (G_CHECKSUM_SHA256, fingerprint->str, -1);
+}
+
+static GStrv
+get_cpufreq_policy_paths (void)
+{
+  g_autofree char *cpufreq_path = NULL;
+  g_autoptr(GDir) dir = NULL;
+  GPtrArray *paths;
+  const char *name;
+
+  paths = g_ptr_array_new ();
+  cpufreq_path = ppd_utils_get_sysfs_path (CPUFREQ_POLICY_DIR);
+  dir = g_dir_open (cpufreq_path, 0, NULL);
+  while (dir && (name = g_dir_read_name (dir))) {
+    if (g_str_has_prefix (name, "policy"))
+      g_ptr_array_add (paths, g_build_filename (CPUFREQ_POLICY_DIR, name, NULL));
+  }
+  g_ptr_array_add (paths, NULL);
+
+  return (GStrv) g_ptr_array_free (paths, FALSE);
+}
+
+/* Returns the names of the drivers and actions that were loaded the
+ * last time the same hardware was probed */
+static GStrv
+probe_cache_lookup (PpdApp     *data,
+                    const char *fingerprint)
+{
+  g_autofree char *cached_fingerprint = NULL;
+  g_auto(GStrv) paths = NULL;
+  g_auto(GStrv) drivers = NULL;
+  g_auto(GStrv) actions = NULL;
+  GPtrArray *names;
+
+  if (data->debug_options->disable_probe_cache)
+    return NULL;
+
+  cached_fingerprint = g_key_file_get_string (data->config, PROBE_CACHE_GROUP, "Fingerprint", NULL);
+  if (g_strcmp0 (cached_fingerprint, fingerprint) != 0) {
+    g_debug ("No probe cache for this hardware");
+    return NULL;
+  }
+
+  paths = g_key_file_get_string_list (data->config, PROBE_CACHE_GROUP, "Paths", NULL, NULL);
+  for (guint i = 0; paths && paths[i]; i++) {
+    g_autofree char *path = ppd_utils_get_sysfs_path (paths[i]);
+
+    if (!g_file_test (path, G_FILE_TEST_EXISTS)) {
+      g_debug ("Cached path '%s' is gone, ignoring probe cache", paths[i]);
+      return NULL;
+    }
+  }
+
+  drivers = g_key_file_get_string_list (data->config, PROBE_CACHE_GROUP, "Drivers", NULL, NULL);
+  if (drivers == NULL || drivers[0] == NULL)
+    return NULL;
+  actions = g_key_file_get_string_list (data->config, PROBE_CACHE_GROUP, "Actions", NULL, NULL);
+
+  names = g_ptr_array_new ();
+  for (guint i = 0; drivers[i]; i++)
+    g_ptr_array_add (names, g_strdup (drivers[i]));
+  for (guint i = 0; actions && actions[i]; i++)
+    g_ptr_array_add (names, g_strdup (actions[i]));
+  g_ptr_array_add (names, NULL);
+
+  return (GStrv) g_ptr_array_free (names, FALSE);
+}
+
+static void
+probe_cache_save (PpdApp     *data,
+                  const char *fingerprint)
+{
+  g_autoptr(GPtrArray) drivers = NULL;
+  g_autoptr(GPtrArray) actions = NULL;
+  g_auto(GStrv) paths = NULL;
+
+  if (data->debug_options->disable_probe_cache)
+    return;
+
+  /* Drivers waiting for the kernel make the results unstable */
+  if (data->probed_drivers->len > 0) {
+    if (g_key_file_remove_group (data->config, PROBE_CACHE_GROUP, NULL))
+      g_debug ("Not caching probe results, some drivers are deferred");
+    else
+      return;
+  } else {
+    drivers = g_ptr_array_new ();
+    if (PPD_IS_DRIVER_CPU (data->cpu_driver))
+      g_ptr_array_add (drivers, (gpointer) ppd_driver_get_driver_name (PPD_DRIVER (data->cpu_driver)));
+    if (PPD_IS_DRIVER_PLATFORM (data->platform_driver))
+      g_ptr_array_add (drivers, (gpointer) ppd_driver_get_driver_name (PPD_DRIVER (data->platform_driver)));
+
+    actions = g_ptr_array_new ();
+    for (guint i = 0; i < data->actions->len; i++)
+      g_ptr_array_add (actions, (gpointer) ppd_action_get_action_name (g_ptr_array_index (data->actions, i)));
+
+    paths = get_cpufreq_policy_paths ();
+
+    g_key_file_set_string (data->config, PROBE_CACHE_GROUP, "Fingerprint", fingerprint);
+    g_key_file_set_string_list (data->config, PROBE_CACHE_GROUP, "Drivers",
+                                (const char * const *) drivers->pdata, drivers->len);
+    g_key_file_set_string_list (data->config, PROBE_CACHE_GROUP, "Actions",
+                                (const char * const *) actions->pdata, actions->len);
+    g_key_file_set_string_list (data->config, PROBE_CACHE_GROUP, "Paths",
+                                (const char * const *) paths,
+                                g_strv_length (paths));
+  }
+
+  schedule_configuration_save (data);
+}
+
+/* The cache only records drivers and actions that loaded successfully */
+static gboolean
+probe_candidates_match_cache (GPtrArray          *candidates,
+                              const char * const *cached)
+{
+  if (candidates->len != g_strv_length ((GStrv) cached))
+    return FALSE;
+
+  for (guint i = 0; i < candidates->len; i++) {
+    ProbeCandidate *candidate = g_ptr_array_index (candidates, i);
+
+    if (candidate->result != PPD_PROBE_RESULT_SUCCESS)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Probes the drivers and actions, and picks the ones that will be used.
+ * With --parallel-probe, the candidates without probe side effects are
+ * probed concurrently first, and the results are then resolved in the
+ * order of objects[], as they would be when probing sequentially. */
+static void
+probe_profile_drivers (PpdApp *data)
+{
+  g_autoptr(GPtrArray) candidates = NULL;
+  g_autofree char *fingerprint = NULL;
+  g_auto(GStrv) cached = NULL;
+  gint64 probe_start_time;
+
+  probe_start_time = g_get_monotonic_time ();
+
+  /* On known hardware, only the drivers and actions that were loaded
+   * last time are probed, falling back to probing everything if any
+   * of them doesn't load the same way */
+  fingerprint = compute_hardware_fingerprint (data);
+  cached = probe_cache_lookup (data, fingerprint);
+  if (cached) {
+    candidates = create_probe_candidates (data, (const char * const *) cached);
+    if (data->debug_options->parallel_probe) {
+      /* Each of them loaded last time, and gets probed either way */
+      ppd_utils_foreach_parallel (candidates, probe_candidate_cb, NULL, NULL);
+    } else {
+      for (guint i = 0; i < candidates->len; i++)
+        probe_candidate (g_ptr_array_index (candidates, i));
+    }
+
+    if (probe_candidates_match_cache (candidates, (const char * const *) cached)) {
+      g_debug ("Using cached probe results");
+    } else {
+      g_debug ("Probe results don't match the cache, probing everything");
+      g_clear_pointer (&candidates, g_ptr_array_unref);
+      g_clear_pointer (&cached, g_strfreev);
+    }
+  }
+
+  if (candidates == NULL) {
+    candidates = create_probe_candidates (data, NULL);
+    if (data->debug_options->parallel_probe)
+      probe_candidates_parallel (candidates);
+  }
+
+  for (guint i = 0; i < candidates->len; i++) {
+    ProbeCandidate *candidate = g_ptr_array_index (candidates, i);
+
+    if (PPD_IS_DRIVER (candidate->object)) {
+      PpdDriver *driver = PPD_DRIVER (candidate->object);
 
       if (PPD_IS_DRIVER_CPU (data->cpu_driver) && PPD_IS_DRIVER_CPU (driver)) {
         g_debug ("CPU driver '%s' already probed, skipping driver '%s'",
@@ -1463,25 +3458,17 @@ start_profile_drivers (PpdApp *data)
         continue;
       }
 
-      profiles = ppd_driver_get_profiles (driver);
-      if (!(profiles & PPD_PROFILE_ALL)) {
-        g_warning ("Profile Driver '%s' implements invalid profiles '0x%X'",
-                   ppd_driver_get_driver_name (driver),
-                   profiles);
-        continue;
-      }
+      if (!candidate->probed)
+        probe_candidate (candidate);
 
-      result = ppd_driver_probe (driver);
-      if (result == PPD_PROBE_RESULT_FAIL) {
+      if (candidate->result == PPD_PROBE_RESULT_FAIL) {
         g_debug ("probe () failed for driver %s, skipping",
                  ppd_driver_get_driver_name (driver));
         continue;
       }
 
-      if (result == PPD_PROBE_RESULT_DEFER) {
-        g_signal_connect (G_OBJECT (driver), "probe-request",
-                          G_CALLBACK (driver_probe_request_cb), data);
-        g_ptr_array_add (data->probed_drivers, g_steal_pointer (&driver));
+      if (candidate->result == PPD_PROBE_RESULT_DEFER) {
+        g_ptr_array_add (data->probed_drivers, g_object_ref (driver));
         continue;
       }
 
@@ -1493,52 +3480,85 @@ start_profile_drivers (PpdApp *data)
         g_return_if_reached ();
 
       if (PPD_DRIVER_GET_CLASS (driver)->power_changed != NULL)
-        needs_battery_state_monitor = TRUE;
+        data->needed_monitors |= MONITOR_BATTERY_STATE;
 
       if (PPD_DRIVER_GET_CLASS (driver)->battery_changed != NULL)
-        needs_battery_change_monitor = TRUE;
+        data->needed_monitors |= MONITOR_BATTERY_CHANGE;
 
       if (PPD_DRIVER_GET_CLASS (driver)->prepare_to_sleep != NULL)
-        needs_suspend_monitor = TRUE;
+        data->needed_monitors |= MONITOR_SUSPEND;
 
       g_info ("Driver '%s' loaded", ppd_driver_get_driver_name (driver));
-
-      g_signal_connect (G_OBJECT (driver), "notify::performance-degraded",
-                        G_CALLBACK (driver_performance_degraded_changed_cb), data);
-      g_signal_connect (G_OBJECT (driver), "profile-changed",
-                        G_CALLBACK (driver_profile_changed_cb), data);
       continue;
     }
 
-    if (PPD_IS_ACTION (object)) {
-      g_autoptr(PpdAction) action = PPD_ACTION (g_steal_pointer (&object));
+    if (PPD_IS_ACTION (candidate->object)) {
+      PpdAction *action = PPD_ACTION (candidate->object);
 
-      g_debug ("Handling action '%s'", ppd_action_get_action_name (action));
-
-      if (action_blocked (data, action)) {
-        g_debug ("Action '%s' is blocked, skipping", ppd_action_get_action_name (action));
-        continue;
-      }
+      if (!candidate->probed)
+        probe_candidate (candidate);
 
-      if (ppd_action_probe (action) == PPD_PROBE_RESULT_FAIL) {
+      if (candidate->result == PPD_PROBE_RESULT_FAIL) {
         g_debug ("probe () failed for action '%s', skipping",
                  ppd_action_get_action_name (action));
         continue;
       }
 
       if (PPD_ACTION_GET_CLASS (action)->power_changed != NULL)
-        needs_battery_state_monitor = TRUE;
+        data->needed_monitors |= MONITOR_BATTERY_STATE;
 
       if (PPD_ACTION_GET_CLASS (action)->battery_changed != NULL)
-        needs_battery_change_monitor = TRUE;
+        data->needed_monitors |= MONITOR_BATTERY_CHANGE;
 
       g_info ("Action '%s' loaded", ppd_action_get_action_name (action));
-      g_ptr_array_add (data->actions, g_steal_pointer (&action));
+      g_ptr_array_add (data->actions, g_object_ref (action));
       continue;
     }
 
     g_return_if_reached ();
   }
+  ppd_stats_record_timing_since ("probe", probe_start_time);
+
+  if (cached == NULL)
+    probe_cache_save (data, fingerprint);
+
+  data->drivers_probed = TRUE;
+}
+
+static void
+connect_driver_signals (PpdApp    *data,
+                        PpdDriver *driver)
+{
+  if (driver == NULL)
+    return;
+
+  g_signal_connect (G_OBJECT (driver), "notify::performance-degraded",
+                    G_CALLBACK (driver_performance_degraded_changed_cb), data);
+  g_signal_connect (G_OBJECT (driver), "profile-changed",
+                    G_CALLBACK (driver_profile_changed_cb), data);
+}
+
+static void
+start_profile_drivers (PpdApp *data)
+{
+  const gchar * const cpu_subsystem[] = { "cpu", NULL };
+
+  /* Drivers might have been probed before claiming the bus name */
+  if (!data->drivers_probed)
+    probe_profile_drivers (data);
+  data->drivers_probed = FALSE;
+
+  /* Only connected now, so that nothing reaches the bus before it is set up */
+  for (guint i = 0; i < data->probed_drivers->len; i++)
+    g_signal_connect (G_OBJECT (g_ptr_array_index (data->probed_drivers, i)), "probe-request",
+                      G_CALLBACK (driver_probe_request_cb), data);
+  connect_driver_signals (data, PPD_DRIVER (data->cpu_driver));
+  connect_driver_signals (data, PPD_DRIVER (data->platform_driver));
+
+  data->cancellable = g_cancellable_new ();
+  data->cpu_udev_client = g_udev_client_new (cpu_subsystem);
+  g_signal_connect (G_OBJECT (data->cpu_udev_client), "uevent",
+                    G_CALLBACK (cpu_uevent_cb), data);
 
   if (!has_required_drivers (data)) {
     data->ret = EXIT_FAILURE;
@@ -1548,17 +3568,25 @@ start_profile_drivers (PpdApp *data)
 
   /* Set initial state either from configuration, or using the currently selected profile */
   apply_configuration (data);
-  if (!activate_target_profile (data, data->active_profile, PPD_PROFILE_ACTIVATION_REASON_RESET, &initial_error))
-    g_warning ("Failed to activate initial profile: %s", initial_error->message);
+  activate_target_profile (data, data->active_profile, PPD_PROFILE_ACTIVATION_REASON_RESET,
+                           initial_profile_activated_cb, NULL);
 
   send_dbus_event (data, PROP_ALL);
   data->was_started = TRUE;
 
-  if (data->debug_options->disable_upower) {
+  start_auto_mode (data);
+  start_power_budget (data);
+
+  if (!(data->needed_monitors & (MONITOR_BATTERY_STATE | MONITOR_BATTERY_CHANGE))) {
+    g_debug ("No battery state monitor required by any driver, let's skip it");
+  } else if (power_supply_source_is_udev ()) {
+    g_debug ("Battery monitor required, tracking power supplies from udev...");
+    start_power_supply_monitor (data);
+  } else if (data->debug_options->disable_upower) {
     g_debug ("upower is disabled, let's skip it");
-  } else if (needs_battery_state_monitor || needs_battery_change_monitor) {
+  } else {
     /* start watching for power changes */
-    if (needs_battery_state_monitor) {
+    if (data->needed_monitors & MONITOR_BATTERY_STATE) {
       g_debug ("Battery state monitor required, connecting to upower...");
       g_dbus_proxy_new (data->connection,
                         G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START |
@@ -1572,7 +3600,7 @@ start_profile_drivers (PpdApp *data)
                         data);
     }
 
-    if (needs_battery_change_monitor) {
+    if (data->needed_monitors & MONITOR_BATTERY_CHANGE) {
       g_debug ("Battery change monitor required, connecting to upower...");
       g_dbus_proxy_new (data->connection,
                         G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START |
@@ -1585,13 +3613,11 @@ start_profile_drivers (PpdApp *data)
                         on_upower_display_proxy_cb,
                         data);
     }
-  } else {
-    g_debug ("No battery state monitor required by any driver, let's skip it");
   }
 
   if (data->debug_options->disable_logind) {
     g_debug ("logind is disabled, let's skip it");
-  } else if (needs_suspend_monitor) {
+  } else if (data->needed_monitors & MONITOR_SUSPEND) {
     g_debug ("Suspension state monitor required, monitoring logind...");
     data->logind_sleep_signal_id =
       g_dbus_connection_signal_subscribe (data->connection,
@@ -1689,8 +3715,14 @@ free_app_data (PpdApp *data)
   if (data == NULL)
     return;
 
+  /* Including when quitting on SIGTERM */
+  flush_configuration (data);
   stop_profile_drivers (data);
 
+  g_clear_handle_id (&data->properties_flush_id, g_source_remove);
+  invalidate_drivers_variants (data);
+  invalidate_profile_holds_variant (data);
+  g_clear_pointer (&data->state_variant, g_variant_unref);
   g_clear_handle_id (&data->name_id, g_bus_unown_name);
   g_clear_handle_id (&data->legacy_name_id, g_bus_unown_name);
 
@@ -1701,7 +3733,11 @@ free_app_data (PpdApp *data)
   g_clear_pointer (&data->actions, g_ptr_array_unref);
   g_clear_object (&data->cpu_driver);
   g_clear_object (&data->platform_driver);
+  ppd_custom_profile_set_active (NULL);
+  g_clear_pointer (&data->custom_profiles, g_ptr_array_unref);
   g_hash_table_destroy (data->profile_holds);
+  g_hash_table_destroy (data->profile_holds_by_requester);
+  g_queue_free_full (data->pending_ops, (GDestroyNotify) pending_op_free);
 
   g_clear_object (&data->auth);
 
@@ -1861,6 +3897,51 @@ debug_pre_parse_hook (GOptionContext *context,
       "Disable logind integration",
       NULL,
     },
+    {
+      "disable-probe-cache",
+      0,
+      G_OPTION_FLAG_NONE,
+      G_OPTION_ARG_NONE,
+      &data->disable_probe_cache,
+      "Always probe every driver and action",
+      NULL,
+    },
+    {
+      "properties-changed-delay",
+      0,
+      G_OPTION_FLAG_NONE,
+      G_OPTION_ARG_INT,
+      &data->properties_changed_delay,
+      "Batch property change notifications over this many milliseconds",
+      "MS",
+    },
+    {
+      "parallel-probe",
+      0,
+      G_OPTION_FLAG_NONE,
+      G_OPTION_ARG_NONE,
+      &data->parallel_probe,
+      "Probe the drivers and actions that don't change the hardware concurrently at startup",
+      NULL,
+    },
+    {
+      "battery-hysteresis",
+      0,
+      G_OPTION_FLAG_NONE,
+      G_OPTION_ARG_DOUBLE,
+      &data->battery_hysteresis,
+      "Override the Hysteresis setting of the [Battery] configuration group",
+      "PERCENT",
+    },
+    {
+      "battery-min-interval",
+      0,
+      G_OPTION_FLAG_NONE,
+      G_OPTION_ARG_INT,
+      &data->battery_min_interval,
+      "Override the MinInterval setting of the [Battery] configuration group",
+      "MS",
+    },
     { NULL }
   };
   g_option_group_add_entries (group, options);
@@ -1889,6 +3970,9 @@ int main (int argc, char **argv)
   g_autoptr(GError) error = NULL;
 
   debug_options->log_level = G_LOG_LEVEL_MESSAGE;
+  /* Unset, the [Battery] configuration group is used */
+  debug_options->battery_hysteresis = -1.0;
+  debug_options->battery_min_interval = -1;
   debug_options->group = g_option_group_new ("debug",
                                              "Debugging Options",
                                              "Show debugging options",
@@ -1913,6 +3997,9 @@ int main (int argc, char **argv)
   data->probed_drivers = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
   data->actions = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
   data->profile_holds = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) profile_hold_free);
+  data->profile_holds_by_requester = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                            (GDestroyNotify) requester_holds_free);
+  data->pending_ops = g_queue_new ();
   data->active_profile = PPD_PROFILE_BALANCED;
   data->selected_profile = PPD_PROFILE_BALANCED;
   data->debug_options = g_steal_pointer(&debug_options);
@@ -1923,8 +4010,14 @@ int main (int argc, char **argv)
   g_info ("Starting power-profiles-daemon version "VERSION);
 
   load_configuration (data);
+  data->custom_profiles = ppd_custom_profiles_load ();
   ppd_app = data;
 
+  /* Claim the bus name only once the drivers are known, so that clients
+   * never see the daemon without them */
+  if (data->debug_options->parallel_probe)
+    probe_profile_drivers (data);
+
   /* Set up D-Bus */
   if (!setup_dbus (data, &error)) {
     g_error ("Failed to start dbus: %s", error->message);
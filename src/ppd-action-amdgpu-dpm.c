@@ -14,10 +14,11 @@
 #include <gudev/gudev.h>
 
 #include "ppd-action-amdgpu-dpm.h"
+#include "ppd-drm-registry.h"
 #include "ppd-profile.h"
 #include "ppd-utils.h"
 
-#define DPM_SYSFS_NAME "device/power_dpm_force_performance_level"
+#define DPM_SYSFS_NAME PPD_DRM_DPM_SYSFS_NAME
 
 /**
  * SECTION:ppd-action-amdgpu-dpm
@@ -31,9 +32,13 @@
 struct _PpdActionAmdgpuDpm
 {
   PpdAction  parent_instance;
-  PpdProfile last_profile;
 
-  GUdevClient *client;
+  PpdDrmRegistry *registry;
+
+  /* Protects last_profile, as profiles are activated from a worker
+   * thread, and cards added from the main thread */
+  GMutex lock;
+  PpdProfile last_profile;
 };
 
 G_DEFINE_TYPE (PpdActionAmdgpuDpm, ppd_action_amdgpu_dpm, PPD_TYPE_ACTION)
@@ -58,7 +63,7 @@ ppd_action_amdgpu_dpm_constructor (GType                  type,
 static gboolean
 ppd_action_amdgpu_dpm_update_target (PpdActionAmdgpuDpm *self, GError **error)
 {
-  g_autolist (GUdevDevice) devices = NULL;
+  g_autoptr(GPtrArray) cards = NULL;
   const gchar *target;
 
   switch (self->last_profile) {
@@ -73,23 +78,16 @@ ppd_action_amdgpu_dpm_update_target (PpdActionAmdgpuDpm *self, GError **error)
     g_assert_not_reached ();
   }
 
-  devices = g_udev_client_query_by_subsystem (self->client, "drm");
-  if (devices == NULL) {
-    g_set_error_literal (error,
-                         G_IO_ERROR,
-                         G_IO_ERROR_NOT_FOUND,
-                         "no drm devices found");
-    return FALSE;
+  cards = ppd_drm_registry_get_cards (self->registry);
+  if (cards->len == 0) {
+    g_debug ("No card supporting DPM performance levels");
+    return TRUE;
   }
 
-  for (GList *l = devices; l != NULL; l = l->next) {
-    GUdevDevice *dev = l->data;
+  for (guint i = 0; i < cards->len; i++) {
+    GUdevDevice *dev = g_ptr_array_index (cards, i);
     const char *value;
 
-    value = g_udev_device_get_devtype (dev);
-    if (g_strcmp0 (value, "drm_minor") != 0)
-      continue;
-
     value = g_udev_device_get_sysfs_attr_uncached (dev, DPM_SYSFS_NAME);
     if (!value)
       continue;
@@ -118,35 +116,43 @@ ppd_action_amdgpu_dpm_activate_profile (PpdAction   *action,
                                         GError     **error)
 {
   PpdActionAmdgpuDpm *self = PPD_ACTION_AMDGPU_DPM (action);
+  gboolean ret;
+
+  g_mutex_lock (&self->lock);
   self->last_profile = profile;
+  ret = ppd_action_amdgpu_dpm_update_target (self, error);
+  g_mutex_unlock (&self->lock);
 
-  return ppd_action_amdgpu_dpm_update_target (self, error);
+  return ret;
 }
 
 static void
-udev_uevent_cb (GUdevClient *client,
-                gchar       *action,
-                GUdevDevice *device,
-                gpointer     user_data)
+card_added_cb (PpdDrmRegistry *registry,
+               GUdevDevice    *device,
+               gpointer        user_data)
 {
   PpdActionAmdgpuDpm *self = user_data;
 
-  g_debug ("Device %s %s", g_udev_device_get_sysfs_path (device), action);
-
-  if (!g_str_equal (action, "add"))
-    return;
-
-  if (!g_udev_device_has_sysfs_attr (device, DPM_SYSFS_NAME))
-    return;
-
-  ppd_action_amdgpu_dpm_update_target (self, NULL);
+  g_debug ("Card %s added", g_udev_device_get_sysfs_path (device));
+  g_mutex_lock (&self->lock);
+  if (self->last_profile != PPD_PROFILE_UNSET)
+    ppd_action_amdgpu_dpm_update_target (self, NULL);
+  g_mutex_unlock (&self->lock);
 }
 
 static PpdProbeResult
 ppd_action_amdgpu_dpm_probe (PpdAction *action)
 {
-  return ppd_utils_match_cpu_vendor ("AuthenticAMD") ?
-    PPD_PROBE_RESULT_SUCCESS : PPD_PROBE_RESULT_FAIL;
+  PpdActionAmdgpuDpm *self = PPD_ACTION_AMDGPU_DPM (action);
+
+  if (!ppd_utils_match_cpu_vendor ("AuthenticAMD"))
+    return PPD_PROBE_RESULT_FAIL;
+
+  self->registry = ppd_drm_registry_get_default ();
+  g_signal_connect_object (G_OBJECT (self->registry), "card-added",
+                           G_CALLBACK (card_added_cb), self, 0);
+
+  return PPD_PROBE_RESULT_SUCCESS;
 }
 
 static void
@@ -155,7 +161,8 @@ ppd_action_amdgpu_dpm_finalize (GObject *object)
   PpdActionAmdgpuDpm *action;
 
   action = PPD_ACTION_AMDGPU_DPM (object);
-  g_clear_object (&action->client);
+  g_clear_object (&action->registry);
+  g_mutex_clear (&action->lock);
   G_OBJECT_CLASS (ppd_action_amdgpu_dpm_parent_class)->finalize (object);
 }
 
@@ -177,9 +184,5 @@ ppd_action_amdgpu_dpm_class_init (PpdActionAmdgpuDpmClass *klass)
 static void
 ppd_action_amdgpu_dpm_init (PpdActionAmdgpuDpm *self)
 {
-  const gchar * const subsystem[] = { "drm", NULL };
-
-  self->client = g_udev_client_new (subsystem);
-  g_signal_connect_object (G_OBJECT (self->client), "uevent",
-                           G_CALLBACK (udev_uevent_cb), self, 0);
+  g_mutex_init (&self->lock);
 }
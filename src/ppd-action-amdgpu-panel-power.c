@@ -14,11 +14,12 @@
 #include <gudev/gudev.h>
 
 #include "ppd-action-amdgpu-panel-power.h"
+#include "ppd-config.h"
+#include "ppd-drm-registry.h"
 #include "ppd-profile.h"
 #include "ppd-utils.h"
 
-#define PANEL_POWER_SYSFS_NAME "amdgpu/panel_power_savings"
-#define PANEL_STATUS_SYSFS_NAME "status"
+#define PANEL_POWER_SYSFS_NAME PPD_DRM_PANEL_POWER_SYSFS_NAME
 
 /**
  * SECTION:ppd-action-amdgpu-panel-power
@@ -34,23 +35,33 @@
 struct _PpdActionAmdgpuPanelPower
 {
   PpdAction  parent_instance;
-  PpdProfile last_profile;
 
-  GUdevClient *client;
+  PpdDrmRegistry *registry;
 
+  /* Protects everything below, as profiles and power changes are
+   * applied from a worker thread, and panels added from the main thread */
+  GMutex lock;
+  PpdProfile last_profile;
   gint panel_power_saving;
   gboolean valid_battery;
   gboolean on_battery;
   gdouble battery_level;
+  gdouble battery_thresholds[N_BATTERY_THRESHOLDS];
 };
 
 G_DEFINE_TYPE (PpdActionAmdgpuPanelPower, ppd_action_amdgpu_panel_power, PPD_TYPE_ACTION)
 
+/* The battery levels ppd_action_amdgpu_panel_update_target() switches
+ * at by default, from the lowest */
+static const gdouble default_battery_thresholds[] = { 20, 30, 50 };
+#define N_BATTERY_THRESHOLDS G_N_ELEMENTS (default_battery_thresholds)
+
 static GObject*
 ppd_action_amdgpu_panel_power_constructor (GType                  type,
                                            guint                  n_construct_params,
                                            GObjectConstructParam *construct_params)
 {
+  PpdActionAmdgpuPanelPower *self;
   GObject *object;
 
   object = G_OBJECT_CLASS (ppd_action_amdgpu_panel_power_parent_class)->constructor (type,
@@ -60,49 +71,35 @@ ppd_action_amdgpu_panel_power_constructor (GType                  type,
                 "action-name", "amdgpu_panel_power",
                 NULL);
 
-  return object;
-}
+  self = PPD_ACTION_AMDGPU_PANEL_POWER (object);
+  for (guint i = 0; i < N_BATTERY_THRESHOLDS; i++)
+    self->battery_thresholds[i] = default_battery_thresholds[i];
+  ppd_config_get_battery_thresholds ("amdgpu_panel_power",
+                                     self->battery_thresholds,
+                                     N_BATTERY_THRESHOLDS);
+  ppd_action_set_battery_thresholds (PPD_ACTION (object),
+                                     self->battery_thresholds,
+                                     N_BATTERY_THRESHOLDS);
 
-static gboolean
-panel_connected (GUdevDevice *device)
-{
-  const char *value;
-  g_autofree gchar *stripped = NULL;
-
-  value = g_udev_device_get_sysfs_attr_uncached (device, PANEL_STATUS_SYSFS_NAME);
-  if (!value)
-    return FALSE;
-  stripped = g_strchomp (g_strdup (value));
-
-  return g_strcmp0 (stripped, "connected") == 0;
+  return object;
 }
 
 static gboolean
 set_panel_power (PpdActionAmdgpuPanelPower *self, gint power, GError **error)
 {
-  GList *devices, *l;
-
-  devices = g_udev_client_query_by_subsystem (self->client, "drm");
-  if (devices == NULL) {
-    g_set_error_literal (error,
-                         G_IO_ERROR,
-                         G_IO_ERROR_NOT_FOUND,
-                         "no drm devices found");
-    return FALSE;
+  g_autoptr(GPtrArray) panels = NULL;
+
+  panels = ppd_drm_registry_get_panels (self->registry);
+  if (panels->len == 0) {
+    g_debug ("No panel supporting power savings");
+    return TRUE;
   }
 
-  for (l = devices; l != NULL; l = l->next) {
-    GUdevDevice *dev = l->data;
+  for (guint i = 0; i < panels->len; i++) {
+    GUdevDevice *dev = g_ptr_array_index (panels, i);
     const char *value;
     guint64 parsed;
 
-    value = g_udev_device_get_devtype (dev);
-    if (g_strcmp0 (value, "drm_connector") != 0)
-      continue;
-
-    if (!panel_connected (dev))
-      continue;
-
     value = g_udev_device_get_sysfs_attr_uncached (dev, PANEL_POWER_SYSFS_NAME);
     if (!value)
       continue;
@@ -128,8 +125,6 @@ set_panel_power (PpdActionAmdgpuPanelPower *self, gint power, GError **error)
     break;
   }
 
-  g_list_free_full (devices, g_object_unref);
-
   return TRUE;
 }
 
@@ -137,23 +132,24 @@ static gboolean
 ppd_action_amdgpu_panel_update_target (PpdActionAmdgpuPanelPower  *self,
                                        GError                    **error)
 {
+  const gdouble *thresholds = self->battery_thresholds;
   gint target = 0;
 
   /* only activate if we know that we're on battery */
   if (self->on_battery) {
     switch (self->last_profile) {
     case PPD_PROFILE_POWER_SAVER:
-      if (!self->battery_level || self->battery_level >= 50)
+      if (!self->battery_level || self->battery_level >= thresholds[2])
         target = 0;
-      else if (self->battery_level > 30)
+      else if (self->battery_level > thresholds[1])
         target = 1;
-      else if (self->battery_level > 20 && self->battery_level <= 30)
+      else if (self->battery_level > thresholds[0])
         target = 2;
-      else /* < 20 */
+      else
         target = 3;
       break;
     case PPD_PROFILE_BALANCED:
-      if (!self->battery_level || self->battery_level >= 30)
+      if (!self->battery_level || self->battery_level >= thresholds[1])
         target = 0;
       else
         target = 1;
@@ -178,14 +174,18 @@ ppd_action_amdgpu_panel_power_activate_profile (PpdAction   *action,
                                                 GError     **error)
 {
   PpdActionAmdgpuPanelPower *self = PPD_ACTION_AMDGPU_PANEL_POWER (action);
+  gboolean ret = TRUE;
+
+  g_mutex_lock (&self->lock);
   self->last_profile = profile;
 
-  if (!self->valid_battery) {
+  if (!self->valid_battery)
     g_debug ("upower not available; battery data might be stale");
-    return TRUE;
-  }
+  else
+    ret = ppd_action_amdgpu_panel_update_target (self, error);
+  g_mutex_unlock (&self->lock);
 
-  return ppd_action_amdgpu_panel_update_target (self, error);
+  return ret;
 }
 
 static gboolean
@@ -194,10 +194,13 @@ ppd_action_amdgpu_panel_power_power_changed (PpdAction             *action,
                                              GError               **error)
 {
   PpdActionAmdgpuPanelPower *self = PPD_ACTION_AMDGPU_PANEL_POWER (action);
+  gboolean ret;
 
+  g_mutex_lock (&self->lock);
   switch (reason) {
   case PPD_POWER_CHANGED_REASON_UNKNOWN:
     self->valid_battery = FALSE;
+    g_mutex_unlock (&self->lock);
     return TRUE;
   case PPD_POWER_CHANGED_REASON_AC:
     self->on_battery = FALSE;
@@ -211,7 +214,10 @@ ppd_action_amdgpu_panel_power_power_changed (PpdAction             *action,
 
   self->valid_battery = TRUE;
 
-  return ppd_action_amdgpu_panel_update_target (self, error);
+  ret = ppd_action_amdgpu_panel_update_target (self, error);
+  g_mutex_unlock (&self->lock);
+
+  return ret;
 }
 
 static gboolean
@@ -220,40 +226,46 @@ ppd_action_amdgpu_panel_power_battery_changed (PpdAction           *action,
                                                GError             **error)
 {
   PpdActionAmdgpuPanelPower *self = PPD_ACTION_AMDGPU_PANEL_POWER (action);
+  gboolean ret;
 
+  g_mutex_lock (&self->lock);
   self->battery_level = val;
 
-  return ppd_action_amdgpu_panel_update_target (self, error);
+  ret = ppd_action_amdgpu_panel_update_target (self, error);
+  g_mutex_unlock (&self->lock);
+
+  return ret;
 }
 
 static void
-udev_uevent_cb (GUdevClient *client,
-                gchar       *action,
-                GUdevDevice *device,
-                gpointer     user_data)
+panel_added_cb (PpdDrmRegistry *registry,
+                GUdevDevice    *device,
+                gpointer        user_data)
 {
   PpdActionAmdgpuPanelPower *self = user_data;
 
-  if (!g_str_equal (action, "add"))
-    return;
-
-  if (!g_udev_device_has_sysfs_attr (device, PANEL_POWER_SYSFS_NAME))
-    return;
-
-  if (!panel_connected (device))
-      return;
-
+  g_mutex_lock (&self->lock);
   g_debug ("Updating panel power saving for '%s' to '%d'",
            g_udev_device_get_sysfs_path (device),
            self->panel_power_saving);
   ppd_utils_write_sysfs_int (device, PANEL_POWER_SYSFS_NAME,
                              self->panel_power_saving, NULL);
+  g_mutex_unlock (&self->lock);
 }
 
 static PpdProbeResult
 ppd_action_amdgpu_panel_power_probe (PpdAction *action)
 {
-  return ppd_utils_match_cpu_vendor ("AuthenticAMD") ? PPD_PROBE_RESULT_SUCCESS : PPD_PROBE_RESULT_FAIL;
+  PpdActionAmdgpuPanelPower *self = PPD_ACTION_AMDGPU_PANEL_POWER (action);
+
+  if (!ppd_utils_match_cpu_vendor ("AuthenticAMD"))
+    return PPD_PROBE_RESULT_FAIL;
+
+  self->registry = ppd_drm_registry_get_default ();
+  g_signal_connect_object (G_OBJECT (self->registry), "panel-added",
+                           G_CALLBACK (panel_added_cb), self, 0);
+
+  return PPD_PROBE_RESULT_SUCCESS;
 }
 
 static void
@@ -262,7 +274,8 @@ ppd_action_amdgpu_panel_power_finalize (GObject *object)
   PpdActionAmdgpuPanelPower *action;
 
   action = PPD_ACTION_AMDGPU_PANEL_POWER (object);
-  g_clear_object (&action->client);
+  g_clear_object (&action->registry);
+  g_mutex_clear (&action->lock);
   G_OBJECT_CLASS (ppd_action_amdgpu_panel_power_parent_class)->finalize (object);
 }
 
@@ -286,9 +299,5 @@ ppd_action_amdgpu_panel_power_class_init (PpdActionAmdgpuPanelPowerClass *klass)
 static void
 ppd_action_amdgpu_panel_power_init (PpdActionAmdgpuPanelPower *self)
 {
-  const gchar * const subsystem[] = { "drm", NULL };
-
-  self->client = g_udev_client_new (subsystem);
-  g_signal_connect_object (G_OBJECT (self->client), "uevent",
-                           G_CALLBACK (udev_uevent_cb), self, 0);
+  g_mutex_init (&self->lock);
 }
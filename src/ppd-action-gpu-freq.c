@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#define G_LOG_DOMAIN "GpuFreq"
+
+#include "config.h"
+
+#include <gudev/gudev.h>
+
+#include "ppd-action-gpu-freq.h"
+#include "ppd-drm-registry.h"
+#include "ppd-profile.h"
+#include "ppd-utils.h"
+
+/**
+ * SECTION:ppd-action-gpu-freq
+ * @Short_description: GPU frequency range
+ * @Title: GPU frequency control
+ *
+ * The GPU frequency action sets the range of frequencies Intel GPUs
+ * run at, through the "gt_min_freq_mhz" and "gt_max_freq_mhz"
+ * attributes of i915 cards, and the "freq0/min_freq" and
+ * "freq0/max_freq" attributes of each GT of xe cards. The
+ * "gt_boost_freq_mhz" the i915 driver jumps to when waiting on the GPU
+ * is capped along with the maximum, as it would otherwise go over it.
+ *
+ * The "performance" profile keeps the GPU at or above its most
+ * efficient frequency, and the "power-saver" profile caps it there.
+ * The "balanced" profile, and stopping the daemon, restore the values
+ * that were there before they were first changed.
+ */
+
+typedef struct {
+  const char *min;       /* lowest frequency allowed */
+  const char *max;       /* highest frequency allowed */
+  const char *hw_min;    /* lowest frequency of the hardware */
+  const char *efficient; /* most efficient frequency */
+  const char *hw_max;    /* highest frequency of the hardware */
+  const char *boost;     /* frequency used when waiting, or NULL */
+} FreqAttrs;
+
+static const FreqAttrs i915_attrs = {
+  "gt_min_freq_mhz", "gt_max_freq_mhz",
+  "gt_RPn_freq_mhz", "gt_RP1_freq_mhz", "gt_RP0_freq_mhz",
+  "gt_boost_freq_mhz",
+};
+
+static const FreqAttrs xe_attrs = {
+  "min_freq", "max_freq",
+  "rpn_freq", "rpe_freq", "rp0_freq",
+  NULL,
+};
+
+struct _PpdActionGpuFreq
+{
+  PpdAction  parent_instance;
+
+  PpdDrmRegistry *registry;
+
+  /* Protects everything below, as profiles are activated from a
+   * worker thread, and cards added from the main thread */
+  GMutex lock;
+  PpdProfile last_profile;
+  GHashTable *saved_values; /* attribute path to the value before it was changed */
+};
+
+G_DEFINE_TYPE (PpdActionGpuFreq, ppd_action_gpu_freq, PPD_TYPE_ACTION)
+
+static GObject*
+ppd_action_gpu_freq_constructor (GType                  type,
+                                 guint                  n_construct_params,
+                                 GObjectConstructParam *construct_params)
+{
+  GObject *object;
+
+  object = G_OBJECT_CLASS (ppd_action_gpu_freq_parent_class)->constructor (type,
+                                                                           n_construct_params,
+                                                                           construct_params);
+  g_object_set (object,
+                "action-name", "gpu_freq",
+                NULL);
+
+  return object;
+}
+
+static char *
+read_freq (const char *dir,
+           const char *attr)
+{
+  g_autofree char *path = NULL;
+  char *contents = NULL;
+
+  path = g_build_filename (dir, attr, NULL);
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return NULL;
+
+  return g_strstrip (contents);
+}
+
+/* Writes @target to @path unless it already holds it, saving the
+ * original value on the first change, or restores the original value
+ * if @target is %NULL */
+static gboolean
+apply_value (PpdActionGpuFreq  *self,
+             const char        *path,
+             const char        *target,
+             GError           **error)
+{
+  g_autofree char *current = NULL;
+  const char *saved;
+  gboolean restore;
+
+  saved = g_hash_table_lookup (self->saved_values, path);
+  restore = (target == NULL);
+  if (restore) {
+    /* Never changed */
+    if (saved == NULL)
+      return TRUE;
+    target = saved;
+  }
+
+  if (!g_file_get_contents (path, &current, NULL, error))
+    return FALSE;
+  g_strstrip (current);
+
+  if (g_strcmp0 (current, target) == 0) {
+    g_debug ("%s already set to %s", path, target);
+  } else {
+    if (!restore && saved == NULL)
+      g_hash_table_insert (self->saved_values, g_strdup (path), g_strdup (current));
+    g_info ("Setting %s to %s", path, target);
+    if (!ppd_utils_write (path, target, error))
+      return FALSE;
+  }
+
+  if (restore)
+    g_hash_table_remove (self->saved_values, path);
+
+  return TRUE;
+}
+
+static gboolean
+apply_to_domain (PpdActionGpuFreq  *self,
+                 const char        *dir,
+                 const FreqAttrs   *attrs,
+                 PpdProfile         profile,
+                 GError           **error)
+{
+  g_autofree char *min_path = NULL;
+  g_autofree char *max_path = NULL;
+  g_autofree char *boost_path = NULL;
+  g_autofree char *hw_min = NULL;
+  g_autofree char *efficient = NULL;
+  g_autofree char *hw_max = NULL;
+  g_autofree char *current_max = NULL;
+  const char *min_target = NULL;
+  const char *max_target = NULL;
+  const char *new_max;
+
+  min_path = g_build_filename (dir, attrs->min, NULL);
+  max_path = g_build_filename (dir, attrs->max, NULL);
+  if (attrs->boost != NULL) {
+    boost_path = g_build_filename (dir, attrs->boost, NULL);
+    if (!g_file_test (boost_path, G_FILE_TEST_EXISTS))
+      g_clear_pointer (&boost_path, g_free);
+  }
+
+  if (profile != PPD_PROFILE_BALANCED) {
+    hw_min = read_freq (dir, attrs->hw_min);
+    efficient = read_freq (dir, attrs->efficient);
+    hw_max = read_freq (dir, attrs->hw_max);
+    if (hw_min == NULL || efficient == NULL || hw_max == NULL) {
+      g_debug ("Frequency range of %s unknown, not changing it", dir);
+      return TRUE;
+    }
+  }
+
+  switch (profile) {
+  case PPD_PROFILE_POWER_SAVER:
+    min_target = hw_min;
+    max_target = efficient;
+    break;
+  case PPD_PROFILE_PERFORMANCE:
+    min_target = efficient;
+    max_target = hw_max;
+    break;
+  case PPD_PROFILE_BALANCED:
+    break;
+  default:
+    g_assert_not_reached ();
+  }
+
+  /* The boost frequency is only bound by the hardware, and capped
+   * along with the maximum */
+  if (boost_path != NULL &&
+      !apply_value (self, boost_path, max_target, error))
+    return FALSE;
+
+  /* The minimum can't go over the maximum, so a raised maximum is
+   * written first, and a lowered one last */
+  new_max = max_target ? max_target : g_hash_table_lookup (self->saved_values, max_path);
+  current_max = read_freq (dir, attrs->max);
+  if (new_max != NULL && current_max != NULL &&
+      g_ascii_strtoull (new_max, NULL, 10) >= g_ascii_strtoull (current_max, NULL, 10)) {
+    if (!apply_value (self, max_path, max_target, error))
+      return FALSE;
+    return apply_value (self, min_path, min_target, error);
+  }
+
+  if (!apply_value (self, min_path, min_target, error))
+    return FALSE;
+  return apply_value (self, max_path, max_target, error);
+}
+
+static gboolean
+apply_to_gpu (PpdActionGpuFreq  *self,
+              GUdevDevice       *device,
+              PpdProfile         profile,
+              GError           **error)
+{
+  const char *sysfs_path = g_udev_device_get_sysfs_path (device);
+  g_autofree char *device_dir = NULL;
+  g_autoptr(GDir) tiles = NULL;
+  const char *tile;
+
+  if (g_udev_device_has_sysfs_attr (device, PPD_DRM_I915_FREQ_SYSFS_NAME))
+    return apply_to_domain (self, sysfs_path, &i915_attrs, profile, error);
+
+  /* xe has frequency controls for each GT of each tile */
+  device_dir = g_build_filename (sysfs_path, "device", NULL);
+  tiles = g_dir_open (device_dir, 0, NULL);
+  while (tiles != NULL && (tile = g_dir_read_name (tiles)) != NULL) {
+    g_autofree char *tile_dir = NULL;
+    g_autoptr(GDir) gts = NULL;
+    const char *gt;
+
+    if (!g_str_has_prefix (tile, "tile"))
+      continue;
+
+    tile_dir = g_build_filename (device_dir, tile, NULL);
+    gts = g_dir_open (tile_dir, 0, NULL);
+    while (gts != NULL && (gt = g_dir_read_name (gts)) != NULL) {
+      g_autofree char *freq_dir = NULL;
+
+      if (!g_str_has_prefix (gt, "gt"))
+        continue;
+
+      freq_dir = g_build_filename (tile_dir, gt, "freq0", NULL);
+      if (!g_file_test (freq_dir, G_FILE_TEST_IS_DIR))
+        continue;
+      if (!apply_to_domain (self, freq_dir, &xe_attrs, profile, error))
+        return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static gboolean
+update_target (PpdActionGpuFreq  *self,
+               PpdProfile         profile,
+               GError           **error)
+{
+  g_autoptr(GPtrArray) gpus = NULL;
+
+  gpus = ppd_drm_registry_get_gpus (self->registry);
+  for (guint i = 0; i < gpus->len; i++) {
+    if (!apply_to_gpu (self, g_ptr_array_index (gpus, i), profile, error))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+ppd_action_gpu_freq_activate_profile (PpdAction   *action,
+                                      PpdProfile   profile,
+                                      GError     **error)
+{
+  PpdActionGpuFreq *self = PPD_ACTION_GPU_FREQ (action);
+  gboolean ret;
+
+  g_mutex_lock (&self->lock);
+  self->last_profile = profile;
+  ret = update_target (self, profile, error);
+  g_mutex_unlock (&self->lock);
+
+  return ret;
+}
+
+static void
+gpu_added_cb (PpdDrmRegistry *registry,
+              GUdevDevice    *device,
+              gpointer        user_data)
+{
+  PpdActionGpuFreq *self = user_data;
+
+  g_debug ("GPU %s added", g_udev_device_get_sysfs_path (device));
+
+  g_mutex_lock (&self->lock);
+  if (self->last_profile != PPD_PROFILE_UNSET)
+    apply_to_gpu (self, device, self->last_profile, NULL);
+  g_mutex_unlock (&self->lock);
+}
+
+static PpdProbeResult
+ppd_action_gpu_freq_probe (PpdAction *action)
+{
+  PpdActionGpuFreq *self = PPD_ACTION_GPU_FREQ (action);
+  g_autoptr(GPtrArray) gpus = NULL;
+
+  self->registry = ppd_drm_registry_get_default ();
+  gpus = ppd_drm_registry_get_gpus (self->registry);
+  if (gpus->len == 0) {
+    g_debug ("No i915 or xe card with frequency controls");
+    return PPD_PROBE_RESULT_FAIL;
+  }
+
+  g_signal_connect_object (G_OBJECT (self->registry), "gpu-added",
+                           G_CALLBACK (gpu_added_cb), self, 0);
+
+  return PPD_PROBE_RESULT_SUCCESS;
+}
+
+static void
+ppd_action_gpu_freq_finalize (GObject *object)
+{
+  PpdActionGpuFreq *action;
+
+  action = PPD_ACTION_GPU_FREQ (object);
+  /* Back to the frequencies from before we started */
+  if (action->registry != NULL)
+    update_target (action, PPD_PROFILE_BALANCED, NULL);
+  g_clear_object (&action->registry);
+  g_clear_pointer (&action->saved_values, g_hash_table_unref);
+  g_mutex_clear (&action->lock);
+  G_OBJECT_CLASS (ppd_action_gpu_freq_parent_class)->finalize (object);
+}
+
+static void
+ppd_action_gpu_freq_class_init (PpdActionGpuFreqClass *klass)
+{
+  GObjectClass *object_class;
+  PpdActionClass *driver_class;
+
+  object_class = G_OBJECT_CLASS(klass);
+  object_class->constructor = ppd_action_gpu_freq_constructor;
+  object_class->finalize = ppd_action_gpu_freq_finalize;
+
+  driver_class = PPD_ACTION_CLASS(klass);
+  driver_class->probe = ppd_action_gpu_freq_probe;
+  driver_class->activate_profile = ppd_action_gpu_freq_activate_profile;
+}
+
+static void
+ppd_action_gpu_freq_init (PpdActionGpuFreq *self)
+{
+  g_mutex_init (&self->lock);
+  self->saved_values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#define G_LOG_DOMAIN "PciePower"
+
+#include "config.h"
+
+#include <string.h>
+
+#include <gudev/gudev.h>
+
+#include "ppd-action-pcie-power.h"
+#include "ppd-profile.h"
+#include "ppd-utils.h"
+
+#define ASPM_POLICY_PATH             "/sys/module/pcie_aspm/parameters/policy"
+#define LATENCY_TOLERANCE_SYSFS_NAME "power/pm_qos_latency_tolerance_us"
+#define RUNTIME_PM_SYSFS_NAME        "power/control"
+
+/**
+ * SECTION:ppd-action-pcie-power
+ * @Short_description: Power savings for PCIe links and NVMe storage
+ * @Title: PCIe and NVMe power control
+ *
+ * The PCIe power action sets the PCIe Active State Power Management
+ * policy, the latency tolerance of NVMe controllers, which drives the
+ * power states Autonomous Power State Transition picks, and the runtime
+ * power management of the NVMe controllers' PCI devices, and of the
+ * ports upstream of them. Other PCI devices are left alone, as not all
+ * of their drivers cope with runtime suspend.
+ *
+ * The "performance" profile keeps links and drives in their fastest
+ * states, and the "power-saver" profile lets them sleep as deeply as
+ * they can. The "balanced" profile restores the values that were there
+ * before they were first changed, so the kernel's and distribution's
+ * defaults apply.
+ */
+
+struct _PpdActionPciePower
+{
+  PpdAction  parent_instance;
+
+  GUdevClient *client;
+
+  /* Protects everything below, as profiles are activated from a
+   * worker thread, and devices added from the main thread */
+  GMutex lock;
+  PpdProfile last_profile;
+  char *aspm_policy_path;
+  GPtrArray *nvme_devices;
+  GPtrArray *pci_devices; /* of the NVMe controllers, and upstream of them */
+  GHashTable *saved_values; /* attribute path to the value before it was changed */
+};
+
+G_DEFINE_TYPE (PpdActionPciePower, ppd_action_pcie_power, PPD_TYPE_ACTION)
+
+static GObject*
+ppd_action_pcie_power_constructor (GType                  type,
+                                   guint                  n_construct_params,
+                                   GObjectConstructParam *construct_params)
+{
+  GObject *object;
+
+  object = G_OBJECT_CLASS (ppd_action_pcie_power_parent_class)->constructor (type,
+                                                                             n_construct_params,
+                                                                             construct_params);
+  g_object_set (object,
+                "action-name", "pcie_power",
+                NULL);
+
+  return object;
+}
+
+/* NULL targets restore the saved values */
+static const char *
+aspm_target (PpdProfile profile)
+{
+  switch (profile) {
+  case PPD_PROFILE_POWER_SAVER:
+    return "powersupersave";
+  case PPD_PROFILE_PERFORMANCE:
+    return "performance";
+  case PPD_PROFILE_BALANCED:
+    return NULL;
+  }
+
+  g_return_val_if_reached (NULL);
+}
+
+static const char *
+latency_tolerance_target (PpdProfile profile)
+{
+  switch (profile) {
+  case PPD_PROFILE_POWER_SAVER:
+    return "any";
+  case PPD_PROFILE_PERFORMANCE:
+    /* No non-operational power states */
+    return "0";
+  case PPD_PROFILE_BALANCED:
+    return NULL;
+  }
+
+  g_return_val_if_reached (NULL);
+}
+
+static const char *
+runtime_pm_target (PpdProfile profile)
+{
+  switch (profile) {
+  case PPD_PROFILE_POWER_SAVER:
+    return "auto";
+  case PPD_PROFILE_PERFORMANCE:
+    return "on";
+  case PPD_PROFILE_BALANCED:
+    return NULL;
+  }
+
+  g_return_val_if_reached (NULL);
+}
+
+/* Writes @target to @path unless it already holds it, saving the
+ * original value on the first change, or restores the original value
+ * if @target is %NULL */
+static gboolean
+apply_value (PpdActionPciePower  *self,
+             const char          *path,
+             const char          *current,
+             const char          *target,
+             GError             **error)
+{
+  const char *saved;
+  gboolean restore;
+
+  saved = g_hash_table_lookup (self->saved_values, path);
+  restore = (target == NULL);
+  if (restore) {
+    /* Never changed */
+    if (saved == NULL)
+      return TRUE;
+    target = saved;
+  }
+
+  if (g_strcmp0 (current, target) == 0) {
+    g_debug ("%s already set to %s", path, target);
+  } else {
+    if (!restore && saved == NULL)
+      g_hash_table_insert (self->saved_values, g_strdup (path), g_strdup (current));
+    g_info ("Setting %s to %s", path, target);
+    if (!ppd_utils_write (path, target, error))
+      return FALSE;
+  }
+
+  if (restore)
+    g_hash_table_remove (self->saved_values, path);
+
+  return TRUE;
+}
+
+static gboolean
+apply_device_value (PpdActionPciePower  *self,
+                    GUdevDevice         *device,
+                    const char          *attribute,
+                    const char          *target,
+                    GError             **error)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *current = NULL;
+  const char *value;
+
+  value = g_udev_device_get_sysfs_attr_uncached (device, attribute);
+  if (value == NULL)
+    return TRUE;
+  current = g_strchomp (g_strdup (value));
+
+  path = g_build_filename (g_udev_device_get_sysfs_path (device), attribute, NULL);
+  return apply_value (self, path, current, target, error);
+}
+
+/* The policy file lists the policies, with the current one in brackets */
+static gboolean
+apply_aspm_policy (PpdActionPciePower  *self,
+                   GError             **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) policies = NULL;
+  g_autofree char *current = NULL;
+  const char *target;
+
+  if (self->aspm_policy_path == NULL)
+    return TRUE;
+
+  if (!g_file_get_contents (self->aspm_policy_path, &contents, NULL, error))
+    return FALSE;
+
+  policies = g_strsplit (g_strstrip (contents), " ", -1);
+  for (guint i = 0; policies[i] != NULL; i++) {
+    char *policy = policies[i];
+
+    if (*policy == '[' && g_str_has_suffix (policy, "]")) {
+      current = g_strndup (policy + 1, strlen (policy) - 2);
+      policy[strlen (policy) - 1] = '\0';
+      memmove (policy, policy + 1, strlen (policy));
+    }
+  }
+  if (current == NULL)
+    current = g_strdup (contents);
+
+  target = aspm_target (self->last_profile);
+  /* Older kernels don't have L1 substates */
+  if (g_strcmp0 (target, "powersupersave") == 0 &&
+      g_strv_length (policies) > 1 &&
+      !g_strv_contains ((const char * const *) policies, target))
+    target = "powersave";
+
+  if (apply_value (self, self->aspm_policy_path, current, target, &local_error))
+    return TRUE;
+
+  /* The firmware didn't hand ASPM control over to the OS */
+  if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED)) {
+    g_info ("ASPM policy can't be changed, leaving it alone: %s", local_error->message);
+    g_hash_table_remove (self->saved_values, self->aspm_policy_path);
+    g_clear_pointer (&self->aspm_policy_path, g_free);
+    return TRUE;
+  }
+
+  g_propagate_error (error, g_steal_pointer (&local_error));
+  return FALSE;
+}
+
+static gboolean
+update_target (PpdActionPciePower  *self,
+               GError             **error)
+{
+  if (!apply_aspm_policy (self, error))
+    return FALSE;
+
+  for (guint i = 0; i < self->nvme_devices->len; i++) {
+    GUdevDevice *dev = g_ptr_array_index (self->nvme_devices, i);
+
+    if (!apply_device_value (self, dev, LATENCY_TOLERANCE_SYSFS_NAME,
+                             latency_tolerance_target (self->last_profile), error))
+      return FALSE;
+  }
+
+  for (guint i = 0; i < self->pci_devices->len; i++) {
+    GUdevDevice *dev = g_ptr_array_index (self->pci_devices, i);
+
+    if (!apply_device_value (self, dev, RUNTIME_PM_SYSFS_NAME,
+                             runtime_pm_target (self->last_profile), error))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+ppd_action_pcie_power_activate_profile (PpdAction   *action,
+                                        PpdProfile   profile,
+                                        GError     **error)
+{
+  PpdActionPciePower *self = PPD_ACTION_PCIE_POWER (action);
+  gboolean ret;
+
+  g_mutex_lock (&self->lock);
+  self->last_profile = profile;
+  ret = update_target (self, error);
+  g_mutex_unlock (&self->lock);
+
+  return ret;
+}
+
+static gboolean
+is_nvme_device (GUdevDevice *device)
+{
+  return g_strcmp0 (g_udev_device_get_subsystem (device), "nvme") == 0 &&
+         g_udev_device_has_sysfs_attr (device, LATENCY_TOLERANCE_SYSFS_NAME);
+}
+
+static gboolean
+is_pci_device (GUdevDevice *device)
+{
+  return g_strcmp0 (g_udev_device_get_subsystem (device), "pci") == 0 &&
+         g_udev_device_has_sysfs_attr (device, RUNTIME_PM_SYSFS_NAME);
+}
+
+static gboolean
+has_device (GPtrArray   *devices,
+            GUdevDevice *device)
+{
+  for (guint i = 0; i < devices->len; i++) {
+    if (g_strcmp0 (g_udev_device_get_sysfs_path (g_ptr_array_index (devices, i)),
+                   g_udev_device_get_sysfs_path (device)) == 0)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* The controller's PCI function, and the bridges and ports up to the
+ * root port, need to allow runtime suspend for the link to sleep */
+static void
+add_upstream_pci_devices (PpdActionPciePower *self,
+                          GUdevDevice        *nvme)
+{
+  g_autoptr(GUdevDevice) device = NULL;
+
+  device = g_udev_device_get_parent (nvme);
+  while (device != NULL) {
+    GUdevDevice *parent;
+
+    if (is_pci_device (device) && !has_device (self->pci_devices, device))
+      g_ptr_array_add (self->pci_devices, g_object_ref (device));
+
+    parent = g_udev_device_get_parent (device);
+    g_object_unref (device);
+    device = parent;
+  }
+}
+
+static void
+rebuild_devices (PpdActionPciePower *self)
+{
+  g_autolist (GUdevDevice) nvme_devices = NULL;
+
+  g_ptr_array_set_size (self->nvme_devices, 0);
+  g_ptr_array_set_size (self->pci_devices, 0);
+
+  nvme_devices = g_udev_client_query_by_subsystem (self->client, "nvme");
+  for (GList *l = nvme_devices; l != NULL; l = l->next) {
+    if (!is_nvme_device (l->data))
+      continue;
+    g_ptr_array_add (self->nvme_devices, g_object_ref (l->data));
+    add_upstream_pci_devices (self, l->data);
+  }
+
+  g_debug ("Found %u NVMe controller(s) and %u PCI device(s)",
+           self->nvme_devices->len, self->pci_devices->len);
+}
+
+static void
+udev_uevent_cb (GUdevClient *client,
+                gchar       *action,
+                GUdevDevice *device,
+                gpointer     user_data)
+{
+  PpdActionPciePower *self = user_data;
+  g_autofree char *path = NULL;
+
+  if (!g_str_equal (action, "add") && !g_str_equal (action, "remove"))
+    return;
+
+  g_debug ("Device %s %s", g_udev_device_get_sysfs_path (device), action);
+
+  g_mutex_lock (&self->lock);
+  rebuild_devices (self);
+
+  if (g_str_equal (action, "remove")) {
+    /* A new device in its place has its own defaults */
+    path = g_build_filename (g_udev_device_get_sysfs_path (device), LATENCY_TOLERANCE_SYSFS_NAME, NULL);
+    g_hash_table_remove (self->saved_values, path);
+    g_clear_pointer (&path, g_free);
+    path = g_build_filename (g_udev_device_get_sysfs_path (device), RUNTIME_PM_SYSFS_NAME, NULL);
+    g_hash_table_remove (self->saved_values, path);
+  } else if (self->last_profile != PPD_PROFILE_UNSET) {
+    /* A new controller brings its upstream ports along, which
+     * might already have their settings */
+    update_target (self, NULL);
+  }
+  g_mutex_unlock (&self->lock);
+}
+
+static PpdProbeResult
+ppd_action_pcie_power_probe (PpdAction *action)
+{
+  PpdActionPciePower *self = PPD_ACTION_PCIE_POWER (action);
+  const gchar * const subsystems[] = { "nvme", "pci", NULL };
+  g_autofree char *aspm_policy_path = NULL;
+  gboolean found;
+
+  aspm_policy_path = ppd_utils_get_sysfs_path (ASPM_POLICY_PATH);
+
+  self->client = g_udev_client_new (subsystems);
+  g_signal_connect_object (G_OBJECT (self->client), "uevent",
+                           G_CALLBACK (udev_uevent_cb), self, 0);
+
+  g_mutex_lock (&self->lock);
+  if (g_file_test (aspm_policy_path, G_FILE_TEST_EXISTS))
+    self->aspm_policy_path = g_steal_pointer (&aspm_policy_path);
+  rebuild_devices (self);
+  found = self->aspm_policy_path != NULL ||
+          self->nvme_devices->len > 0 ||
+          self->pci_devices->len > 0;
+  g_mutex_unlock (&self->lock);
+
+  return found ? PPD_PROBE_RESULT_SUCCESS : PPD_PROBE_RESULT_FAIL;
+}
+
+static void
+ppd_action_pcie_power_finalize (GObject *object)
+{
+  PpdActionPciePower *action;
+
+  action = PPD_ACTION_PCIE_POWER (object);
+  g_clear_object (&action->client);
+  g_clear_pointer (&action->aspm_policy_path, g_free);
+  g_clear_pointer (&action->nvme_devices, g_ptr_array_unref);
+  g_clear_pointer (&action->pci_devices, g_ptr_array_unref);
+  g_clear_pointer (&action->saved_values, g_hash_table_unref);
+  g_mutex_clear (&action->lock);
+  G_OBJECT_CLASS (ppd_action_pcie_power_parent_class)->finalize (object);
+}
+
+static void
+ppd_action_pcie_power_class_init (PpdActionPciePowerClass *klass)
+{
+  GObjectClass *object_class;
+  PpdActionClass *driver_class;
+
+  object_class = G_OBJECT_CLASS(klass);
+  object_class->constructor = ppd_action_pcie_power_constructor;
+  object_class->finalize = ppd_action_pcie_power_finalize;
+
+  driver_class = PPD_ACTION_CLASS(klass);
+  driver_class->probe = ppd_action_pcie_power_probe;
+  driver_class->activate_profile = ppd_action_pcie_power_activate_profile;
+}
+
+static void
+ppd_action_pcie_power_init (PpdActionPciePower *self)
+{
+  g_mutex_init (&self->lock);
+  self->nvme_devices = g_ptr_array_new_with_free_func (g_object_unref);
+  self->pci_devices = g_ptr_array_new_with_free_func (g_object_unref);
+  self->saved_values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
@@ -0,0 +1,15 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#pragma once
+
+#include "ppd-action.h"
+
+#define PPD_TYPE_ACTION_PCIE_POWER (ppd_action_pcie_power_get_type())
+G_DECLARE_FINAL_TYPE (PpdActionPciePower, ppd_action_pcie_power, PPD, ACTION_PCIE_POWER, PpdAction)
@@ -12,6 +12,7 @@
 #include <gudev/gudev.h>
 
 #include "ppd-action-trickle-charge.h"
+#include "ppd-power-supply.h"
 #include "ppd-profile.h"
 #include "ppd-utils.h"
 
@@ -21,7 +22,11 @@ struct _PpdActionTrickleCharge
 {
   PpdAction  parent_instance;
 
-  GUdevClient *client;
+  PpdPowerSupplyMonitor *monitor;
+
+  /* Protects active, as profiles are activated from a worker thread,
+   * and power supplies added from the main thread */
+  GMutex lock;
   gboolean active;
 };
 
@@ -48,14 +53,11 @@ static void
 set_charge_type (PpdActionTrickleCharge *action,
                  const char             *charge_type)
 {
-  GList *devices, *l;
-
-  devices = g_udev_client_query_by_subsystem (action->client, "power_supply");
-  if (devices == NULL)
-    return;
+  g_autoptr(GPtrArray) devices = NULL;
 
-  for (l = devices; l != NULL; l = l->next) {
-    GUdevDevice *dev = l->data;
+  devices = ppd_power_supply_monitor_get_devices (action->monitor);
+  for (guint i = 0; i < devices->len; i++) {
+    GUdevDevice *dev = g_ptr_array_index (devices, i);
     const char *value;
 
     if (g_strcmp0 (g_udev_device_get_sysfs_attr (dev, "scope"), "Device") != 0)
@@ -72,8 +74,6 @@ set_charge_type (PpdActionTrickleCharge *action,
 
     break;
   }
-
-  g_list_free_full (devices, g_object_unref);
 }
 
 static gboolean
@@ -83,6 +83,7 @@ ppd_action_trickle_charge_activate_profile (PpdAction   *action,
 {
   PpdActionTrickleCharge *self = PPD_ACTION_TRICKLE_CHARGE (action);
 
+  g_mutex_lock (&self->lock);
   if (profile == PPD_PROFILE_POWER_SAVER) {
     set_charge_type (self, "Trickle");
     self->active = TRUE;
@@ -90,30 +91,29 @@ ppd_action_trickle_charge_activate_profile (PpdAction   *action,
     set_charge_type (self, "Fast");
     self->active = FALSE;
   }
+  g_mutex_unlock (&self->lock);
 
   return TRUE;
 }
 
 static void
-uevent_cb (GUdevClient *client,
-           gchar       *action,
-           GUdevDevice *device,
-           gpointer     user_data)
+device_added_cb (PpdPowerSupplyMonitor *monitor,
+                 GUdevDevice           *device,
+                 gpointer               user_data)
 {
   PpdActionTrickleCharge *self = user_data;
   const char *charge_type;
 
-  if (g_strcmp0 (action, "add") != 0)
-    return;
-
   if (!g_udev_device_has_sysfs_attr (device, CHARGE_TYPE_SYSFS_NAME))
     return;
 
+  g_mutex_lock (&self->lock);
   charge_type = self->active ? "Trickle" : "Fast";
   g_debug ("Updating charge type for '%s' to '%s'",
            g_udev_device_get_sysfs_path (device),
            charge_type);
   ppd_utils_write_sysfs (device, CHARGE_TYPE_SYSFS_NAME, charge_type, NULL);
+  g_mutex_unlock (&self->lock);
 }
 
 static void
@@ -122,7 +122,8 @@ ppd_action_trickle_charge_finalize (GObject *object)
   PpdActionTrickleCharge *driver;
 
   driver = PPD_ACTION_TRICKLE_CHARGE (object);
-  g_clear_object (&driver->client);
+  g_clear_object (&driver->monitor);
+  g_mutex_clear (&driver->lock);
   G_OBJECT_CLASS (ppd_action_trickle_charge_parent_class)->finalize (object);
 }
 
@@ -143,9 +144,8 @@ ppd_action_trickle_charge_class_init (PpdActionTrickleChargeClass *klass)
 static void
 ppd_action_trickle_charge_init (PpdActionTrickleCharge *self)
 {
-  const gchar * const subsystem[] = { "power_supply", NULL };
-
-  self->client = g_udev_client_new (subsystem);
-  g_signal_connect (G_OBJECT (self->client), "uevent",
-                    G_CALLBACK (uevent_cb), self);
+  g_mutex_init (&self->lock);
+  self->monitor = ppd_power_supply_monitor_get_default ();
+  g_signal_connect_object (G_OBJECT (self->monitor), "device-added",
+                           G_CALLBACK (device_added_cb), self, 0);
 }
@@ -10,7 +10,9 @@
 #define G_LOG_DOMAIN "Action"
 
 #include "ppd-action.h"
+#include "ppd-battery-bands.h"
 #include "ppd-enums.h"
+#include "ppd-stats.h"
 
 /**
  * SECTION:ppd-action
@@ -37,8 +39,9 @@
 
 typedef struct
 {
-  char          *action_name;
-  PpdProfile     profile;
+  char            *action_name;
+  PpdProfile       profile;
+  PpdBatteryBands *battery_bands;
 } PpdActionPrivate;
 
 enum {
@@ -93,6 +96,7 @@ ppd_action_finalize (GObject *object)
 
   priv = PPD_ACTION_GET_PRIVATE (PPD_ACTION (object));
   g_clear_pointer (&priv->action_name, g_free);
+  g_clear_pointer (&priv->battery_bands, ppd_battery_bands_free);
 
   G_OBJECT_CLASS (ppd_action_parent_class)->finalize (object);
 }
@@ -141,12 +145,21 @@ ppd_action_activate_profile (PpdAction  *action,
                              PpdProfile         profile,
                              GError           **error)
 {
+  g_autofree char *stats_name = NULL;
+  gint64 start_time;
+  gboolean ret;
+
   g_return_val_if_fail (PPD_IS_ACTION (action), FALSE);
 
   if (!PPD_ACTION_GET_CLASS (action)->activate_profile)
     return TRUE;
 
-  return PPD_ACTION_GET_CLASS (action)->activate_profile (action, profile, error);
+  start_time = g_get_monotonic_time ();
+  ret = PPD_ACTION_GET_CLASS (action)->activate_profile (action, profile, error);
+  stats_name = g_strdup_printf ("action:%s", ppd_action_get_action_name (action));
+  ppd_stats_record_timing_since (stats_name, start_time);
+
+  return ret;
 }
 
 gboolean ppd_action_power_changed (PpdAction             *action,
@@ -173,6 +186,41 @@ gboolean ppd_action_battery_changed (PpdAction             *action,
   return PPD_ACTION_GET_CLASS (action)->battery_changed (action, val, error);
 }
 
+/**
+ * ppd_action_set_battery_thresholds:
+ * @action: a #PpdAction
+ * @thresholds: (array length=n_thresholds): battery levels, in percent
+ * @n_thresholds: the number of thresholds
+ *
+ * Declares the battery levels the action changes behaviour at, so that
+ * @battery_changed is only called when one of them is crossed, rather
+ * than for every battery level change.
+ */
+void
+ppd_action_set_battery_thresholds (PpdAction     *action,
+                                   const gdouble *thresholds,
+                                   guint          n_thresholds)
+{
+  PpdActionPrivate *priv;
+
+  g_return_if_fail (PPD_IS_ACTION (action));
+
+  priv = PPD_ACTION_GET_PRIVATE (action);
+  g_clear_pointer (&priv->battery_bands, ppd_battery_bands_free);
+  priv->battery_bands = ppd_battery_bands_new (thresholds, n_thresholds);
+}
+
+PpdBatteryBands *
+ppd_action_get_battery_bands (PpdAction *action)
+{
+  PpdActionPrivate *priv;
+
+  g_return_val_if_fail (PPD_IS_ACTION (action), NULL);
+
+  priv = PPD_ACTION_GET_PRIVATE (action);
+  return priv->battery_bands;
+}
+
 const char *
 ppd_action_get_action_name (PpdAction *action)
 {
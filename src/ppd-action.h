@@ -11,6 +11,7 @@
 
 #include <glib-object.h>
 #include "ppd-profile.h"
+#include "ppd-battery-bands.h"
 
 #define PPD_TYPE_ACTION (ppd_action_get_type ())
 G_DECLARE_DERIVABLE_TYPE (PpdAction, ppd_action, PPD, ACTION, GObject)
@@ -48,5 +49,7 @@ PpdProbeResult ppd_action_probe (PpdAction *action);
 gboolean ppd_action_activate_profile (PpdAction *action, PpdProfile profile, GError **error);
 gboolean ppd_action_power_changed (PpdAction *action, PpdPowerChangedReason reason, GError **error);
 gboolean ppd_action_battery_changed (PpdAction *action, gdouble val, GError **error);
+PpdBatteryBands *ppd_action_get_battery_bands (PpdAction *action);
 const char *ppd_action_get_action_name (PpdAction *action);
+void ppd_action_set_battery_thresholds (PpdAction *action, const gdouble *thresholds, guint n_thresholds);
 #endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#include "ppd-battery-bands.h"
+
+/* Battery levels are split into bands by the thresholds an action or
+ * driver declared, so that it is only told about level changes that can
+ * change its behaviour. The thresholds themselves are bands of their own,
+ * as users might compare them with either < or <=.
+ *
+ * Crossing into a lower band happens as soon as the level drops, while
+ * going back up requires the level to exceed the boundary by the
+ * hysteresis, so that a level wobbling around a threshold doesn't cause
+ * a change every time. */
+struct _PpdBatteryBands {
+  GArray *thresholds;
+  gint band;
+};
+
+static gint
+compare_thresholds (gconstpointer a,
+                    gconstpointer b)
+{
+  gdouble da = *(const gdouble *) a;
+  gdouble db = *(const gdouble *) b;
+
+  return (da > db) - (da < db);
+}
+
+PpdBatteryBands *
+ppd_battery_bands_new (const gdouble *thresholds,
+                       guint          n_thresholds)
+{
+  PpdBatteryBands *bands;
+
+  g_return_val_if_fail (thresholds != NULL || n_thresholds == 0, NULL);
+
+  bands = g_new0 (PpdBatteryBands, 1);
+  bands->thresholds = g_array_sized_new (FALSE, FALSE, sizeof (gdouble), n_thresholds);
+  g_array_append_vals (bands->thresholds, thresholds, n_thresholds);
+  g_array_sort (bands->thresholds, compare_thresholds);
+  bands->band = -1;
+
+  return bands;
+}
+
+void
+ppd_battery_bands_free (PpdBatteryBands *bands)
+{
+  if (bands == NULL)
+    return;
+  g_array_unref (bands->thresholds);
+  g_free (bands);
+}
+
+static gint
+band_for_level (PpdBatteryBands *bands,
+                gdouble          level)
+{
+  gint band = 0;
+
+  for (guint i = 0; i < bands->thresholds->len; i++) {
+    gdouble threshold = g_array_index (bands->thresholds, gdouble, i);
+
+    if (level > threshold) {
+      band += 2;
+      continue;
+    }
+    if (level == threshold)
+      band += 1;
+    break;
+  }
+
+  return band;
+}
+
+/* Returns %TRUE if @level is in a different band than the last level
+ * that was accepted, or if it is the first level */
+gboolean
+ppd_battery_bands_update (PpdBatteryBands *bands,
+                          gdouble          level,
+                          gdouble          hysteresis)
+{
+  gint band;
+
+  g_return_val_if_fail (bands != NULL, TRUE);
+
+  band = band_for_level (bands, level);
+  if (bands->band < 0) {
+    bands->band = band;
+    return TRUE;
+  }
+
+  if (band == bands->band)
+    return FALSE;
+
+  if (band > bands->band && hysteresis > 0 &&
+      band_for_level (bands, level - hysteresis) <= bands->band)
+    return FALSE;
+
+  bands->band = band;
+  return TRUE;
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef struct _PpdBatteryBands PpdBatteryBands;
+
+PpdBatteryBands *ppd_battery_bands_new (const gdouble *thresholds,
+                                        guint          n_thresholds);
+void ppd_battery_bands_free (PpdBatteryBands *bands);
+gboolean ppd_battery_bands_update (PpdBatteryBands *bands,
+                                   gdouble          level,
+                                   gdouble          hysteresis);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PpdBatteryBands, ppd_battery_bands_free)
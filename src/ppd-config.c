@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#define G_LOG_DOMAIN "Config"
+
+#include "ppd-config.h"
+
+#define CONFIG_PATH "/etc/power-profiles-daemon/power-profiles-daemon.conf"
+
+/* The administrator's configuration, as opposed to the state.ini file
+ * the daemon saves its own state to. It is loaded on first use, and
+ * again after ppd_config_invalidate(), from any thread. */
+G_LOCK_DEFINE_STATIC (config);
+static GKeyFile *config = NULL;
+
+GKeyFile *
+ppd_config_get (void)
+{
+  GKeyFile *keyfile;
+
+  G_LOCK (config);
+  if (config == NULL) {
+    g_autofree char *path = NULL;
+    g_autoptr(GError) error = NULL;
+
+    path = ppd_utils_get_sysfs_path (CONFIG_PATH);
+    config = g_key_file_new ();
+    if (g_key_file_load_from_file (config, path, G_KEY_FILE_NONE, &error))
+      g_debug ("Loaded configuration file '%s'", path);
+    else if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+      g_debug ("No configuration file '%s'", path);
+    else
+      g_warning ("Could not load configuration file '%s': %s", path, error->message);
+  }
+  keyfile = g_key_file_ref (config);
+  G_UNLOCK (config);
+
+  return keyfile;
+}
+
+void
+ppd_config_invalidate (void)
+{
+  G_LOCK (config);
+  g_clear_pointer (&config, g_key_file_unref);
+  G_UNLOCK (config);
+}
+
+static const char *
+core_type_to_group (PpdCpuCoreType type)
+{
+  switch (type) {
+  case PPD_CPU_CORE_TYPE_PERFORMANCE:
+    return "PerformanceCores";
+  case PPD_CPU_CORE_TYPE_EFFICIENCY:
+    return "EfficiencyCores";
+  case PPD_CPU_CORE_TYPE_UNKNOWN:
+    break;
+  }
+
+  return NULL;
+}
+
+/* Looks up "<setting>.<profile>" in the group for the core class,
+ * preferring a "<setting>.<profile>.battery" key when on battery.
+ * Returns %NULL if the driver's default should be used. */
+char *
+ppd_config_get_cpu_class_pref (PpdCpuCoreType  type,
+                               const char     *setting,
+                               PpdProfile      profile,
+                               gboolean        battery)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_autofree char *key = NULL;
+  const char *group;
+  char *value = NULL;
+
+  g_return_val_if_fail (setting != NULL, NULL);
+
+  group = core_type_to_group (type);
+  if (group == NULL)
+    return NULL;
+
+  keyfile = ppd_config_get ();
+  key = g_strdup_printf ("%s.%s", setting, ppd_profile_to_str (profile));
+  if (battery) {
+    g_autofree char *battery_key = NULL;
+
+    battery_key = g_strconcat (key, ".battery", NULL);
+    value = g_key_file_get_string (keyfile, group, battery_key, NULL);
+  }
+  if (value == NULL)
+    value = g_key_file_get_string (keyfile, group, key, NULL);
+
+  if (value != NULL)
+    g_strstrip (value);
+
+  return value;
+}
+
+/* Looks up "<setting>.<profile>" in the [FrequencyEnvelope] group,
+ * leaving @limit untouched if unset or invalid */
+gboolean
+ppd_config_get_freq_limit (const char   *setting,
+                           PpdProfile    profile,
+                           PpdFreqLimit *limit)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *key = NULL;
+  g_autofree char *value = NULL;
+  PpdFreqLimit parsed = { 0, };
+
+  keyfile = ppd_config_get ();
+  key = g_strdup_printf ("%s.%s", setting, ppd_profile_to_str (profile));
+  value = g_key_file_get_string (keyfile, "FrequencyEnvelope", key, NULL);
+  if (value == NULL)
+    return FALSE;
+
+  if (!ppd_freq_limit_parse (g_strstrip (value), &parsed, &error)) {
+    g_warning ("Invalid FrequencyEnvelope %s '%s': %s", key, value, error->message);
+    return FALSE;
+  }
+
+  *limit = parsed;
+  return TRUE;
+}
+
+#define BATTERY_GROUP "Battery"
+
+/* Battery percentage needed past a threshold before reacting to the
+ * level getting back to the other side, defaulting to 1% */
+gdouble
+ppd_config_get_battery_hysteresis (void)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_autoptr(GError) error = NULL;
+  gdouble hysteresis;
+
+  keyfile = ppd_config_get ();
+  hysteresis = g_key_file_get_double (keyfile, BATTERY_GROUP, "Hysteresis", &error);
+  if (error != NULL) {
+    if (!g_error_matches (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) &&
+        !g_error_matches (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND))
+      g_warning ("Invalid Battery Hysteresis: %s", error->message);
+    return 1.0;
+  }
+  if (hysteresis < 0 || hysteresis > 100) {
+    g_warning ("Invalid Battery Hysteresis %f, not a percentage", hysteresis);
+    return 1.0;
+  }
+
+  return hysteresis;
+}
+
+/* Minimum delay between two battery level changes, in milliseconds,
+ * the ones in between being coalesced */
+guint
+ppd_config_get_battery_min_interval (void)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_autoptr(GError) error = NULL;
+  gint interval;
+
+  keyfile = ppd_config_get ();
+  interval = g_key_file_get_integer (keyfile, BATTERY_GROUP, "MinInterval", &error);
+  if (error != NULL) {
+    if (!g_error_matches (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) &&
+        !g_error_matches (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND))
+      g_warning ("Invalid Battery MinInterval: %s", error->message);
+    return 0;
+  }
+  if (interval < 0) {
+    g_warning ("Invalid Battery MinInterval %d, it can't be negative", interval);
+    return 0;
+  }
+
+  return interval;
+}
+
+/* Looks up "Thresholds.<name>" in the [Battery] group, leaving
+ * @thresholds untouched unless it holds @n_thresholds increasing
+ * percentages */
+gboolean
+ppd_config_get_battery_thresholds (const char *name,
+                                   gdouble    *thresholds,
+                                   guint       n_thresholds)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_autofree char *key = NULL;
+  g_autofree gdouble *values = NULL;
+  gsize n_values = 0;
+
+  g_return_val_if_fail (name != NULL, FALSE);
+
+  keyfile = ppd_config_get ();
+  key = g_strdup_printf ("Thresholds.%s", name);
+  values = g_key_file_get_double_list (keyfile, BATTERY_GROUP, key, &n_values, NULL);
+  if (values == NULL)
+    return FALSE;
+
+  if (n_values != n_thresholds) {
+    g_warning ("Invalid Battery %s, %u thresholds are needed", key, n_thresholds);
+    return FALSE;
+  }
+  for (guint i = 0; i < n_values; i++) {
+    if (values[i] < 0 || values[i] > 100 || (i > 0 && values[i] <= values[i - 1])) {
+      g_warning ("Invalid Battery %s, thresholds are increasing percentages", key);
+      return FALSE;
+    }
+  }
+
+  for (guint i = 0; i < n_values; i++)
+    thresholds[i] = values[i];
+  return TRUE;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include "ppd-custom-profile.h"
+#include "ppd-profile.h"
+#include "ppd-utils.h"
+
+GKeyFile *ppd_config_get (void);
+void ppd_config_invalidate (void);
+char *ppd_config_get_cpu_class_pref (PpdCpuCoreType  type,
+                                     const char     *setting,
+                                     PpdProfile      profile,
+                                     gboolean        battery);
+gboolean ppd_config_get_freq_limit (const char   *setting,
+                                    PpdProfile    profile,
+                                    PpdFreqLimit *limit);
+gdouble ppd_config_get_battery_hysteresis (void);
+guint ppd_config_get_battery_min_interval (void);
+gboolean ppd_config_get_battery_thresholds (const char *name,
+                                            gdouble    *thresholds,
+                                            guint       n_thresholds);
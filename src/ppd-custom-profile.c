@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#define G_LOG_DOMAIN "Profile"
+
+#include <string.h>
+
+#include "ppd-custom-profile.h"
+#include "ppd-utils.h"
+
+#define PROFILES_DIR "/etc/power-profiles-daemon/profiles.d"
+#define PROFILE_GROUP "Profile"
+#define ACTIONS_GROUP "Actions"
+
+/* Custom profiles tweak one of the base profiles, which is what clients
+ * see as the active profile. Their settings are parsed once, when loaded,
+ * and only read afterwards, so drivers can consult the active one from
+ * their worker threads. */
+struct _PpdCustomProfile {
+  char *name;
+  PpdProfile base;
+  char *epp;
+  char *governor;
+  const char *boost;
+  PpdFreqLimit min_freq;
+  PpdFreqLimit max_freq;
+  char *platform_profile;
+  GHashTable *action_profiles; /* action name to PpdProfile, UNSET to skip it */
+};
+
+G_LOCK_DEFINE_STATIC (active_profile);
+static PpdCustomProfile *active_profile = NULL;
+
+static void
+custom_profile_clear (PpdCustomProfile *profile)
+{
+  g_free (profile->name);
+  g_free (profile->epp);
+  g_free (profile->governor);
+  g_free (profile->platform_profile);
+  g_clear_pointer (&profile->action_profiles, g_hash_table_unref);
+}
+
+PpdCustomProfile *
+ppd_custom_profile_ref (PpdCustomProfile *profile)
+{
+  return g_atomic_rc_box_acquire (profile);
+}
+
+void
+ppd_custom_profile_unref (PpdCustomProfile *profile)
+{
+  g_atomic_rc_box_release_full (profile, (GDestroyNotify) custom_profile_clear);
+}
+
+/* "min", "nonlinear", "max", a percentage of the maximum frequency,
+ * or a frequency in kHz */
+gboolean
+ppd_freq_limit_parse (const char    *str,
+                      PpdFreqLimit  *limit,
+                      GError       **error)
+{
+  g_autofree char *number = NULL;
+  guint64 value;
+
+  if (g_str_equal (str, "min")) {
+    limit->type = PPD_FREQ_LIMIT_MIN;
+    return TRUE;
+  }
+  if (g_str_equal (str, "nonlinear")) {
+    limit->type = PPD_FREQ_LIMIT_NONLINEAR;
+    return TRUE;
+  }
+  if (g_str_equal (str, "max")) {
+    limit->type = PPD_FREQ_LIMIT_MAX;
+    return TRUE;
+  }
+  if (g_str_has_suffix (str, "%")) {
+    number = g_strndup (str, strlen (str) - 1);
+    if (!g_ascii_string_to_unsigned (number, 10, 1, 100, &value, error))
+      return FALSE;
+
+    limit->type = PPD_FREQ_LIMIT_PERCENT;
+    limit->value = value;
+    return TRUE;
+  }
+  if (!g_ascii_string_to_unsigned (str, 10, 1, G_MAXUINT32, &value, error))
+    return FALSE;
+
+  limit->type = PPD_FREQ_LIMIT_KHZ;
+  limit->value = value;
+  return TRUE;
+}
+
+/* Resolves @limit against a policy's frequencies, returning 0 if it
+ * can't, as the frequency it depends on is unknown */
+guint64
+ppd_freq_limit_to_khz (const PpdFreqLimit *limit,
+                       guint64             min_khz,
+                       guint64             nonlinear_khz,
+                       guint64             max_khz)
+{
+  switch (limit->type) {
+  case PPD_FREQ_LIMIT_MIN:
+    return min_khz;
+  case PPD_FREQ_LIMIT_NONLINEAR:
+    return nonlinear_khz;
+  case PPD_FREQ_LIMIT_MAX:
+    return max_khz;
+  case PPD_FREQ_LIMIT_KHZ:
+    return limit->value;
+  case PPD_FREQ_LIMIT_PERCENT:
+    return max_khz * limit->value / 100;
+  case PPD_FREQ_LIMIT_UNSET:
+    break;
+  }
+
+  return 0;
+}
+
+static char *
+get_optional_string (GKeyFile   *keyfile,
+                     const char *key)
+{
+  char *value;
+
+  value = g_key_file_get_string (keyfile, PROFILE_GROUP, key, NULL);
+  if (value == NULL)
+    return NULL;
+
+  g_strstrip (value);
+  if (*value == '\0')
+    g_clear_pointer (&value, g_free);
+
+  return value;
+}
+
+static gboolean
+get_optional_freq_limit (GKeyFile      *keyfile,
+                         const char    *key,
+                         PpdFreqLimit  *limit,
+                         GError       **error)
+{
+  g_autofree char *value = NULL;
+
+  value = get_optional_string (keyfile, key);
+  if (value == NULL)
+    return TRUE;
+
+  if (!ppd_freq_limit_parse (value, limit, error)) {
+    g_prefix_error (error, "Invalid %s '%s': ", key, value);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static PpdCustomProfile *
+custom_profile_new_from_file (const char  *path,
+                              GError     **error)
+{
+  g_autoptr(PpdCustomProfile) profile = NULL;
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_autofree char *base = NULL;
+  g_auto(GStrv) actions = NULL;
+
+  keyfile = g_key_file_new ();
+  if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, error))
+    return NULL;
+
+  profile = g_atomic_rc_box_new0 (PpdCustomProfile);
+  profile->action_profiles = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  profile->name = get_optional_string (keyfile, "Name");
+  if (profile->name == NULL) {
+    g_set_error_literal (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND,
+                         "No profile name");
+    return NULL;
+  }
+  if (ppd_profile_from_str (profile->name) != PPD_PROFILE_UNSET) {
+    g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                 "'%s' is a base profile name", profile->name);
+    return NULL;
+  }
+
+  base = get_optional_string (keyfile, "Inherits");
+  profile->base = base ? ppd_profile_from_str (base) : PPD_PROFILE_UNSET;
+  if (profile->base == PPD_PROFILE_UNSET) {
+    g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                 "Invalid base profile '%s'", base ? base : "");
+    return NULL;
+  }
+
+  profile->epp = get_optional_string (keyfile, "EnergyPerformancePreference");
+  profile->governor = get_optional_string (keyfile, "Governor");
+  profile->platform_profile = get_optional_string (keyfile, "PlatformProfile");
+
+  if (g_key_file_has_key (keyfile, PROFILE_GROUP, "Boost", NULL)) {
+    g_autoptr(GError) local_error = NULL;
+    gboolean boost;
+
+    boost = g_key_file_get_boolean (keyfile, PROFILE_GROUP, "Boost", &local_error);
+    if (local_error != NULL) {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
+    }
+    profile->boost = boost ? "1" : "0";
+  }
+
+  if (!get_optional_freq_limit (keyfile, "MinFrequency", &profile->min_freq, error) ||
+      !get_optional_freq_limit (keyfile, "MaxFrequency", &profile->max_freq, error))
+    return NULL;
+
+  actions = g_key_file_get_keys (keyfile, ACTIONS_GROUP, NULL, NULL);
+  for (guint i = 0; actions && actions[i]; i++) {
+    g_autofree char *value = NULL;
+    PpdProfile action_profile = PPD_PROFILE_UNSET;
+
+    value = g_key_file_get_string (keyfile, ACTIONS_GROUP, actions[i], NULL);
+    g_strstrip (value);
+    if (!g_str_equal (value, "none")) {
+      action_profile = ppd_profile_from_str (value);
+      if (action_profile == PPD_PROFILE_UNSET) {
+        g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                     "Invalid profile '%s' for action '%s'", value, actions[i]);
+        return NULL;
+      }
+    }
+    g_hash_table_insert (profile->action_profiles, g_strdup (actions[i]),
+                         GUINT_TO_POINTER (action_profile));
+  }
+
+  return g_steal_pointer (&profile);
+}
+
+static gint
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+  return g_strcmp0 (*(const char **) a, *(const char **) b);
+}
+
+/* Loads the *.conf files in profiles.d in alphabetical order, skipping
+ * invalid ones, and the ones defining an already used name */
+GPtrArray *
+ppd_custom_profiles_load (void)
+{
+  g_autoptr(GPtrArray) filenames = NULL;
+  g_autofree char *dir_path = NULL;
+  g_autoptr(GDir) dir = NULL;
+  GPtrArray *profiles;
+  const char *name;
+
+  profiles = g_ptr_array_new_with_free_func ((GDestroyNotify) ppd_custom_profile_unref);
+
+  dir_path = ppd_utils_get_sysfs_path (PROFILES_DIR);
+  dir = g_dir_open (dir_path, 0, NULL);
+  if (dir == NULL)
+    return profiles;
+
+  filenames = g_ptr_array_new_with_free_func (g_free);
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    if (g_str_has_suffix (name, ".conf"))
+      g_ptr_array_add (filenames, g_strdup (name));
+  }
+  g_ptr_array_sort (filenames, compare_strings);
+
+  for (guint i = 0; i < filenames->len; i++) {
+    g_autofree char *path = NULL;
+    g_autoptr(GError) error = NULL;
+    PpdCustomProfile *profile;
+    gboolean duplicate = FALSE;
+
+    path = g_build_filename (dir_path, g_ptr_array_index (filenames, i), NULL);
+    profile = custom_profile_new_from_file (path, &error);
+    if (profile == NULL) {
+      g_warning ("Ignoring custom profile '%s': %s", path, error->message);
+      continue;
+    }
+
+    for (guint j = 0; j < profiles->len && !duplicate; j++)
+      duplicate = g_str_equal (ppd_custom_profile_get_name (g_ptr_array_index (profiles, j)),
+                               profile->name);
+    if (duplicate) {
+      g_warning ("Ignoring custom profile '%s': '%s' is already defined", path, profile->name);
+      ppd_custom_profile_unref (profile);
+      continue;
+    }
+
+    g_debug ("Loaded custom profile '%s', based on '%s'",
+             profile->name, ppd_profile_to_str (profile->base));
+    g_ptr_array_add (profiles, profile);
+  }
+
+  return profiles;
+}
+
+const char *
+ppd_custom_profile_get_name (PpdCustomProfile *profile)
+{
+  return profile->name;
+}
+
+PpdProfile
+ppd_custom_profile_get_base (PpdCustomProfile *profile)
+{
+  return profile->base;
+}
+
+const char *
+ppd_custom_profile_get_epp (PpdCustomProfile *profile)
+{
+  return profile->epp;
+}
+
+const char *
+ppd_custom_profile_get_governor (PpdCustomProfile *profile)
+{
+  return profile->governor;
+}
+
+const char *
+ppd_custom_profile_get_boost (PpdCustomProfile *profile)
+{
+  return profile->boost;
+}
+
+const PpdFreqLimit *
+ppd_custom_profile_get_min_freq (PpdCustomProfile *profile)
+{
+  return &profile->min_freq;
+}
+
+const PpdFreqLimit *
+ppd_custom_profile_get_max_freq (PpdCustomProfile *profile)
+{
+  return &profile->max_freq;
+}
+
+const char *
+ppd_custom_profile_get_platform_profile (PpdCustomProfile *profile)
+{
+  return profile->platform_profile;
+}
+
+/* Returns %TRUE if the profile overrides what @action_name should do,
+ * with @action_profile set to %PPD_PROFILE_UNSET if it should be left alone */
+gboolean
+ppd_custom_profile_get_action_profile (PpdCustomProfile *profile,
+                                       const char       *action_name,
+                                       PpdProfile       *action_profile)
+{
+  gpointer value;
+
+  if (!g_hash_table_lookup_extended (profile->action_profiles, action_name, NULL, &value))
+    return FALSE;
+
+  *action_profile = GPOINTER_TO_UINT (value);
+  return TRUE;
+}
+
+void
+ppd_custom_profile_set_active (PpdCustomProfile *profile)
+{
+  G_LOCK (active_profile);
+  if (profile != NULL)
+    ppd_custom_profile_ref (profile);
+  g_clear_pointer (&active_profile, ppd_custom_profile_unref);
+  active_profile = profile;
+  G_UNLOCK (active_profile);
+}
+
+PpdCustomProfile *
+ppd_custom_profile_get_active (void)
+{
+  PpdCustomProfile *profile = NULL;
+
+  G_LOCK (active_profile);
+  if (active_profile != NULL)
+    profile = ppd_custom_profile_ref (active_profile);
+  G_UNLOCK (active_profile);
+
+  return profile;
+}
+
+/* The active custom profile, if it is based on @profile */
+PpdCustomProfile *
+ppd_custom_profile_get_active_for (PpdProfile profile)
+{
+  PpdCustomProfile *custom;
+
+  custom = ppd_custom_profile_get_active ();
+  if (custom != NULL && custom->base != profile)
+    g_clear_pointer (&custom, ppd_custom_profile_unref);
+
+  return custom;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include "ppd-profile.h"
+
+typedef enum {
+  PPD_FREQ_LIMIT_UNSET,
+  PPD_FREQ_LIMIT_MIN,       /* cpuinfo_min_freq */
+  PPD_FREQ_LIMIT_NONLINEAR, /* lowest non-linear frequency */
+  PPD_FREQ_LIMIT_MAX,       /* cpuinfo_max_freq */
+  PPD_FREQ_LIMIT_KHZ,       /* an explicit frequency */
+  PPD_FREQ_LIMIT_PERCENT,   /* a percentage of cpuinfo_max_freq */
+} PpdFreqLimitType;
+
+typedef struct {
+  PpdFreqLimitType type;
+  guint64 value; /* in kHz, or percent */
+} PpdFreqLimit;
+
+gboolean ppd_freq_limit_parse (const char    *str,
+                               PpdFreqLimit  *limit,
+                               GError       **error);
+guint64 ppd_freq_limit_to_khz (const PpdFreqLimit *limit,
+                               guint64             min_khz,
+                               guint64             nonlinear_khz,
+                               guint64             max_khz);
+
+typedef struct _PpdCustomProfile PpdCustomProfile;
+
+GPtrArray *ppd_custom_profiles_load (void);
+
+PpdCustomProfile *ppd_custom_profile_ref (PpdCustomProfile *profile);
+void ppd_custom_profile_unref (PpdCustomProfile *profile);
+const char *ppd_custom_profile_get_name (PpdCustomProfile *profile);
+PpdProfile ppd_custom_profile_get_base (PpdCustomProfile *profile);
+const char *ppd_custom_profile_get_epp (PpdCustomProfile *profile);
+const char *ppd_custom_profile_get_governor (PpdCustomProfile *profile);
+const char *ppd_custom_profile_get_boost (PpdCustomProfile *profile);
+const PpdFreqLimit *ppd_custom_profile_get_min_freq (PpdCustomProfile *profile);
+const PpdFreqLimit *ppd_custom_profile_get_max_freq (PpdCustomProfile *profile);
+const char *ppd_custom_profile_get_platform_profile (PpdCustomProfile *profile);
+gboolean ppd_custom_profile_get_action_profile (PpdCustomProfile *profile,
+                                                const char       *action_name,
+                                                PpdProfile       *action_profile);
+
+void ppd_custom_profile_set_active (PpdCustomProfile *profile);
+PpdCustomProfile *ppd_custom_profile_get_active (void);
+PpdCustomProfile *ppd_custom_profile_get_active_for (PpdProfile profile);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PpdCustomProfile, ppd_custom_profile_unref)
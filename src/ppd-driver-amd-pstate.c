@@ -12,6 +12,9 @@
 
 #include <upower.h>
 
+#include "ppd-config.h"
+#include "ppd-custom-profile.h"
+#include "ppd-power-budget.h"
 #include "ppd-utils.h"
 #include "ppd-driver-amd-pstate.h"
 
@@ -32,12 +35,47 @@ enum acpi_preferred_pm_profiles {
   NR_PM_PROFILES = 9
 };
 
+typedef enum {
+  MIN_FREQ_CPUINFO,
+  MIN_FREQ_LOWEST_NONLINEAR,
+  MIN_FREQ_CPUINFO_MAX, /* for the ceilings */
+  N_MIN_FREQS
+} MinFreqSource;
+
+static const char *min_freq_attrs[N_MIN_FREQS] = {
+  "cpuinfo_min_freq",
+  "amd_pstate_lowest_nonlinear_freq",
+  "cpuinfo_max_freq",
+};
+
+#define POLICY_HAS_BOOST            (1 << 0)
+#define POLICY_HAS_MIN_FREQ(source) (1 << ((source) + 1))
+
+/* Everything the activation needs, gathered at probe time, so that
+ * switching profiles does not build paths or stat files */
+typedef struct {
+  guint       len;
+  GPtrArray  *indices; /* for ppd_utils_foreach_parallel() */
+  char      **governor;
+  char      **epp;
+  char      **boost;
+  char      **scaling_min_freq;
+  char      **scaling_max_freq;
+  char      **min_freq[N_MIN_FREQS]; /* values, not paths */
+  char      **saved_min_freq; /* values found on startup, restored on exit */
+  char      **saved_max_freq;
+  guint8     *flags;
+  guint8     *core_type; /* PpdCpuCoreType */
+  GArray    **cpus; /* for scoped holds, or NULL */
+  gboolean    max_freq_limited; /* needs restoring once unlimited */
+} PolicyTable;
+
 struct _PpdDriverAmdPstate
 {
   PpdDriverCpu  parent_instance;
 
   PpdProfile activated_profile;
-  GPtrArray *epp_devices; /* Array of paths */
+  PolicyTable *policies;
   gboolean on_battery;
 };
 
@@ -66,9 +104,137 @@ ppd_driver_amd_pstate_constructor (GType                  type,
   return object;
 }
 
+static void
+policy_table_free (PolicyTable *table)
+{
+  for (guint i = 0; i < table->len; i++) {
+    g_free (table->governor[i]);
+    g_free (table->epp[i]);
+    g_free (table->boost[i]);
+    g_free (table->scaling_min_freq[i]);
+    g_free (table->scaling_max_freq[i]);
+    for (guint j = 0; j < N_MIN_FREQS; j++)
+      g_free (table->min_freq[j][i]);
+    g_free (table->saved_min_freq[i]);
+    g_free (table->saved_max_freq[i]);
+    g_clear_pointer (&table->cpus[i], g_array_unref);
+  }
+  g_free (table->governor);
+  g_free (table->epp);
+  g_free (table->boost);
+  g_free (table->scaling_min_freq);
+  g_free (table->scaling_max_freq);
+  for (guint j = 0; j < N_MIN_FREQS; j++)
+    g_free (table->min_freq[j]);
+  g_free (table->saved_min_freq);
+  g_free (table->saved_max_freq);
+  g_free (table->flags);
+  g_free (table->core_type);
+  g_free (table->cpus);
+  g_ptr_array_unref (table->indices);
+  g_free (table);
+}
+
+static char *
+read_freq (const char *path)
+{
+  char *value = NULL;
+
+  if (!g_file_get_contents (path, &value, NULL, NULL))
+    return NULL;
+
+  return g_strchomp (value);
+}
+
+static PolicyTable *
+policy_table_new (GPtrArray *bases)
+{
+  g_autoptr(PpdCpuTopology) topology = NULL;
+  PolicyTable *table;
+
+  topology = ppd_utils_get_cpu_topology ();
+  table = g_new0 (PolicyTable, 1);
+  table->len = bases->len;
+  table->indices = g_ptr_array_sized_new (bases->len);
+  table->governor = g_new0 (char *, bases->len);
+  table->epp = g_new0 (char *, bases->len);
+  table->boost = g_new0 (char *, bases->len);
+  table->scaling_min_freq = g_new0 (char *, bases->len);
+  table->scaling_max_freq = g_new0 (char *, bases->len);
+  for (guint j = 0; j < N_MIN_FREQS; j++)
+    table->min_freq[j] = g_new0 (char *, bases->len);
+  table->saved_min_freq = g_new0 (char *, bases->len);
+  table->saved_max_freq = g_new0 (char *, bases->len);
+  table->flags = g_new0 (guint8, bases->len);
+  table->core_type = g_new0 (guint8, bases->len);
+  table->cpus = g_new0 (GArray *, bases->len);
+
+  for (guint i = 0; i < bases->len; i++) {
+    const char *base = g_ptr_array_index (bases, i);
+    g_autofree char *boost = NULL;
+    GArray *cpus;
+
+    g_ptr_array_add (table->indices, GUINT_TO_POINTER (i));
+    table->governor[i] = g_build_filename (base, "scaling_governor", NULL);
+    table->epp[i] = g_build_filename (base, "energy_performance_preference", NULL);
+    table->scaling_min_freq[i] = g_build_filename (base, "scaling_min_freq", NULL);
+    table->scaling_max_freq[i] = g_build_filename (base, "scaling_max_freq", NULL);
+    table->core_type[i] = ppd_cpu_topology_get_policy_core_type (topology, base);
+    cpus = ppd_cpu_topology_get_policy_cpus (topology, base);
+    if (cpus != NULL)
+      table->cpus[i] = g_array_ref (cpus);
+
+    boost = g_build_filename (base, "boost", NULL);
+    if (g_file_test (boost, G_FILE_TEST_EXISTS)) {
+      table->boost[i] = g_steal_pointer (&boost);
+      table->flags[i] |= POLICY_HAS_BOOST;
+    }
+
+    /* Those are hardware constants, read them only once */
+    for (guint j = 0; j < N_MIN_FREQS; j++) {
+      g_autofree char *path = NULL;
+      g_autofree char *value = NULL;
+      g_autoptr(GError) error = NULL;
+
+      path = g_build_filename (base, min_freq_attrs[j], NULL);
+      if (!g_file_test (path, G_FILE_TEST_EXISTS))
+        continue;
+      if (!g_file_get_contents (path, &value, NULL, &error)) {
+        g_debug ("Failed to read %s: %s", path, error->message);
+        continue;
+      }
+      table->min_freq[j][i] = g_strchomp (g_steal_pointer (&value));
+      table->flags[i] |= POLICY_HAS_MIN_FREQ (j);
+    }
+
+    table->saved_min_freq[i] = read_freq (table->scaling_min_freq[i]);
+    table->saved_max_freq[i] = read_freq (table->scaling_max_freq[i]);
+  }
+
+  return table;
+}
+
+static void
+policy_table_restore (PolicyTable *table)
+{
+  for (guint i = 0; i < table->len; i++) {
+    g_autoptr(GError) error = NULL;
+
+    if (table->saved_max_freq[i] != NULL &&
+        !ppd_utils_write (table->scaling_max_freq[i], table->saved_max_freq[i], &error)) {
+      g_debug ("Failed to restore %s: %s", table->scaling_max_freq[i], error->message);
+      g_clear_error (&error);
+    }
+    if (table->saved_min_freq[i] != NULL &&
+        !ppd_utils_write (table->scaling_min_freq[i], table->saved_min_freq[i], &error))
+      g_debug ("Failed to restore %s: %s", table->scaling_min_freq[i], error->message);
+  }
+}
+
 static PpdProbeResult
 probe_epp (PpdDriverAmdPstate *pstate)
 {
+  g_autoptr(GPtrArray) bases = NULL;
   g_autoptr(GDir) dir = NULL;
   g_autofree char *policy_dir = NULL;
   g_autofree char *pstate_status_path = NULL;
@@ -136,16 +302,18 @@ probe_epp (PpdDriverAmdPstate *pstate)
       continue;
     }
 
-    if (!pstate->epp_devices)
-      pstate->epp_devices = g_ptr_array_new_with_free_func (g_free);
+    if (!bases)
+      bases = g_ptr_array_new_with_free_func (g_free);
 
-    g_ptr_array_add (pstate->epp_devices, g_steal_pointer (&base));
+    g_ptr_array_add (bases, g_steal_pointer (&base));
   }
 
-  if (pstate->epp_devices && pstate->epp_devices->len)
-    return PPD_PROBE_RESULT_SUCCESS;
+  if (!bases || !bases->len)
+    return PPD_PROBE_RESULT_FAIL;
+
+  pstate->policies = policy_table_new (bases);
 
-  return PPD_PROBE_RESULT_FAIL;
+  return PPD_PROBE_RESULT_SUCCESS;
 }
 
 static PpdProbeResult
@@ -208,83 +376,256 @@ profile_to_cpb_pref (PpdProfile profile)
 
 }
 
-static const char *
+static PpdFreqLimitType
 profile_to_min_freq (PpdProfile profile)
 {
   switch (profile) {
   case PPD_PROFILE_POWER_SAVER:
-    return "cpuinfo_min_freq";
+    return PPD_FREQ_LIMIT_MIN;
   case PPD_PROFILE_BALANCED:
   case PPD_PROFILE_PERFORMANCE:
-    return "amd_pstate_lowest_nonlinear_freq";
+    return PPD_FREQ_LIMIT_NONLINEAR;
   }
 
-  g_return_val_if_reached (NULL);
+  g_return_val_if_reached (PPD_FREQ_LIMIT_MIN);
 
 }
 
-static gboolean
-apply_pref_to_devices (GPtrArray   *devices,
-                       PpdProfile   profile,
-                       gboolean     battery,
-                       GError     **error)
+/* Preferences that don't come from the tables above are copied into
+ * fixed-size buffers, longer ones can't be valid */
+#define PREF_SIZE 32
+
+static const char *
+copy_pref (char        buf[PREF_SIZE],
+           const char *pref)
 {
-  const char *epp_pref;
-  const char *gov_pref;
-  const char *cpb_pref;
-  const char *min_freq;
+  if (pref == NULL)
+    return NULL;
+  if (g_strlcpy (buf, pref, PREF_SIZE) >= PREF_SIZE) {
+    g_debug ("Ignoring preference '%s', it is too long", pref);
+    return NULL;
+  }
 
-  if (profile == PPD_PROFILE_UNSET)
+  return buf;
+}
+
+static const char *
+class_epp_pref (PpdCpuCoreType  type,
+                PpdProfile      profile,
+                gboolean        battery,
+                char            buf[PREF_SIZE])
+{
+  g_autofree char *config_pref = NULL;
+  const char *pref;
+
+  config_pref = ppd_config_get_cpu_class_pref (type, "EnergyPerformancePreference", profile, battery);
+  pref = copy_pref (buf, config_pref);
+  if (pref != NULL)
+    return pref;
+
+  /* Dense cores gain little from the most aggressive preference, and
+   * would take power budget away from the full-size cores */
+  if (type == PPD_CPU_CORE_TYPE_EFFICIENCY && profile == PPD_PROFILE_PERFORMANCE)
+    return "balance_performance";
+
+  return profile_to_epp_pref (profile, battery);
+}
+
+static const char *
+class_cpb_pref (PpdCpuCoreType  type,
+                PpdProfile      profile,
+                gboolean        battery,
+                char            buf[PREF_SIZE])
+{
+  g_autofree char *config_pref = NULL;
+  const char *pref;
+
+  config_pref = ppd_config_get_cpu_class_pref (type, "Boost", profile, battery);
+  pref = copy_pref (buf, config_pref);
+  if (pref != NULL)
+    return pref;
+
+  return profile_to_cpb_pref (profile);
+}
+
+#define N_PROFILES 3
+
+/* Values indexed by PpdCpuCoreType are per core class, preferences are
+ * static strings, or point to the buffers */
+typedef struct _PolicyPrefs PolicyPrefs;
+struct _PolicyPrefs {
+  const PolicyTable *table;
+  const char *epp_pref[PPD_N_CPU_CORE_TYPES];
+  const char *gov_pref[PPD_N_CPU_CORE_TYPES];
+  const char *cpb_pref[PPD_N_CPU_CORE_TYPES];
+  char epp_buf[PPD_N_CPU_CORE_TYPES][PREF_SIZE];
+  char cpb_buf[PPD_N_CPU_CORE_TYPES][PREF_SIZE];
+  PpdFreqLimit min_freq;
+  PpdFreqLimit max_freq; /* unset to leave alone */
+  const PolicyPrefs *held[N_PROFILES]; /* for policies with scoped holds */
+};
+
+static guint64
+policy_freq (const PolicyTable *table,
+             guint              i,
+             MinFreqSource      source)
+{
+  if (!(table->flags[i] & POLICY_HAS_MIN_FREQ (source)))
+    return 0;
+
+  return g_ascii_strtoull (table->min_freq[source][i], NULL, 10);
+}
+
+static gboolean
+write_freq (const PolicyTable   *table,
+            guint                i,
+            const char          *path,
+            const PpdFreqLimit  *limit,
+            GError             **error)
+{
+  char value[32];
+  guint64 khz;
+
+  khz = ppd_freq_limit_to_khz (limit,
+                               policy_freq (table, i, MIN_FREQ_CPUINFO),
+                               policy_freq (table, i, MIN_FREQ_LOWEST_NONLINEAR),
+                               policy_freq (table, i, MIN_FREQ_CPUINFO_MAX));
+  if (khz == 0)
     return TRUE;
 
-  epp_pref = profile_to_epp_pref (profile, battery);
-  gov_pref = profile_to_gov_pref (profile);
-  cpb_pref = profile_to_cpb_pref (profile);
-  min_freq = profile_to_min_freq (profile);
+  g_snprintf (value, sizeof (value), "%" G_GUINT64_FORMAT, khz);
+  return ppd_utils_write_cached (path, value, error);
+}
+
+static gboolean
+apply_pref_to_policy (gpointer   item,
+                      gpointer   user_data,
+                      GError   **error)
+{
+  const PolicyPrefs *prefs = user_data;
+  const PolicyTable *table = prefs->table;
+  guint i = GPOINTER_TO_UINT (item);
+  PpdProfile held;
 
-  for (guint i = 0; i < devices->len; ++i) {
-    const char *base = g_ptr_array_index (devices, i);
-    g_autofree char *epp = NULL;
-    g_autofree char *gov = NULL;
-    g_autofree char *cpb = NULL;
-    g_autofree char *min_freq_path = NULL;
+  held = ppd_utils_get_scoped_hold_profile (table->cpus[i]);
+  if (held != PPD_PROFILE_UNSET && prefs->held[g_bit_nth_lsf (held, -1)] != NULL)
+    prefs = prefs->held[g_bit_nth_lsf (held, -1)];
 
-    gov = g_build_filename (base,
-                            "scaling_governor",
-                            NULL);
+  if (!ppd_utils_write_cached (table->governor[i], prefs->gov_pref[table->core_type[i]], error))
+    return FALSE;
 
-    if (!ppd_utils_write (gov, gov_pref, error))
-      return FALSE;
+  if (!ppd_utils_write_cached (table->epp[i], prefs->epp_pref[table->core_type[i]], error))
+    return FALSE;
 
-    epp = g_build_filename (base,
-                            "energy_performance_preference",
-                            NULL);
+  if (table->flags[i] & POLICY_HAS_BOOST) {
+    if (!ppd_utils_write_cached (table->boost[i], prefs->cpb_pref[table->core_type[i]], error))
+      return FALSE;
+  }
 
-    if (!ppd_utils_write (epp, epp_pref, error))
+  /* The maximum first, so that raising both doesn't get refused */
+  if (prefs->max_freq.type != PPD_FREQ_LIMIT_UNSET) {
+    if (!write_freq (table, i, table->scaling_max_freq[i], &prefs->max_freq, error))
+      return FALSE;
+  } else if (table->max_freq_limited && table->saved_max_freq[i] != NULL) {
+    if (!ppd_utils_write_cached (table->scaling_max_freq[i], table->saved_max_freq[i], error))
       return FALSE;
+  }
 
-    cpb = g_build_filename (base, "boost", NULL);
-    if (g_file_test (cpb, G_FILE_TEST_EXISTS)) {
-      if (!ppd_utils_write (cpb, cpb_pref, error))
-        return FALSE;
-    }
+  if (!write_freq (table, i, table->scaling_min_freq[i], &prefs->min_freq, error))
+    return FALSE;
 
-    min_freq_path = g_build_filename (base, min_freq, NULL);
-    if (g_file_test (min_freq_path, G_FILE_TEST_EXISTS)) {
-      g_autofree char *scaling_freq_path = NULL;
-      g_autofree char *min_freq_val = NULL;
+  return TRUE;
+}
 
-      if (!g_file_get_contents (min_freq_path, &min_freq_val, NULL, error))
-        return FALSE;
-      min_freq_val = g_strchomp (min_freq_val);
+static void
+policy_prefs_init (PolicyPrefs       *prefs,
+                   const PolicyTable *table,
+                   PpdProfile         profile,
+                   gboolean           battery)
+{
+  g_autoptr(PpdCustomProfile) custom = NULL;
 
-      scaling_freq_path = g_build_filename (base, "scaling_min_freq", NULL);
-      if (!ppd_utils_write (scaling_freq_path, min_freq_val, error))
-        return FALSE;
+  prefs->table = table;
+  for (guint type = 0; type < PPD_N_CPU_CORE_TYPES; type++) {
+    prefs->epp_pref[type] = class_epp_pref (type, profile, battery, prefs->epp_buf[type]);
+    prefs->cpb_pref[type] = class_cpb_pref (type, profile, battery, prefs->cpb_buf[type]);
+    prefs->gov_pref[type] = profile_to_gov_pref (profile);
+  }
+  prefs->min_freq.type = profile_to_min_freq (profile);
+  ppd_config_get_freq_limit ("MinFrequency", profile, &prefs->min_freq);
+  ppd_config_get_freq_limit ("MaxFrequency", profile, &prefs->max_freq);
+
+  custom = ppd_custom_profile_get_active_for (profile);
+  if (custom != NULL) {
+    for (guint type = 0; type < PPD_N_CPU_CORE_TYPES; type++) {
+      const char *pref;
+
+      pref = copy_pref (prefs->epp_buf[type], ppd_custom_profile_get_epp (custom));
+      if (pref != NULL)
+        prefs->epp_pref[type] = pref;
+      pref = copy_pref (prefs->cpb_buf[type], ppd_custom_profile_get_boost (custom));
+      if (pref != NULL)
+        prefs->cpb_pref[type] = pref;
+      if (ppd_custom_profile_get_governor (custom) != NULL)
+        prefs->gov_pref[type] = ppd_custom_profile_get_governor (custom);
     }
+    if (ppd_custom_profile_get_min_freq (custom)->type != PPD_FREQ_LIMIT_UNSET)
+      prefs->min_freq = *ppd_custom_profile_get_min_freq (custom);
+    if (ppd_custom_profile_get_max_freq (custom)->type != PPD_FREQ_LIMIT_UNSET)
+      prefs->max_freq = *ppd_custom_profile_get_max_freq (custom);
   }
 
-  return TRUE;
+  /* Stepped down when close to the power or temperature limits */
+  for (guint type = 0; type < PPD_N_CPU_CORE_TYPES; type++) {
+    prefs->epp_pref[type] = ppd_power_budget_step_epp (prefs->epp_pref[type],
+                                                       prefs->epp_buf[type],
+                                                       PREF_SIZE);
+    prefs->cpb_pref[type] = ppd_power_budget_step_boost (prefs->cpb_pref[type]);
+
+    /* The performance governor refuses any other preference */
+    if (g_strcmp0 (prefs->gov_pref[type], "performance") == 0 &&
+        g_strcmp0 (prefs->epp_pref[type], "performance") != 0)
+      prefs->gov_pref[type] = "powersave";
+  }
+}
+
+static gboolean
+apply_pref_to_devices (PolicyTable  *table,
+                       PpdProfile    profile,
+                       gboolean      battery,
+                       GError      **error)
+{
+  PolicyPrefs prefs = { 0, };
+  PolicyPrefs held_prefs[N_PROFILES] = { { 0, }, };
+  PpdProfile held_profiles;
+  gboolean max_freq_limited;
+  gboolean ret;
+
+  if (profile == PPD_PROFILE_UNSET)
+    return TRUE;
+
+  policy_prefs_init (&prefs, table, profile, battery);
+  max_freq_limited = prefs.max_freq.type != PPD_FREQ_LIMIT_UNSET;
+
+  /* Holds scoped to some of the CPUs only apply to their policies */
+  held_profiles = ppd_utils_get_scoped_hold_profiles () & ~profile;
+  for (guint i = 0; i < N_PROFILES; i++) {
+    if (!(held_profiles & (1 << i)))
+      continue;
+    policy_prefs_init (&held_prefs[i], table, 1 << i, battery);
+    max_freq_limited |= held_prefs[i].max_freq.type != PPD_FREQ_LIMIT_UNSET;
+    prefs.held[i] = &held_prefs[i];
+  }
+
+  if (max_freq_limited)
+    table->max_freq_limited = TRUE;
+
+  /* Policies are independent, so write them all at once */
+  ret = ppd_utils_foreach_parallel (table->indices, apply_pref_to_policy, &prefs, error);
+  if (ret && !max_freq_limited)
+    table->max_freq_limited = FALSE;
+
+  return ret;
 }
 
 static gboolean
@@ -296,21 +637,11 @@ ppd_driver_amd_pstate_activate_profile (PpdDriver                    *driver,
   PpdDriverAmdPstate *pstate = PPD_DRIVER_AMD_PSTATE (driver);
   gboolean ret = FALSE;
 
-  g_return_val_if_fail (pstate->epp_devices != NULL, FALSE);
-  g_return_val_if_fail (pstate->epp_devices->len != 0, FALSE);
-
-  ret = apply_pref_to_devices (pstate->epp_devices, profile, pstate->on_battery, error);
-  if (!ret && pstate->activated_profile != PPD_PROFILE_UNSET) {
-    g_autoptr(GError) error_local = NULL;
-    /* reset back to previous */
-    if (!apply_pref_to_devices (pstate->epp_devices,
-                                pstate->activated_profile,
-                                pstate->on_battery,
-                                &error_local))
-      g_warning ("failed to restore previous profile: %s", error_local->message);
-    return ret;
-  }
+  g_return_val_if_fail (pstate->policies != NULL, FALSE);
+  g_return_val_if_fail (pstate->policies->len != 0, FALSE);
 
+  /* Partial writes are rolled back by the daemon's journal */
+  ret = apply_pref_to_devices (pstate->policies, profile, pstate->on_battery, error);
   if (ret)
     pstate->activated_profile = profile;
 
@@ -323,6 +654,10 @@ ppd_driver_amd_pstate_power_changed (PpdDriver              *driver,
                                      GError                **error)
 {
   PpdDriverAmdPstate *pstate = PPD_DRIVER_AMD_PSTATE (driver);
+  g_autoptr(PpdJournal) journal = NULL;
+  g_autoptr(GError) rollback_error = NULL;
+  PpdJournal *previous;
+  gboolean ret;
 
   switch (reason) {
   case PPD_POWER_CHANGED_REASON_UNKNOWN:
@@ -336,10 +671,25 @@ ppd_driver_amd_pstate_power_changed (PpdDriver              *driver,
     g_assert_not_reached ();
   }
 
-  return apply_pref_to_devices (pstate->epp_devices,
-                                pstate->activated_profile,
-                                pstate->on_battery,
-                                error);
+  /* Partial writes are rolled back by the journal of a running
+   * transition, and by our own outside of one */
+  if (ppd_utils_journal_get_thread_default () != NULL)
+    return apply_pref_to_devices (pstate->policies,
+                                  pstate->activated_profile,
+                                  pstate->on_battery,
+                                  error);
+
+  journal = ppd_journal_new ();
+  previous = ppd_utils_journal_begin (journal);
+  ret = apply_pref_to_devices (pstate->policies,
+                               pstate->activated_profile,
+                               pstate->on_battery,
+                               error);
+  if (!ret && !ppd_journal_rollback (journal, 0, &rollback_error))
+    g_warning ("Failed to roll back power change: %s", rollback_error->message);
+  ppd_utils_journal_end (previous);
+
+  return ret;
 }
 
 static void
@@ -348,7 +698,9 @@ ppd_driver_amd_pstate_finalize (GObject *object)
   PpdDriverAmdPstate *driver;
 
   driver = PPD_DRIVER_AMD_PSTATE (object);
-  g_clear_pointer (&driver->epp_devices, g_ptr_array_unref);
+  if (driver->policies != NULL)
+    policy_table_restore (driver->policies);
+  g_clear_pointer (&driver->policies, policy_table_free);
   G_OBJECT_CLASS (ppd_driver_amd_pstate_parent_class)->finalize (object);
 }
 
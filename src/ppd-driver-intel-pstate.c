@@ -11,6 +11,9 @@
 
 #include <upower.h>
 
+#include "ppd-config.h"
+#include "ppd-custom-profile.h"
+#include "ppd-power-budget.h"
 #include "ppd-utils.h"
 #include "ppd-driver-intel-pstate.h"
 
@@ -20,6 +23,8 @@
 #define PSTATE_STATUS_PATH "/sys/devices/system/cpu/intel_pstate/status"
 #define NO_TURBO_PATH "/sys/devices/system/cpu/intel_pstate/no_turbo"
 #define TURBO_PCT_PATH "/sys/devices/system/cpu/intel_pstate/turbo_pct"
+#define MIN_PERF_PCT_PATH "/sys/devices/system/cpu/intel_pstate/min_perf_pct"
+#define MAX_PERF_PCT_PATH "/sys/devices/system/cpu/intel_pstate/max_perf_pct"
 
 #define SYSTEMD_DBUS_NAME                       "org.freedesktop.login1"
 #define SYSTEMD_DBUS_PATH                       "/org/freedesktop/login1"
@@ -29,11 +34,25 @@ struct _PpdDriverIntelPstate
 {
   PpdDriverCpu  parent_instance;
 
+  /* Protects activated_profile and on_battery, as profiles are
+   * activated from a worker thread, and re-applied on resume from the
+   * main thread */
+  GMutex lock;
   PpdProfile activated_profile;
   GPtrArray *epp_devices; /* Array of paths */
   GPtrArray *epb_devices; /* Array of paths */
-  GFileMonitor *no_turbo_mon;
+  GPtrArray *epp_classes[PPD_N_CPU_CORE_TYPES]; /* epp_devices by core type */
+  GPtrArray *epb_classes[PPD_N_CPU_CORE_TYPES]; /* epb_devices by core type */
+  GHashTable *device_cpus; /* EPP and EPB paths to the CPUs they cover */
+  PpdSysfsMonitor *no_turbo_mon;
   char *no_turbo_path;
+  char *min_perf_pct_path;
+  char *max_perf_pct_path;
+  char *saved_min_perf_pct; /* values found on startup, restored on exit */
+  char *saved_max_perf_pct;
+  gboolean min_perf_pct_limited; /* needs restoring once unlimited */
+  gboolean max_perf_pct_limited;
+  guint64 cpuinfo_max_freq; /* highest of all policies, 0 if unknown */
   gboolean on_battery;
 };
 
@@ -80,28 +99,21 @@ update_no_turbo (PpdDriverIntelPstate *pstate)
 }
 
 static void
-no_turbo_changed (GFileMonitor     *monitor,
-                  GFile            *file,
-                  GFile            *other_file,
-                  GFileMonitorEvent event_type,
-                  gpointer          user_data)
+no_turbo_changed (PpdSysfsMonitor *monitor,
+                  gpointer         user_data)
 {
   PpdDriverIntelPstate *pstate = user_data;
-  g_autofree char *path = NULL;
 
-  path = g_file_get_path (file);
-  g_debug ("File monitor change happened for '%s' (event type %d)", path, event_type);
-
-  g_return_if_fail (event_type != G_FILE_MONITOR_EVENT_DELETED);
-
-  if (event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT)
-    update_no_turbo (pstate);
+  g_debug ("File monitor change happened for '%s'",
+           ppd_sysfs_monitor_get_path (monitor));
+  update_no_turbo (pstate);
 }
 
-static GFileMonitor *
+static PpdSysfsMonitor *
 monitor_no_turbo_prop (const char *path)
 {
-  g_autoptr(GFile) no_turbo = NULL;
+  g_autoptr(GError) error = NULL;
+  PpdSysfsMonitor *monitor;
 
   if (!g_file_test (path, G_FILE_TEST_EXISTS)) {
     g_debug ("Not monitoring '%s' as it does not exist", path);
@@ -109,8 +121,12 @@ monitor_no_turbo_prop (const char *path)
   }
 
   g_debug ("About to start monitoring '%s'", path);
-  no_turbo = g_file_new_for_path (path);
-  return g_file_monitor (no_turbo, G_FILE_MONITOR_NONE, NULL, NULL);
+  /* intel_pstate doesn't notify about no_turbo changes, it's checked
+   * again whenever the profile or power source change */
+  monitor = ppd_sysfs_monitor_new (path, PPD_SYSFS_MONITOR_FLAGS_NONE, &error);
+  if (monitor == NULL)
+    g_warning ("Could not monitor '%s': %s", path, error->message);
+  return monitor;
 }
 
 static gboolean
@@ -136,13 +152,18 @@ ppd_driver_intel_pstate_prepare_for_sleep (PpdDriver  *driver,
 {
   PpdDriverIntelPstate *pstate = PPD_DRIVER_INTEL_PSTATE (driver);
   g_autoptr(GError) local_error = NULL;
+  PpdProfile profile;
 
   if (start)
     return TRUE;
 
+  g_mutex_lock (&pstate->lock);
+  profile = pstate->activated_profile;
+  g_mutex_unlock (&pstate->lock);
+
   g_debug ("Re-applying energy_perf_bias");
   if (!ppd_driver_intel_pstate_activate_profile (PPD_DRIVER (pstate),
-                                                 pstate->activated_profile,
+                                                 profile,
                                                  PPD_PROFILE_ACTIVATION_REASON_RESUME,
                                                  &local_error)) {
     g_propagate_prefixed_error (error, g_steal_pointer (&local_error),
@@ -250,6 +271,174 @@ probe_epp (PpdDriverIntelPstate *pstate)
   return PPD_PROBE_RESULT_FAIL;
 }
 
+static char *
+read_value (const char *path)
+{
+  char *value = NULL;
+
+  if (!g_file_get_contents (path, &value, NULL, NULL))
+    return NULL;
+
+  return g_strchomp (value);
+}
+
+/* The performance limits are global, in percent of the highest
+ * frequency any CPU can reach */
+static void
+probe_perf_pct (PpdDriverIntelPstate *pstate)
+{
+  g_autofree char *min_path = NULL;
+  g_autofree char *max_path = NULL;
+
+  min_path = ppd_utils_get_sysfs_path (MIN_PERF_PCT_PATH);
+  max_path = ppd_utils_get_sysfs_path (MAX_PERF_PCT_PATH);
+  pstate->saved_min_perf_pct = read_value (min_path);
+  pstate->saved_max_perf_pct = read_value (max_path);
+  if (pstate->saved_min_perf_pct == NULL || pstate->saved_max_perf_pct == NULL) {
+    g_clear_pointer (&pstate->saved_min_perf_pct, g_free);
+    g_clear_pointer (&pstate->saved_max_perf_pct, g_free);
+    return;
+  }
+
+  pstate->min_perf_pct_path = g_steal_pointer (&min_path);
+  pstate->max_perf_pct_path = g_steal_pointer (&max_path);
+
+  for (guint i = 0; pstate->epp_devices != NULL && i < pstate->epp_devices->len; i++) {
+    g_autofree char *policy = NULL;
+    g_autofree char *path = NULL;
+    g_autofree char *value = NULL;
+
+    policy = g_path_get_dirname (g_ptr_array_index (pstate->epp_devices, i));
+    path = g_build_filename (policy, "cpuinfo_max_freq", NULL);
+    value = read_value (path);
+    if (value != NULL)
+      pstate->cpuinfo_max_freq = MAX (pstate->cpuinfo_max_freq,
+                                      g_ascii_strtoull (value, NULL, 10));
+  }
+}
+
+static void
+restore_perf_pct (PpdDriverIntelPstate *pstate)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (pstate->max_perf_pct_path == NULL)
+    return;
+
+  /* Only the limits we changed, they are shared with other tools */
+  if (pstate->max_perf_pct_limited &&
+      !ppd_utils_write (pstate->max_perf_pct_path, pstate->saved_max_perf_pct, &error)) {
+    g_debug ("Failed to restore %s: %s", pstate->max_perf_pct_path, error->message);
+    g_clear_error (&error);
+  }
+  if (pstate->min_perf_pct_limited &&
+      !ppd_utils_write (pstate->min_perf_pct_path, pstate->saved_min_perf_pct, &error))
+    g_debug ("Failed to restore %s: %s", pstate->min_perf_pct_path, error->message);
+}
+
+static PpdCpuCoreType
+epp_device_core_type (PpdCpuTopology *topology,
+                      const char     *path)
+{
+  g_autofree char *policy = NULL;
+
+  policy = g_path_get_dirname (path);
+  return ppd_cpu_topology_get_policy_core_type (topology, policy);
+}
+
+static GArray *
+epp_device_cpus (PpdCpuTopology *topology,
+                 const char     *path)
+{
+  g_autofree char *policy = NULL;
+  GArray *cpus;
+
+  policy = g_path_get_dirname (path);
+  cpus = ppd_cpu_topology_get_policy_cpus (topology, policy);
+  return cpus ? g_array_ref (cpus) : NULL;
+}
+
+/* Returns -1 if @path isn't under a CPU directory */
+static gint
+epb_device_cpu (const char *path)
+{
+  g_autofree char *power_dir = NULL;
+  g_autofree char *cpu_dir = NULL;
+  g_autofree char *name = NULL;
+
+  /* cpuN/power/energy_perf_bias */
+  power_dir = g_path_get_dirname (path);
+  cpu_dir = g_path_get_dirname (power_dir);
+  name = g_path_get_basename (cpu_dir);
+  if (!g_str_has_prefix (name, "cpu") || !g_ascii_isdigit (name[3]))
+    return -1;
+
+  return (gint) g_ascii_strtoull (name + 3, NULL, 10);
+}
+
+static PpdCpuCoreType
+epb_device_core_type (PpdCpuTopology *topology,
+                      const char     *path)
+{
+  gint cpu = epb_device_cpu (path);
+
+  if (cpu < 0)
+    return PPD_CPU_CORE_TYPE_UNKNOWN;
+
+  return ppd_cpu_topology_get_core_type (topology, cpu);
+}
+
+static GArray *
+epb_device_cpus (PpdCpuTopology *topology,
+                 const char     *path)
+{
+  gint cpu = epb_device_cpu (path);
+  GArray *cpus;
+
+  if (cpu < 0)
+    return NULL;
+
+  cpus = g_array_new (FALSE, FALSE, sizeof (guint));
+  g_array_append_val (cpus, cpu);
+  return cpus;
+}
+
+typedef PpdCpuCoreType (* DeviceCoreTypeFunc) (PpdCpuTopology *topology,
+                                               const char     *path);
+typedef GArray * (* DeviceCpusFunc) (PpdCpuTopology *topology,
+                                     const char     *path);
+
+static void
+split_by_core_type (PpdDriverIntelPstate  *pstate,
+                    GPtrArray             *devices,
+                    GPtrArray            **classes,
+                    DeviceCoreTypeFunc     func,
+                    DeviceCpusFunc         cpus_func)
+{
+  g_autoptr(PpdCpuTopology) topology = NULL;
+
+  for (guint type = 0; type < PPD_N_CPU_CORE_TYPES; type++)
+    g_clear_pointer (&classes[type], g_ptr_array_unref);
+
+  if (devices == NULL)
+    return;
+
+  topology = ppd_utils_get_cpu_topology ();
+  for (guint i = 0; i < devices->len; i++) {
+    const char *path = g_ptr_array_index (devices, i);
+    PpdCpuCoreType type = func (topology, path);
+    GArray *cpus;
+
+    if (classes[type] == NULL)
+      classes[type] = g_ptr_array_new_with_free_func (g_free);
+    g_ptr_array_add (classes[type], g_strdup (path));
+
+    cpus = cpus_func (topology, path);
+    if (cpus != NULL)
+      g_hash_table_insert (pstate->device_cpus, g_strdup (path), cpus);
+  }
+}
+
 static PpdProbeResult
 ppd_driver_intel_pstate_probe (PpdDriver  *driver)
 {
@@ -265,6 +454,12 @@ ppd_driver_intel_pstate_probe (PpdDriver  *driver)
   if (ret != PPD_PROBE_RESULT_SUCCESS)
     goto out;
 
+  split_by_core_type (pstate, pstate->epp_devices, pstate->epp_classes,
+                      epp_device_core_type, epp_device_cpus);
+  split_by_core_type (pstate, pstate->epb_devices, pstate->epb_classes,
+                      epb_device_core_type, epb_device_cpus);
+  probe_perf_pct (pstate);
+
   has_turbo = sys_has_turbo ();
   if (has_turbo) {
     /* Monitor the first "no_turbo" */
@@ -286,6 +481,8 @@ out:
     g_debug ("\tEnergy Performance Bias: %s",
              epp_ret == PPD_PROBE_RESULT_SUCCESS ? "yes" : "no");
     g_debug ("\tHas Turbo: %s", has_turbo ? "yes" : "no");
+    g_debug ("\tPerformance Limits: %s",
+             pstate->max_perf_pct_path != NULL ? "yes" : "no");
   }
   return ret;
 }
@@ -324,12 +521,213 @@ profile_to_epb_pref (PpdProfile profile, gboolean battery)
   g_return_val_if_reached (NULL);
 }
 
+static char *
+class_epp_pref (PpdCpuCoreType type,
+                PpdProfile     profile,
+                gboolean       battery)
+{
+  char *pref;
+
+  pref = ppd_config_get_cpu_class_pref (type, "EnergyPerformancePreference", profile, battery);
+  if (pref != NULL)
+    return pref;
+
+  /* E-cores gain little from the most aggressive preference, and
+   * would take power budget away from the P-cores */
+  if (type == PPD_CPU_CORE_TYPE_EFFICIENCY && profile == PPD_PROFILE_PERFORMANCE)
+    return g_strdup ("balance_performance");
+
+  return g_strdup (profile_to_epp_pref (profile, battery));
+}
+
+static char *
+class_epb_pref (PpdCpuCoreType type,
+                PpdProfile     profile,
+                gboolean       battery)
+{
+  char *pref;
+
+  pref = ppd_config_get_cpu_class_pref (type, "EnergyPerfBias", profile, battery);
+  if (pref != NULL)
+    return pref;
+
+  return g_strdup (profile_to_epb_pref (profile, battery));
+}
+
+/* Returns the percentage @limit stands for, or a negative value if it
+ * can't be expressed as one */
+static gint
+freq_limit_to_pct (PpdDriverIntelPstate *pstate,
+                   const PpdFreqLimit   *limit)
+{
+  switch (limit->type) {
+  case PPD_FREQ_LIMIT_MIN:
+    return 0;
+  case PPD_FREQ_LIMIT_MAX:
+    return 100;
+  case PPD_FREQ_LIMIT_PERCENT:
+    return (gint) limit->value;
+  case PPD_FREQ_LIMIT_KHZ:
+    if (pstate->cpuinfo_max_freq == 0)
+      break;
+    return (gint) MIN (100, limit->value * 100 / pstate->cpuinfo_max_freq);
+  case PPD_FREQ_LIMIT_NONLINEAR:
+  case PPD_FREQ_LIMIT_UNSET:
+    break;
+  }
+
+  return -1;
+}
+
+/* @limited tracks whether @path holds one of our limits, the file is
+ * left alone otherwise */
+static gboolean
+write_perf_pct (PpdDriverIntelPstate  *pstate,
+                const char            *path,
+                const char            *saved,
+                const PpdFreqLimit    *limit,
+                gboolean              *limited,
+                GError               **error)
+{
+  char value[16];
+  gint pct;
+
+  /* Going back to what was there before we started */
+  if (limit->type == PPD_FREQ_LIMIT_UNSET) {
+    if (!*limited)
+      return TRUE;
+    if (!ppd_utils_write_cached (path, saved, error))
+      return FALSE;
+    *limited = FALSE;
+    return TRUE;
+  }
+
+  pct = freq_limit_to_pct (pstate, limit);
+  if (pct < 0) {
+    g_debug ("Ignoring frequency limit for %s, it can't be expressed as a percentage", path);
+    return TRUE;
+  }
+
+  g_snprintf (value, sizeof (value), "%d", pct);
+  *limited = TRUE;
+  return ppd_utils_write_cached (path, value, error);
+}
+
+static gboolean
+apply_perf_pct (PpdDriverIntelPstate  *pstate,
+                PpdProfile             profile,
+                PpdCustomProfile      *custom,
+                GError               **error)
+{
+  PpdFreqLimit min_freq = { PPD_FREQ_LIMIT_UNSET, 0 };
+  PpdFreqLimit max_freq = { PPD_FREQ_LIMIT_UNSET, 0 };
+
+  if (pstate->max_perf_pct_path == NULL)
+    return TRUE;
+
+  ppd_config_get_freq_limit ("MinFrequency", profile, &min_freq);
+  ppd_config_get_freq_limit ("MaxFrequency", profile, &max_freq);
+  if (custom != NULL) {
+    if (ppd_custom_profile_get_min_freq (custom)->type != PPD_FREQ_LIMIT_UNSET)
+      min_freq = *ppd_custom_profile_get_min_freq (custom);
+    if (ppd_custom_profile_get_max_freq (custom)->type != PPD_FREQ_LIMIT_UNSET)
+      max_freq = *ppd_custom_profile_get_max_freq (custom);
+  }
+
+  /* The maximum first, so that raising both doesn't get refused */
+  if (!write_perf_pct (pstate, pstate->max_perf_pct_path,
+                       pstate->saved_max_perf_pct, &max_freq,
+                       &pstate->max_perf_pct_limited, error))
+    return FALSE;
+
+  return write_perf_pct (pstate, pstate->min_perf_pct_path,
+                         pstate->saved_min_perf_pct, &min_freq,
+                         &pstate->min_perf_pct_limited, error);
+}
+
+static char *
+device_epp_pref (PpdDriverIntelPstate *pstate,
+                 PpdCpuCoreType        type,
+                 PpdProfile            profile)
+{
+  g_autoptr(PpdCustomProfile) custom = NULL;
+  g_autofree char *epp_pref = NULL;
+  char buf[32];
+
+  custom = ppd_custom_profile_get_active_for (profile);
+  if (custom != NULL && ppd_custom_profile_get_epp (custom) != NULL)
+    epp_pref = g_strdup (ppd_custom_profile_get_epp (custom));
+  else
+    epp_pref = class_epp_pref (type, profile, pstate->on_battery);
+
+  /* Stepped down when close to the power or temperature limits */
+  return g_strdup (ppd_power_budget_step_epp (epp_pref, buf, sizeof (buf)));
+}
+
+static char *
+device_epb_pref (PpdDriverIntelPstate *pstate,
+                 PpdCpuCoreType        type,
+                 PpdProfile            profile)
+{
+  return class_epb_pref (type, profile, pstate->on_battery);
+}
+
+typedef char * (* DevicePrefFunc) (PpdDriverIntelPstate *pstate,
+                                   PpdCpuCoreType        type,
+                                   PpdProfile            profile);
+
+#define N_PROFILES 3
+
+/* Holds scoped to some of the CPUs only apply to the devices covering
+ * them, the others get @profile */
+static gboolean
+write_class_pref (PpdDriverIntelPstate  *pstate,
+                  GPtrArray             *devices,
+                  PpdCpuCoreType         type,
+                  PpdProfile             profile,
+                  PpdProfile             held_profiles,
+                  DevicePrefFunc         func,
+                  GError               **error)
+{
+  g_autofree char *pref = NULL;
+  char *held_prefs[N_PROFILES] = { NULL, };
+  gboolean ret = TRUE;
+
+  pref = func (pstate, type, profile);
+  if (held_profiles == PPD_PROFILE_UNSET)
+    return ppd_utils_write_files_cached (devices, pref, error);
+
+  for (guint i = 0; ret && i < devices->len; i++) {
+    const char *path = g_ptr_array_index (devices, i);
+    const char *value = pref;
+    PpdProfile held;
+
+    held = ppd_utils_get_scoped_hold_profile (g_hash_table_lookup (pstate->device_cpus, path));
+    if (held & held_profiles) {
+      guint n = g_bit_nth_lsf (held, -1);
+
+      if (held_prefs[n] == NULL)
+        held_prefs[n] = func (pstate, type, held);
+      value = held_prefs[n];
+    }
+
+    ret = ppd_utils_write_cached (path, value, error);
+  }
+
+  for (guint n = 0; n < N_PROFILES; n++)
+    g_free (held_prefs[n]);
+
+  return ret;
+}
+
 static gboolean
 apply_pref_to_devices (PpdDriver   *driver,
                        PpdProfile   profile,
                        GError     **error)
 {
   PpdDriverIntelPstate *pstate = PPD_DRIVER_INTEL_PSTATE (driver);
+  g_autoptr(PpdCustomProfile) custom = NULL;
+  PpdProfile held_profiles;
 
   if (profile == PPD_PROFILE_UNSET)
     return TRUE;
@@ -339,20 +737,32 @@ apply_pref_to_devices (PpdDriver   *driver,
   g_return_val_if_fail ((pstate->epp_devices && pstate->epp_devices->len != 0) ||
                         (pstate->epb_devices && pstate->epb_devices->len != 0), FALSE);
 
-  if (pstate->epp_devices) {
-    const char *epp_pref = profile_to_epp_pref (profile, pstate->on_battery);
+  custom = ppd_custom_profile_get_active_for (profile);
+  held_profiles = ppd_utils_get_scoped_hold_profiles () & ~profile;
+
+  for (guint type = 0; type < PPD_N_CPU_CORE_TYPES; type++) {
+    if (pstate->epp_classes[type] == NULL)
+      continue;
 
-    if (!ppd_utils_write_files (pstate->epp_devices, epp_pref, error))
+    if (!write_class_pref (pstate, pstate->epp_classes[type], type,
+                           profile, held_profiles, device_epp_pref, error))
       return FALSE;
   }
 
-  if (pstate->epb_devices) {
-    const char *epb_pref = profile_to_epb_pref (profile, pstate->on_battery);
+  for (guint type = 0; type < PPD_N_CPU_CORE_TYPES; type++) {
+    if (pstate->epb_classes[type] == NULL)
+      continue;
 
-    if (!ppd_utils_write_files (pstate->epb_devices, epb_pref, error))
+    if (!write_class_pref (pstate, pstate->epb_classes[type], type,
+                           profile, held_profiles, device_epb_pref, error))
       return FALSE;
   }
 
+  /* The performance limits are global, and stay on @profile */
+
+  if (!apply_perf_pct (pstate, profile, custom, error))
+    return FALSE;
+
   pstate->activated_profile = profile;
 
   return TRUE;
@@ -364,7 +774,9 @@ ppd_driver_intel_pstate_power_changed (PpdDriver              *driver,
                                        GError                **error)
 {
   PpdDriverIntelPstate *pstate = PPD_DRIVER_INTEL_PSTATE (driver);
+  gboolean ret;
 
+  g_mutex_lock (&pstate->lock);
   switch (reason) {
   case PPD_POWER_CHANGED_REASON_UNKNOWN:
   case PPD_POWER_CHANGED_REASON_AC:
@@ -374,12 +786,19 @@ ppd_driver_intel_pstate_power_changed (PpdDriver              *driver,
     pstate->on_battery = TRUE;
     break;
   default:
+    g_mutex_unlock (&pstate->lock);
     g_return_val_if_reached (FALSE);
   }
 
-  return apply_pref_to_devices (driver,
-                                pstate->activated_profile,
-                                error);
+  ret = apply_pref_to_devices (driver,
+                               pstate->activated_profile,
+                               error);
+  g_mutex_unlock (&pstate->lock);
+
+  if (pstate->no_turbo_mon)
+    ppd_sysfs_monitor_check (pstate->no_turbo_mon);
+
+  return ret;
 }
 
 static gboolean
@@ -388,7 +807,18 @@ ppd_driver_intel_pstate_activate_profile (PpdDriver                    *driver,
                                           PpdProfileActivationReason   reason,
                                           GError                     **error)
 {
-  return apply_pref_to_devices (driver, profile, error);
+  PpdDriverIntelPstate *pstate = PPD_DRIVER_INTEL_PSTATE (driver);
+  gboolean ret;
+
+  g_mutex_lock (&pstate->lock);
+  ret = apply_pref_to_devices (driver, profile, error);
+  g_mutex_unlock (&pstate->lock);
+
+  /* Rather than waiting for no_turbo to be read again in the background */
+  if (pstate->no_turbo_mon)
+    ppd_sysfs_monitor_check (pstate->no_turbo_mon);
+
+  return ret;
 }
 
 static void
@@ -398,10 +828,21 @@ ppd_driver_intel_pstate_finalize (GObject *object)
 
   driver = PPD_DRIVER_INTEL_PSTATE (object);
 
+  restore_perf_pct (driver);
+  g_clear_pointer (&driver->min_perf_pct_path, g_free);
+  g_clear_pointer (&driver->max_perf_pct_path, g_free);
+  g_clear_pointer (&driver->saved_min_perf_pct, g_free);
+  g_clear_pointer (&driver->saved_max_perf_pct, g_free);
   g_clear_pointer (&driver->epp_devices, g_ptr_array_unref);
   g_clear_pointer (&driver->epb_devices, g_ptr_array_unref);
+  for (guint type = 0; type < PPD_N_CPU_CORE_TYPES; type++) {
+    g_clear_pointer (&driver->epp_classes[type], g_ptr_array_unref);
+    g_clear_pointer (&driver->epb_classes[type], g_ptr_array_unref);
+  }
+  g_clear_pointer (&driver->device_cpus, g_hash_table_unref);
   g_clear_pointer (&driver->no_turbo_path, g_free);
   g_clear_object (&driver->no_turbo_mon);
+  g_mutex_clear (&driver->lock);
   G_OBJECT_CLASS (ppd_driver_intel_pstate_parent_class)->finalize (object);
 }
 
@@ -425,4 +866,7 @@ ppd_driver_intel_pstate_class_init (PpdDriverIntelPstateClass *klass)
 static void
 ppd_driver_intel_pstate_init (PpdDriverIntelPstate *self)
 {
+  g_mutex_init (&self->lock);
+  self->device_cpus = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, (GDestroyNotify) g_array_unref);
 }
@@ -12,6 +12,7 @@
 #include <gudev/gudev.h>
 #include <gio/gio.h>
 
+#include "ppd-custom-profile.h"
 #include "ppd-driver-platform-profile.h"
 #include "ppd-utils.h"
 
@@ -26,11 +27,16 @@ struct _PpdDriverPlatformProfile
   PpdProbeResult probe_result;
   GUdevDevice *device;
   int lapmode;
-  PpdProfile acpi_platform_profile;
   char **profile_choices;
   gboolean has_low_power;
-  GFileMonitor *lapmode_mon;
-  GFileMonitor *acpi_platform_profile_mon;
+  /* Protects the three below, as profiles are activated from a worker
+   * thread, and platform_profile changes noticed on the main thread */
+  GMutex lock;
+  PpdProfile acpi_platform_profile;
+  gboolean custom_value_applied;
+  char *written_value; /* last value we wrote, to recognise its notification */
+  PpdSysfsMonitor *lapmode_mon;
+  PpdSysfsMonitor *acpi_platform_profile_mon;
   gulong acpi_platform_profile_changed_id;
 };
 
@@ -81,28 +87,28 @@ acpi_platform_profile_value_to_profile (const char *str)
   if (str == NULL)
     return PPD_PROFILE_UNSET;
 
-  switch (str[0]) {
-  case 'l': /* low-power */
-  case 'q': /* quiet */
+  if (g_str_equal (str, "low-power") ||
+      g_str_equal (str, "quiet"))
     return PPD_PROFILE_POWER_SAVER;
-  case 'c': /* cool */
-  case 'b':
+  if (g_str_equal (str, "cool") ||
+      g_str_equal (str, "balanced") ||
+      g_str_equal (str, "balanced-performance"))
     return PPD_PROFILE_BALANCED;
-  case 'p':
+  if (g_str_equal (str, "performance") ||
+      g_str_equal (str, "max-power"))
     return PPD_PROFILE_PERFORMANCE;
-  default:
-    g_debug ("Unhandled ACPI platform profile '%c'", str[0]);
-    g_return_val_if_reached (PPD_PROFILE_UNSET);
-  }
+
+  /* Such as "custom", which custom profiles may also have written */
+  g_debug ("Unhandled ACPI platform profile '%s'", str);
+  return PPD_PROFILE_UNSET;
 }
 
-static PpdProfile
+static char *
 read_platform_profile (void)
 {
   g_autofree char *platform_profile_path = NULL;
-  g_autofree char *new_profile_str = NULL;
   g_autoptr(GError) error = NULL;
-  PpdProfile new_profile;
+  char *new_profile_str = NULL;
 
   platform_profile_path = ppd_utils_get_sysfs_path (ACPI_PLATFORM_PROFILE_PATH);
   if (!g_file_get_contents (platform_profile_path,
@@ -110,14 +116,10 @@ read_platform_profile (void)
     g_debug ("Failed to get contents for '%s': %s",
              platform_profile_path,
              error->message);
-    return PPD_PROFILE_UNSET;
+    return NULL;
   }
 
-  new_profile = acpi_platform_profile_value_to_profile (new_profile_str);
-  g_debug ("ACPI performance_profile is now %c, so profile is detected as %s",
-           new_profile_str[0],
-           ppd_profile_to_str (new_profile));
-  return new_profile;
+  return g_strstrip (new_profile_str);
 }
 
 static gboolean
@@ -178,98 +180,140 @@ update_dytc_lapmode_state (PpdDriverPlatformProfile *self)
 static void
 update_acpi_platform_profile_state (PpdDriverPlatformProfile *self)
 {
+  g_autofree char *new_profile_str = NULL;
   PpdProfile new_profile;
 
-  new_profile = read_platform_profile ();
-  if (new_profile == PPD_PROFILE_UNSET ||
-      new_profile == self->acpi_platform_profile)
+  new_profile_str = read_platform_profile ();
+  if (new_profile_str == NULL)
     return;
 
+  /* Notifications arrive after the write returned, so ours can't be
+   * told apart from others by blocking the handler around it */
+  g_mutex_lock (&self->lock);
+  if (g_strcmp0 (new_profile_str, self->written_value) == 0) {
+    g_mutex_unlock (&self->lock);
+    g_debug ("ACPI platform_profile is still %s", new_profile_str);
+    return;
+  }
+
+  new_profile = acpi_platform_profile_value_to_profile (new_profile_str);
+  g_debug ("ACPI platform_profile is now %s, so profile is detected as %s",
+           new_profile_str,
+           ppd_profile_to_str (new_profile));
+  if (new_profile == PPD_PROFILE_UNSET ||
+      new_profile == self->acpi_platform_profile) {
+    g_mutex_unlock (&self->lock);
+    return;
+  }
   self->acpi_platform_profile = new_profile;
+  self->custom_value_applied = FALSE;
+  g_clear_pointer (&self->written_value, g_free);
+  g_mutex_unlock (&self->lock);
+
   ppd_driver_emit_profile_changed (PPD_DRIVER (self), new_profile);
 }
 
 static void
-lapmode_changed (GFileMonitor      *monitor,
-                 GFile             *file,
-                 GFile             *other_file,
-                 GFileMonitorEvent  event_type,
-                 gpointer           user_data)
+lapmode_changed (PpdSysfsMonitor *monitor,
+                 gpointer         user_data)
 {
   PpdDriverPlatformProfile *self = user_data;
 
-  g_debug (LAPMODE_SYSFS_NAME " attribute changed (event: %d)", event_type);
-  g_return_if_fail (event_type != G_FILE_MONITOR_EVENT_DELETED);
-
-  if (event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT)
-    update_dytc_lapmode_state (self);
+  g_debug (LAPMODE_SYSFS_NAME " attribute changed");
+  update_dytc_lapmode_state (self);
 }
 
 static void
-acpi_platform_profile_changed (GFileMonitor      *monitor,
-                               GFile             *file,
-                               GFile             *other_file,
-                               GFileMonitorEvent  event_type,
-                               gpointer           user_data)
+acpi_platform_profile_changed (PpdSysfsMonitor *monitor,
+                               gpointer         user_data)
 {
   PpdDriverPlatformProfile *self = user_data;
 
-  g_debug (ACPI_PLATFORM_PROFILE_PATH " changed (%d)", event_type);
+  g_debug (ACPI_PLATFORM_PROFILE_PATH " changed");
   if (self->probe_result == PPD_PROBE_RESULT_DEFER) {
     g_signal_emit_by_name (G_OBJECT (self), "probe-request", 0);
     return;
   }
 
-  g_return_if_fail (event_type != G_FILE_MONITOR_EVENT_DELETED);
-
-  if (event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT)
-    update_acpi_platform_profile_state (self);
+  update_acpi_platform_profile_state (self);
 }
 
 static gboolean
-ppd_driver_platform_profile_activate_profile (PpdDriver                   *driver,
-                                              PpdProfile                   profile,
-                                              PpdProfileActivationReason   reason,
-                                              GError                     **error)
+activate_profile_locked (PpdDriverPlatformProfile  *self,
+                         PpdProfile                 profile,
+                         GError                   **error)
 {
-  PpdDriverPlatformProfile *self = PPD_DRIVER_PLATFORM_PROFILE (driver);
   g_autoptr(GError) local_error = NULL;
+  g_autoptr(PpdCustomProfile) custom = NULL;
   g_autofree char *platform_profile_path = NULL;
   const char *platform_profile_value;
+  const char *custom_value = NULL;
 
   g_return_val_if_fail (self->acpi_platform_profile_mon, FALSE);
 
-  if (self->acpi_platform_profile == profile) {
-    g_debug ("Can't switch to %s mode, already there",
-             ppd_profile_to_str (profile));
-    return TRUE;
+  custom = ppd_custom_profile_get_active_for (profile);
+  if (custom != NULL)
+    custom_value = ppd_custom_profile_get_platform_profile (custom);
+  if (custom_value != NULL &&
+      !g_strv_contains ((const char * const *) self->profile_choices, custom_value)) {
+    g_warning ("Unsupported platform_profile '%s' in custom profile '%s'",
+               custom_value, ppd_custom_profile_get_name (custom));
+    custom_value = NULL;
   }
 
-  platform_profile_value = profile_to_acpi_platform_profile_value (self, profile);
-  if (self->acpi_platform_profile == acpi_platform_profile_value_to_profile (platform_profile_value)) {
-    g_debug ("Not switching to platform_profile %s, emulating for %s, already there",
-             platform_profile_value,
-             ppd_profile_to_str (profile));
-    return TRUE;
+  if (custom_value != NULL)
+    platform_profile_value = custom_value;
+  else
+    platform_profile_value = profile_to_acpi_platform_profile_value (self, profile);
+
+  /* Both shortcuts only hold if no custom value is involved */
+  if (custom_value == NULL && !self->custom_value_applied) {
+    if (self->acpi_platform_profile == profile) {
+      g_debug ("Can't switch to %s mode, already there",
+               ppd_profile_to_str (profile));
+      return TRUE;
+    }
+
+    if (self->acpi_platform_profile == acpi_platform_profile_value_to_profile (platform_profile_value)) {
+      g_debug ("Not switching to platform_profile %s, emulating for %s, already there",
+               platform_profile_value,
+               ppd_profile_to_str (profile));
+      return TRUE;
+    }
   }
 
-  g_signal_handler_block (G_OBJECT (self->acpi_platform_profile_mon), self->acpi_platform_profile_changed_id);
   platform_profile_path = ppd_utils_get_sysfs_path (ACPI_PLATFORM_PROFILE_PATH);
-  if (!ppd_utils_write (platform_profile_path,
-                        profile_to_acpi_platform_profile_value (self, profile), &local_error)) {
+  if (!ppd_utils_write (platform_profile_path, platform_profile_value, &local_error)) {
     g_debug ("Failed to write to acpi_platform_profile: %s", local_error->message);
     g_propagate_prefixed_error (error, g_steal_pointer (&local_error),
                                 "Failed to write to acpi_platform_profile: ");
-    g_signal_handler_unblock (G_OBJECT (self->acpi_platform_profile_mon), self->acpi_platform_profile_changed_id);
     return FALSE;
   }
-  g_signal_handler_unblock (G_OBJECT (self->acpi_platform_profile_mon), self->acpi_platform_profile_changed_id);
 
   g_debug ("Successfully switched to profile %s", ppd_profile_to_str (profile));
   self->acpi_platform_profile = profile;
+  self->custom_value_applied = custom_value != NULL;
+  g_free (self->written_value);
+  self->written_value = g_strdup (platform_profile_value);
   return TRUE;
 }
 
+static gboolean
+ppd_driver_platform_profile_activate_profile (PpdDriver                   *driver,
+                                              PpdProfile                   profile,
+                                              PpdProfileActivationReason   reason,
+                                              GError                     **error)
+{
+  PpdDriverPlatformProfile *self = PPD_DRIVER_PLATFORM_PROFILE (driver);
+  gboolean ret;
+
+  g_mutex_lock (&self->lock);
+  ret = activate_profile_locked (self, profile, error);
+  g_mutex_unlock (&self->lock);
+
+  return ret;
+}
+
 static int
 find_dytc (GUdevDevice *dev,
            gpointer     user_data)
@@ -287,8 +331,8 @@ static PpdProbeResult
 ppd_driver_platform_profile_probe (PpdDriver  *driver)
 {
   PpdDriverPlatformProfile *self = PPD_DRIVER_PLATFORM_PROFILE (driver);
-  g_autoptr(GFile) acpi_platform_profile = NULL;
   g_autofree char *platform_profile_path = NULL;
+  g_autoptr(GError) error = NULL;
 
   g_return_val_if_fail (self->probe_result == PPD_PROBE_RESULT_UNSET, PPD_PROBE_RESULT_FAIL);
 
@@ -306,11 +350,14 @@ ppd_driver_platform_profile_probe (PpdDriver  *driver)
     return self->probe_result;
   }
 
-  acpi_platform_profile = g_file_new_for_path (platform_profile_path);
-  self->acpi_platform_profile_mon = g_file_monitor (acpi_platform_profile,
-                                                    G_FILE_MONITOR_NONE,
-                                                    NULL,
-                                                    NULL);
+  self->acpi_platform_profile_mon = ppd_sysfs_monitor_new (platform_profile_path,
+                                                           PPD_SYSFS_MONITOR_FLAGS_NOTIFY,
+                                                           &error);
+  if (self->acpi_platform_profile_mon == NULL) {
+    g_debug ("Could not monitor platform_profile sysfs file: %s", error->message);
+    self->probe_result = PPD_PROBE_RESULT_FAIL;
+    return self->probe_result;
+  }
   self->acpi_platform_profile_changed_id =
     g_signal_connect (G_OBJECT (self->acpi_platform_profile_mon), "changed",
                       G_CALLBACK (acpi_platform_profile_changed), self);
@@ -328,9 +375,11 @@ ppd_driver_platform_profile_probe (PpdDriver  *driver)
 
   self->lapmode_mon = ppd_utils_monitor_sysfs_attr (self->device,
                                                     LAPMODE_SYSFS_NAME,
+                                                    PPD_SYSFS_MONITOR_FLAGS_NOTIFY,
                                                     NULL);
-  g_signal_connect_object (G_OBJECT (self->lapmode_mon), "changed",
-                           G_CALLBACK (lapmode_changed), self, 0);
+  if (self->lapmode_mon)
+    g_signal_connect_object (G_OBJECT (self->lapmode_mon), "changed",
+                             G_CALLBACK (lapmode_changed), self, 0);
   update_dytc_lapmode_state (self);
 
 out:
@@ -350,9 +399,11 @@ ppd_driver_platform_profile_finalize (GObject *object)
   g_clear_signal_handler (&driver->acpi_platform_profile_changed_id,
                           driver->acpi_platform_profile_mon);
   g_clear_pointer (&driver->profile_choices, g_strfreev);
+  g_clear_pointer (&driver->written_value, g_free);
   g_clear_object (&driver->device);
   g_clear_object (&driver->lapmode_mon);
   g_clear_object (&driver->acpi_platform_profile_mon);
+  g_mutex_clear (&driver->lock);
   G_OBJECT_CLASS (ppd_driver_platform_profile_parent_class)->finalize (object);
 }
 
@@ -374,5 +425,6 @@ ppd_driver_platform_profile_class_init (PpdDriverPlatformProfileClass *klass)
 static void
 ppd_driver_platform_profile_init (PpdDriverPlatformProfile *self)
 {
+  g_mutex_init (&self->lock);
   self->probe_result = PPD_PROBE_RESULT_UNSET;
 }
@@ -9,6 +9,7 @@
 
 #include "ppd-driver.h"
 #include "ppd-enums.h"
+#include "ppd-stats.h"
 
 /**
  * SECTION:ppd-driver
@@ -34,6 +35,7 @@ typedef struct
   PpdProfile     profiles;
   gboolean       selected;
   char          *performance_degraded;
+  PpdBatteryBands *battery_bands;
 } PpdDriverPrivate;
 
 enum {
@@ -120,6 +122,7 @@ ppd_driver_finalize (GObject *object)
   priv = PPD_DRIVER_GET_PRIVATE (PPD_DRIVER (object));
   g_clear_pointer (&priv->driver_name, g_free);
   g_clear_pointer (&priv->performance_degraded, g_free);
+  g_clear_pointer (&priv->battery_bands, ppd_battery_bands_free);
 
   G_OBJECT_CLASS (ppd_driver_parent_class)->finalize (object);
 }
@@ -229,13 +232,22 @@ ppd_driver_activate_profile (PpdDriver                   *driver,
                              PpdProfileActivationReason   reason,
                              GError                     **error)
 {
+  g_autofree char *stats_name = NULL;
+  gint64 start_time;
+  gboolean ret;
+
   g_return_val_if_fail (PPD_IS_DRIVER (driver), FALSE);
   g_return_val_if_fail (ppd_profile_has_single_flag (profile), FALSE);
 
   if (!PPD_DRIVER_GET_CLASS (driver)->activate_profile)
     return TRUE;
 
-  return PPD_DRIVER_GET_CLASS (driver)->activate_profile (driver, profile, reason, error);
+  start_time = g_get_monotonic_time ();
+  ret = PPD_DRIVER_GET_CLASS (driver)->activate_profile (driver, profile, reason, error);
+  stats_name = g_strdup_printf ("driver:%s", ppd_driver_get_driver_name (driver));
+  ppd_stats_record_timing_since (stats_name, start_time);
+
+  return ret;
 }
 
 gboolean
@@ -263,6 +275,41 @@ gboolean ppd_driver_battery_changed (PpdDriver              *driver,
   return PPD_DRIVER_GET_CLASS (driver)->battery_changed (driver, val, error);
 }
 
+/**
+ * ppd_driver_set_battery_thresholds:
+ * @driver: a #PpdDriver
+ * @thresholds: (array length=n_thresholds): battery levels, in percent
+ * @n_thresholds: the number of thresholds
+ *
+ * Declares the battery levels the driver changes behaviour at, so that
+ * @battery_changed is only called when one of them is crossed, rather
+ * than for every battery level change.
+ */
+void
+ppd_driver_set_battery_thresholds (PpdDriver     *driver,
+                                   const gdouble *thresholds,
+                                   guint          n_thresholds)
+{
+  PpdDriverPrivate *priv;
+
+  g_return_if_fail (PPD_IS_DRIVER (driver));
+
+  priv = PPD_DRIVER_GET_PRIVATE (driver);
+  g_clear_pointer (&priv->battery_bands, ppd_battery_bands_free);
+  priv->battery_bands = ppd_battery_bands_new (thresholds, n_thresholds);
+}
+
+PpdBatteryBands *
+ppd_driver_get_battery_bands (PpdDriver *driver)
+{
+  PpdDriverPrivate *priv;
+
+  g_return_val_if_fail (PPD_IS_DRIVER (driver), NULL);
+
+  priv = PPD_DRIVER_GET_PRIVATE (driver);
+  return priv->battery_bands;
+}
+
 gboolean
 ppd_driver_prepare_to_sleep (PpdDriver  *driver,
                              gboolean    start,
@@ -358,6 +405,10 @@ ppd_profile_activation_reason_to_str (PpdProfileActivationReason reason)
     return "resume";
   case PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD:
     return "program-hold";
+  case PPD_PROFILE_ACTIVATION_REASON_AUTO:
+    return "auto";
+  case PPD_PROFILE_ACTIVATION_REASON_POWER_BUDGET:
+    return "power-budget";
   default:
     g_return_val_if_reached (NULL);
   }
@@ -11,6 +11,7 @@
 
 #include <glib-object.h>
 #include "ppd-profile.h"
+#include "ppd-battery-bands.h"
 
 #define PPD_TYPE_DRIVER (ppd_driver_get_type ())
 G_DECLARE_DERIVABLE_TYPE (PpdDriver, ppd_driver, PPD, DRIVER, GObject)
@@ -27,6 +28,10 @@ G_DECLARE_DERIVABLE_TYPE (PpdDriver, ppd_driver, PPD, DRIVER, GObject)
  *   is lost during suspend.
  * @PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD: setting profile because a program
  *   requested it through the `HoldProfile` method.
+ * @PPD_PROFILE_ACTIVATION_REASON_AUTO: setting profile because the automatic
+ *   mode picked it for the current workload.
+ * @PPD_PROFILE_ACTIVATION_REASON_POWER_BUDGET: re-applying the active profile
+ *   because the power budget stepped its settings up or down.
  *
  * Those are possible reasons for a profile being activated. Based on those
  * reasons, drivers can choose whether or not that changes the effective
@@ -37,7 +42,9 @@ typedef enum{
   PPD_PROFILE_ACTIVATION_REASON_RESET,
   PPD_PROFILE_ACTIVATION_REASON_USER,
   PPD_PROFILE_ACTIVATION_REASON_RESUME,
-  PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD
+  PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD,
+  PPD_PROFILE_ACTIVATION_REASON_AUTO,
+  PPD_PROFILE_ACTIVATION_REASON_POWER_BUDGET
 } PpdProfileActivationReason;
 
 /**
@@ -79,6 +86,8 @@ gboolean ppd_driver_activate_profile (PpdDriver *driver,
 gboolean ppd_driver_power_changed (PpdDriver *driver, PpdPowerChangedReason reason, GError **error);
 gboolean ppd_driver_prepare_to_sleep (PpdDriver  *driver, gboolean start, GError **error);
 gboolean ppd_driver_battery_changed (PpdDriver *driver, gdouble val, GError **error);
+PpdBatteryBands *ppd_driver_get_battery_bands (PpdDriver *driver);
+void ppd_driver_set_battery_thresholds (PpdDriver *driver, const gdouble *thresholds, guint n_thresholds);
 const char *ppd_driver_get_driver_name (PpdDriver *driver);
 PpdProfile ppd_driver_get_profiles (PpdDriver *driver);
 const char *ppd_driver_get_performance_degraded (PpdDriver *driver);
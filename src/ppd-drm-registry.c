@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#define G_LOG_DOMAIN "DrmRegistry"
+
+#include "config.h"
+
+#include "ppd-drm-registry.h"
+
+#define PANEL_STATUS_SYSFS_NAME "status"
+
+/**
+ * SECTION:ppd-drm-registry
+ * @Short_description: DRM devices used by actions
+ * @Title: DRM device registry
+ *
+ * The DRM device registry enumerates the DRM subsystem once, and keeps
+ * track of the connected panels that support panel power savings, of
+ * the cards that support DPM performance levels, and of the cards with
+ * frequency controls, so that actions don't need to enumerate every DRM
+ * device on each profile change.
+ *
+ * The lists are rebuilt on uevents, and handed out as snapshots, which
+ * can be used from the threads that activate profiles.
+ */
+
+struct _PpdDrmRegistry
+{
+  GObject parent_instance;
+
+  GUdevClient *client;
+
+  GMutex lock;
+  GPtrArray *panels;
+  GPtrArray *cards;
+  GPtrArray *gpus;
+};
+
+enum {
+  PANEL_ADDED,
+  CARD_ADDED,
+  GPU_ADDED,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+G_DEFINE_TYPE (PpdDrmRegistry, ppd_drm_registry, G_TYPE_OBJECT)
+
+G_LOCK_DEFINE_STATIC (default_registry);
+static PpdDrmRegistry *default_registry = NULL;
+
+static gboolean
+panel_connected (GUdevDevice *device)
+{
+  const char *value;
+  g_autofree gchar *stripped = NULL;
+
+  value = g_udev_device_get_sysfs_attr_uncached (device, PANEL_STATUS_SYSFS_NAME);
+  if (!value)
+    return FALSE;
+  stripped = g_strchomp (g_strdup (value));
+
+  return g_strcmp0 (stripped, "connected") == 0;
+}
+
+static gboolean
+is_panel (GUdevDevice *device)
+{
+  return g_strcmp0 (g_udev_device_get_devtype (device), "drm_connector") == 0 &&
+         g_udev_device_has_sysfs_attr (device, PPD_DRM_PANEL_POWER_SYSFS_NAME) &&
+         panel_connected (device);
+}
+
+static gboolean
+is_card (GUdevDevice *device)
+{
+  return g_strcmp0 (g_udev_device_get_devtype (device), "drm_minor") == 0 &&
+         g_udev_device_has_sysfs_attr (device, PPD_DRM_DPM_SYSFS_NAME);
+}
+
+static gboolean
+is_gpu (GUdevDevice *device)
+{
+  return g_strcmp0 (g_udev_device_get_devtype (device), "drm_minor") == 0 &&
+         (g_udev_device_has_sysfs_attr (device, PPD_DRM_I915_FREQ_SYSFS_NAME) ||
+          g_udev_device_has_sysfs_attr (device, PPD_DRM_XE_FREQ_SYSFS_NAME));
+}
+
+static void
+rebuild_devices (PpdDrmRegistry *self)
+{
+  g_autolist (GUdevDevice) devices = NULL;
+  g_autoptr(GPtrArray) panels = NULL;
+  g_autoptr(GPtrArray) cards = NULL;
+  g_autoptr(GPtrArray) gpus = NULL;
+
+  panels = g_ptr_array_new_with_free_func (g_object_unref);
+  cards = g_ptr_array_new_with_free_func (g_object_unref);
+  gpus = g_ptr_array_new_with_free_func (g_object_unref);
+
+  devices = g_udev_client_query_by_subsystem (self->client, "drm");
+  for (GList *l = devices; l != NULL; l = l->next) {
+    GUdevDevice *dev = l->data;
+
+    if (is_panel (dev))
+      g_ptr_array_add (panels, g_object_ref (dev));
+    else if (is_card (dev))
+      g_ptr_array_add (cards, g_object_ref (dev));
+    else if (is_gpu (dev))
+      g_ptr_array_add (gpus, g_object_ref (dev));
+  }
+
+  g_debug ("Found %u panel(s), %u card(s) and %u GPU(s) with frequency controls",
+           panels->len, cards->len, gpus->len);
+
+  /* Snapshots handed out earlier keep their own reference */
+  g_mutex_lock (&self->lock);
+  g_clear_pointer (&self->panels, g_ptr_array_unref);
+  g_clear_pointer (&self->cards, g_ptr_array_unref);
+  g_clear_pointer (&self->gpus, g_ptr_array_unref);
+  self->panels = g_steal_pointer (&panels);
+  self->cards = g_steal_pointer (&cards);
+  self->gpus = g_steal_pointer (&gpus);
+  g_mutex_unlock (&self->lock);
+}
+
+static void
+udev_uevent_cb (GUdevClient *client,
+                gchar       *action,
+                GUdevDevice *device,
+                gpointer     user_data)
+{
+  PpdDrmRegistry *self = user_data;
+
+  g_debug ("Device %s %s", g_udev_device_get_sysfs_path (device), action);
+
+  rebuild_devices (self);
+
+  if (!g_str_equal (action, "add"))
+    return;
+
+  if (is_panel (device))
+    g_signal_emit (self, signals[PANEL_ADDED], 0, device);
+  else if (is_card (device))
+    g_signal_emit (self, signals[CARD_ADDED], 0, device);
+  else if (is_gpu (device))
+    g_signal_emit (self, signals[GPU_ADDED], 0, device);
+}
+
+/**
+ * ppd_drm_registry_get_panels:
+ * @registry: a #PpdDrmRegistry
+ *
+ * Returns: (transfer container): the connected panels that support
+ * panel power savings, as #GUdevDevice objects.
+ */
+GPtrArray *
+ppd_drm_registry_get_panels (PpdDrmRegistry *registry)
+{
+  GPtrArray *panels;
+
+  g_return_val_if_fail (PPD_IS_DRM_REGISTRY (registry), NULL);
+
+  g_mutex_lock (&registry->lock);
+  panels = g_ptr_array_ref (registry->panels);
+  g_mutex_unlock (&registry->lock);
+
+  return panels;
+}
+
+/**
+ * ppd_drm_registry_get_cards:
+ * @registry: a #PpdDrmRegistry
+ *
+ * Returns: (transfer container): the cards that support DPM performance
+ * levels, as #GUdevDevice objects.
+ */
+GPtrArray *
+ppd_drm_registry_get_cards (PpdDrmRegistry *registry)
+{
+  GPtrArray *cards;
+
+  g_return_val_if_fail (PPD_IS_DRM_REGISTRY (registry), NULL);
+
+  g_mutex_lock (&registry->lock);
+  cards = g_ptr_array_ref (registry->cards);
+  g_mutex_unlock (&registry->lock);
+
+  return cards;
+}
+
+/**
+ * ppd_drm_registry_get_gpus:
+ * @registry: a #PpdDrmRegistry
+ *
+ * Returns: (transfer container): the i915 and xe cards with frequency
+ * controls, as #GUdevDevice objects.
+ */
+GPtrArray *
+ppd_drm_registry_get_gpus (PpdDrmRegistry *registry)
+{
+  GPtrArray *gpus;
+
+  g_return_val_if_fail (PPD_IS_DRM_REGISTRY (registry), NULL);
+
+  g_mutex_lock (&registry->lock);
+  gpus = g_ptr_array_ref (registry->gpus);
+  g_mutex_unlock (&registry->lock);
+
+  return gpus;
+}
+
+/**
+ * ppd_drm_registry_get_default:
+ *
+ * Returns: (transfer full): the registry shared by all the actions,
+ * which is created on first use, and destroyed along with the last
+ * action using it.
+ */
+PpdDrmRegistry *
+ppd_drm_registry_get_default (void)
+{
+  PpdDrmRegistry *registry;
+
+  G_LOCK (default_registry);
+  if (default_registry == NULL) {
+    default_registry = g_object_new (PPD_TYPE_DRM_REGISTRY, NULL);
+    registry = default_registry;
+  } else {
+    registry = g_object_ref (default_registry);
+  }
+  G_UNLOCK (default_registry);
+
+  return registry;
+}
+
+static void
+ppd_drm_registry_dispose (GObject *object)
+{
+  G_LOCK (default_registry);
+  if (default_registry == PPD_DRM_REGISTRY (object))
+    default_registry = NULL;
+  G_UNLOCK (default_registry);
+
+  G_OBJECT_CLASS (ppd_drm_registry_parent_class)->dispose (object);
+}
+
+static void
+ppd_drm_registry_finalize (GObject *object)
+{
+  PpdDrmRegistry *self = PPD_DRM_REGISTRY (object);
+
+  g_clear_object (&self->client);
+  g_clear_pointer (&self->panels, g_ptr_array_unref);
+  g_clear_pointer (&self->cards, g_ptr_array_unref);
+  g_clear_pointer (&self->gpus, g_ptr_array_unref);
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (ppd_drm_registry_parent_class)->finalize (object);
+}
+
+static void
+ppd_drm_registry_class_init (PpdDrmRegistryClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = ppd_drm_registry_dispose;
+  object_class->finalize = ppd_drm_registry_finalize;
+
+  /**
+   * PpdDrmRegistry::panel-added:
+   * @registry: the #PpdDrmRegistry
+   * @device: the #GUdevDevice of the panel
+   *
+   * Emitted when a connected panel supporting power savings appears.
+   */
+  signals[PANEL_ADDED] = g_signal_new ("panel-added",
+                                       G_TYPE_FROM_CLASS (klass),
+                                       G_SIGNAL_RUN_LAST,
+                                       0,
+                                       NULL,
+                                       NULL,
+                                       g_cclosure_marshal_generic,
+                                       G_TYPE_NONE,
+                                       1,
+                                       G_UDEV_TYPE_DEVICE);
+
+  /**
+   * PpdDrmRegistry::card-added:
+   * @registry: the #PpdDrmRegistry
+   * @device: the #GUdevDevice of the card
+   *
+   * Emitted when a card supporting DPM performance levels appears.
+   */
+  signals[CARD_ADDED] = g_signal_new ("card-added",
+                                      G_TYPE_FROM_CLASS (klass),
+                                      G_SIGNAL_RUN_LAST,
+                                      0,
+                                      NULL,
+                                      NULL,
+                                      g_cclosure_marshal_generic,
+                                      G_TYPE_NONE,
+                                      1,
+                                      G_UDEV_TYPE_DEVICE);
+
+  /**
+   * PpdDrmRegistry::gpu-added:
+   * @registry: the #PpdDrmRegistry
+   * @device: the #GUdevDevice of the card
+   *
+   * Emitted when a card with frequency controls appears.
+   */
+  signals[GPU_ADDED] = g_signal_new ("gpu-added",
+                                     G_TYPE_FROM_CLASS (klass),
+                                     G_SIGNAL_RUN_LAST,
+                                     0,
+                                     NULL,
+                                     NULL,
+                                     g_cclosure_marshal_generic,
+                                     G_TYPE_NONE,
+                                     1,
+                                     G_UDEV_TYPE_DEVICE);
+}
+
+static void
+ppd_drm_registry_init (PpdDrmRegistry *self)
+{
+  const gchar * const subsystem[] = { "drm", NULL };
+
+  g_mutex_init (&self->lock);
+  self->client = g_udev_client_new (subsystem);
+  g_signal_connect_object (G_OBJECT (self->client), "uevent",
+                           G_CALLBACK (udev_uevent_cb), self, 0);
+  rebuild_devices (self);
+}
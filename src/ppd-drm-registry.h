@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#pragma once
+
+#include <gudev/gudev.h>
+
+#define PPD_DRM_PANEL_POWER_SYSFS_NAME "amdgpu/panel_power_savings"
+#define PPD_DRM_DPM_SYSFS_NAME         "device/power_dpm_force_performance_level"
+#define PPD_DRM_I915_FREQ_SYSFS_NAME   "gt_min_freq_mhz"
+#define PPD_DRM_XE_FREQ_SYSFS_NAME     "device/tile0/gt0/freq0/min_freq"
+
+#define PPD_TYPE_DRM_REGISTRY (ppd_drm_registry_get_type())
+G_DECLARE_FINAL_TYPE (PpdDrmRegistry, ppd_drm_registry, PPD, DRM_REGISTRY, GObject)
+
+PpdDrmRegistry *ppd_drm_registry_get_default (void);
+GPtrArray *ppd_drm_registry_get_panels (PpdDrmRegistry *registry);
+GPtrArray *ppd_drm_registry_get_cards (PpdDrmRegistry *registry);
+GPtrArray *ppd_drm_registry_get_gpus (PpdDrmRegistry *registry);
@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#define G_LOG_DOMAIN "PowerBudget"
+
+#include <string.h>
+
+#include "ppd-power-budget.h"
+#include "ppd-utils.h"
+
+#define POWERCAP_DIR           "/sys/class/powercap"
+#define THERMAL_DIR            "/sys/class/thermal"
+
+/* Stepping down starts a bit before the limits, so that the firmware
+ * doesn't need to throttle, and stepping back up needs some headroom,
+ * so that a load sitting on a limit doesn't step back and forth */
+#define POWER_APPROACHED       0.95 /* of the power limit */
+#define POWER_CLEARED          0.85
+#define POWER_NEAR             0.75
+#define TEMPERATURE_APPROACHED 3.0  /* degrees under the temperature limit */
+#define TEMPERATURE_CLEARED    8.0
+#define TEMPERATURE_NEAR       15.0
+
+/* Consecutive samples with headroom before stepping back up */
+#define SAMPLES_TO_RECOVER     3
+
+/* Thermal zones following the CPU package temperature, others such as
+ * the battery's, the wireless card's, or the NVMe drive's have their
+ * own limits */
+static const char *cpu_thermal_zone_types[] = {
+  "x86_pkg_temp",
+  "TCPU",
+  "acpitz",
+  NULL,
+};
+
+typedef enum {
+  HEADROOM_FAR,   /* far from the limits */
+  HEADROOM_NEAR,  /* close enough to sample often */
+  HEADROOM_TIGHT, /* too close to step back up */
+  HEADROOM_NONE,  /* needs stepping down */
+} Headroom;
+
+/* Samples the package power from the RAPL energy counters, and the
+ * temperature of the thermal zones, and picks how many steps down from
+ * the active profile's settings they call for. The sampling interval
+ * doubles for every sample far from the limits, up to its maximum. */
+struct _PpdPowerBudget {
+  guint min_interval;
+  guint max_interval;
+  guint interval;
+  gdouble power_limit;       /* W, or 0 */
+  gdouble temperature_limit; /* degrees Celsius, or 0 */
+
+  GHashTable *energy;        /* powercap zone to previous energy_uj */
+  gint64 energy_time;
+
+  guint step;
+  guint recover_samples;
+  const char *reason;
+};
+
+PpdPowerBudget *
+ppd_power_budget_new (guint   min_interval,
+                      guint   max_interval,
+                      gdouble power_limit,
+                      gdouble temperature_limit)
+{
+  PpdPowerBudget *budget;
+
+  budget = g_new0 (PpdPowerBudget, 1);
+  budget->min_interval = min_interval;
+  budget->max_interval = MAX (min_interval, max_interval);
+  budget->interval = min_interval;
+  budget->power_limit = MAX (power_limit, 0);
+  budget->temperature_limit = MAX (temperature_limit, 0);
+  budget->energy = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  return budget;
+}
+
+void
+ppd_power_budget_free (PpdPowerBudget *budget)
+{
+  g_hash_table_unref (budget->energy);
+  g_free (budget);
+}
+
+/* Forgets about the energy counters, for when sampling was paused.
+ * The current step is kept, until samples say otherwise. */
+void
+ppd_power_budget_reset (PpdPowerBudget *budget)
+{
+  g_hash_table_remove_all (budget->energy);
+  budget->energy_time = 0;
+  budget->recover_samples = 0;
+  budget->interval = budget->min_interval;
+}
+
+guint
+ppd_power_budget_get_interval (PpdPowerBudget *budget)
+{
+  return budget->interval;
+}
+
+/* Why the settings are stepped down, a "PerformanceDegraded" reason,
+ * or NULL if they aren't */
+const char *
+ppd_power_budget_get_reason (PpdPowerBudget *budget)
+{
+  return budget->step > 0 ? budget->reason : NULL;
+}
+
+static guint64
+read_u64 (const char *dir,
+          const char *attr,
+          gboolean   *found)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *contents = NULL;
+
+  path = g_build_filename (dir, attr, NULL);
+  *found = g_file_get_contents (path, &contents, NULL, NULL);
+  if (!*found)
+    return 0;
+
+  return g_ascii_strtoull (contents, NULL, 10);
+}
+
+/* The power drawn by all the packages since the last sample, in W, or
+ * a negative value if unknown */
+static gdouble
+sample_package_power (PpdPowerBudget *budget)
+{
+  g_autofree char *powercap_dir = NULL;
+  g_autoptr(GDir) dir = NULL;
+  const char *name;
+  gint64 now;
+  guint64 consumed = 0;
+  gboolean has_zones = FALSE;
+  gdouble power = -1.0;
+
+  powercap_dir = ppd_utils_get_sysfs_path (POWERCAP_DIR);
+  dir = g_dir_open (powercap_dir, 0, NULL);
+  if (dir == NULL)
+    return -1.0;
+
+  now = g_get_monotonic_time ();
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    g_autofree char *base = NULL;
+    g_autofree char *zone_name = NULL;
+    g_autofree char *zone_name_path = NULL;
+    guint64 energy, max_energy, *previous;
+    gboolean found;
+
+    /* The MMIO interface exposes the same packages again */
+    if (g_str_has_prefix (name, "intel-rapl-mmio"))
+      continue;
+
+    base = g_build_filename (powercap_dir, name, NULL);
+    zone_name_path = g_build_filename (base, "name", NULL);
+    if (!g_file_get_contents (zone_name_path, &zone_name, NULL, NULL) ||
+        !g_str_has_prefix (zone_name, "package"))
+      continue;
+
+    energy = read_u64 (base, "energy_uj", &found);
+    if (!found)
+      continue;
+    max_energy = read_u64 (base, "max_energy_range_uj", &found);
+
+    previous = g_hash_table_lookup (budget->energy, name);
+    if (previous != NULL) {
+      has_zones = TRUE;
+      if (energy >= *previous)
+        consumed += energy - *previous;
+      else if (max_energy > *previous)
+        consumed += max_energy - *previous + energy; /* wrapped around */
+    } else {
+      previous = g_new (guint64, 1);
+      g_hash_table_insert (budget->energy, g_strdup (name), previous);
+    }
+    *previous = energy;
+  }
+
+  /* uJ over us are W */
+  if (has_zones && budget->energy_time > 0 && now > budget->energy_time)
+    power = (gdouble) consumed / (now - budget->energy_time);
+  budget->energy_time = now;
+
+  return power;
+}
+
+/* The temperature of a thermal zone, in millidegrees Celsius, or a
+ * negative value if unknown, or invalid. Zones report negative values
+ * when their sensor isn't working. */
+static gint64
+read_temperature (const char *dir)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *contents = NULL;
+  gint64 millidegrees;
+  char *end;
+
+  path = g_build_filename (dir, "temp", NULL);
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return -1;
+
+  millidegrees = g_ascii_strtoll (g_strchomp (contents), &end, 10);
+  if (end == contents || *end != '\0')
+    return -1;
+
+  return millidegrees;
+}
+
+/* The temperature of the hottest CPU thermal zone, in degrees Celsius,
+ * or a negative value if unknown */
+static gdouble
+sample_temperature (void)
+{
+  g_autofree char *thermal_dir = NULL;
+  g_autoptr(GDir) dir = NULL;
+  const char *name;
+  gdouble temperature = -1.0;
+
+  thermal_dir = ppd_utils_get_sysfs_path (THERMAL_DIR);
+  dir = g_dir_open (thermal_dir, 0, NULL);
+  if (dir == NULL)
+    return -1.0;
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    g_autofree char *base = NULL;
+    g_autofree char *type_path = NULL;
+    g_autofree char *type = NULL;
+    gint64 millidegrees;
+
+    if (!g_str_has_prefix (name, "thermal_zone"))
+      continue;
+
+    base = g_build_filename (thermal_dir, name, NULL);
+    type_path = g_build_filename (base, "type", NULL);
+    if (!g_file_get_contents (type_path, &type, NULL, NULL) ||
+        !g_strv_contains (cpu_thermal_zone_types, g_strchomp (type)))
+      continue;
+
+    millidegrees = read_temperature (base);
+    if (millidegrees >= 0)
+      temperature = MAX (temperature, millidegrees / 1000.0);
+  }
+
+  return temperature;
+}
+
+static Headroom
+power_headroom (gdouble power,
+                gdouble limit)
+{
+  if (power >= limit * POWER_APPROACHED)
+    return HEADROOM_NONE;
+  if (power >= limit * POWER_CLEARED)
+    return HEADROOM_TIGHT;
+  if (power >= limit * POWER_NEAR)
+    return HEADROOM_NEAR;
+  return HEADROOM_FAR;
+}
+
+static Headroom
+temperature_headroom (gdouble temperature,
+                      gdouble limit)
+{
+  if (temperature >= limit - TEMPERATURE_APPROACHED)
+    return HEADROOM_NONE;
+  if (temperature >= limit - TEMPERATURE_CLEARED)
+    return HEADROOM_TIGHT;
+  if (temperature >= limit - TEMPERATURE_NEAR)
+    return HEADROOM_NEAR;
+  return HEADROOM_FAR;
+}
+
+/* Returns how many steps down from the active profile's settings the
+ * power draw and temperatures call for */
+guint
+ppd_power_budget_sample (PpdPowerBudget *budget)
+{
+  Headroom headroom = HEADROOM_FAR;
+  const char *reason = NULL;
+  gdouble power = -1.0, temperature = -1.0;
+
+  if (budget->power_limit > 0)
+    power = sample_package_power (budget);
+  if (budget->temperature_limit > 0)
+    temperature = sample_temperature ();
+
+  if (power >= 0) {
+    headroom = power_headroom (power, budget->power_limit);
+    reason = "power-limit";
+  }
+  if (temperature >= 0) {
+    Headroom temperature_state;
+
+    temperature_state = temperature_headroom (temperature, budget->temperature_limit);
+    if (reason == NULL || temperature_state > headroom) {
+      headroom = temperature_state;
+      reason = "high-operating-temperature";
+    }
+  }
+
+  g_debug ("Sampled package power %.1f W, temperature %.1f C, step %u",
+           power, temperature, budget->step);
+
+  switch (headroom) {
+  case HEADROOM_NONE:
+    budget->recover_samples = 0;
+    if (budget->step < PPD_POWER_BUDGET_MAX_STEP) {
+      budget->step++;
+      budget->reason = reason;
+      g_debug ("Approaching the %s, stepping down to %u", reason, budget->step);
+    }
+    break;
+  case HEADROOM_TIGHT:
+    budget->recover_samples = 0;
+    break;
+  case HEADROOM_NEAR:
+  case HEADROOM_FAR:
+    if (budget->step > 0 && ++budget->recover_samples >= SAMPLES_TO_RECOVER) {
+      budget->step--;
+      budget->recover_samples = 0;
+      g_debug ("Back under the limits, stepping up to %u", budget->step);
+    }
+    break;
+  }
+
+  if (headroom == HEADROOM_FAR && budget->step == 0)
+    budget->interval = MIN (budget->interval * 2, budget->max_interval);
+  else
+    budget->interval = budget->min_interval;
+
+  return budget->step;
+}
+
+/* The step the drivers apply, set from the main thread and read from
+ * the drivers' workers */
+G_LOCK_DEFINE_STATIC (active_step);
+static guint active_step = 0;
+
+void
+ppd_power_budget_set_active_step (guint step)
+{
+  G_LOCK (active_step);
+  active_step = MIN (step, PPD_POWER_BUDGET_MAX_STEP);
+  G_UNLOCK (active_step);
+}
+
+guint
+ppd_power_budget_get_active_step (void)
+{
+  guint step;
+
+  G_LOCK (active_step);
+  step = active_step;
+  G_UNLOCK (active_step);
+
+  return step;
+}
+
+/* From the most performant to the most power efficient */
+static const char *epp_prefs[] = {
+  "performance",
+  "balance_performance",
+  "balance_power",
+  "power",
+};
+
+/* Lowers @epp by a notch for every step after the first one. Returns
+ * @epp, a static string, or @buf holding a raw value, @buf and @epp can
+ * be the same buffer. */
+const char *
+ppd_power_budget_step_epp (const char *epp,
+                           char       *buf,
+                           gsize       len)
+{
+  guint step, notches;
+  char *end;
+  guint64 value;
+
+  if (epp == NULL)
+    return NULL;
+
+  step = ppd_power_budget_get_active_step ();
+  notches = step > 1 ? step - 1 : 0;
+  if (notches == 0)
+    return epp;
+
+  if (g_strcmp0 (epp, "default") == 0)
+    epp = "balance_performance";
+  for (guint i = 0; i < G_N_ELEMENTS (epp_prefs); i++) {
+    if (g_strcmp0 (epp, epp_prefs[i]) == 0)
+      return epp_prefs[MIN (i + notches, G_N_ELEMENTS (epp_prefs) - 1)];
+  }
+
+  /* Raw values go from 0 (performance) to 255 (power) */
+  value = g_ascii_strtoull (epp, &end, 10);
+  if (end != epp && *end == '\0') {
+    g_snprintf (buf, len, "%" G_GUINT64_FORMAT, MIN (value + notches * 64, 255));
+    return buf;
+  }
+
+  return epp;
+}
+
+/* Disables boost from the first step */
+const char *
+ppd_power_budget_step_boost (const char *boost)
+{
+  if (boost == NULL)
+    return NULL;
+
+  if (ppd_power_budget_get_active_step () > 0)
+    return "0";
+
+  return boost;
+}
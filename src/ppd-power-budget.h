@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+/* Steps down from the active profile's settings: boost is disabled
+ * from the first step, and the energy performance preference lowered
+ * by one notch for every step after that */
+#define PPD_POWER_BUDGET_MAX_STEP 3
+
+typedef struct _PpdPowerBudget PpdPowerBudget;
+
+PpdPowerBudget *ppd_power_budget_new (guint   min_interval,
+                                      guint   max_interval,
+                                      gdouble power_limit,
+                                      gdouble temperature_limit);
+void ppd_power_budget_free (PpdPowerBudget *budget);
+void ppd_power_budget_reset (PpdPowerBudget *budget);
+guint ppd_power_budget_sample (PpdPowerBudget *budget);
+guint ppd_power_budget_get_interval (PpdPowerBudget *budget);
+const char *ppd_power_budget_get_reason (PpdPowerBudget *budget);
+
+void ppd_power_budget_set_active_step (guint step);
+guint ppd_power_budget_get_active_step (void);
+const char *ppd_power_budget_step_epp (const char *epp,
+                                       char       *buf,
+                                       gsize       len);
+const char *ppd_power_budget_step_boost (const char *boost);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PpdPowerBudget, ppd_power_budget_free)
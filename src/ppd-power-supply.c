@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#define G_LOG_DOMAIN "PowerSupply"
+
+#include "config.h"
+
+#include "ppd-power-supply.h"
+
+/**
+ * SECTION:ppd-power-supply
+ * @Short_description: Power supplies tracked from udev
+ * @Title: Power supply monitor
+ *
+ * The power supply monitor tracks the power_supply devices from udev
+ * uevents, and works out whether the system runs on AC or on battery,
+ * and the charge level of its batteries, weighted by their capacity,
+ * without going through UPower.
+ *
+ * Devices are handed out as snapshots, which can be used from the
+ * threads that activate profiles.
+ */
+
+struct _PpdPowerSupplyMonitor
+{
+  GObject parent_instance;
+
+  GUdevClient *client;
+
+  GMutex lock;
+  GPtrArray *devices;
+
+  PpdPowerChangedReason power_state;
+  gdouble battery_level;
+};
+
+enum {
+  DEVICE_ADDED,
+  POWER_STATE_CHANGED,
+  BATTERY_LEVEL_CHANGED,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+G_DEFINE_TYPE (PpdPowerSupplyMonitor, ppd_power_supply_monitor, G_TYPE_OBJECT)
+
+G_LOCK_DEFINE_STATIC (default_monitor);
+static PpdPowerSupplyMonitor *default_monitor = NULL;
+
+/* Peripherals, such as mice, report a "Device" scope, and neither
+ * power the system, nor tell whether it's on AC */
+static gboolean
+is_system_supply (GUdevDevice *device)
+{
+  return g_strcmp0 (g_udev_device_get_sysfs_attr (device, "scope"), "Device") != 0;
+}
+
+static gboolean
+is_battery (GUdevDevice *device)
+{
+  return g_strcmp0 (g_udev_device_get_sysfs_attr (device, "type"), "Battery") == 0;
+}
+
+static gdouble
+get_attr_as_double (GUdevDevice *device,
+                    const char  *attribute)
+{
+  if (!g_udev_device_has_sysfs_attr (device, attribute))
+    return -1.0;
+
+  return g_udev_device_get_sysfs_attr_as_double (device, attribute);
+}
+
+/* The energy stored in and held by a battery, in µWh */
+static gboolean
+get_battery_energy (GUdevDevice *device,
+                    gdouble     *now,
+                    gdouble     *full)
+{
+  gdouble voltage;
+
+  *now = get_attr_as_double (device, "energy_now");
+  *full = get_attr_as_double (device, "energy_full");
+  if (*now >= 0 && *full > 0)
+    return TRUE;
+
+  voltage = get_attr_as_double (device, "voltage_min_design");
+  *now = get_attr_as_double (device, "charge_now");
+  *full = get_attr_as_double (device, "charge_full");
+  if (*now >= 0 && *full > 0 && voltage > 0) {
+    *now *= voltage / 1000000;
+    *full *= voltage / 1000000;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+static PpdPowerChangedReason
+compute_power_state (GPtrArray *devices)
+{
+  gboolean has_line_power = FALSE;
+  gboolean has_battery = FALSE;
+  gboolean discharging = FALSE;
+
+  for (guint i = 0; i < devices->len; i++) {
+    GUdevDevice *dev = g_ptr_array_index (devices, i);
+
+    if (!is_system_supply (dev))
+      continue;
+
+    if (is_battery (dev)) {
+      if (g_udev_device_has_sysfs_attr (dev, "present") &&
+          g_udev_device_get_sysfs_attr_as_int (dev, "present") == 0)
+        continue;
+      has_battery = TRUE;
+      if (g_strcmp0 (g_udev_device_get_sysfs_attr (dev, "status"), "Discharging") == 0)
+        discharging = TRUE;
+      continue;
+    }
+
+    has_line_power = TRUE;
+    if (g_udev_device_get_sysfs_attr_as_int (dev, "online") > 0)
+      return PPD_POWER_CHANGED_REASON_AC;
+  }
+
+  if (!has_battery)
+    return PPD_POWER_CHANGED_REASON_UNKNOWN;
+
+  /* All the line power supplies are offline */
+  if (has_line_power || discharging)
+    return PPD_POWER_CHANGED_REASON_BATTERY;
+
+  return PPD_POWER_CHANGED_REASON_AC;
+}
+
+/* The overall charge level in percent, weighted by the batteries'
+ * capacities, or a negative value without batteries */
+static gdouble
+compute_battery_level (GPtrArray *devices)
+{
+  gdouble energy_now = 0, energy_full = 0;
+  gdouble capacity = 0;
+  gboolean weighted = TRUE;
+  guint n_batteries = 0;
+
+  for (guint i = 0; i < devices->len; i++) {
+    GUdevDevice *dev = g_ptr_array_index (devices, i);
+    gboolean has_energy;
+    gdouble now, full;
+
+    if (!is_system_supply (dev) || !is_battery (dev))
+      continue;
+
+    has_energy = get_battery_energy (dev, &now, &full);
+    if (g_udev_device_has_sysfs_attr (dev, "capacity"))
+      capacity += get_attr_as_double (dev, "capacity");
+    else if (has_energy)
+      capacity += now * 100 / full;
+    else
+      continue;
+    n_batteries++;
+
+    if (has_energy) {
+      energy_now += now;
+      energy_full += full;
+    } else {
+      weighted = FALSE;
+    }
+  }
+
+  if (n_batteries == 0)
+    return -1.0;
+
+  /* Without energy information for all of them, all batteries count
+   * the same */
+  if (weighted && energy_full > 0)
+    return CLAMP (energy_now * 100 / energy_full, 0, 100);
+
+  return CLAMP (capacity / n_batteries, 0, 100);
+}
+
+static void
+rebuild_devices (PpdPowerSupplyMonitor *self)
+{
+  g_autolist (GUdevDevice) devices = NULL;
+  g_autoptr(GPtrArray) supplies = NULL;
+  PpdPowerChangedReason power_state;
+  gdouble battery_level;
+
+  supplies = g_ptr_array_new_with_free_func (g_object_unref);
+
+  devices = g_udev_client_query_by_subsystem (self->client, "power_supply");
+  for (GList *l = devices; l != NULL; l = l->next)
+    g_ptr_array_add (supplies, g_object_ref (l->data));
+
+  power_state = compute_power_state (supplies);
+  battery_level = compute_battery_level (supplies);
+  g_debug ("Found %u power supplies, power state is %s, battery level is %f",
+           supplies->len, ppd_power_changed_reason_to_str (power_state), battery_level);
+
+  /* Snapshots handed out earlier keep their own reference */
+  g_mutex_lock (&self->lock);
+  g_clear_pointer (&self->devices, g_ptr_array_unref);
+  self->devices = g_steal_pointer (&supplies);
+  g_mutex_unlock (&self->lock);
+
+  if (power_state != self->power_state) {
+    self->power_state = power_state;
+    g_signal_emit (self, signals[POWER_STATE_CHANGED], 0);
+  }
+
+  if (battery_level != self->battery_level) {
+    self->battery_level = battery_level;
+    g_signal_emit (self, signals[BATTERY_LEVEL_CHANGED], 0);
+  }
+}
+
+static void
+udev_uevent_cb (GUdevClient *client,
+                gchar       *action,
+                GUdevDevice *device,
+                gpointer     user_data)
+{
+  PpdPowerSupplyMonitor *self = user_data;
+
+  g_debug ("Device %s %s", g_udev_device_get_sysfs_path (device), action);
+
+  rebuild_devices (self);
+
+  if (g_str_equal (action, "add"))
+    g_signal_emit (self, signals[DEVICE_ADDED], 0, device);
+}
+
+/**
+ * ppd_power_supply_monitor_get_devices:
+ * @monitor: a #PpdPowerSupplyMonitor
+ *
+ * Returns: (transfer container): the power supplies, as #GUdevDevice
+ * objects.
+ */
+GPtrArray *
+ppd_power_supply_monitor_get_devices (PpdPowerSupplyMonitor *monitor)
+{
+  GPtrArray *devices;
+
+  g_return_val_if_fail (PPD_IS_POWER_SUPPLY_MONITOR (monitor), NULL);
+
+  g_mutex_lock (&monitor->lock);
+  devices = g_ptr_array_ref (monitor->devices);
+  g_mutex_unlock (&monitor->lock);
+
+  return devices;
+}
+
+/**
+ * ppd_power_supply_monitor_get_power_state:
+ * @monitor: a #PpdPowerSupplyMonitor
+ *
+ * Returns: whether the system runs on AC or on battery, or
+ * %PPD_POWER_CHANGED_REASON_UNKNOWN if it has no battery.
+ */
+PpdPowerChangedReason
+ppd_power_supply_monitor_get_power_state (PpdPowerSupplyMonitor *monitor)
+{
+  g_return_val_if_fail (PPD_IS_POWER_SUPPLY_MONITOR (monitor), PPD_POWER_CHANGED_REASON_UNKNOWN);
+
+  return monitor->power_state;
+}
+
+/**
+ * ppd_power_supply_monitor_get_battery_level:
+ * @monitor: a #PpdPowerSupplyMonitor
+ *
+ * Returns: the charge level of the system's batteries in percent,
+ * or a negative value if it has none.
+ */
+gdouble
+ppd_power_supply_monitor_get_battery_level (PpdPowerSupplyMonitor *monitor)
+{
+  g_return_val_if_fail (PPD_IS_POWER_SUPPLY_MONITOR (monitor), -1.0);
+
+  return monitor->battery_level;
+}
+
+/**
+ * ppd_power_supply_monitor_get_default:
+ *
+ * Returns: (transfer full): the monitor shared by the daemon and the
+ * actions, which is created on first use, and destroyed along with its
+ * last user.
+ */
+PpdPowerSupplyMonitor *
+ppd_power_supply_monitor_get_default (void)
+{
+  PpdPowerSupplyMonitor *monitor;
+
+  G_LOCK (default_monitor);
+  if (default_monitor == NULL) {
+    default_monitor = g_object_new (PPD_TYPE_POWER_SUPPLY_MONITOR, NULL);
+    monitor = default_monitor;
+  } else {
+    monitor = g_object_ref (default_monitor);
+  }
+  G_UNLOCK (default_monitor);
+
+  return monitor;
+}
+
+static void
+ppd_power_supply_monitor_dispose (GObject *object)
+{
+  G_LOCK (default_monitor);
+  if (default_monitor == PPD_POWER_SUPPLY_MONITOR (object))
+    default_monitor = NULL;
+  G_UNLOCK (default_monitor);
+
+  G_OBJECT_CLASS (ppd_power_supply_monitor_parent_class)->dispose (object);
+}
+
+static void
+ppd_power_supply_monitor_finalize (GObject *object)
+{
+  PpdPowerSupplyMonitor *self = PPD_POWER_SUPPLY_MONITOR (object);
+
+  g_clear_object (&self->client);
+  g_clear_pointer (&self->devices, g_ptr_array_unref);
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (ppd_power_supply_monitor_parent_class)->finalize (object);
+}
+
+static void
+ppd_power_supply_monitor_class_init (PpdPowerSupplyMonitorClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = ppd_power_supply_monitor_dispose;
+  object_class->finalize = ppd_power_supply_monitor_finalize;
+
+  /**
+   * PpdPowerSupplyMonitor::device-added:
+   * @monitor: the #PpdPowerSupplyMonitor
+   * @device: the #GUdevDevice of the power supply
+   *
+   * Emitted when a power supply appears.
+   */
+  signals[DEVICE_ADDED] = g_signal_new ("device-added",
+                                        G_TYPE_FROM_CLASS (klass),
+                                        G_SIGNAL_RUN_LAST,
+                                        0,
+                                        NULL,
+                                        NULL,
+                                        g_cclosure_marshal_generic,
+                                        G_TYPE_NONE,
+                                        1,
+                                        G_UDEV_TYPE_DEVICE);
+
+  /**
+   * PpdPowerSupplyMonitor::power-state-changed:
+   * @monitor: the #PpdPowerSupplyMonitor
+   *
+   * Emitted when the system switches between AC and battery.
+   */
+  signals[POWER_STATE_CHANGED] = g_signal_new ("power-state-changed",
+                                               G_TYPE_FROM_CLASS (klass),
+                                               G_SIGNAL_RUN_LAST,
+                                               0,
+                                               NULL,
+                                               NULL,
+                                               g_cclosure_marshal_generic,
+                                               G_TYPE_NONE,
+                                               0);
+
+  /**
+   * PpdPowerSupplyMonitor::battery-level-changed:
+   * @monitor: the #PpdPowerSupplyMonitor
+   *
+   * Emitted when the charge level of the batteries changes.
+   */
+  signals[BATTERY_LEVEL_CHANGED] = g_signal_new ("battery-level-changed",
+                                                 G_TYPE_FROM_CLASS (klass),
+                                                 G_SIGNAL_RUN_LAST,
+                                                 0,
+                                                 NULL,
+                                                 NULL,
+                                                 g_cclosure_marshal_generic,
+                                                 G_TYPE_NONE,
+                                                 0);
+}
+
+static void
+ppd_power_supply_monitor_init (PpdPowerSupplyMonitor *self)
+{
+  const gchar * const subsystem[] = { "power_supply", NULL };
+
+  g_mutex_init (&self->lock);
+  self->battery_level = -1.0;
+  self->client = g_udev_client_new (subsystem);
+  g_signal_connect_object (G_OBJECT (self->client), "uevent",
+                           G_CALLBACK (udev_uevent_cb), self, 0);
+  rebuild_devices (self);
+}
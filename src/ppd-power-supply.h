@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#pragma once
+
+#include <gudev/gudev.h>
+
+#include "ppd-profile.h"
+
+#define PPD_TYPE_POWER_SUPPLY_MONITOR (ppd_power_supply_monitor_get_type())
+G_DECLARE_FINAL_TYPE (PpdPowerSupplyMonitor, ppd_power_supply_monitor, PPD, POWER_SUPPLY_MONITOR, GObject)
+
+PpdPowerSupplyMonitor *ppd_power_supply_monitor_get_default (void);
+GPtrArray *ppd_power_supply_monitor_get_devices (PpdPowerSupplyMonitor *monitor);
+PpdPowerChangedReason ppd_power_supply_monitor_get_power_state (PpdPowerSupplyMonitor *monitor);
+gdouble ppd_power_supply_monitor_get_battery_level (PpdPowerSupplyMonitor *monitor);
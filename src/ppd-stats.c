@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#define G_LOG_DOMAIN "Stats"
+
+#include "ppd-stats.h"
+
+/* Timings are kept in power-of-two buckets of microseconds, bucket n
+ * holding durations in [2^(n-1), 2^n), so recording is a couple of
+ * instructions, and the percentiles are accurate to within a factor
+ * of two, which is plenty to tell a slow driver apart. */
+#define N_BUCKETS 32
+
+typedef struct {
+  guint64 count;
+  guint64 max;
+  guint64 buckets[N_BUCKETS];
+} Histogram;
+
+G_LOCK_DEFINE_STATIC (stats);
+static GHashTable *histograms = NULL;
+static guint64 sysfs_writes = 0;
+static guint64 sysfs_writes_skipped = 0;
+
+static guint
+bucket_for_usecs (guint64 usecs)
+{
+  guint bucket = 0;
+
+  while (usecs != 0 && bucket < N_BUCKETS - 1) {
+    usecs >>= 1;
+    bucket++;
+  }
+
+  return bucket;
+}
+
+static guint64
+histogram_percentile (Histogram *histogram,
+                      guint      percent)
+{
+  guint64 rank;
+  guint64 seen = 0;
+
+  if (histogram->count == 0)
+    return 0;
+
+  rank = (histogram->count * percent + 99) / 100;
+  for (guint i = 0; i < N_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank) {
+      guint64 upper = i == 0 ? 0 : (G_GUINT64_CONSTANT (1) << i) - 1;
+      return MIN (upper, histogram->max);
+    }
+  }
+
+  return histogram->max;
+}
+
+static int
+compare_names (gconstpointer a,
+               gconstpointer b,
+               gpointer      user_data)
+{
+  return g_strcmp0 (*(const char **) a, *(const char **) b);
+}
+
+void
+ppd_stats_record_timing (const char *name,
+                         gint64      usecs)
+{
+  Histogram *histogram;
+
+  g_return_if_fail (name != NULL);
+
+  if (usecs < 0)
+    usecs = 0;
+
+  G_LOCK (stats);
+  if (histograms == NULL)
+    histograms = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  histogram = g_hash_table_lookup (histograms, name);
+  if (histogram == NULL) {
+    histogram = g_new0 (Histogram, 1);
+    g_hash_table_insert (histograms, g_strdup (name), histogram);
+  }
+  histogram->count++;
+  histogram->max = MAX (histogram->max, (guint64) usecs);
+  histogram->buckets[bucket_for_usecs (usecs)]++;
+  G_UNLOCK (stats);
+}
+
+void
+ppd_stats_record_timing_since (const char *name,
+                               gint64      start_time)
+{
+  ppd_stats_record_timing (name, g_get_monotonic_time () - start_time);
+}
+
+void
+ppd_stats_record_write (gboolean skipped)
+{
+  G_LOCK (stats);
+  if (skipped)
+    sysfs_writes_skipped++;
+  else
+    sysfs_writes++;
+  G_UNLOCK (stats);
+}
+
+GVariant *
+ppd_stats_get_variant (void)
+{
+  GVariantBuilder builder;
+  GVariantBuilder timings;
+
+  g_variant_builder_init (&timings, G_VARIANT_TYPE ("aa{sv}"));
+
+  G_LOCK (stats);
+  if (histograms != NULL) {
+    g_autofree gpointer *names = NULL;
+    guint n_names;
+
+    names = g_hash_table_get_keys_as_array (histograms, &n_names);
+    g_qsort_with_data (names, n_names, sizeof (gpointer),
+                       compare_names, NULL);
+
+    for (guint i = 0; i < n_names; i++) {
+      Histogram *histogram = g_hash_table_lookup (histograms, names[i]);
+      GVariantBuilder entry;
+
+      g_variant_builder_init (&entry, G_VARIANT_TYPE ("a{sv}"));
+      g_variant_builder_add (&entry, "{sv}", "Name",
+                             g_variant_new_string (names[i]));
+      g_variant_builder_add (&entry, "{sv}", "Count",
+                             g_variant_new_uint64 (histogram->count));
+      g_variant_builder_add (&entry, "{sv}", "P50",
+                             g_variant_new_uint64 (histogram_percentile (histogram, 50)));
+      g_variant_builder_add (&entry, "{sv}", "P99",
+                             g_variant_new_uint64 (histogram_percentile (histogram, 99)));
+      g_variant_builder_add (&entry, "{sv}", "Max",
+                             g_variant_new_uint64 (histogram->max));
+      g_variant_builder_add (&timings, "a{sv}", &entry);
+    }
+  }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "SysfsWrites",
+                         g_variant_new_uint64 (sysfs_writes));
+  g_variant_builder_add (&builder, "{sv}", "SysfsWritesSkipped",
+                         g_variant_new_uint64 (sysfs_writes_skipped));
+  G_UNLOCK (stats);
+
+  g_variant_builder_add (&builder, "{sv}", "Timings",
+                         g_variant_builder_end (&timings));
+
+  return g_variant_builder_end (&builder);
+}
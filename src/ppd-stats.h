@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+void ppd_stats_record_timing (const char *name,
+                              gint64      usecs);
+void ppd_stats_record_timing_since (const char *name,
+                                    gint64      start_time);
+void ppd_stats_record_write (gboolean skipped);
+GVariant *ppd_stats_get_variant (void);
@@ -0,0 +1,554 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#define G_LOG_DOMAIN "SysfsMonitor"
+
+#include <glib-unix.h>
+#include <gio/gio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "ppd-sysfs-monitor.h"
+
+/**
+ * SECTION:ppd-sysfs-monitor
+ * @Short_description: Sysfs attribute change notifications
+ * @Title: Sysfs attribute monitor
+ *
+ * GFileMonitor can't be told about sysfs attributes changing, and falls
+ * back to polling them, waking up the daemon even when nothing changes.
+ *
+ * Attributes the kernel calls sysfs_notify() on, created with
+ * %PPD_SYSFS_MONITOR_FLAGS_NOTIFY, wake up poll() with POLLPRI instead,
+ * and are watched that way. Files that can't be polled, such as regular
+ * files, are watched with inotify. All the monitors share a single epoll
+ * file descriptor, and main loop sources, which are only removed from
+ * the main thread.
+ *
+ * Every sysfs attribute accepts POLLPRI, but only those wake it up, so
+ * the others still need polling. They are read less and less often while
+ * they don't change, trading how late a change might be noticed, up to
+ * half a minute, for fewer wakeups. Users call ppd_sysfs_monitor_check()
+ * when something that might have changed them happened, such as a
+ * profile or power source change, to have them read right away.
+ */
+
+/* How often attributes that don't notify are read, in milliseconds,
+ * doubling every time nothing changed */
+#define READ_INTERVAL_MIN 2000
+#define READ_INTERVAL_MAX 32000
+
+struct _PpdSysfsMonitor
+{
+  GObject parent_instance;
+
+  char *path;
+  int fd; /* polled for POLLPRI, or read periodically, or -1 */
+  int wd; /* inotify watch, or -1 */
+  char *contents; /* last read, if read periodically */
+};
+
+enum {
+  CHANGED,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+G_DEFINE_TYPE (PpdSysfsMonitor, ppd_sysfs_monitor, G_TYPE_OBJECT)
+
+/* Monitors can be created from the threads probing drivers, but the
+ * changes are always signalled from the main context */
+typedef struct {
+  int epoll_fd;
+  int inotify_fd; /* or -1, until needed */
+  guint source_id;
+  GSource *read_source; /* or NULL, while nothing is read periodically */
+  guint read_interval;
+  GPtrArray *monitors; /* not owned */
+} Watcher;
+
+G_LOCK_DEFINE_STATIC (watcher);
+static Watcher *watcher = NULL;
+
+static void
+close_fd (int *fd)
+{
+  if (*fd >= 0)
+    close (*fd);
+  *fd = -1;
+}
+
+static void
+watcher_free (void)
+{
+  g_clear_handle_id (&watcher->source_id, g_source_remove);
+  if (watcher->read_source != NULL) {
+    g_source_destroy (watcher->read_source);
+    g_clear_pointer (&watcher->read_source, g_source_unref);
+  }
+  close_fd (&watcher->inotify_fd);
+  close_fd (&watcher->epoll_fd);
+  g_ptr_array_unref (watcher->monitors);
+  g_clear_pointer (&watcher, g_free);
+}
+
+static guint
+monitors_for_wd (int        wd,
+                 GPtrArray *monitors)
+{
+  guint n = 0;
+
+  for (guint i = 0; i < watcher->monitors->len; i++) {
+    PpdSysfsMonitor *monitor = g_ptr_array_index (watcher->monitors, i);
+
+    if (monitor->wd != wd)
+      continue;
+    if (monitors != NULL)
+      g_ptr_array_add (monitors, g_object_ref (monitor));
+    n++;
+  }
+
+  return n;
+}
+
+static void
+read_inotify_events (GPtrArray *changed)
+{
+  char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  ssize_t len;
+
+  while ((len = read (watcher->inotify_fd, buf, sizeof (buf))) > 0) {
+    for (char *ptr = buf; ptr < buf + len;) {
+      const struct inotify_event *event = (const struct inotify_event *) ptr;
+
+      if (event->mask & IN_CLOSE_WRITE)
+        monitors_for_wd (event->wd, changed);
+      ptr += sizeof (struct inotify_event) + event->len;
+    }
+  }
+}
+
+static gboolean
+watcher_dispatch (gint         fd,
+                  GIOCondition condition,
+                  gpointer     user_data)
+{
+  struct epoll_event events[16];
+  g_autoptr(GPtrArray) changed = NULL;
+  int n;
+
+  changed = g_ptr_array_new_with_free_func (g_object_unref);
+
+  /* Under the lock, so that no monitor in the events goes away */
+  G_LOCK (watcher);
+  n = epoll_wait (fd, events, G_N_ELEMENTS (events), 0);
+  if (n < 0) {
+    int errsv = errno;
+
+    G_UNLOCK (watcher);
+    if (errsv != EINTR)
+      g_warning ("Failed to wait for sysfs changes: %s", g_strerror (errsv));
+    return G_SOURCE_CONTINUE;
+  }
+
+  for (int i = 0; i < n; i++) {
+    PpdSysfsMonitor *monitor = events[i].data.ptr;
+    char c;
+
+    if (monitor == NULL) {
+      read_inotify_events (changed);
+      continue;
+    }
+
+    /* The attribute needs reading from the start to be polled again */
+    if (pread (monitor->fd, &c, 1, 0) < 0)
+      g_debug ("Failed to read '%s': %s", monitor->path, g_strerror (errno));
+    g_ptr_array_add (changed, g_object_ref (monitor));
+  }
+  G_UNLOCK (watcher);
+
+  for (guint i = 0; i < changed->len; i++) {
+    PpdSysfsMonitor *monitor = g_ptr_array_index (changed, i);
+
+    g_debug ("'%s' changed", monitor->path);
+    g_signal_emit (G_OBJECT (monitor), signals[CHANGED], 0);
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static char *
+read_contents (PpdSysfsMonitor *monitor)
+{
+  char buf[4096];
+  ssize_t len;
+
+  len = pread (monitor->fd, buf, sizeof (buf) - 1, 0);
+  if (len < 0) {
+    g_debug ("Failed to read '%s': %s", monitor->path, g_strerror (errno));
+    return NULL;
+  }
+  buf[len] = '\0';
+
+  return g_strdup (buf);
+}
+
+static gboolean
+watcher_read (gpointer user_data)
+{
+  g_autoptr(GPtrArray) changed = NULL;
+  gboolean reading = FALSE;
+
+  changed = g_ptr_array_new_with_free_func (g_object_unref);
+
+  G_LOCK (watcher);
+  for (guint i = 0; i < watcher->monitors->len; i++) {
+    PpdSysfsMonitor *monitor = g_ptr_array_index (watcher->monitors, i);
+    g_autofree char *contents = NULL;
+
+    if (monitor->contents == NULL)
+      continue;
+    reading = TRUE;
+
+    contents = read_contents (monitor);
+    if (contents == NULL || g_str_equal (contents, monitor->contents))
+      continue;
+    g_free (monitor->contents);
+    monitor->contents = g_steal_pointer (&contents);
+    g_ptr_array_add (changed, g_object_ref (monitor));
+  }
+  if (reading) {
+    if (changed->len > 0)
+      watcher->read_interval = READ_INTERVAL_MIN;
+    else
+      watcher->read_interval = MIN (watcher->read_interval * 2, READ_INTERVAL_MAX);
+    g_source_set_ready_time (watcher->read_source, g_get_monotonic_time () +
+                             watcher->read_interval * G_TIME_SPAN_MILLISECOND);
+  } else {
+    g_clear_pointer (&watcher->read_source, g_source_unref);
+  }
+  G_UNLOCK (watcher);
+
+  for (guint i = 0; i < changed->len; i++) {
+    PpdSysfsMonitor *monitor = g_ptr_array_index (changed, i);
+
+    g_debug ("'%s' changed", monitor->path);
+    g_signal_emit (G_OBJECT (monitor), signals[CHANGED], 0);
+  }
+
+  return reading ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static gboolean
+read_source_dispatch (GSource     *source,
+                      GSourceFunc  callback,
+                      gpointer     user_data)
+{
+  return callback (user_data);
+}
+
+static GSourceFuncs read_source_funcs = {
+  NULL,
+  NULL,
+  read_source_dispatch,
+  NULL,
+};
+
+/* Unlike a timeout, the next read can be moved from any thread */
+static void
+watcher_start_reading (void)
+{
+  gint64 ready_time;
+
+  ready_time = g_get_monotonic_time () + READ_INTERVAL_MIN * G_TIME_SPAN_MILLISECOND;
+  watcher->read_interval = READ_INTERVAL_MIN;
+  if (watcher->read_source != NULL) {
+    g_source_set_ready_time (watcher->read_source, ready_time);
+    return;
+  }
+
+  watcher->read_source = g_source_new (&read_source_funcs, sizeof (GSource));
+  g_source_set_callback (watcher->read_source, watcher_read, NULL, NULL);
+  g_source_set_ready_time (watcher->read_source, ready_time);
+  g_source_attach (watcher->read_source, NULL);
+}
+
+static Watcher *
+watcher_get (GError **error)
+{
+  g_autoptr(GSource) source = NULL;
+  int epoll_fd;
+
+  if (watcher != NULL)
+    return watcher;
+
+  epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                 "Failed to create epoll instance: %s", g_strerror (errno));
+    return NULL;
+  }
+
+  watcher = g_new0 (Watcher, 1);
+  watcher->epoll_fd = epoll_fd;
+  watcher->inotify_fd = -1;
+  watcher->monitors = g_ptr_array_new ();
+  source = g_unix_fd_source_new (epoll_fd, G_IO_IN);
+  g_source_set_callback (source, (GSourceFunc) watcher_dispatch, NULL, NULL);
+  watcher->source_id = g_source_attach (source, NULL);
+
+  return watcher;
+}
+
+static gboolean
+watcher_add_inotify (PpdSysfsMonitor  *monitor,
+                     GError          **error)
+{
+  if (watcher->inotify_fd < 0) {
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    int fd;
+
+    fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Failed to create inotify instance: %s", g_strerror (errno));
+      return FALSE;
+    }
+    if (epoll_ctl (watcher->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Failed to watch inotify instance: %s", g_strerror (errno));
+      close (fd);
+      return FALSE;
+    }
+    watcher->inotify_fd = fd;
+  }
+
+  monitor->wd = inotify_add_watch (watcher->inotify_fd, monitor->path, IN_CLOSE_WRITE);
+  if (monitor->wd < 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                 "Failed to watch '%s': %s", monitor->path, g_strerror (errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+watcher_add_locked (PpdSysfsMonitor       *monitor,
+                    PpdSysfsMonitorFlags   flags,
+                    GError               **error)
+{
+  struct epoll_event event = { .events = EPOLLPRI, .data.ptr = monitor };
+  char c;
+
+  if (watcher_get (error) == NULL)
+    return FALSE;
+
+  monitor->fd = open (monitor->path, O_RDONLY | O_CLOEXEC);
+  if (monitor->fd < 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                 "Failed to open '%s': %s", monitor->path, g_strerror (errno));
+    return FALSE;
+  }
+
+  /* Regular files can't be polled */
+  if (epoll_ctl (watcher->epoll_fd, EPOLL_CTL_ADD, monitor->fd, &event) == 0) {
+    if (flags & PPD_SYSFS_MONITOR_FLAGS_NOTIFY) {
+      if (pread (monitor->fd, &c, 1, 0) < 0)
+        g_debug ("Failed to read '%s': %s", monitor->path, g_strerror (errno));
+      g_debug ("Polling '%s' for changes", monitor->path);
+    } else {
+      epoll_ctl (watcher->epoll_fd, EPOLL_CTL_DEL, monitor->fd, NULL);
+      monitor->contents = read_contents (monitor);
+      if (monitor->contents == NULL)
+        monitor->contents = g_strdup ("");
+      watcher_start_reading ();
+      g_debug ("Reading '%s' periodically for changes", monitor->path);
+    }
+  } else {
+    close_fd (&monitor->fd);
+    if (!watcher_add_inotify (monitor, error))
+      return FALSE;
+    g_debug ("Watching '%s' for changes with inotify", monitor->path);
+  }
+
+  g_ptr_array_add (watcher->monitors, monitor);
+  return TRUE;
+}
+
+static gboolean
+watcher_add (PpdSysfsMonitor       *monitor,
+             PpdSysfsMonitorFlags   flags,
+             GError               **error)
+{
+  gboolean ret;
+
+  G_LOCK (watcher);
+  ret = watcher_add_locked (monitor, flags, error);
+  G_UNLOCK (watcher);
+
+  return ret;
+}
+
+static gboolean
+watcher_free_idle (gpointer user_data)
+{
+  G_LOCK (watcher);
+  if (watcher != NULL && watcher->monitors->len == 0)
+    watcher_free ();
+  G_UNLOCK (watcher);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+watcher_remove_locked (PpdSysfsMonitor *monitor)
+{
+  if (watcher == NULL || !g_ptr_array_remove (watcher->monitors, monitor))
+    return;
+
+  if (monitor->fd >= 0) {
+    epoll_ctl (watcher->epoll_fd, EPOLL_CTL_DEL, monitor->fd, NULL);
+    close_fd (&monitor->fd);
+  }
+
+  if (monitor->wd >= 0) {
+    /* Watches on the same file share a descriptor */
+    if (monitors_for_wd (monitor->wd, NULL) == 0)
+      inotify_rm_watch (watcher->inotify_fd, monitor->wd);
+    monitor->wd = -1;
+  }
+
+  g_clear_pointer (&monitor->contents, g_free);
+
+  if (watcher->monitors->len > 0)
+    return;
+
+  /* The sources are only removed from the thread running the main
+   * loop, such as when it's stopping, or from an idle on it */
+  if (g_main_context_acquire (NULL)) {
+    watcher_free ();
+    g_main_context_release (NULL);
+  } else {
+    g_idle_add (watcher_free_idle, NULL);
+  }
+}
+
+static void
+watcher_remove (PpdSysfsMonitor *monitor)
+{
+  G_LOCK (watcher);
+  watcher_remove_locked (monitor);
+  G_UNLOCK (watcher);
+}
+
+PpdSysfsMonitor *
+ppd_sysfs_monitor_new (const char            *path,
+                       PpdSysfsMonitorFlags   flags,
+                       GError               **error)
+{
+  g_autoptr(PpdSysfsMonitor) monitor = NULL;
+
+  g_return_val_if_fail (path != NULL, NULL);
+
+  monitor = g_object_new (PPD_TYPE_SYSFS_MONITOR, NULL);
+  monitor->path = g_strdup (path);
+  if (!watcher_add (monitor, flags, error))
+    return NULL;
+
+  return g_steal_pointer (&monitor);
+}
+
+const char *
+ppd_sysfs_monitor_get_path (PpdSysfsMonitor *monitor)
+{
+  g_return_val_if_fail (PPD_IS_SYSFS_MONITOR (monitor), NULL);
+
+  return monitor->path;
+}
+
+/**
+ * ppd_sysfs_monitor_check:
+ * @monitor: a #PpdSysfsMonitor
+ *
+ * Reads the attribute again as soon as possible, if it is read
+ * periodically, and goes back to reading it often. Can be called from
+ * any thread, #PpdSysfsMonitor::changed is still emitted from the main
+ * context.
+ */
+void
+ppd_sysfs_monitor_check (PpdSysfsMonitor *monitor)
+{
+  g_return_if_fail (PPD_IS_SYSFS_MONITOR (monitor));
+
+  G_LOCK (watcher);
+  if (monitor->contents != NULL && watcher->read_source != NULL) {
+    watcher->read_interval = READ_INTERVAL_MIN;
+    g_source_set_ready_time (watcher->read_source, 0);
+  }
+  G_UNLOCK (watcher);
+}
+
+/* Stops watching in dispose, as the watcher might still take a
+ * reference to signal a change */
+static void
+ppd_sysfs_monitor_dispose (GObject *object)
+{
+  PpdSysfsMonitor *monitor = PPD_SYSFS_MONITOR (object);
+
+  watcher_remove (monitor);
+  close_fd (&monitor->fd);
+  G_OBJECT_CLASS (ppd_sysfs_monitor_parent_class)->dispose (object);
+}
+
+static void
+ppd_sysfs_monitor_finalize (GObject *object)
+{
+  PpdSysfsMonitor *monitor = PPD_SYSFS_MONITOR (object);
+
+  g_clear_pointer (&monitor->path, g_free);
+  g_clear_pointer (&monitor->contents, g_free);
+  G_OBJECT_CLASS (ppd_sysfs_monitor_parent_class)->finalize (object);
+}
+
+static void
+ppd_sysfs_monitor_class_init (PpdSysfsMonitorClass *klass)
+{
+  GObjectClass *object_class;
+
+  object_class = G_OBJECT_CLASS (klass);
+  object_class->dispose = ppd_sysfs_monitor_dispose;
+  object_class->finalize = ppd_sysfs_monitor_finalize;
+
+  /**
+   * PpdSysfsMonitor::changed:
+   *
+   * Emitted when the attribute changed, or might have.
+   */
+  signals[CHANGED] = g_signal_new ("changed",
+                                   G_TYPE_FROM_CLASS (klass),
+                                   G_SIGNAL_RUN_LAST,
+                                   0,
+                                   NULL,
+                                   NULL,
+                                   g_cclosure_marshal_generic,
+                                   G_TYPE_NONE,
+                                   0);
+}
+
+static void
+ppd_sysfs_monitor_init (PpdSysfsMonitor *monitor)
+{
+  monitor->fd = -1;
+  monitor->wd = -1;
+}
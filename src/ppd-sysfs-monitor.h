@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+/**
+ * PpdSysfsMonitorFlags:
+ * @PPD_SYSFS_MONITOR_FLAGS_NONE: No flags.
+ * @PPD_SYSFS_MONITOR_FLAGS_NOTIFY: the kernel calls sysfs_notify() when
+ *   the attribute changes, so it doesn't need reading periodically, or
+ *   checking with ppd_sysfs_monitor_check().
+ */
+typedef enum {
+  PPD_SYSFS_MONITOR_FLAGS_NONE   = 0,
+  PPD_SYSFS_MONITOR_FLAGS_NOTIFY = 1 << 0,
+} PpdSysfsMonitorFlags;
+
+#define PPD_TYPE_SYSFS_MONITOR (ppd_sysfs_monitor_get_type())
+G_DECLARE_FINAL_TYPE (PpdSysfsMonitor, ppd_sysfs_monitor, PPD, SYSFS_MONITOR, GObject)
+
+PpdSysfsMonitor *ppd_sysfs_monitor_new (const char            *path,
+                                        PpdSysfsMonitorFlags   flags,
+                                        GError               **error);
+const char *ppd_sysfs_monitor_get_path (PpdSysfsMonitor *monitor);
+void ppd_sysfs_monitor_check (PpdSysfsMonitor *monitor);
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#define G_LOG_DOMAIN "Trace"
+
+#include "config.h"
+
+#include <string.h>
+
+#include "ppd-trace.h"
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PPD_PROBE(name, ...) STAP_PROBEV (power_profiles_daemon, name, __VA_ARGS__)
+#else
+#define PPD_PROBE(name, ...) G_STMT_START { } G_STMT_END
+#endif
+
+/* The last transitions are kept in a ring buffer of fixed size entries,
+ * so that tracing doesn't allocate, and can always be left on. Writes
+ * done while a transition is in flight are accounted to it. */
+#define N_TRANSITIONS 32
+#define PATH_LEN 128
+
+typedef struct {
+  guint64 id;
+  gint64 start_time; /* wall clock */
+  gint64 start_monotonic;
+  gint64 duration;
+  PpdProfile from;
+  PpdProfile to;
+  const char *reason;
+  PpdTraceResult result;
+  guint n_writes;
+  guint n_failed_writes;
+  gint64 slowest_write_usecs;
+  char slowest_write[PATH_LEN];
+  int failed_errno;
+  char failed_write[PATH_LEN];
+} TraceTransition;
+
+G_LOCK_DEFINE_STATIC (trace);
+static TraceTransition transitions[N_TRANSITIONS];
+static guint64 n_transitions = 0;
+
+static TraceTransition *
+current_transition_locked (void)
+{
+  TraceTransition *transition;
+
+  if (n_transitions == 0)
+    return NULL;
+
+  transition = &transitions[(n_transitions - 1) % N_TRANSITIONS];
+  if (transition->result != PPD_TRACE_RESULT_IN_PROGRESS)
+    return NULL;
+
+  return transition;
+}
+
+static const char *
+result_to_str (PpdTraceResult result)
+{
+  switch (result) {
+  case PPD_TRACE_RESULT_IN_PROGRESS:
+    return "in-progress";
+  case PPD_TRACE_RESULT_COMPLETED:
+    return "completed";
+  case PPD_TRACE_RESULT_FAILED:
+    return "failed";
+  case PPD_TRACE_RESULT_TIMED_OUT:
+    return "timed-out";
+  default:
+    g_assert_not_reached ();
+  }
+}
+
+void
+ppd_trace_transition_begin (PpdProfile  from,
+                            PpdProfile  to,
+                            const char *reason)
+{
+  TraceTransition *transition;
+
+  PPD_PROBE (transition__start, ppd_profile_to_str (from), ppd_profile_to_str (to), reason);
+
+  G_LOCK (trace);
+  transition = &transitions[n_transitions % N_TRANSITIONS];
+  memset (transition, 0, sizeof (*transition));
+  transition->id = ++n_transitions;
+  transition->start_time = g_get_real_time ();
+  transition->start_monotonic = g_get_monotonic_time ();
+  transition->from = from;
+  transition->to = to;
+  transition->reason = reason;
+  transition->result = PPD_TRACE_RESULT_IN_PROGRESS;
+  G_UNLOCK (trace);
+}
+
+void
+ppd_trace_transition_end (PpdTraceResult result)
+{
+  TraceTransition *transition;
+
+  g_return_if_fail (result != PPD_TRACE_RESULT_IN_PROGRESS);
+
+  G_LOCK (trace);
+  transition = current_transition_locked ();
+  if (transition != NULL) {
+    transition->duration = g_get_monotonic_time () - transition->start_monotonic;
+    transition->result = result;
+    PPD_PROBE (transition__end, ppd_profile_to_str (transition->to),
+               result_to_str (result), transition->duration);
+  }
+  G_UNLOCK (trace);
+}
+
+/* Called from the worker threads */
+void
+ppd_trace_write (const char *filename,
+                 const char *value,
+                 gint64      usecs,
+                 int         errnum)
+{
+  TraceTransition *transition;
+
+  PPD_PROBE (sysfs__write, filename, value, usecs, errnum);
+
+  G_LOCK (trace);
+  transition = current_transition_locked ();
+  if (transition != NULL) {
+    transition->n_writes++;
+    if (transition->slowest_write[0] == '\0' ||
+        usecs > transition->slowest_write_usecs) {
+      transition->slowest_write_usecs = usecs;
+      g_strlcpy (transition->slowest_write, filename, PATH_LEN);
+    }
+    if (errnum != 0) {
+      transition->n_failed_writes++;
+      transition->failed_errno = errnum;
+      g_strlcpy (transition->failed_write, filename, PATH_LEN);
+    }
+  }
+  G_UNLOCK (trace);
+}
+
+void
+ppd_trace_hold_added (guint       cookie,
+                      PpdProfile  profile,
+                      const char *application_id)
+{
+  PPD_PROBE (hold__add, cookie, ppd_profile_to_str (profile), application_id);
+}
+
+void
+ppd_trace_hold_removed (guint      cookie,
+                        PpdProfile profile)
+{
+  PPD_PROBE (hold__remove, cookie, ppd_profile_to_str (profile));
+}
+
+GVariant *
+ppd_trace_get_variant (void)
+{
+  GVariantBuilder builder;
+  guint64 first;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+
+  G_LOCK (trace);
+  first = n_transitions > N_TRANSITIONS ? n_transitions - N_TRANSITIONS : 0;
+  for (guint64 i = first; i < n_transitions; i++) {
+    TraceTransition *transition = &transitions[i % N_TRANSITIONS];
+    GVariantBuilder entry;
+
+    g_variant_builder_init (&entry, G_VARIANT_TYPE ("a{sv}"));
+    g_variant_builder_add (&entry, "{sv}", "Id",
+                           g_variant_new_uint64 (transition->id));
+    g_variant_builder_add (&entry, "{sv}", "StartTime",
+                           g_variant_new_int64 (transition->start_time));
+    g_variant_builder_add (&entry, "{sv}", "Duration",
+                           g_variant_new_int64 (transition->duration));
+    g_variant_builder_add (&entry, "{sv}", "From",
+                           g_variant_new_string (ppd_profile_to_str (transition->from)));
+    g_variant_builder_add (&entry, "{sv}", "To",
+                           g_variant_new_string (ppd_profile_to_str (transition->to)));
+    g_variant_builder_add (&entry, "{sv}", "Reason",
+                           g_variant_new_string (transition->reason));
+    g_variant_builder_add (&entry, "{sv}", "Result",
+                           g_variant_new_string (result_to_str (transition->result)));
+    g_variant_builder_add (&entry, "{sv}", "Writes",
+                           g_variant_new_uint32 (transition->n_writes));
+    g_variant_builder_add (&entry, "{sv}", "FailedWrites",
+                           g_variant_new_uint32 (transition->n_failed_writes));
+    if (transition->n_writes > 0) {
+      g_variant_builder_add (&entry, "{sv}", "SlowestWrite",
+                             g_variant_new_string (transition->slowest_write));
+      g_variant_builder_add (&entry, "{sv}", "SlowestWriteDuration",
+                             g_variant_new_int64 (transition->slowest_write_usecs));
+    }
+    if (transition->n_failed_writes > 0) {
+      g_variant_builder_add (&entry, "{sv}", "FailedWrite",
+                             g_variant_new_string (transition->failed_write));
+      g_variant_builder_add (&entry, "{sv}", "FailedWriteError",
+                             g_variant_new_string (g_strerror (transition->failed_errno)));
+    }
+    g_variant_builder_add (&builder, "a{sv}", &entry);
+  }
+  G_UNLOCK (trace);
+
+  return g_variant_builder_end (&builder);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include "ppd-profile.h"
+
+typedef enum {
+  PPD_TRACE_RESULT_IN_PROGRESS,
+  PPD_TRACE_RESULT_COMPLETED,
+  PPD_TRACE_RESULT_FAILED,
+  PPD_TRACE_RESULT_TIMED_OUT,
+} PpdTraceResult;
+
+void ppd_trace_transition_begin (PpdProfile  from,
+                                 PpdProfile  to,
+                                 const char *reason);
+void ppd_trace_transition_end (PpdTraceResult result);
+void ppd_trace_write (const char *filename,
+                      const char *value,
+                      gint64      usecs,
+                      int         errnum);
+void ppd_trace_hold_added (guint       cookie,
+                           PpdProfile  profile,
+                           const char *application_id);
+void ppd_trace_hold_removed (guint      cookie,
+                             PpdProfile profile);
+GVariant *ppd_trace_get_variant (void);
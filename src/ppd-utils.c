@@ -10,13 +10,21 @@
 #define G_LOG_DOMAIN "Utils"
 
 #include "ppd-utils.h"
+#include "ppd-stats.h"
+#include "ppd-trace.h"
 #include <glib/gstdio.h>
 #include <gio/gio.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #define PROC_CPUINFO_PATH      "/proc/cpuinfo"
+#define CPU_DIR                "/sys/devices/system/cpu/"
+#define CPUFREQ_DIR            "/sys/devices/system/cpu/cpufreq/"
+#define CGROUP_DIR             "/sys/fs/cgroup"
 
 char *
 ppd_utils_get_sysfs_path (const char *filename)
@@ -30,6 +38,245 @@ ppd_utils_get_sysfs_path (const char *filename)
   return g_build_filename (root, filename, NULL);
 }
 
+static gboolean
+write_fd (int          fd,
+          const char  *filename,
+          const char  *value,
+          GError     **error)
+{
+  gint64 start_time = g_get_monotonic_time ();
+  size_t size;
+  size_t offset = 0;
+
+  size = strlen (value);
+  while (size) {
+    ssize_t written = pwrite (fd, value + offset, size, offset);
+
+    if (written == -1) {
+      int errsv = errno;
+
+      ppd_trace_write (filename, value, g_get_monotonic_time () - start_time, errsv);
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Error writing '%s': %s", filename, g_strerror (errsv));
+      g_debug ("Error writing '%s': %s", filename, g_strerror (errsv));
+      return FALSE;
+    }
+
+    g_return_val_if_fail (written <= size, FALSE);
+    size -= written;
+    offset += written;
+  }
+
+  ppd_trace_write (filename, value, g_get_monotonic_time () - start_time, 0);
+  return TRUE;
+}
+
+/* While a journal is active, the first write to every file records the
+ * value it held before, so that a profile transition spanning several
+ * drivers and actions can be undone by writing those back in reverse.
+ *
+ * Files restored by a rollback are remembered, and later writes of that
+ * same value skipped, so drivers and actions can be told about the
+ * restored profile without touching the hardware a second time. */
+typedef struct {
+  char     *filename;
+  char     *value;
+  gboolean  cached;
+} JournalEntry;
+
+struct _PpdJournal {
+  GPtrArray  *entries;
+  GHashTable *recorded;
+  GHashTable *restored;
+  gboolean    replaying;
+};
+
+/* Protects the contents of journals, the parallel workers of a
+ * transition share its journal */
+G_LOCK_DEFINE_STATIC (journal);
+/* Writes are only recorded in the journal of the thread making them, so
+ * that those done from the main loop in the middle of a transition
+ * aren't rolled back with it */
+static GPrivate thread_journal = G_PRIVATE_INIT (NULL);
+
+static void
+journal_entry_free (JournalEntry *entry)
+{
+  g_free (entry->filename);
+  g_free (entry->value);
+  g_free (entry);
+}
+
+/* Returns %FALSE if the write can be skipped */
+static gboolean
+journal_prepare_write (const char *filename,
+                       const char *value,
+                       const char *known_value,
+                       gboolean    cached)
+{
+  PpdJournal *journal;
+  const char *restored;
+  char *prior = NULL;
+
+  journal = g_private_get (&thread_journal);
+  if (journal == NULL)
+    return TRUE;
+
+  G_LOCK (journal);
+  if (journal->replaying) {
+    G_UNLOCK (journal);
+    return TRUE;
+  }
+
+  restored = g_hash_table_lookup (journal->restored, filename);
+  if (restored != NULL) {
+    if (g_strcmp0 (restored, value) == 0) {
+      G_UNLOCK (journal);
+      g_debug ("Not writing '%s' to '%s', already restored", value, filename);
+      return FALSE;
+    }
+    g_hash_table_remove (journal->restored, filename);
+  }
+
+  if (!g_hash_table_contains (journal->recorded, filename)) {
+    if (known_value != NULL)
+      prior = g_strdup (known_value);
+    else if (g_file_get_contents (filename, &prior, NULL, NULL))
+      g_strchomp (prior);
+    else
+      g_debug ("Could not read '%s', it won't be rolled back", filename);
+  }
+
+  if (prior != NULL) {
+    JournalEntry *entry;
+
+    entry = g_new0 (JournalEntry, 1);
+    entry->filename = g_strdup (filename);
+    entry->value = prior;
+    entry->cached = cached;
+    g_ptr_array_add (journal->entries, entry);
+    g_hash_table_add (journal->recorded, g_strdup (filename));
+  }
+  G_UNLOCK (journal);
+
+  return TRUE;
+}
+
+PpdJournal *
+ppd_journal_new (void)
+{
+  PpdJournal *journal;
+
+  journal = g_new0 (PpdJournal, 1);
+  journal->entries = g_ptr_array_new_with_free_func ((GDestroyNotify) journal_entry_free);
+  journal->recorded = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  journal->restored = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  return journal;
+}
+
+/* Records the writes of the calling thread in @journal, until
+ * ppd_utils_journal_end() is called with the returned journal */
+PpdJournal *
+ppd_utils_journal_begin (PpdJournal *journal)
+{
+  PpdJournal *previous;
+
+  previous = g_private_get (&thread_journal);
+  g_private_set (&thread_journal, journal);
+
+  return previous;
+}
+
+void
+ppd_utils_journal_end (PpdJournal *previous)
+{
+  g_private_set (&thread_journal, previous);
+}
+
+PpdJournal *
+ppd_utils_journal_get_thread_default (void)
+{
+  return g_private_get (&thread_journal);
+}
+
+void
+ppd_journal_free (PpdJournal *journal)
+{
+  if (journal == NULL)
+    return;
+
+  g_ptr_array_unref (journal->entries);
+  g_hash_table_destroy (journal->recorded);
+  g_hash_table_destroy (journal->restored);
+  g_free (journal);
+}
+
+guint
+ppd_journal_get_length (PpdJournal *journal)
+{
+  guint len;
+
+  g_return_val_if_fail (journal != NULL, 0);
+
+  G_LOCK (journal);
+  len = journal->entries->len;
+  G_UNLOCK (journal);
+
+  return len;
+}
+
+/* Writes back the prior values recorded after @savepoint, most recent
+ * first. Every file is tried, and the first failure returned. */
+gboolean
+ppd_journal_rollback (PpdJournal  *journal,
+                      guint        savepoint,
+                      GError     **error)
+{
+  g_autoptr(GPtrArray) entries = NULL;
+  gboolean ret = TRUE;
+
+  g_return_val_if_fail (journal != NULL, FALSE);
+
+  entries = g_ptr_array_new_with_free_func ((GDestroyNotify) journal_entry_free);
+
+  G_LOCK (journal);
+  while (journal->entries->len > savepoint) {
+    JournalEntry *entry;
+
+    entry = g_ptr_array_steal_index (journal->entries, journal->entries->len - 1);
+    g_hash_table_remove (journal->recorded, entry->filename);
+    g_hash_table_insert (journal->restored,
+                         g_strdup (entry->filename), g_strdup (entry->value));
+    g_ptr_array_add (entries, entry);
+  }
+  journal->replaying = TRUE;
+  G_UNLOCK (journal);
+
+  for (guint i = 0; i < entries->len; i++) {
+    JournalEntry *entry = g_ptr_array_index (entries, i);
+    g_autoptr(GError) local_error = NULL;
+    gboolean written;
+
+    g_debug ("Rolling back '%s' to '%s'", entry->filename, entry->value);
+    if (entry->cached)
+      written = ppd_utils_write_cached (entry->filename, entry->value, &local_error);
+    else
+      written = ppd_utils_write (entry->filename, entry->value, &local_error);
+
+    if (!written && ret) {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      ret = FALSE;
+    }
+  }
+
+  G_LOCK (journal);
+  journal->replaying = FALSE;
+  G_UNLOCK (journal);
+
+  return ret;
+}
+
 gboolean
 ppd_utils_write (const char  *filename,
                  const char  *value,
@@ -39,37 +286,442 @@ ppd_utils_write (const char  *filename,
   g_autofd
 #endif
   int fd = -1;
-  size_t size;
+  gboolean ret;
 
   g_return_val_if_fail (filename, FALSE);
   g_return_val_if_fail (value, FALSE);
 
+  if (!journal_prepare_write (filename, value, NULL, FALSE))
+    return TRUE;
+
   g_debug ("Writing '%s' to '%s'", value, filename);
 
   fd = g_open (filename, O_WRONLY | O_TRUNC | O_SYNC);
   if (fd == -1) {
-    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+    int errsv = errno;
+
+    ppd_trace_write (filename, value, 0, errsv);
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
                  "Could not open '%s' for writing", filename);
     g_debug ("Could not open for writing '%s'", filename);
     return FALSE;
   }
 
-  size = strlen (value);
-  while (size) {
-    ssize_t written = write (fd, value, size);
-
-    if (written == -1) {
-      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
-                   "Error writing '%s': %s", filename, g_strerror (errno));
-      g_debug ("Error writing '%s': %s", filename, g_strerror (errno));
+  ret = write_fd (fd, filename, value, error);
+  ppd_stats_record_write (FALSE);
 #if !GLIB_CHECK_VERSION (2, 76, 0)
-      g_close (fd, NULL);
+  g_close (fd, NULL);
 #endif
+
+  return ret;
+}
+
+/* The write cache keeps one file descriptor open per sysfs attribute,
+ * along with the last value successfully written to it, so that
+ * re-applying a profile does not re-open every attribute, and skips
+ * the attributes that already have the expected value. Only the most
+ * recently written attributes are kept, so that large machines don't
+ * pin thousands of descriptors.
+ *
+ * Entries are reference counted, as writes can happen from the worker
+ * threads of ppd_utils_foreach_parallel() while the main thread
+ * invalidates the cache. */
+#define WRITE_CACHE_MAX_ENTRIES 512
+/* Longer values are still written, but not cached */
+#define WRITE_CACHE_VALUE_SIZE 64
+
+typedef struct {
+  int    fd;
+  char   value[WRITE_CACHE_VALUE_SIZE]; /* empty while unknown, protected
+                                         * by the write_cache lock */
+  char  *filename;
+  GList  lru_link; /* in write_cache_lru, while in write_cache */
+} WriteCacheEntry;
+
+G_LOCK_DEFINE_STATIC (write_cache);
+static GHashTable *write_cache = NULL;
+static GQueue write_cache_lru = G_QUEUE_INIT; /* most recently used first */
+
+static void
+write_cache_entry_clear (WriteCacheEntry *entry)
+{
+  if (entry->fd >= 0)
+    g_close (entry->fd, NULL);
+  g_free (entry->filename);
+}
+
+static void
+write_cache_entry_unref (WriteCacheEntry *entry)
+{
+  g_atomic_rc_box_release_full (entry, (GDestroyNotify) write_cache_entry_clear);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (WriteCacheEntry, write_cache_entry_unref)
+
+/* @value is set to a copy of the last value written, as other threads
+ * can change it */
+static WriteCacheEntry *
+write_cache_lookup (const char *filename,
+                    char        value[WRITE_CACHE_VALUE_SIZE])
+{
+  WriteCacheEntry *entry = NULL;
+
+  G_LOCK (write_cache);
+  if (write_cache != NULL)
+    entry = g_hash_table_lookup (write_cache, filename);
+  if (entry != NULL) {
+    g_queue_unlink (&write_cache_lru, &entry->lru_link);
+    g_queue_push_head_link (&write_cache_lru, &entry->lru_link);
+    g_atomic_rc_box_acquire (entry);
+    memcpy (value, entry->value, WRITE_CACHE_VALUE_SIZE);
+  }
+  G_UNLOCK (write_cache);
+
+  return entry;
+}
+
+/* Called with the write_cache lock held */
+static void
+write_cache_remove_locked (WriteCacheEntry *entry)
+{
+  g_queue_unlink (&write_cache_lru, &entry->lru_link);
+  g_hash_table_remove (write_cache, entry->filename);
+}
+
+/* Returns the entry now cached for the file, which is an existing one
+ * if another thread opened it in the meantime */
+static WriteCacheEntry *
+write_cache_insert (WriteCacheEntry *entry)
+{
+  WriteCacheEntry *cached;
+
+  G_LOCK (write_cache);
+  if (write_cache == NULL)
+    write_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         NULL, (GDestroyNotify) write_cache_entry_unref);
+  cached = g_hash_table_lookup (write_cache, entry->filename);
+  if (cached != NULL) {
+    g_atomic_rc_box_acquire (cached);
+    G_UNLOCK (write_cache);
+    return cached;
+  }
+
+  g_hash_table_insert (write_cache, entry->filename,
+                       g_atomic_rc_box_acquire (entry));
+  entry->lru_link.data = entry;
+  g_queue_push_head_link (&write_cache_lru, &entry->lru_link);
+
+  /* Evicted entries close their descriptor once the last writer using
+   * them is done */
+  while (write_cache_lru.length > WRITE_CACHE_MAX_ENTRIES)
+    write_cache_remove_locked (g_queue_peek_tail (&write_cache_lru));
+  G_UNLOCK (write_cache);
+
+  return g_atomic_rc_box_acquire (entry);
+}
+
+static void
+write_cache_remove (WriteCacheEntry *entry)
+{
+  G_LOCK (write_cache);
+  if (write_cache != NULL &&
+      g_hash_table_lookup (write_cache, entry->filename) == entry)
+    write_cache_remove_locked (entry);
+  G_UNLOCK (write_cache);
+}
+
+static void
+write_cache_entry_set_value (WriteCacheEntry *entry,
+                             const char      *value)
+{
+  G_LOCK (write_cache);
+  if (g_strlcpy (entry->value, value, WRITE_CACHE_VALUE_SIZE) >= WRITE_CACHE_VALUE_SIZE)
+    entry->value[0] = '\0';
+  G_UNLOCK (write_cache);
+}
+
+gboolean
+ppd_utils_write_cached (const char  *filename,
+                        const char  *value,
+                        GError     **error)
+{
+  g_autoptr(WriteCacheEntry) entry = NULL;
+  char cached_value[WRITE_CACHE_VALUE_SIZE] = "";
+
+  g_return_val_if_fail (filename, FALSE);
+  g_return_val_if_fail (value, FALSE);
+
+  entry = write_cache_lookup (filename, cached_value);
+  if (entry != NULL && *cached_value != '\0' && g_str_equal (cached_value, value)) {
+    g_debug ("Not writing '%s' to '%s', already set", value, filename);
+    ppd_stats_record_write (TRUE);
+    return TRUE;
+  }
+
+  if (!journal_prepare_write (filename, value,
+                              *cached_value != '\0' ? cached_value : NULL, TRUE))
+    return TRUE;
+
+  if (entry == NULL) {
+    g_autoptr(WriteCacheEntry) new_entry = NULL;
+    int fd;
+
+    fd = g_open (filename, O_WRONLY | O_SYNC);
+    if (fd == -1) {
+      int errsv = errno;
+
+      ppd_trace_write (filename, value, 0, errsv);
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Could not open '%s' for writing", filename);
+      g_debug ("Could not open for writing '%s'", filename);
       return FALSE;
     }
 
-    g_return_val_if_fail (written <= size, FALSE);
-    size -= written;
+    new_entry = g_atomic_rc_box_new0 (WriteCacheEntry);
+    new_entry->fd = fd;
+    new_entry->filename = g_strdup (filename);
+    entry = write_cache_insert (new_entry);
+  }
+
+  g_debug ("Writing '%s' to '%s'", value, filename);
+
+  /* Same as opening with O_TRUNC; sysfs ignores size changes */
+  if (ftruncate (entry->fd, 0) == -1) {
+    int errsv = errno;
+
+    ppd_trace_write (filename, value, 0, errsv);
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                 "Error truncating '%s': %s", filename, g_strerror (errsv));
+    write_cache_remove (entry);
+    return FALSE;
+  }
+
+  ppd_stats_record_write (FALSE);
+  if (!write_fd (entry->fd, filename, value, error)) {
+    /* Re-open the attribute on the next write */
+    write_cache_remove (entry);
+    return FALSE;
+  }
+
+  write_cache_entry_set_value (entry, value);
+
+  return TRUE;
+}
+
+static gboolean
+write_file_cached_cb (gpointer   item,
+                      gpointer   user_data,
+                      GError   **error)
+{
+  return ppd_utils_write_cached (item, user_data, error);
+}
+
+gboolean
+ppd_utils_write_files_cached (GPtrArray   *filenames,
+                              const char  *value,
+                              GError     **error)
+{
+  g_return_val_if_fail (filenames != NULL, FALSE);
+
+  return ppd_utils_foreach_parallel (filenames,
+                                     write_file_cached_cb,
+                                     (gpointer) value,
+                                     error);
+}
+
+void
+ppd_utils_invalidate_write_cache (void)
+{
+  G_LOCK (write_cache);
+  if (write_cache != NULL) {
+    g_debug ("Invalidating sysfs write cache (%u entries)",
+             g_hash_table_size (write_cache));
+    g_clear_pointer (&write_cache, g_hash_table_destroy);
+    g_queue_init (&write_cache_lru);
+  }
+  G_UNLOCK (write_cache);
+}
+
+/* Reads back every attribute in the write cache, and forgets the ones
+ * that don't hold the last value written anymore, so that re-applying
+ * the profile only rewrites those. Returns how many were forgotten,
+ * out of @n_checked. */
+guint
+ppd_utils_reconcile_write_cache (guint *n_checked)
+{
+  g_autoptr(GPtrArray) values = NULL;
+  g_autoptr(GPtrArray) entries = NULL;
+  GHashTableIter iter;
+  gpointer value;
+  guint drifted = 0;
+
+  values = g_ptr_array_new_with_free_func (g_free);
+  entries = g_ptr_array_new_with_free_func ((GDestroyNotify) write_cache_entry_unref);
+
+  G_LOCK (write_cache);
+  if (write_cache != NULL) {
+    g_hash_table_iter_init (&iter, write_cache);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+      WriteCacheEntry *entry = value;
+
+      g_ptr_array_add (values, g_strdup (entry->value));
+      g_ptr_array_add (entries, g_atomic_rc_box_acquire (entry));
+    }
+  }
+  G_UNLOCK (write_cache);
+
+  for (guint i = 0; i < entries->len; i++) {
+    WriteCacheEntry *entry = g_ptr_array_index (entries, i);
+    const char *filename = entry->filename;
+    const char *written = g_ptr_array_index (values, i);
+    g_autofree char *contents = NULL;
+
+    if (!g_file_get_contents (filename, &contents, NULL, NULL)) {
+      g_debug ("Could not read back '%s', will rewrite it", filename);
+    } else if (g_strcmp0 (g_strstrip (contents), written) != 0) {
+      g_debug ("'%s' changed from '%s' to '%s'", filename, written, contents);
+    } else {
+      continue;
+    }
+
+    write_cache_remove (entry);
+    drifted++;
+  }
+
+  if (n_checked != NULL)
+    *n_checked = entries->len;
+
+  return drifted;
+}
+
+/* Writing to cpufreq attributes can block for milliseconds in the
+ * kernel's notifiers, so per-policy writes are spread over a shared
+ * pool of threads, and the caller waits for all of them to finish. */
+typedef struct {
+  PpdUtilsForeachFunc  func;
+  gpointer             user_data;
+  PpdJournal          *journal; /* of the calling thread */
+  GMutex               mutex;
+  GCond                cond;
+  guint                pending;
+  GError              *error;
+} ParallelJob;
+
+typedef struct {
+  ParallelJob *job;
+  gpointer     item;
+} ParallelTask;
+
+G_LOCK_DEFINE_STATIC (parallel_pool);
+static GThreadPool *parallel_pool = NULL;
+
+static void
+parallel_job_add_error (ParallelJob *job,
+                        GError      *error)
+{
+  char *message;
+
+  if (job->error == NULL) {
+    job->error = error;
+    return;
+  }
+
+  /* Keep the domain and code of the first error, but all the messages */
+  message = g_strdup_printf ("%s; %s", job->error->message, error->message);
+  g_free (job->error->message);
+  job->error->message = message;
+  g_error_free (error);
+}
+
+static void
+parallel_worker (gpointer data,
+                 gpointer user_data)
+{
+  ParallelTask *task = data;
+  ParallelJob *job = task->job;
+  PpdJournal *previous;
+  GError *error = NULL;
+  gboolean ret;
+
+  previous = ppd_utils_journal_begin (job->journal);
+  ret = job->func (task->item, job->user_data, &error);
+  ppd_utils_journal_end (previous);
+
+  g_mutex_lock (&job->mutex);
+  if (!ret)
+    parallel_job_add_error (job, error ? error :
+                            g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                                 "Unknown error"));
+  if (--job->pending == 0)
+    g_cond_signal (&job->cond);
+  g_mutex_unlock (&job->mutex);
+}
+
+static GThreadPool *
+get_parallel_pool (void)
+{
+  G_LOCK (parallel_pool);
+  if (parallel_pool == NULL) {
+    g_autoptr(GError) error = NULL;
+
+    parallel_pool = g_thread_pool_new (parallel_worker, NULL,
+                                       g_get_num_processors (),
+                                       FALSE, &error);
+    if (parallel_pool == NULL)
+      g_debug ("Could not create thread pool: %s", error->message);
+  }
+  G_UNLOCK (parallel_pool);
+
+  return parallel_pool;
+}
+
+gboolean
+ppd_utils_foreach_parallel (GPtrArray            *items,
+                            PpdUtilsForeachFunc   func,
+                            gpointer              user_data,
+                            GError              **error)
+{
+  g_autofree ParallelTask *tasks = NULL;
+  ParallelJob job = { 0 };
+  GThreadPool *pool;
+
+  g_return_val_if_fail (items != NULL, FALSE);
+  g_return_val_if_fail (func != NULL, FALSE);
+
+  pool = items->len > 1 ? get_parallel_pool () : NULL;
+  if (pool == NULL) {
+    for (guint i = 0; i < items->len; i++) {
+      if (!func (g_ptr_array_index (items, i), user_data, error))
+        return FALSE;
+    }
+    return TRUE;
+  }
+
+  job.func = func;
+  job.user_data = user_data;
+  job.journal = ppd_utils_journal_get_thread_default ();
+  job.pending = items->len;
+  g_mutex_init (&job.mutex);
+  g_cond_init (&job.cond);
+
+  tasks = g_new (ParallelTask, items->len);
+  for (guint i = 0; i < items->len; i++) {
+    tasks[i].job = &job;
+    tasks[i].item = g_ptr_array_index (items, i);
+    g_thread_pool_push (pool, &tasks[i], NULL);
+  }
+
+  g_mutex_lock (&job.mutex);
+  while (job.pending > 0)
+    g_cond_wait (&job.cond, &job.mutex);
+  g_mutex_unlock (&job.mutex);
+
+  g_mutex_clear (&job.mutex);
+  g_cond_clear (&job.cond);
+
+  if (job.error != NULL) {
+    g_propagate_error (error, job.error);
+    return FALSE;
   }
 
   return TRUE;
@@ -118,21 +770,17 @@ gboolean ppd_utils_write_sysfs_int (GUdevDevice  *device,
   return ppd_utils_write_sysfs (device, attribute, str_value, error);
 }
 
-GFileMonitor *
-ppd_utils_monitor_sysfs_attr (GUdevDevice  *device,
-                              const char   *attribute,
-                              GError      **error)
+PpdSysfsMonitor *
+ppd_utils_monitor_sysfs_attr (GUdevDevice           *device,
+                              const char            *attribute,
+                              PpdSysfsMonitorFlags   flags,
+                              GError               **error)
 {
   g_autofree char *path = NULL;
-  g_autoptr(GFile) file = NULL;
 
   path = g_build_filename (g_udev_device_get_sysfs_path (device), attribute, NULL);
-  file = g_file_new_for_path (path);
   g_debug ("Monitoring file %s for changes", path);
-  return g_file_monitor_file (file,
-                              G_FILE_MONITOR_NONE,
-                              NULL,
-                              error);
+  return ppd_sysfs_monitor_new (path, flags, error);
 }
 
 GUdevDevice *
@@ -168,30 +816,570 @@ ppd_utils_find_device (const char   *subsystem,
   return ret;
 }
 
+/* The CPU topology is parsed once, and shared by all the drivers until
+ * CPUs are hotplugged. It is reference counted as drivers might use it
+ * from worker threads while it gets invalidated. */
+struct _PpdCpuTopology {
+  char *vendor;
+  guint family;
+  guint model;
+  guint n_cpus;
+  guint8 *core_types;       /* PpdCpuCoreType, indexed by CPU */
+  GPtrArray *smt_siblings;  /* GArray of CPUs, indexed by CPU */
+  GHashTable *policy_cpus;  /* policy name to GArray of CPUs */
+};
+
+G_LOCK_DEFINE_STATIC (cpu_topology);
+static PpdCpuTopology *cpu_topology = NULL;
+
+static void
+cpu_topology_clear (PpdCpuTopology *topology)
+{
+  g_free (topology->vendor);
+  g_free (topology->core_types);
+  g_clear_pointer (&topology->smt_siblings, g_ptr_array_unref);
+  g_clear_pointer (&topology->policy_cpus, g_hash_table_unref);
+}
+
+PpdCpuTopology *
+ppd_cpu_topology_ref (PpdCpuTopology *topology)
+{
+  return g_atomic_rc_box_acquire (topology);
+}
+
+void
+ppd_cpu_topology_unref (PpdCpuTopology *topology)
+{
+  g_atomic_rc_box_release_full (topology, (GDestroyNotify) cpu_topology_clear);
+}
+
+/* Parses both the "0-3,8" cpulist format, and the "0 1 2" format
+ * of the cpufreq policy attributes */
+GArray *
+ppd_utils_parse_cpu_list (const char *str)
+{
+  GArray *cpus;
+  const char *p = str;
+
+  cpus = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  while (*p != '\0') {
+    char *end;
+    guint64 first, last;
+
+    if (!g_ascii_isdigit (*p)) {
+      p++;
+      continue;
+    }
+
+    first = last = g_ascii_strtoull (p, &end, 10);
+    if (*end == '-' && g_ascii_isdigit (end[1]))
+      last = g_ascii_strtoull (end + 1, &end, 10);
+    for (guint64 cpu = first; cpu <= last && cpu <= G_MAXUINT16; cpu++) {
+      guint value = cpu;
+      g_array_append_val (cpus, value);
+    }
+    p = end;
+  }
+
+  return cpus;
+}
+
+static GArray *
+read_cpu_list (const char *path)
+{
+  g_autofree char *sysfs_path = NULL;
+  g_autofree char *contents = NULL;
+
+  sysfs_path = ppd_utils_get_sysfs_path (path);
+  if (!g_file_get_contents (sysfs_path, &contents, NULL, NULL))
+    return NULL;
+
+  return ppd_utils_parse_cpu_list (contents);
+}
+
+/* Only looks at the first processor, one line at a time, rather than
+ * loading the whole file which is huge on large machines. Long lines,
+ * such as "flags", are skipped in chunks. */
+static void
+scan_cpuinfo (PpdCpuTopology *topology)
+{
+  g_autofree char *cpuinfo_path = NULL;
+  gboolean line_start = TRUE;
+  char line[256];
+  FILE *file;
+
+  cpuinfo_path = ppd_utils_get_sysfs_path (PROC_CPUINFO_PATH);
+  file = g_fopen (cpuinfo_path, "re");
+  if (file == NULL)
+    return;
+
+  while (fgets (line, sizeof (line), file)) {
+    gboolean at_start = line_start;
+    size_t len = strlen (line);
+    char *colon;
+
+    line_start = len > 0 && line[len - 1] == '\n';
+    if (!at_start)
+      continue;
+
+    /* End of the first processor */
+    if (line[0] == '\n')
+      break;
+
+    colon = strchr (line, ':');
+    if (colon == NULL)
+      continue;
+    *colon = '\0';
+    g_strstrip (line);
+    g_strstrip (colon + 1);
+
+    if (topology->vendor == NULL && g_str_equal (line, "vendor_id"))
+      topology->vendor = g_strdup (colon + 1);
+    else if (g_str_equal (line, "cpu family"))
+      topology->family = g_ascii_strtoull (colon + 1, NULL, 10);
+    else if (g_str_equal (line, "model"))
+      topology->model = g_ascii_strtoull (colon + 1, NULL, 10);
+  }
+
+  fclose (file);
+}
+
+static void
+cpu_list_free (GArray *cpus)
+{
+  if (cpus != NULL)
+    g_array_unref (cpus);
+}
+
+static void
+scan_cpus (PpdCpuTopology *topology)
+{
+  g_autofree char *cpu_path = NULL;
+  g_autoptr(GDir) dir = NULL;
+  const char *name;
+
+  /* CPUs without a siblings list, or missing, are left NULL */
+  topology->smt_siblings = g_ptr_array_new_with_free_func ((GDestroyNotify) cpu_list_free);
+
+  cpu_path = ppd_utils_get_sysfs_path (CPU_DIR);
+  dir = g_dir_open (cpu_path, 0, NULL);
+  while (dir && (name = g_dir_read_name (dir))) {
+    g_autofree char *siblings_path = NULL;
+    char *end;
+    guint64 cpu;
+
+    if (!g_str_has_prefix (name, "cpu") || !g_ascii_isdigit (name[3]))
+      continue;
+    cpu = g_ascii_strtoull (name + 3, &end, 10);
+    if (*end != '\0' || cpu > G_MAXUINT16)
+      continue;
+
+    if (cpu >= topology->smt_siblings->len)
+      g_ptr_array_set_size (topology->smt_siblings, cpu + 1);
+    siblings_path = g_build_filename (CPU_DIR, name, "topology", "thread_siblings_list", NULL);
+    g_ptr_array_index (topology->smt_siblings, cpu) = read_cpu_list (siblings_path);
+  }
+  topology->n_cpus = topology->smt_siblings->len;
+}
+
+/* Policies whose maximum frequency is below this share of the fastest
+ * one's hold efficiency cores, such as AMD's dense cores. Preferred
+ * cores only differ from the others by a few percent. */
+#define EFFICIENCY_CORE_MAX_FREQ_PCT 85
+
+static guint64
+read_policy_max_freq (const char *policy)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *sysfs_path = NULL;
+  g_autofree char *contents = NULL;
+
+  path = g_build_filename (CPUFREQ_DIR, policy, "cpuinfo_max_freq", NULL);
+  sysfs_path = ppd_utils_get_sysfs_path (path);
+  if (!g_file_get_contents (sysfs_path, &contents, NULL, NULL))
+    return 0;
+
+  return g_ascii_strtoull (contents, NULL, 10);
+}
+
+/* Splits the policies in two clusters by maximum frequency, if they
+ * are far enough apart. The policies are iterated in the same order
+ * both times, as the table doesn't change. */
+static void
+scan_core_types_by_max_freq (PpdCpuTopology *topology)
+{
+  g_autoptr(GArray) max_freqs = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  guint64 lowest = G_MAXUINT64;
+  guint64 highest = 0;
+  guint n = 0;
+
+  max_freqs = g_array_new (FALSE, FALSE, sizeof (guint64));
+  g_hash_table_iter_init (&iter, topology->policy_cpus);
+  while (g_hash_table_iter_next (&iter, &key, NULL)) {
+    guint64 max_freq = read_policy_max_freq (key);
+
+    g_array_append_val (max_freqs, max_freq);
+    if (max_freq == 0)
+      continue;
+    lowest = MIN (lowest, max_freq);
+    highest = MAX (highest, max_freq);
+  }
+
+  if (highest == 0 || lowest * 100 >= highest * EFFICIENCY_CORE_MAX_FREQ_PCT)
+    return;
+
+  g_hash_table_iter_init (&iter, topology->policy_cpus);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    guint64 max_freq = g_array_index (max_freqs, guint64, n++);
+    GArray *cpus = value;
+    PpdCpuCoreType type;
+
+    if (max_freq == 0)
+      continue;
+    if (max_freq * 100 < highest * EFFICIENCY_CORE_MAX_FREQ_PCT)
+      type = PPD_CPU_CORE_TYPE_EFFICIENCY;
+    else
+      type = PPD_CPU_CORE_TYPE_PERFORMANCE;
+
+    for (guint i = 0; i < cpus->len; i++) {
+      guint cpu = g_array_index (cpus, guint, i);
+
+      if (cpu < topology->n_cpus)
+        topology->core_types[cpu] = type;
+    }
+  }
+}
+
+/* Intel hybrid CPUs list their cores in the PMU of each type. The
+ * others, such as AMD ones mixing full-size and dense cores, are told
+ * apart by the maximum frequency of their policies, and the cores of
+ * homogeneous CPUs are all of unknown type. */
+static void
+scan_core_types (PpdCpuTopology *topology)
+{
+  const struct {
+    const char *path;
+    PpdCpuCoreType type;
+  } hybrid_pmus[] = {
+    { "/sys/devices/cpu_core/cpus", PPD_CPU_CORE_TYPE_PERFORMANCE },
+    { "/sys/devices/cpu_atom/cpus", PPD_CPU_CORE_TYPE_EFFICIENCY },
+  };
+  gboolean has_pmus = FALSE;
+
+  topology->core_types = g_new0 (guint8, MAX (topology->n_cpus, 1));
+
+  for (guint i = 0; i < G_N_ELEMENTS (hybrid_pmus); i++) {
+    g_autoptr(GArray) cpus = read_cpu_list (hybrid_pmus[i].path);
+
+    has_pmus |= cpus != NULL;
+    for (guint j = 0; cpus && j < cpus->len; j++) {
+      guint cpu = g_array_index (cpus, guint, j);
+
+      if (cpu < topology->n_cpus)
+        topology->core_types[cpu] = hybrid_pmus[i].type;
+    }
+  }
+
+  if (!has_pmus)
+    scan_core_types_by_max_freq (topology);
+}
+
+static void
+scan_policies (PpdCpuTopology *topology)
+{
+  g_autofree char *cpufreq_path = NULL;
+  g_autoptr(GDir) dir = NULL;
+  const char *name;
+
+  topology->policy_cpus = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, (GDestroyNotify) g_array_unref);
+
+  cpufreq_path = ppd_utils_get_sysfs_path (CPUFREQ_DIR);
+  dir = g_dir_open (cpufreq_path, 0, NULL);
+  while (dir && (name = g_dir_read_name (dir))) {
+    g_autofree char *related_path = NULL;
+    GArray *cpus;
+
+    if (!g_str_has_prefix (name, "policy"))
+      continue;
+
+    related_path = g_build_filename (CPUFREQ_DIR, name, "related_cpus", NULL);
+    cpus = read_cpu_list (related_path);
+    if (cpus)
+      g_hash_table_insert (topology->policy_cpus, g_strdup (name), cpus);
+  }
+}
+
+PpdCpuTopology *
+ppd_utils_get_cpu_topology (void)
+{
+  PpdCpuTopology *topology;
+
+  G_LOCK (cpu_topology);
+  if (cpu_topology == NULL) {
+    cpu_topology = g_atomic_rc_box_new0 (PpdCpuTopology);
+    scan_cpuinfo (cpu_topology);
+    scan_cpus (cpu_topology);
+    scan_policies (cpu_topology);
+    scan_core_types (cpu_topology);
+
+    g_debug ("CPU topology: vendor '%s', family %u, model %u, %u CPUs, %u policies%s",
+             cpu_topology->vendor ? cpu_topology->vendor : "unknown",
+             cpu_topology->family, cpu_topology->model, cpu_topology->n_cpus,
+             g_hash_table_size (cpu_topology->policy_cpus),
+             ppd_cpu_topology_is_hybrid (cpu_topology) ? ", hybrid" : "");
+  }
+  topology = ppd_cpu_topology_ref (cpu_topology);
+  G_UNLOCK (cpu_topology);
+
+  return topology;
+}
+
+void
+ppd_utils_invalidate_cpu_topology (void)
+{
+  G_LOCK (cpu_topology);
+  g_clear_pointer (&cpu_topology, ppd_cpu_topology_unref);
+  G_UNLOCK (cpu_topology);
+}
+
+const char *
+ppd_cpu_topology_get_vendor (PpdCpuTopology *topology)
+{
+  return topology->vendor;
+}
+
+guint
+ppd_cpu_topology_get_family (PpdCpuTopology *topology)
+{
+  return topology->family;
+}
+
+guint
+ppd_cpu_topology_get_model (PpdCpuTopology *topology)
+{
+  return topology->model;
+}
+
+guint
+ppd_cpu_topology_get_n_cpus (PpdCpuTopology *topology)
+{
+  return topology->n_cpus;
+}
+
+gboolean
+ppd_cpu_topology_is_hybrid (PpdCpuTopology *topology)
+{
+  gboolean has_performance = FALSE;
+  gboolean has_efficiency = FALSE;
+
+  for (guint cpu = 0; cpu < topology->n_cpus; cpu++) {
+    has_performance |= topology->core_types[cpu] == PPD_CPU_CORE_TYPE_PERFORMANCE;
+    has_efficiency |= topology->core_types[cpu] == PPD_CPU_CORE_TYPE_EFFICIENCY;
+  }
+
+  return has_performance && has_efficiency;
+}
+
+PpdCpuCoreType
+ppd_cpu_topology_get_core_type (PpdCpuTopology *topology,
+                                guint           cpu)
+{
+  if (cpu >= topology->n_cpus)
+    return PPD_CPU_CORE_TYPE_UNKNOWN;
+
+  return topology->core_types[cpu];
+}
+
+GArray *
+ppd_cpu_topology_get_smt_siblings (PpdCpuTopology *topology,
+                                   guint           cpu)
+{
+  if (cpu >= topology->n_cpus)
+    return NULL;
+
+  return g_ptr_array_index (topology->smt_siblings, cpu);
+}
+
+/* @policy is either a policy name, or the path of its directory */
+GArray *
+ppd_cpu_topology_get_policy_cpus (PpdCpuTopology *topology,
+                                  const char     *policy)
+{
+  g_autofree char *name = NULL;
+
+  g_return_val_if_fail (policy != NULL, NULL);
+
+  name = g_path_get_basename (policy);
+  return g_hash_table_lookup (topology->policy_cpus, name);
+}
+
+/* The core type shared by all the CPUs of @policy, if any */
+PpdCpuCoreType
+ppd_cpu_topology_get_policy_core_type (PpdCpuTopology *topology,
+                                       const char     *policy)
+{
+  PpdCpuCoreType type = PPD_CPU_CORE_TYPE_UNKNOWN;
+  GArray *cpus;
+
+  cpus = ppd_cpu_topology_get_policy_cpus (topology, policy);
+  for (guint i = 0; cpus && i < cpus->len; i++) {
+    PpdCpuCoreType cpu_type;
+
+    cpu_type = ppd_cpu_topology_get_core_type (topology, g_array_index (cpus, guint, i));
+    if (i > 0 && cpu_type != type)
+      return PPD_CPU_CORE_TYPE_UNKNOWN;
+    type = cpu_type;
+  }
+
+  return type;
+}
+
 gboolean
 ppd_utils_match_cpu_vendor (const char *vendor)
 {
-  g_autofree gchar *cpuinfo_path = NULL;
-  g_autofree gchar *cpuinfo = NULL;
+  g_autoptr(PpdCpuTopology) topology = ppd_utils_get_cpu_topology ();
+
+  return g_strcmp0 (ppd_cpu_topology_get_vendor (topology), vendor) == 0;
+}
+
+/* The CPUs the cgroup of @pid may run on, from the cpuset of its
+ * closest ancestor that has one. Only the unified hierarchy is
+ * supported. */
+static GArray *
+read_pid_cpus (guint32   pid,
+               GError  **error)
+{
+  g_autofree char *proc_path = NULL;
+  g_autofree char *cgroup_path = NULL;
+  g_autofree char *contents = NULL;
+  g_autofree char *root = NULL;
+  g_autofree char *dir = NULL;
   g_auto(GStrv) lines = NULL;
+  const char *relpath = NULL;
 
-  cpuinfo_path = ppd_utils_get_sysfs_path (PROC_CPUINFO_PATH);
-  if (!g_file_get_contents (cpuinfo_path, &cpuinfo, NULL, NULL))
-    return FALSE;
+  proc_path = g_strdup_printf ("/proc/%u/cgroup", pid);
+  cgroup_path = ppd_utils_get_sysfs_path (proc_path);
+  if (!g_file_get_contents (cgroup_path, &contents, NULL, error))
+    return NULL;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (guint i = 0; lines[i] != NULL && relpath == NULL; i++) {
+    if (g_str_has_prefix (lines[i], "0::"))
+      relpath = lines[i] + strlen ("0::");
+  }
+  if (relpath == NULL) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                 "Process %u is not in the unified cgroup hierarchy", pid);
+    return NULL;
+  }
 
-  lines = g_strsplit (cpuinfo, "\n", -1);
+  root = ppd_utils_get_sysfs_path (CGROUP_DIR);
+  dir = g_build_filename (root, relpath, NULL);
+  for (;;) {
+    g_autofree char *path = NULL;
+    g_autofree char *cpuset = NULL;
 
-  for (gchar **line = lines; *line != NULL; line++) {
-      if (g_str_has_prefix (*line, "vendor_id") &&
-          strchr (*line, ':')) {
-          g_auto(GStrv) sections = g_strsplit (*line, ":", 2);
+    path = g_build_filename (dir, "cpuset.cpus.effective", NULL);
+    if (g_file_get_contents (path, &cpuset, NULL, NULL)) {
+      g_autoptr(GArray) cpus = ppd_utils_parse_cpu_list (cpuset);
 
-          if (g_strv_length (sections) < 2)
-            continue;
-          if (g_strcmp0 (g_strstrip (sections[1]), vendor) == 0)
-            return TRUE;
+      if (cpus->len > 0) {
+        g_debug ("Process %u can run on CPUs '%s'", pid, g_strchomp (cpuset));
+        return g_steal_pointer (&cpus);
       }
+    }
+
+    if (strlen (dir) <= strlen (root))
+      break;
+    g_free (path);
+    path = g_steal_pointer (&dir);
+    dir = g_path_get_dirname (path);
+  }
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+               "No cpuset found for the cgroup of process %u", pid);
+  return NULL;
+}
+
+/* @pidfd, if not -1, pins the process @pid was taken from: it becoming
+ * readable means that process exited, and @pid might have been reused
+ * by the time its cgroup was read */
+GArray *
+ppd_utils_get_pid_cpus (guint32   pid,
+                        int       pidfd,
+                        GError  **error)
+{
+  g_autoptr(GArray) cpus = NULL;
+  struct pollfd pfd = { pidfd, POLLIN, 0 };
+
+  cpus = read_pid_cpus (pid, error);
+  if (cpus == NULL || pidfd < 0)
+    return g_steal_pointer (&cpus);
+
+  if (poll (&pfd, 1, 0) != 0) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                 "Process %u exited", pid);
+    return NULL;
+  }
+
+  return g_steal_pointer (&cpus);
+}
+
+/* The profiles of the holds scoped to some CPUs, by CPU, so that the
+ * CPU drivers can look them up from their workers */
+G_LOCK_DEFINE_STATIC (scoped_holds);
+static GArray *scoped_holds = NULL;
+
+void
+ppd_utils_set_scoped_holds (GArray *profiles)
+{
+  G_LOCK (scoped_holds);
+  g_clear_pointer (&scoped_holds, g_array_unref);
+  if (profiles != NULL)
+    scoped_holds = g_array_ref (profiles);
+  G_UNLOCK (scoped_holds);
+}
+
+/* All the profiles held for some of the CPUs */
+PpdProfile
+ppd_utils_get_scoped_hold_profiles (void)
+{
+  PpdProfile profiles = PPD_PROFILE_UNSET;
+
+  G_LOCK (scoped_holds);
+  for (guint cpu = 0; scoped_holds != NULL && cpu < scoped_holds->len; cpu++)
+    profiles |= g_array_index (scoped_holds, PpdProfile, cpu);
+  G_UNLOCK (scoped_holds);
+
+  return profiles;
+}
+
+/* The profile held for any of @cpus, power-saver holds winning over
+ * performance ones, like global holds do */
+PpdProfile
+ppd_utils_get_scoped_hold_profile (GArray *cpus)
+{
+  PpdProfile profile = PPD_PROFILE_UNSET;
+
+  if (cpus == NULL)
+    return PPD_PROFILE_UNSET;
+
+  G_LOCK (scoped_holds);
+  for (guint i = 0; scoped_holds != NULL && i < cpus->len; i++) {
+    guint cpu = g_array_index (cpus, guint, i);
+    PpdProfile held;
+
+    if (cpu >= scoped_holds->len)
+      continue;
+    held = g_array_index (scoped_holds, PpdProfile, cpu);
+    if (held == PPD_PROFILE_POWER_SAVER || profile == PPD_PROFILE_UNSET)
+      profile = held;
   }
+  G_UNLOCK (scoped_holds);
 
-  return FALSE;
+  return profile;
 }
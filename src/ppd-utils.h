@@ -12,6 +12,25 @@
 #include <gudev/gudev.h>
 #include <gio/gio.h>
 
+#include "ppd-profile.h"
+#include "ppd-sysfs-monitor.h"
+
+typedef enum {
+  PPD_CPU_CORE_TYPE_UNKNOWN,
+  PPD_CPU_CORE_TYPE_PERFORMANCE,
+  PPD_CPU_CORE_TYPE_EFFICIENCY,
+} PpdCpuCoreType;
+
+#define PPD_N_CPU_CORE_TYPES (PPD_CPU_CORE_TYPE_EFFICIENCY + 1)
+
+typedef struct _PpdCpuTopology PpdCpuTopology;
+typedef struct _PpdJournal PpdJournal;
+
+/* Called from a worker thread for every element of the array */
+typedef gboolean (* PpdUtilsForeachFunc) (gpointer   item,
+                                          gpointer   user_data,
+                                          GError   **error);
+
 char * ppd_utils_get_sysfs_path (const char *filename);
 gboolean ppd_utils_write (const char  *filename,
                           const char  *value,
@@ -19,6 +38,27 @@ gboolean ppd_utils_write (const char  *filename,
 gboolean ppd_utils_write_files (GPtrArray   *filenames,
                                 const char  *value,
                                 GError     **error);
+gboolean ppd_utils_write_cached (const char  *filename,
+                                 const char  *value,
+                                 GError     **error);
+gboolean ppd_utils_write_files_cached (GPtrArray   *filenames,
+                                       const char  *value,
+                                       GError     **error);
+void ppd_utils_invalidate_write_cache (void);
+guint ppd_utils_reconcile_write_cache (guint *n_checked);
+PpdJournal *ppd_journal_new (void);
+PpdJournal *ppd_utils_journal_begin (PpdJournal *journal);
+void ppd_utils_journal_end (PpdJournal *previous);
+PpdJournal *ppd_utils_journal_get_thread_default (void);
+void ppd_journal_free (PpdJournal *journal);
+guint ppd_journal_get_length (PpdJournal *journal);
+gboolean ppd_journal_rollback (PpdJournal  *journal,
+                               guint        savepoint,
+                               GError     **error);
+gboolean ppd_utils_foreach_parallel (GPtrArray            *items,
+                                     PpdUtilsForeachFunc   func,
+                                     gpointer              user_data,
+                                     GError              **error);
 gboolean ppd_utils_write_sysfs (GUdevDevice  *device,
                                 const char   *attribute,
                                 const char   *value,
@@ -27,10 +67,40 @@ gboolean ppd_utils_write_sysfs_int (GUdevDevice  *device,
                                     const char   *attribute,
                                     gint64        value,
                                     GError      **error);
-GFileMonitor *ppd_utils_monitor_sysfs_attr (GUdevDevice  *device,
-                                            const char   *attribute,
-                                            GError      **error);
+PpdSysfsMonitor *ppd_utils_monitor_sysfs_attr (GUdevDevice           *device,
+                                               const char            *attribute,
+                                               PpdSysfsMonitorFlags   flags,
+                                               GError               **error);
 GUdevDevice *ppd_utils_find_device (const char   *subsystem,
                                     GCompareFunc  func,
                                     gpointer      user_data);
 gboolean ppd_utils_match_cpu_vendor (const char *vendor);
+GArray *ppd_utils_parse_cpu_list (const char *str);
+GArray *ppd_utils_get_pid_cpus (guint32   pid,
+                                int       pidfd,
+                                GError  **error);
+
+void ppd_utils_set_scoped_holds (GArray *profiles);
+PpdProfile ppd_utils_get_scoped_hold_profiles (void);
+PpdProfile ppd_utils_get_scoped_hold_profile (GArray *cpus);
+
+PpdCpuTopology *ppd_utils_get_cpu_topology (void);
+void ppd_utils_invalidate_cpu_topology (void);
+PpdCpuTopology *ppd_cpu_topology_ref (PpdCpuTopology *topology);
+void ppd_cpu_topology_unref (PpdCpuTopology *topology);
+const char *ppd_cpu_topology_get_vendor (PpdCpuTopology *topology);
+guint ppd_cpu_topology_get_family (PpdCpuTopology *topology);
+guint ppd_cpu_topology_get_model (PpdCpuTopology *topology);
+guint ppd_cpu_topology_get_n_cpus (PpdCpuTopology *topology);
+gboolean ppd_cpu_topology_is_hybrid (PpdCpuTopology *topology);
+PpdCpuCoreType ppd_cpu_topology_get_core_type (PpdCpuTopology *topology,
+                                               guint           cpu);
+GArray *ppd_cpu_topology_get_smt_siblings (PpdCpuTopology *topology,
+                                           guint           cpu);
+GArray *ppd_cpu_topology_get_policy_cpus (PpdCpuTopology *topology,
+                                          const char     *policy);
+PpdCpuCoreType ppd_cpu_topology_get_policy_core_type (PpdCpuTopology *topology,
+                                                      const char     *policy);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PpdCpuTopology, ppd_cpu_topology_unref)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PpdJournal, ppd_journal_free)
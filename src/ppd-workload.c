@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#define G_LOG_DOMAIN "Workload"
+
+#include <string.h>
+
+#include "ppd-workload.h"
+#include "ppd-utils.h"
+
+#define PROC_STAT_PATH          "/proc/stat"
+#define PROC_PRESSURE_CPU_PATH  "/proc/pressure/cpu"
+#define CPUFREQ_POLICY_DIR      "/sys/devices/system/cpu/cpufreq/"
+
+/* Loads are between 0 and 1. Entering a profile needs a higher load
+ * than staying in it, so that a load sitting on a threshold doesn't
+ * switch profiles back and forth. */
+#define LOAD_ENTER_PERFORMANCE  0.70
+#define LOAD_LEAVE_PERFORMANCE  0.45
+#define LOAD_ENTER_POWER_SAVER  0.08
+#define LOAD_LEAVE_POWER_SAVER  0.20
+
+/* A CPU stalled on runnable tasks this often is saturated */
+#define PRESSURE_SATURATED      25.0
+/* Policies running this close to their top frequency are already
+ * asking for all the performance they can get */
+#define FREQ_RATIO_HIGH         0.90
+
+/* Consecutive samples wanting a profile before switching to it,
+ * reacting to load faster than to idleness */
+#define SAMPLES_TO_RAISE        2
+#define SAMPLES_TO_LOWER        5
+
+typedef enum {
+  LEVEL_POWER_SAVER,
+  LEVEL_BALANCED,
+  LEVEL_PERFORMANCE,
+} WorkloadLevel;
+
+/* Samples the CPU load, and picks a profile for it. The sampling
+ * interval starts at its minimum, and doubles for every sample that
+ * doesn't make a change likelier, up to its maximum. */
+struct _PpdWorkload {
+  guint min_interval;
+  guint max_interval;
+  guint interval;
+
+  gboolean has_stat;
+  guint64 busy;
+  guint64 total;
+
+  WorkloadLevel level;
+  WorkloadLevel candidate;
+  guint candidate_samples;
+};
+
+PpdWorkload *
+ppd_workload_new (guint min_interval,
+                  guint max_interval)
+{
+  PpdWorkload *workload;
+
+  workload = g_new0 (PpdWorkload, 1);
+  workload->min_interval = min_interval;
+  workload->max_interval = MAX (min_interval, max_interval);
+  workload->interval = min_interval;
+  workload->level = LEVEL_BALANCED;
+
+  return workload;
+}
+
+void
+ppd_workload_free (PpdWorkload *workload)
+{
+  g_free (workload);
+}
+
+/* Forgets about previous samples, for when sampling was paused */
+void
+ppd_workload_reset (PpdWorkload *workload)
+{
+  workload->has_stat = FALSE;
+  workload->candidate_samples = 0;
+  workload->interval = workload->min_interval;
+}
+
+guint
+ppd_workload_get_interval (PpdWorkload *workload)
+{
+  return workload->interval;
+}
+
+static WorkloadLevel
+profile_to_level (PpdProfile profile)
+{
+  switch (profile) {
+  case PPD_PROFILE_POWER_SAVER:
+    return LEVEL_POWER_SAVER;
+  case PPD_PROFILE_PERFORMANCE:
+    return LEVEL_PERFORMANCE;
+  default:
+    return LEVEL_BALANCED;
+  }
+}
+
+static PpdProfile
+level_to_profile (WorkloadLevel level)
+{
+  switch (level) {
+  case LEVEL_POWER_SAVER:
+    return PPD_PROFILE_POWER_SAVER;
+  case LEVEL_PERFORMANCE:
+    return PPD_PROFILE_PERFORMANCE;
+  case LEVEL_BALANCED:
+    break;
+  }
+
+  return PPD_PROFILE_BALANCED;
+}
+
+static char *
+read_file (const char *path)
+{
+  g_autofree char *full_path = NULL;
+  char *contents = NULL;
+
+  full_path = ppd_utils_get_sysfs_path (path);
+  if (!g_file_get_contents (full_path, &contents, NULL, NULL))
+    return NULL;
+
+  return contents;
+}
+
+/* The fraction of time the CPUs were busy since the last sample, from
+ * the aggregated "cpu" line, or a negative value if unknown */
+static gdouble
+sample_cpu_busy (PpdWorkload *workload)
+{
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) fields = NULL;
+  guint64 busy = 0, total = 0;
+  gdouble ratio = -1.0;
+  char *eol;
+
+  contents = read_file (PROC_STAT_PATH);
+  if (contents == NULL || !g_str_has_prefix (contents, "cpu "))
+    return -1.0;
+
+  eol = strchr (contents, '\n');
+  if (eol != NULL)
+    *eol = '\0';
+
+  /* user nice system idle iowait irq softirq steal, guest times
+   * are already accounted in user and nice */
+  fields = g_strsplit_set (contents + strlen ("cpu "), " ", -1);
+  for (guint i = 0, n = 0; fields[i] != NULL && n < 8; i++) {
+    guint64 value;
+
+    if (*fields[i] == '\0')
+      continue;
+    value = g_ascii_strtoull (fields[i], NULL, 10);
+    total += value;
+    if (n != 3 && n != 4)
+      busy += value;
+    n++;
+  }
+
+  if (workload->has_stat && total > workload->total && busy >= workload->busy)
+    ratio = (gdouble) (busy - workload->busy) / (total - workload->total);
+
+  workload->has_stat = TRUE;
+  workload->busy = busy;
+  workload->total = total;
+
+  return ratio;
+}
+
+/* The "some" avg10 value, the percentage of time runnable tasks were
+ * waiting for a CPU, or a negative value if PSI isn't available */
+static gdouble
+sample_cpu_pressure (void)
+{
+  g_autofree char *contents = NULL;
+  const char *avg10;
+
+  contents = read_file (PROC_PRESSURE_CPU_PATH);
+  if (contents == NULL || !g_str_has_prefix (contents, "some "))
+    return -1.0;
+
+  avg10 = strstr (contents, "avg10=");
+  if (avg10 == NULL)
+    return -1.0;
+
+  return g_ascii_strtod (avg10 + strlen ("avg10="), NULL);
+}
+
+static guint64
+read_khz (const char *dir,
+          const char *attr)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *contents = NULL;
+
+  path = g_build_filename (dir, attr, NULL);
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return 0;
+
+  return g_ascii_strtoull (contents, NULL, 10);
+}
+
+/* How close the policies run to their top frequency on average, or
+ * a negative value if unknown */
+static gdouble
+sample_freq_ratio (void)
+{
+  g_autofree char *policy_dir = NULL;
+  g_autoptr(GDir) dir = NULL;
+  const char *name;
+  gdouble sum = 0;
+  guint n = 0;
+
+  policy_dir = ppd_utils_get_sysfs_path (CPUFREQ_POLICY_DIR);
+  dir = g_dir_open (policy_dir, 0, NULL);
+  if (dir == NULL)
+    return -1.0;
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    g_autofree char *base = NULL;
+    guint64 cur, max;
+
+    if (!g_str_has_prefix (name, "policy"))
+      continue;
+
+    base = g_build_filename (policy_dir, name, NULL);
+    cur = read_khz (base, "scaling_cur_freq");
+    max = read_khz (base, "cpuinfo_max_freq");
+    if (cur == 0 || max == 0)
+      continue;
+
+    sum += MIN (1.0, (gdouble) cur / max);
+    n++;
+  }
+
+  return n > 0 ? sum / n : -1.0;
+}
+
+static WorkloadLevel
+wanted_level (WorkloadLevel level,
+              gdouble       load)
+{
+  switch (level) {
+  case LEVEL_PERFORMANCE:
+    if (load >= LOAD_LEAVE_PERFORMANCE)
+      return LEVEL_PERFORMANCE;
+    return load <= LOAD_ENTER_POWER_SAVER ? LEVEL_POWER_SAVER : LEVEL_BALANCED;
+  case LEVEL_POWER_SAVER:
+    if (load >= LOAD_ENTER_PERFORMANCE)
+      return LEVEL_PERFORMANCE;
+    return load > LOAD_LEAVE_POWER_SAVER ? LEVEL_BALANCED : LEVEL_POWER_SAVER;
+  case LEVEL_BALANCED:
+    break;
+  }
+
+  if (load >= LOAD_ENTER_PERFORMANCE)
+    return LEVEL_PERFORMANCE;
+  if (load <= LOAD_ENTER_POWER_SAVER)
+    return LEVEL_POWER_SAVER;
+  return LEVEL_BALANCED;
+}
+
+/* Returns the profile the workload calls for, with @current being the
+ * active profile, which might have been changed by other means */
+PpdProfile
+ppd_workload_sample (PpdWorkload *workload,
+                     PpdProfile   current)
+{
+  gdouble busy, pressure, freq_ratio, load;
+  WorkloadLevel wanted;
+  guint needed;
+
+  if (profile_to_level (current) != workload->level) {
+    workload->level = profile_to_level (current);
+    workload->candidate_samples = 0;
+  }
+
+  busy = sample_cpu_busy (workload);
+  pressure = sample_cpu_pressure ();
+  freq_ratio = sample_freq_ratio ();
+
+  load = MAX (busy, 0.0);
+  if (pressure >= 0)
+    load = MAX (load, MIN (1.0, pressure / PRESSURE_SATURATED));
+  if (busy >= 0 && freq_ratio >= FREQ_RATIO_HIGH)
+    load = MAX (load, (busy + freq_ratio) / 2);
+
+  if (busy < 0 && pressure < 0) {
+    g_debug ("No load information yet");
+    wanted = workload->level;
+  } else {
+    wanted = wanted_level (workload->level, load);
+    g_debug ("Sampled load %.2f (busy: %.2f, pressure: %.2f, frequency: %.2f), wants %s",
+             load, busy, pressure, freq_ratio, ppd_profile_to_str (level_to_profile (wanted)));
+  }
+
+  if (wanted == workload->level) {
+    workload->candidate_samples = 0;
+    workload->interval = MIN (workload->interval * 2, workload->max_interval);
+    return level_to_profile (workload->level);
+  }
+
+  if (workload->candidate_samples == 0 || wanted != workload->candidate) {
+    workload->candidate = wanted;
+    workload->candidate_samples = 0;
+  }
+  workload->candidate_samples++;
+  workload->interval = workload->min_interval;
+
+  needed = wanted > workload->level ? SAMPLES_TO_RAISE : SAMPLES_TO_LOWER;
+  if (workload->candidate_samples >= needed) {
+    workload->level = wanted;
+    workload->candidate_samples = 0;
+  }
+
+  return level_to_profile (workload->level);
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include "ppd-profile.h"
+
+typedef struct _PpdWorkload PpdWorkload;
+
+PpdWorkload *ppd_workload_new (guint min_interval,
+                               guint max_interval);
+void ppd_workload_free (PpdWorkload *workload);
+void ppd_workload_reset (PpdWorkload *workload);
+PpdProfile ppd_workload_sample (PpdWorkload *workload,
+                                PpdProfile   current);
+guint ppd_workload_get_interval (PpdWorkload *workload);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PpdWorkload, ppd_workload_free)
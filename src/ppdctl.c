@@ -0,0 +1,765 @@
+/*
+ * Copyright (c) 2026 The power-profiles-daemon contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+/* A native equivalent of powerprofilesctl, for when starting a Python
+ * interpreter for each call costs more than the D-Bus call itself */
+
+#include "config.h"
+
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <locale.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+#define PP_NAME          "org.freedesktop.UPower.PowerProfiles"
+#define PP_PATH          "/org/freedesktop/UPower/PowerProfiles"
+#define PP_IFACE         "org.freedesktop.UPower.PowerProfiles"
+#define PROPERTIES_IFACE "org.freedesktop.DBus.Properties"
+
+typedef int (*CommandFunc) (GDBusConnection *bus, int argc, char **argv);
+
+static void
+print_error (GError *error)
+{
+  g_printerr ("Failed to communicate with power-profiles-daemon: %s\n", error->message);
+}
+
+static GDBusConnection *
+get_bus (void)
+{
+  g_autoptr(GError) error = NULL;
+  GDBusConnection *bus;
+
+  bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
+  if (bus == NULL)
+    print_error (error);
+
+  return bus;
+}
+
+static GVariant *
+call_method (GDBusConnection     *bus,
+             const char          *iface,
+             const char          *method,
+             GVariant            *parameters,
+             const GVariantType  *reply_type,
+             GError             **error)
+{
+  return g_dbus_connection_call_sync (bus, PP_NAME, PP_PATH, iface, method,
+                                      parameters, reply_type,
+                                      G_DBUS_CALL_FLAGS_NONE, -1, NULL, error);
+}
+
+static GVariant *
+get_property (GDBusConnection  *bus,
+              const char       *property,
+              GError          **error)
+{
+  g_autoptr(GVariant) reply = NULL;
+  GVariant *value;
+
+  reply = call_method (bus, PROPERTIES_IFACE, "Get",
+                       g_variant_new ("(ss)", PP_IFACE, property),
+                       G_VARIANT_TYPE ("(v)"), error);
+  if (reply == NULL)
+    return NULL;
+
+  g_variant_get (reply, "(v)", &value);
+  return value;
+}
+
+/* Prints @value the way Python prints the unpacked variant, strings
+ * without quotes */
+static void
+print_value (GVariant *value)
+{
+  g_autofree char *printed = NULL;
+
+  if (g_variant_is_of_type (value, G_VARIANT_TYPE_VARIANT)) {
+    g_autoptr(GVariant) child = g_variant_get_variant (value);
+    print_value (child);
+    return;
+  }
+
+  if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING)) {
+    g_print ("%s", g_variant_get_string (value, NULL));
+    return;
+  }
+
+  printed = g_variant_print (value, FALSE);
+  g_print ("%s", printed);
+}
+
+static void
+print_field (GVariant   *dict,
+             const char *label,
+             const char *key,
+             const char *unit)
+{
+  g_autoptr(GVariant) value = NULL;
+
+  value = g_variant_lookup_value (dict, key, NULL);
+  g_print ("%s ", label);
+  if (value != NULL)
+    print_value (value);
+  g_print ("%s\n", unit ? unit : "");
+}
+
+static gboolean
+parse_no_options (const char   *command,
+                  int          *argc,
+                  char       ***argv,
+                  const char   *summary)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+
+  context = g_option_context_new (NULL);
+  g_option_context_set_summary (context, summary);
+  if (!g_option_context_parse (context, argc, argv, &error)) {
+    g_printerr ("%s: %s\n", command, error->message);
+    return FALSE;
+  }
+  if (*argc > 1) {
+    g_printerr ("%s: unrecognized arguments: %s\n", command, (*argv)[1]);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static int
+command_version (GDBusConnection *bus,
+                 int              argc,
+                 char           **argv)
+{
+  g_autoptr(GVariant) version = NULL;
+
+  if (!parse_no_options ("version", &argc, &argv, "Print version information and exit"))
+    return 2;
+
+  if (bus != NULL)
+    version = get_property (bus, "Version", NULL);
+
+  g_print ("client: %s\ndaemon: %s\n", VERSION,
+           version ? g_variant_get_string (version, NULL) : "unknown");
+  return 0;
+}
+
+static int
+command_get (GDBusConnection *bus,
+             int              argc,
+             char           **argv)
+{
+  g_autoptr(GVariant) profile = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (!parse_no_options ("get", &argc, &argv, "Print the currently active power profile"))
+    return 2;
+
+  profile = get_property (bus, "ActiveProfile", &error);
+  if (profile == NULL) {
+    print_error (error);
+    return 1;
+  }
+
+  g_print ("%s\n", g_variant_get_string (profile, NULL));
+  return 0;
+}
+
+static int
+command_set (GDBusConnection *bus,
+             int              argc,
+             char           **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GError) error = NULL;
+
+  context = g_option_context_new ("PROFILE");
+  g_option_context_set_summary (context, "Set the currently active power profile");
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("set: %s\n", error->message);
+    return 2;
+  }
+  if (argc != 2) {
+    g_printerr ("set: expected one profile\n");
+    return 2;
+  }
+
+  reply = call_method (bus, PROPERTIES_IFACE, "Set",
+                       g_variant_new ("(ssv)", PP_IFACE, "ActiveProfile",
+                                      g_variant_new_string (argv[1])),
+                       NULL, &error);
+  if (reply == NULL) {
+    print_error (error);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int
+command_list (GDBusConnection *bus,
+              int              argc,
+              char           **argv)
+{
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GVariant) state = NULL;
+  g_autoptr(GVariant) profiles = NULL;
+  g_autoptr(GError) error = NULL;
+  const char *reason = "";
+  const char *active = NULL;
+  gsize n_profiles;
+
+  if (!parse_no_options ("list", &argc, &argv, "List available power profiles"))
+    return 2;
+
+  reply = call_method (bus, PP_IFACE, "GetState", g_variant_new ("(t)", (guint64) 0),
+                       G_VARIANT_TYPE ("(ta{sv})"), &error);
+  if (reply == NULL) {
+    print_error (error);
+    return 1;
+  }
+
+  state = g_variant_get_child_value (reply, 1);
+  profiles = g_variant_lookup_value (state, "Profiles", G_VARIANT_TYPE ("aa{sv}"));
+  g_variant_lookup (state, "PerformanceDegraded", "&s", &reason);
+  g_variant_lookup (state, "ActiveProfile", "&s", &active);
+  if (profiles == NULL)
+    return 0;
+
+  n_profiles = g_variant_n_children (profiles);
+  for (gsize i = n_profiles; i > 0; i--) {
+    g_autoptr(GVariant) profile = g_variant_get_child_value (profiles, i - 1);
+    const char *drivers[] = { "CpuDriver", "PlatformDriver" };
+    const char *name = NULL;
+
+    if (i < n_profiles)
+      g_print ("\n");
+
+    g_variant_lookup (profile, "Profile", "&s", &name);
+    g_print ("%s %s:\n",
+             g_strcmp0 (name, active) == 0 ? "*" : " ",
+             name);
+    for (guint j = 0; j < G_N_ELEMENTS (drivers); j++) {
+      const char *driver;
+
+      if (g_variant_lookup (profile, drivers[j], "&s", &driver))
+        g_print ("    %s:\t%s\n", drivers[j], driver);
+    }
+    if (g_strcmp0 (name, "performance") == 0) {
+      if (*reason != '\0')
+        g_print ("    Degraded:   yes (%s)\n", reason);
+      else
+        g_print ("    Degraded:   no\n");
+    }
+  }
+
+  return 0;
+}
+
+static int
+command_list_holds (GDBusConnection *bus,
+                    int              argc,
+                    char           **argv)
+{
+  g_autoptr(GVariant) holds = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (!parse_no_options ("list-holds", &argc, &argv, "List current power profile holds"))
+    return 2;
+
+  holds = get_property (bus, "ActiveProfileHolds", &error);
+  if (holds == NULL) {
+    print_error (error);
+    return 1;
+  }
+
+  for (gsize i = 0; i < g_variant_n_children (holds); i++) {
+    g_autoptr(GVariant) hold = g_variant_get_child_value (holds, i);
+
+    if (i > 0)
+      g_print ("\n");
+    g_print ("Hold:\n");
+    print_field (hold, "  Profile:        ", "Profile", NULL);
+    print_field (hold, "  Application ID: ", "ApplicationId", NULL);
+    print_field (hold, "  Reason:         ", "Reason", NULL);
+  }
+
+  return 0;
+}
+
+static int
+command_stats (GDBusConnection *bus,
+               int              argc,
+               char           **argv)
+{
+  g_autoptr(GVariant) stats = NULL;
+  g_autoptr(GVariant) timings = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (!parse_no_options ("stats", &argc, &argv, "Print statistics about profile changes"))
+    return 2;
+
+  stats = get_property (bus, "Stats", &error);
+  if (stats == NULL) {
+    print_error (error);
+    return 1;
+  }
+
+  print_field (stats, "Sysfs writes:  ", "SysfsWrites", NULL);
+  print_field (stats, "Skipped writes:", "SysfsWritesSkipped", NULL);
+
+  timings = g_variant_lookup_value (stats, "Timings", G_VARIANT_TYPE ("aa{sv}"));
+  for (gsize i = 0; timings != NULL && i < g_variant_n_children (timings); i++) {
+    g_autoptr(GVariant) timing = g_variant_get_child_value (timings, i);
+    const char *name = NULL;
+
+    g_variant_lookup (timing, "Name", "&s", &name);
+    g_print ("\n%s:\n", name);
+    print_field (timing, "  Count:", "Count", NULL);
+    print_field (timing, "  p50:  ", "P50", " µs");
+    print_field (timing, "  p99:  ", "P99", " µs");
+    print_field (timing, "  Max:  ", "Max", " µs");
+  }
+
+  return 0;
+}
+
+static int
+command_trace (GDBusConnection *bus,
+               int              argc,
+               char           **argv)
+{
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GVariant) transitions = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (!parse_no_options ("trace", &argc, &argv, "Print the last profile transitions"))
+    return 2;
+
+  reply = call_method (bus, PP_IFACE, "GetTrace", NULL,
+                       G_VARIANT_TYPE ("(aa{sv})"), &error);
+  if (reply == NULL) {
+    print_error (error);
+    return 1;
+  }
+
+  transitions = g_variant_get_child_value (reply, 0);
+  for (gsize i = 0; i < g_variant_n_children (transitions); i++) {
+    g_autoptr(GVariant) transition = g_variant_get_child_value (transitions, i);
+    g_autoptr(GVariant) id = NULL;
+    const char *path, *write_error;
+
+    if (i > 0)
+      g_print ("\n");
+    id = g_variant_lookup_value (transition, "Id", NULL);
+    g_print ("Transition ");
+    if (id != NULL)
+      print_value (id);
+    g_print (":\n");
+    print_field (transition, "  From:    ", "From", NULL);
+    print_field (transition, "  To:      ", "To", NULL);
+    print_field (transition, "  Reason:  ", "Reason", NULL);
+    print_field (transition, "  Result:  ", "Result", NULL);
+    print_field (transition, "  Duration:", "Duration", " µs");
+    print_field (transition, "  Writes:  ", "Writes", NULL);
+    if (g_variant_lookup (transition, "SlowestWrite", "&s", &path)) {
+      g_autoptr(GVariant) duration = NULL;
+
+      duration = g_variant_lookup_value (transition, "SlowestWriteDuration", NULL);
+      g_print ("  Slowest:  %s (", path);
+      if (duration != NULL)
+        print_value (duration);
+      g_print (" µs)\n");
+    }
+    if (g_variant_lookup (transition, "FailedWrite", "&s", &path) &&
+        g_variant_lookup (transition, "FailedWriteError", "&s", &write_error))
+      g_print ("  Failed:   %s (%s)\n", path, write_error);
+  }
+
+  return 0;
+}
+
+static GPid launched_pid = 0;
+
+static void
+forward_signal (int signum)
+{
+  if (launched_pid > 0)
+    kill (launched_pid, signum);
+}
+
+static int
+command_launch (GDBusConnection *bus,
+                int              argc,
+                char           **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *profile = NULL;
+  g_autofree char *reason = NULL;
+  g_autofree char *appid = NULL;
+  g_auto(GStrv) arguments = NULL;
+  const int redirected_signals[] = { SIGTERM, SIGINT, SIGABRT };
+  struct sigaction action = { 0 };
+  gboolean spawned = TRUE;
+  guint32 cookie;
+  int status = 0;
+  const GOptionEntry options[] = {
+    { "profile", 'p', 0, G_OPTION_ARG_STRING, &profile, "Profile to use for launch command", "PROFILE" },
+    { "reason", 'r', 0, G_OPTION_ARG_STRING, &reason, "Reason to use for launch command", "REASON" },
+    { "appid", 'i', 0, G_OPTION_ARG_STRING, &appid, "AppId to use for launch command", "APPID" },
+    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &arguments, NULL, "COMMAND…" },
+    { NULL }
+  };
+
+  context = g_option_context_new (NULL);
+  g_option_context_set_summary (context,
+                                "Launch the command while holding a power profile, "
+                                "either performance, or power-saver. By default, the profile hold "
+                                "is for the performance profile, but it might not be available on "
+                                "all systems. See the list command for a list of available profiles.");
+  g_option_context_add_main_entries (context, options, NULL);
+  /* Options after the command are the command's */
+  g_option_context_set_strict_posix (context, TRUE);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("launch: %s\n", error->message);
+    return 2;
+  }
+  if (arguments == NULL || arguments[0] == NULL) {
+    g_printerr ("Error: No command to launch\n");
+    return 1;
+  }
+  if (appid == NULL)
+    appid = g_strdup (arguments[0]);
+  if (profile == NULL)
+    profile = g_strdup ("performance");
+  if (reason == NULL)
+    reason = g_strdup_printf ("Running %s", appid);
+
+  reply = call_method (bus, PP_IFACE, "HoldProfile",
+                       g_variant_new ("(sss)", profile, reason, appid),
+                       G_VARIANT_TYPE ("(u)"), &error);
+  if (reply == NULL) {
+    print_error (error);
+    return 1;
+  }
+  g_variant_get (reply, "(u)", &cookie);
+  g_clear_pointer (&reply, g_variant_unref);
+
+  if (!g_spawn_async (NULL, arguments, NULL,
+                      G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD |
+                      G_SPAWN_CHILD_INHERITS_STDIN,
+                      NULL, NULL, &launched_pid, &error)) {
+    g_printerr ("Error: %s\n", error->message);
+    g_clear_error (&error);
+    spawned = FALSE;
+  } else {
+    /* Redirect the same signals to the child */
+    action.sa_handler = forward_signal;
+    for (guint i = 0; i < G_N_ELEMENTS (redirected_signals); i++)
+      sigaction (redirected_signals[i], &action, NULL);
+
+    while (waitpid (launched_pid, &status, 0) < 0 && errno == EINTR)
+      ;
+
+    action.sa_handler = SIG_DFL;
+    for (guint i = 0; i < G_N_ELEMENTS (redirected_signals); i++)
+      sigaction (redirected_signals[i], &action, NULL);
+    g_spawn_close_pid (launched_pid);
+    launched_pid = 0;
+  }
+
+  reply = call_method (bus, PP_IFACE, "ReleaseProfile",
+                       g_variant_new ("(u)", cookie), NULL, &error);
+  if (reply == NULL) {
+    print_error (error);
+    return 1;
+  }
+
+  if (!spawned)
+    return 1;
+
+  if (WIFSIGNALED (status)) {
+    /* Use standard POSIX signal exit code */
+    signal (WTERMSIG (status), SIG_DFL);
+    raise (WTERMSIG (status));
+    return 128 + WTERMSIG (status);
+  }
+
+  return WEXITSTATUS (status);
+}
+
+static void
+append_json_string (GString    *out,
+                    const char *str)
+{
+  g_string_append_c (out, '"');
+  for (const char *p = str; *p != '\0'; p++) {
+    switch (*p) {
+    case '"':
+      g_string_append (out, "\\\"");
+      break;
+    case '\\':
+      g_string_append (out, "\\\\");
+      break;
+    case '\n':
+      g_string_append (out, "\\n");
+      break;
+    case '\t':
+      g_string_append (out, "\\t");
+      break;
+    default:
+      if ((guchar) *p < 0x20)
+        g_string_append_printf (out, "\\u%04x", (guchar) *p);
+      else
+        g_string_append_c (out, *p);
+    }
+  }
+  g_string_append_c (out, '"');
+}
+
+static void
+append_json (GString  *out,
+             GVariant *value)
+{
+  char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  switch (g_variant_classify (value)) {
+  case G_VARIANT_CLASS_BOOLEAN:
+    g_string_append (out, g_variant_get_boolean (value) ? "true" : "false");
+    break;
+  case G_VARIANT_CLASS_BYTE:
+    g_string_append_printf (out, "%u", g_variant_get_byte (value));
+    break;
+  case G_VARIANT_CLASS_INT16:
+    g_string_append_printf (out, "%d", g_variant_get_int16 (value));
+    break;
+  case G_VARIANT_CLASS_UINT16:
+    g_string_append_printf (out, "%u", g_variant_get_uint16 (value));
+    break;
+  case G_VARIANT_CLASS_INT32:
+    g_string_append_printf (out, "%d", g_variant_get_int32 (value));
+    break;
+  case G_VARIANT_CLASS_UINT32:
+    g_string_append_printf (out, "%u", g_variant_get_uint32 (value));
+    break;
+  case G_VARIANT_CLASS_INT64:
+    g_string_append_printf (out, "%" G_GINT64_FORMAT, g_variant_get_int64 (value));
+    break;
+  case G_VARIANT_CLASS_UINT64:
+    g_string_append_printf (out, "%" G_GUINT64_FORMAT, g_variant_get_uint64 (value));
+    break;
+  case G_VARIANT_CLASS_HANDLE:
+    g_string_append_printf (out, "%d", g_variant_get_handle (value));
+    break;
+  case G_VARIANT_CLASS_DOUBLE:
+    g_string_append (out, g_ascii_dtostr (buf, sizeof (buf), g_variant_get_double (value)));
+    break;
+  case G_VARIANT_CLASS_STRING:
+  case G_VARIANT_CLASS_OBJECT_PATH:
+  case G_VARIANT_CLASS_SIGNATURE:
+    append_json_string (out, g_variant_get_string (value, NULL));
+    break;
+  case G_VARIANT_CLASS_VARIANT:
+    {
+      g_autoptr(GVariant) child = g_variant_get_variant (value);
+      append_json (out, child);
+    }
+    break;
+  case G_VARIANT_CLASS_MAYBE:
+    {
+      g_autoptr(GVariant) child = g_variant_get_maybe (value);
+      if (child != NULL)
+        append_json (out, child);
+      else
+        g_string_append (out, "null");
+    }
+    break;
+  case G_VARIANT_CLASS_ARRAY:
+  case G_VARIANT_CLASS_TUPLE:
+  case G_VARIANT_CLASS_DICT_ENTRY:
+    {
+      /* Dictionaries with string keys are objects, anything else a list */
+      gboolean object = g_variant_is_of_type (value, G_VARIANT_TYPE ("a{s*}"));
+
+      g_string_append_c (out, object ? '{' : '[');
+      for (gsize i = 0; i < g_variant_n_children (value); i++) {
+        g_autoptr(GVariant) child = g_variant_get_child_value (value, i);
+
+        if (i > 0)
+          g_string_append (out, ", ");
+        if (object) {
+          g_autoptr(GVariant) key = g_variant_get_child_value (child, 0);
+          g_autoptr(GVariant) val = g_variant_get_child_value (child, 1);
+
+          append_json_string (out, g_variant_get_string (key, NULL));
+          g_string_append (out, ": ");
+          append_json (out, val);
+        } else {
+          append_json (out, child);
+        }
+      }
+      g_string_append_c (out, object ? '}' : ']');
+    }
+    break;
+  }
+}
+
+static void
+print_json_line (GVariant *properties)
+{
+  g_autoptr(GString) line = g_string_new (NULL);
+
+  append_json (line, properties);
+  g_string_append_c (line, '\n');
+  fputs (line->str, stdout);
+  fflush (stdout);
+}
+
+static void
+properties_changed_cb (GDBusConnection *bus,
+                       const char      *sender_name,
+                       const char      *object_path,
+                       const char      *interface_name,
+                       const char      *signal_name,
+                       GVariant        *parameters,
+                       gpointer         user_data)
+{
+  g_autoptr(GVariant) changed = NULL;
+  const char *iface;
+
+  g_variant_get (parameters, "(&s@a{sv}@as)", &iface, &changed, NULL);
+  if (g_strcmp0 (iface, PP_IFACE) != 0)
+    return;
+
+  print_json_line (changed);
+}
+
+static gboolean
+quit_cb (gpointer user_data)
+{
+  g_main_loop_quit (user_data);
+  return G_SOURCE_REMOVE;
+}
+
+static int
+command_monitor (GDBusConnection *bus,
+                 int              argc,
+                 char           **argv)
+{
+  g_autoptr(GMainLoop) loop = NULL;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GVariant) properties = NULL;
+  g_autoptr(GError) error = NULL;
+  guint subscription;
+
+  if (!parse_no_options ("monitor", &argc, &argv,
+                         "Print the properties, then their changes, as JSON lines"))
+    return 2;
+
+  /* Subscribe before reading the state, so no change gets lost */
+  subscription = g_dbus_connection_signal_subscribe (bus, PP_NAME, PROPERTIES_IFACE,
+                                                     "PropertiesChanged", PP_PATH,
+                                                     PP_IFACE, G_DBUS_SIGNAL_FLAGS_NONE,
+                                                     properties_changed_cb, NULL, NULL);
+
+  reply = call_method (bus, PROPERTIES_IFACE, "GetAll",
+                       g_variant_new ("(s)", PP_IFACE),
+                       G_VARIANT_TYPE ("(a{sv})"), &error);
+  if (reply == NULL) {
+    print_error (error);
+    g_dbus_connection_signal_unsubscribe (bus, subscription);
+    return 1;
+  }
+  properties = g_variant_get_child_value (reply, 0);
+  print_json_line (properties);
+
+  loop = g_main_loop_new (NULL, FALSE);
+  g_unix_signal_add (SIGINT, quit_cb, loop);
+  g_unix_signal_add (SIGTERM, quit_cb, loop);
+  g_main_loop_run (loop);
+
+  g_dbus_connection_signal_unsubscribe (bus, subscription);
+  return 0;
+}
+
+static const struct {
+  const char *name;
+  CommandFunc func;
+  const char *help;
+} commands[] = {
+  { "list", command_list, "List available power profiles" },
+  { "list-holds", command_list_holds, "List current power profile holds" },
+  { "get", command_get, "Print the currently active power profile" },
+  { "set", command_set, "Set the currently active power profile" },
+  { "launch", command_launch, "Launch a command while holding a power profile" },
+  { "stats", command_stats, "Print statistics about profile changes" },
+  { "trace", command_trace, "Print the last profile transitions" },
+  { "monitor", command_monitor, "Stream property changes as JSON lines" },
+  { "version", command_version, "Print version information and exit" },
+};
+
+static void
+print_usage (FILE *out)
+{
+  fprintf (out, "Usage: ppdctl [COMMAND] [OPTION…]\n\nCommands:\n");
+  for (guint i = 0; i < G_N_ELEMENTS (commands); i++)
+    fprintf (out, "  %-12s %s\n", commands[i].name, commands[i].help);
+  fprintf (out, "\nUse “ppdctl COMMAND --help” to get detailed help for individual commands\n");
+}
+
+int main (int argc, char **argv)
+{
+  g_autoptr(GDBusConnection) bus = NULL;
+  g_autofree char *prgname = NULL;
+  const char *name = "list";
+  char *default_argv[] = { (char *) "list", NULL };
+
+  setlocale (LC_ALL, "");
+
+  if (argc > 1) {
+    if (g_str_equal (argv[1], "--help") || g_str_equal (argv[1], "-h")) {
+      print_usage (stdout);
+      return 0;
+    }
+    name = argv[1];
+    argc--;
+    argv++;
+  } else {
+    argc = 1;
+    argv = default_argv;
+  }
+
+  for (guint i = 0; i < G_N_ELEMENTS (commands); i++) {
+    if (!g_str_equal (commands[i].name, name))
+      continue;
+
+    prgname = g_strdup_printf ("ppdctl %s", name);
+    g_set_prgname (prgname);
+
+    /* version also works without a daemon */
+    bus = get_bus ();
+    if (bus == NULL && commands[i].func != command_version)
+      return 1;
+
+    return commands[i].func (bus, argc, argv);
+  }
+
+  g_printerr ("ppdctl: invalid command: %s\n", name);
+  print_usage (stderr);
+  return 2;
+}
@@ -0,0 +1,297 @@
+#!/usr/bin/python3
+
+# power-profiles-daemon benchmarks
+#
+# Times the daemon against synthetic umockdev trees of increasing size, and
+# prints the results as JSON, or writes them to $PPD_BENCH_OUTPUT.
+#
+# Copyright: (C) 2026 The power-profiles-daemon contributors
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+import json
+import os
+import statistics
+import sys
+import time
+import unittest
+
+from integration_test import Tests, GLib, Gio
+
+SIZES = [int(s) for s in os.getenv("PPD_BENCH_SIZES", "8,64,512").split(",")]
+CLIENTS = [int(s) for s in os.getenv("PPD_BENCH_CLIENTS", "1,8,64").split(",")]
+ROUNDS = int(os.getenv("PPD_BENCH_ROUNDS", "50"))
+PROFILES = ["performance", "balanced", "power-saver"]
+
+
+def summarize(samples):
+    """Summary of timings, in milliseconds"""
+    ordered = sorted(samples)
+    return {
+        "samples": len(ordered),
+        "mean": statistics.mean(ordered),
+        "median": statistics.median(ordered),
+        "p95": ordered[min(len(ordered) - 1, int(len(ordered) * 0.95))],
+        "max": ordered[-1],
+    }
+
+
+class Bench(Tests):
+    """Timings of the daemon on large synthetic systems"""
+
+    results = []
+
+    @classmethod
+    def tearDownClass(cls):
+        output = json.dumps({"results": cls.results}, indent=2)
+        path = os.getenv("PPD_BENCH_OUTPUT")
+        if path:
+            with open(path, "w", encoding="utf-8") as tmpf:
+                tmpf.write(output + "\n")
+        else:
+            print(output)
+        super().tearDownClass()
+
+    def record(self, name, size, unit, values, **extra):
+        result = {
+            "name": name,
+            "policies": size,
+            "connectors": self.n_connectors(size),
+            "power_supplies": self.n_power_supplies(size),
+            "unit": unit,
+        }
+        result.update(extra)
+        result.update(values)
+        self.results.append(result)
+
+    @staticmethod
+    def n_connectors(size):
+        return max(1, size // 8)
+
+    @staticmethod
+    def n_power_supplies(size):
+        return max(1, size // 16)
+
+    def create_tree(self, size):
+        """Create size CPU policies and proportionally many connectors and batteries"""
+        root = self.testbed.get_root_dir()
+
+        for i in range(size):
+            policy_dir = os.path.join(root, f"sys/devices/system/cpu/cpufreq/policy{i}/")
+            os.makedirs(policy_dir)
+            self.write_file_contents(
+                os.path.join(policy_dir, "scaling_governor"), "powersave\n"
+            )
+            self.write_file_contents(
+                os.path.join(policy_dir, "energy_performance_preference"),
+                "performance\n",
+            )
+
+        pstate_dir = os.path.join(root, "sys/devices/system/cpu/intel_pstate")
+        os.makedirs(pstate_dir)
+        self.write_file_contents(os.path.join(pstate_dir, "no_turbo"), "0\n")
+        self.write_file_contents(os.path.join(pstate_dir, "status"), "active\n")
+
+        self.create_amd_apu()
+        for i in range(self.n_connectors(size)):
+            self.testbed.add_device(
+                "drm",
+                f"card{i}-eDP-1",
+                None,
+                ["amdgpu/panel_power_savings", "0"],
+                ["DEVTYPE", "drm_connector"],
+            )
+
+        config_dir = os.path.join(root, "etc/power-profiles-daemon")
+        os.makedirs(config_dir)
+        self.write_file_contents(
+            os.path.join(config_dir, "power-profiles-daemon.conf"),
+            "[PowerSupply]\nSource=udev\n",
+        )
+        self.testbed.add_device(
+            "power_supply", "AC", None, ["type", "Mains", "online", "1"], []
+        )
+        for i in range(self.n_power_supplies(size)):
+            self.testbed.add_device(
+                "power_supply",
+                f"BAT{i}",
+                None,
+                [
+                    "type",
+                    "Battery",
+                    "status",
+                    "Charging",
+                    "capacity",
+                    "50",
+                    "energy_now",
+                    "25000000",
+                    "energy_full",
+                    "50000000",
+                ],
+                [],
+            )
+
+    def new_client(self):
+        """Open a separate connection to the system bus, as another client would"""
+        address = Gio.dbus_address_get_for_bus_sync(Gio.BusType.SYSTEM, None)
+        connection = Gio.DBusConnection.new_for_address_sync(
+            address,
+            Gio.DBusConnectionFlags.AUTHENTICATION_CLIENT
+            | Gio.DBusConnectionFlags.MESSAGE_BUS_CONNECTION,
+            None,
+            None,
+        )
+        self.addCleanup(connection.close_sync, None)
+        return connection
+
+    def wait_for(self, condition):
+        self.assert_eventually(condition, timeout=60000)
+
+    def bench_startup(self, size):
+        self.create_tree(size)
+        samples = []
+        for _ in range(max(1, ROUNDS // 10)):
+            start = time.monotonic()
+            self.start_daemon()
+            samples.append((time.monotonic() - start) * 1000)
+            self.stop_daemon(delete_profile=True)
+        self.record("startup", size, "ms", summarize(samples))
+
+    def bench_set_profile(self, size):
+        self.create_tree(size)
+        self.start_daemon()
+        samples = []
+        for i in range(ROUNDS):
+            profile = PROFILES[i % len(PROFILES)]
+            start = time.monotonic()
+            self.set_dbus_property("ActiveProfile", GLib.Variant.new_string(profile))
+            samples.append((time.monotonic() - start) * 1000)
+        self.record("set-active-profile", size, "ms", summarize(samples))
+
+    def bench_hold_release(self, size):
+        self.create_tree(size)
+        self.start_daemon()
+
+        for n_clients in CLIENTS:
+            clients = [self.new_client() for _ in range(n_clients)]
+            pending = 0
+
+            def on_released(connection, res):
+                nonlocal pending
+                connection.call_finish(res)
+                pending -= 1
+
+            def on_held(connection, res):
+                (cookie,) = connection.call_finish(res).unpack()
+                connection.call(
+                    self.PP,
+                    self.PP_PATH,
+                    self.PP_INTERFACE,
+                    "ReleaseProfile",
+                    GLib.Variant("(u)", (cookie,)),
+                    None,
+                    Gio.DBusCallFlags.NO_AUTO_START,
+                    -1,
+                    None,
+                    on_released,
+                )
+
+            start = time.monotonic()
+            for _ in range(ROUNDS):
+                for connection in clients:
+                    pending += 1
+                    connection.call(
+                        self.PP,
+                        self.PP_PATH,
+                        self.PP_INTERFACE,
+                        "HoldProfile",
+                        GLib.Variant("(sss)", ("performance", "benchmark", "bench")),
+                        GLib.VariantType("(u)"),
+                        Gio.DBusCallFlags.NO_AUTO_START,
+                        -1,
+                        None,
+                        on_held,
+                    )
+                self.wait_for(lambda: pending == 0)
+            elapsed = time.monotonic() - start
+
+            self.record(
+                "hold-release",
+                size,
+                "ops/s",
+                {"samples": ROUNDS * n_clients, "rate": ROUNDS * n_clients / elapsed},
+                clients=n_clients,
+            )
+
+    def bench_properties_changed(self, size):
+        self.create_tree(size)
+        self.start_daemon()
+
+        for n_clients in CLIENTS:
+            received = 0
+
+            def on_properties_changed(*_):
+                nonlocal received
+                received += 1
+
+            for connection in [self.new_client() for _ in range(n_clients)]:
+                connection.signal_subscribe(
+                    self.PP,
+                    "org.freedesktop.DBus.Properties",
+                    "PropertiesChanged",
+                    self.PP_PATH,
+                    None,
+                    Gio.DBusSignalFlags.NONE,
+                    on_properties_changed,
+                )
+
+            samples = []
+            for i in range(ROUNDS):
+                received = 0
+                profile = PROFILES[i % len(PROFILES)]
+                start = time.monotonic()
+                self.set_dbus_property("ActiveProfile", GLib.Variant.new_string(profile))
+                self.wait_for(lambda: received >= n_clients)
+                samples.append((time.monotonic() - start) * 1000)
+
+            self.record(
+                "properties-changed", size, "ms", summarize(samples), clients=n_clients
+            )
+
+
+def add_benchmarks():
+    """Add a test for each benchmark and tree size"""
+    for name in [n for n in dir(Bench) if n.startswith("bench_")]:
+        for size in SIZES:
+
+            def run(self, bench=getattr(Bench, name), size=size):
+                bench(self, size)
+
+            setattr(Bench, f"test_{name[len('bench_'):]}_{size}", run)
+
+
+add_benchmarks()
+
+
+if __name__ == "__main__":
+    # run ourselves under umockdev
+    if "umockdev" not in os.environ.get("LD_PRELOAD", ""):
+        os.execvp("umockdev-wrapper", ["umockdev-wrapper", sys.executable] + sys.argv)
+
+    # Only run the benchmarks, not the inherited integration tests
+    suite = unittest.TestSuite(
+        Bench(name)
+        for name in dir(Bench)
+        if name.startswith("test_") and not hasattr(Tests, name)
+    )
+    result = unittest.TextTestRunner(stream=sys.stderr).run(suite)
+    if result.errors or result.failures:
+        sys.exit(1)
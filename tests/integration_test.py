@@ -19,6 +19,7 @@
 # MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
 # GNU General Public License for more details.
 
+import json
 import os
 import subprocess
 import signal
@@ -391,6 +392,10 @@ class Tests(dbusmock.DBusTestCase):
     def powerprofilesctl_command(self):
         return self.python_coverage_commands() + [self.powerprofilesctl_path()]
 
+    def ppdctl_path(self):
+        builddir = os.getenv("top_builddir", ".")
+        return os.path.join(builddir, "src", "ppdctl")
+
     def assert_eventually(self, condition, message=None, timeout=5000, keep_checking=0):
         """Assert that condition function eventually returns True.
 
@@ -693,6 +698,276 @@ class Tests(dbusmock.DBusTestCase):
         self.assertEqual(profiles[0]["CpuDriver"], "intel_pstate")
         self.assertEqual(profiles[0]["PlatformDriver"], "platform_profile")
 
+    def test_parallel_probe(self):
+        """Drivers probed concurrently are resolved like sequential ones"""
+
+        dir1 = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/"
+        )
+        os.makedirs(dir1)
+        self.write_file_contents(os.path.join(dir1, "scaling_governor"), "powersave\n")
+        energy_prefs = os.path.join(dir1, "energy_performance_preference")
+        self.write_file_contents(energy_prefs, "performance\n")
+
+        pstate_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/intel_pstate"
+        )
+        os.makedirs(pstate_dir)
+        self.write_file_contents(os.path.join(pstate_dir, "no_turbo"), "0\n")
+        self.write_file_contents(os.path.join(pstate_dir, "status"), "active\n")
+
+        self.create_platform_profile()
+        self.start_daemon(["--parallel-probe"])
+
+        profiles = self.get_dbus_property("Profiles")
+        self.assertEqual(len(profiles), 3)
+        self.assertEqual(profiles[0]["Driver"], "multiple")
+        self.assertEqual(profiles[0]["CpuDriver"], "intel_pstate")
+        self.assertEqual(profiles[0]["PlatformDriver"], "platform_profile")
+        timings = [timing["Name"] for timing in self.get_dbus_property("Stats")["Timings"]]
+        self.assertIn("probe:intel_pstate", timings)
+        self.assertIn("probe:platform_profile", timings)
+        # Lower priority CPU drivers write to the hardware when probed
+        self.assertNotIn("probe:amd_pstate", timings)
+
+        self.assert_file_eventually_contains(energy_prefs, "balance_performance")
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("performance"))
+        self.assert_file_eventually_contains(energy_prefs, "performance")
+
+    def test_intel_pstate_scoped_hold(self):
+        """Intel P-State applies scoped holds to their policies only"""
+
+        prefs = []
+        for policy in range(2):
+            policy_dir = os.path.join(
+                self.testbed.get_root_dir(),
+                f"sys/devices/system/cpu/cpufreq/policy{policy}/",
+            )
+            os.makedirs(policy_dir)
+            self.write_file_contents(
+                os.path.join(policy_dir, "scaling_governor"), "powersave\n"
+            )
+            self.write_file_contents(
+                os.path.join(policy_dir, "related_cpus"), f"{policy}\n"
+            )
+            pref = os.path.join(policy_dir, "energy_performance_preference")
+            self.write_file_contents(pref, "performance\n")
+            prefs.append(pref)
+
+        pstate_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/intel_pstate"
+        )
+        os.makedirs(pstate_dir)
+        self.write_file_contents(os.path.join(pstate_dir, "no_turbo"), "0\n")
+        self.write_file_contents(os.path.join(pstate_dir, "status"), "active\n")
+
+        self.start_daemon()
+        for pref in prefs:
+            self.assert_file_eventually_contains(pref, "balance_performance")
+
+        cookie = self.call_dbus_method(
+            "HoldProfileScoped",
+            GLib.Variant(
+                "(sssa{sv})",
+                (
+                    "power-saver",
+                    "",
+                    "testprofile",
+                    {"Cpus": GLib.Variant.new_string("1")},
+                ),
+            ),
+        )
+        self.assertEqual(self.get_dbus_property("ActiveProfile"), "balanced")
+        self.assert_file_eventually_contains(prefs[1], "power")
+        self.assert_file_eventually_contains(prefs[0], "balance_performance")
+
+        self.call_dbus_method("ReleaseProfile", GLib.Variant("(u)", cookie))
+        self.assert_file_eventually_contains(prefs[1], "balance_performance")
+
+    def test_intel_pstate_core_classes(self):
+        """Hybrid CPUs get per core class energy preferences"""
+
+        prefs = []
+        for policy in range(2):
+            policy_dir = os.path.join(
+                self.testbed.get_root_dir(),
+                f"sys/devices/system/cpu/cpufreq/policy{policy}/",
+            )
+            os.makedirs(policy_dir)
+            self.write_file_contents(
+                os.path.join(policy_dir, "scaling_governor"), "powersave\n"
+            )
+            self.write_file_contents(
+                os.path.join(policy_dir, "related_cpus"), f"{policy}\n"
+            )
+            pref = os.path.join(policy_dir, "energy_performance_preference")
+            self.write_file_contents(pref, "performance\n")
+            prefs.append(pref)
+
+        for pmu, cpus in [("cpu_core", "0"), ("cpu_atom", "1")]:
+            pmu_dir = os.path.join(self.testbed.get_root_dir(), "sys/devices", pmu)
+            os.makedirs(pmu_dir)
+            self.write_file_contents(os.path.join(pmu_dir, "cpus"), cpus + "\n")
+
+        pstate_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/intel_pstate"
+        )
+        os.makedirs(pstate_dir)
+        self.write_file_contents(os.path.join(pstate_dir, "no_turbo"), "0\n")
+        self.write_file_contents(os.path.join(pstate_dir, "status"), "active\n")
+
+        self.start_daemon()
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("performance"))
+        self.assert_file_eventually_contains(prefs[0], "performance")
+        self.assert_file_eventually_contains(prefs[1], "balance_performance")
+        self.stop_daemon()
+
+        # override the E-cores' preference from the configuration file
+        config_dir = os.path.join(
+            self.testbed.get_root_dir(), "etc/power-profiles-daemon"
+        )
+        os.makedirs(config_dir)
+        self.write_file_contents(
+            os.path.join(config_dir, "power-profiles-daemon.conf"),
+            "[EfficiencyCores]\nEnergyPerformancePreference.power-saver=balance_power\n",
+        )
+
+        self.start_daemon()
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        self.assert_file_eventually_contains(prefs[0], "power")
+        self.assert_file_eventually_contains(prefs[1], "balance_power")
+
+    def test_intel_pstate_frequency_envelope(self):
+        """Frequency floors and ceilings as performance percentages"""
+
+        policy_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/"
+        )
+        os.makedirs(policy_dir)
+        self.write_file_contents(
+            os.path.join(policy_dir, "scaling_governor"), "powersave\n"
+        )
+        self.write_file_contents(
+            os.path.join(policy_dir, "cpuinfo_max_freq"), "4000000\n"
+        )
+        self.write_file_contents(
+            os.path.join(policy_dir, "energy_performance_preference"), "performance\n"
+        )
+
+        pstate_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/intel_pstate"
+        )
+        os.makedirs(pstate_dir)
+        self.write_file_contents(os.path.join(pstate_dir, "no_turbo"), "0\n")
+        self.write_file_contents(os.path.join(pstate_dir, "status"), "active\n")
+        min_perf_pct = os.path.join(pstate_dir, "min_perf_pct")
+        max_perf_pct = os.path.join(pstate_dir, "max_perf_pct")
+        self.write_file_contents(min_perf_pct, "10\n")
+        self.write_file_contents(max_perf_pct, "100\n")
+
+        config_dir = os.path.join(
+            self.testbed.get_root_dir(), "etc/power-profiles-daemon"
+        )
+        os.makedirs(config_dir)
+        self.write_file_contents(
+            os.path.join(config_dir, "power-profiles-daemon.conf"),
+            "[FrequencyEnvelope]\nMinFrequency.performance=50%\n"
+            "MaxFrequency.power-saver=2000000\n",
+        )
+
+        self.start_daemon()
+        # Limits that aren't configured are left to other tools
+        self.write_file_contents(max_perf_pct, "90\n")
+        self.assert_file_eventually_contains(max_perf_pct, "90\n", keep_checking=500)
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        self.assert_file_eventually_contains(max_perf_pct, "50")
+        self.assert_file_eventually_contains(min_perf_pct, "10\n")
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("performance"))
+        self.assert_file_eventually_contains(max_perf_pct, "100")
+        self.assert_file_eventually_contains(min_perf_pct, "50")
+
+        self.stop_daemon()
+        self.assert_file_eventually_contains(min_perf_pct, "10")
+
+    def test_probe_cache(self):
+        """Probe results are reused on the same hardware"""
+
+        dir1 = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/"
+        )
+        os.makedirs(dir1)
+        self.write_file_contents(os.path.join(dir1, "scaling_governor"), "powersave\n")
+        self.write_file_contents(
+            os.path.join(dir1, "energy_performance_preference"), "performance\n"
+        )
+
+        pstate_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/intel_pstate"
+        )
+        os.makedirs(pstate_dir)
+        self.write_file_contents(os.path.join(pstate_dir, "no_turbo"), "0\n")
+        self.write_file_contents(os.path.join(pstate_dir, "status"), "active\n")
+
+        self.start_daemon()
+        self.assertEqual(self.get_dbus_property("Profiles")[0]["CpuDriver"], "intel_pstate")
+        self.stop_daemon()
+        self.assertTrue(self.have_text_in_log("No probe cache for this hardware"))
+
+        config = self.read_file_contents(
+            os.path.join(self.testbed.get_root_dir(), "ppd_test_conf.ini")
+        ).decode("utf-8")
+        self.assertIn("[ProbeCache]", config)
+        self.assertIn("Drivers=intel_pstate;placeholder;", config)
+
+        self.start_daemon()
+        profiles = self.get_dbus_property("Profiles")
+        self.assertEqual(profiles[0]["CpuDriver"], "intel_pstate")
+        self.assertEqual(profiles[0]["PlatformDriver"], "placeholder")
+        self.stop_daemon()
+        self.assertTrue(self.have_text_in_log("Using cached probe results"))
+        self.assertFalse(self.have_text_in_log("Handling driver 'amd_pstate'"))
+
+        # New hardware invalidates the cache
+        self.create_platform_profile()
+        self.start_daemon()
+        profiles = self.get_dbus_property("Profiles")
+        self.assertEqual(profiles[0]["PlatformDriver"], "platform_profile")
+        self.stop_daemon()
+        self.assertFalse(self.have_text_in_log("Using cached probe results"))
+
+        # So do devices that only later probes look at
+        os.makedirs(
+            os.path.join(self.testbed.get_root_dir(), "sys/class/thermal/thermal_zone0")
+        )
+        self.start_daemon()
+        self.stop_daemon()
+        self.assertFalse(self.have_text_in_log("Using cached probe results"))
+
+        self.start_daemon(["--disable-probe-cache"])
+        self.stop_daemon()
+        self.assertFalse(self.have_text_in_log("Using cached probe results"))
+        self.assertTrue(self.have_text_in_log("Handling driver 'amd_pstate'"))
+
+    def test_state_saved_lazily(self):
+        """Profile changes in quick succession are saved once"""
+
+        self.create_platform_profile()
+        self.start_daemon()
+
+        state_path = os.path.join(self.testbed.get_root_dir(), "ppd_test_conf.ini")
+        for profile in ["performance", "power-saver", "performance"]:
+            self.set_dbus_property("ActiveProfile", GLib.Variant.new_string(profile))
+        self.assert_eventually(
+            lambda: b"Profile=performance" in self.read_file_contents(state_path)
+        )
+
+        # Pending changes are written out when quitting
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        self.stop_daemon()
+        self.assertIn(b"Profile=power-saver", self.read_file_contents(state_path))
+
     def test_intel_pstate_balance(self):
         """Intel P-State driver (balance)"""
 
@@ -821,6 +1096,34 @@ class Tests(dbusmock.DBusTestCase):
             energy_prefs, "balance_performance", timeout=3000, keep_checking=100
         )
 
+        self.assertTrue(
+            self.have_text_in_log(
+                "energy_performance_preference' changed from 'balance_performance' "
+                "to 'performance'"
+            )
+        )
+        self.assertTrue(
+            self.have_text_in_log("Firmware reset 1 of 1 attributes during suspend")
+        )
+
+        # Attributes the firmware left alone aren't rewritten
+        obj_logind.EmitSignal(
+            "org.freedesktop.login1.Manager", "PrepareForSleep", "b", [True]
+        )
+        obj_logind.EmitSignal(
+            "org.freedesktop.login1.Manager", "PrepareForSleep", "b", [False]
+        )
+        self.assert_eventually(
+            lambda: self.have_text_in_log(
+                "Firmware reset 0 of 1 attributes during suspend"
+            )
+        )
+        self.assert_eventually(
+            lambda: self.have_text_in_log(
+                "Not writing 'balance_performance' to '"
+            )
+        )
+
     def test_intel_pstate_error(self):
         """Intel P-State driver in error state"""
 
@@ -964,6 +1267,50 @@ class Tests(dbusmock.DBusTestCase):
         self.start_daemon(["--block-action", "amdgpu_panel_power"])
         self.assertNotIn("amdgpu_panel_power", self.get_dbus_property("Actions"))
 
+    def test_config_allow_deny(self):
+        """Objects left out by the configuration are never created"""
+        self.testbed.add_device(
+            "drm",
+            "card1-eDP",
+            None,
+            ["amdgpu/panel_power_savings", "0"],
+            ["DEVTYPE", "drm_connector"],
+        )
+        self.create_amd_apu()
+        self.create_platform_profile()
+
+        config_dir = os.path.join(
+            self.testbed.get_root_dir(), "etc/power-profiles-daemon"
+        )
+        os.makedirs(config_dir)
+        config = os.path.join(config_dir, "power-profiles-daemon.conf")
+        self.write_file_contents(
+            config, "[Objects]\nDeny=amdgpu_panel_power;trickle_charge\n"
+        )
+
+        self.start_daemon()
+        actions = self.get_dbus_property("Actions")
+        self.assertNotIn("amdgpu_panel_power", actions)
+        self.assertNotIn("trickle_charge", actions)
+        self.assertTrue(
+            self.have_text_in_log(
+                "Action 'amdgpu_panel_power' is denied by the configuration"
+            )
+        )
+        self.stop_daemon()
+
+        self.write_file_contents(config, "[Objects]\nAllow=placeholder\n")
+        self.start_daemon()
+        self.assertEqual(self.get_dbus_property("Actions"), [])
+        profiles = self.get_dbus_property("Profiles")
+        self.assertEqual(len(profiles), 2)
+        self.assertEqual(profiles[0]["Driver"], "placeholder")
+        self.assertTrue(
+            self.have_text_in_log(
+                "Driver 'platform_profile' is not allowed by the configuration"
+            )
+        )
+
     def test_driver_blocklist(self):
         """Test driver blocklist works"""
         # Create 2 CPUs with preferences
@@ -1098,6 +1445,13 @@ class Tests(dbusmock.DBusTestCase):
         self.assertEqual(
             self.read_sysfs_file("sys/firmware/acpi/platform_profile"), b"balanced"
         )
+        # the policy that could be written was rolled back
+        self.assertEqual(
+            self.read_sysfs_file(
+                "sys/devices/system/cpu/cpufreq/policy1/energy_performance_preference"
+            ),
+            b"balance_performance",
+        )
         self.change_immutable(prefs1, False)
 
         # test when platform driver fails to write
@@ -1185,6 +1539,51 @@ class Tests(dbusmock.DBusTestCase):
         self.assert_file_eventually_contains(energy_prefs, "power")
         self.assert_file_eventually_contains(scaling_governor, "powersave")
 
+    def test_amd_pstate_core_classes(self):
+        """Dense cores are told apart by their maximum frequency"""
+
+        cpu_dir = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/")
+        prefs = []
+        for policy, max_freq in enumerate(["5100000", "4900000", "3300000"]):
+            topology_dir = os.path.join(cpu_dir, f"cpu{policy}", "topology")
+            os.makedirs(topology_dir)
+            self.write_file_contents(
+                os.path.join(topology_dir, "thread_siblings_list"), f"{policy}\n"
+            )
+            policy_dir = os.path.join(cpu_dir, f"cpufreq/policy{policy}/")
+            os.makedirs(policy_dir)
+            self.write_file_contents(
+                os.path.join(policy_dir, "scaling_governor"), "powersave\n"
+            )
+            self.write_file_contents(
+                os.path.join(policy_dir, "related_cpus"), f"{policy}\n"
+            )
+            self.write_file_contents(
+                os.path.join(policy_dir, "cpuinfo_max_freq"), max_freq + "\n"
+            )
+            pref = os.path.join(policy_dir, "energy_performance_preference")
+            self.write_file_contents(pref, "performance\n")
+            prefs.append(pref)
+
+        pstate_dir = os.path.join(cpu_dir, "amd_pstate")
+        os.makedirs(pstate_dir)
+        self.write_file_contents(os.path.join(pstate_dir, "status"), "active\n")
+
+        # desktop PM profile
+        acpi_dir = os.path.join(self.testbed.get_root_dir(), "sys/firmware/acpi/")
+        os.makedirs(acpi_dir)
+        self.write_file_contents(os.path.join(acpi_dir, "pm_profile"), "1\n")
+
+        self.start_daemon()
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("performance"))
+        # a preferred core a little slower than the others isn't a dense one
+        self.assert_file_eventually_contains(prefs[0], "performance")
+        self.assert_file_eventually_contains(prefs[1], "performance")
+        self.assert_file_eventually_contains(prefs[2], "balance_performance")
+        self.stop_daemon()
+
+        self.assertTrue(self.have_text_in_log("3 CPUs, 3 policies, hybrid"))
+
     # pylint: disable=too-many-statements
     def test_amd_pstate_min_freq(self):
         """AMD P-State driver min freq support"""
@@ -1261,6 +1660,79 @@ class Tests(dbusmock.DBusTestCase):
         self.assert_file_eventually_contains(scaling_governor, "powersave")
         self.assert_file_eventually_contains(scaling_min_freq, "400000")
 
+    def test_amd_pstate_frequency_envelope(self):
+        """Frequency floors and ceilings from the configuration file"""
+
+        policy_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/"
+        )
+        os.makedirs(policy_dir)
+        self.write_file_contents(
+            os.path.join(policy_dir, "cpuinfo_min_freq"), "400000\n"
+        )
+        self.write_file_contents(
+            os.path.join(policy_dir, "cpuinfo_max_freq"), "4000000\n"
+        )
+        self.write_file_contents(
+            os.path.join(policy_dir, "amd_pstate_lowest_nonlinear_freq"), "1114000\n"
+        )
+        self.write_file_contents(
+            os.path.join(policy_dir, "scaling_min_freq"), "400000\n"
+        )
+        self.write_file_contents(
+            os.path.join(policy_dir, "scaling_max_freq"), "4000000\n"
+        )
+        self.write_file_contents(
+            os.path.join(policy_dir, "scaling_governor"), "powersave\n"
+        )
+        self.write_file_contents(
+            os.path.join(policy_dir, "energy_performance_preference"), "performance\n"
+        )
+
+        pstate_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/amd_pstate"
+        )
+        os.makedirs(pstate_dir)
+        self.write_file_contents(os.path.join(pstate_dir, "status"), "active\n")
+
+        acpi_dir = os.path.join(self.testbed.get_root_dir(), "sys/firmware/acpi/")
+        os.makedirs(acpi_dir)
+        self.write_file_contents(os.path.join(acpi_dir, "pm_profile"), "1\n")
+
+        config_dir = os.path.join(
+            self.testbed.get_root_dir(), "etc/power-profiles-daemon"
+        )
+        os.makedirs(config_dir)
+        self.write_file_contents(
+            os.path.join(config_dir, "power-profiles-daemon.conf"),
+            "[FrequencyEnvelope]\nMinFrequency.performance=50%\n"
+            "MaxFrequency.power-saver=1500000\n",
+        )
+
+        scaling_min_freq = os.path.join(policy_dir, "scaling_min_freq")
+        scaling_max_freq = os.path.join(policy_dir, "scaling_max_freq")
+
+        self.start_daemon()
+        self.assert_file_eventually_contains(scaling_min_freq, "1114000")
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("performance"))
+        self.assert_file_eventually_contains(scaling_min_freq, "2000000")
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        self.assert_file_eventually_contains(scaling_max_freq, "1500000")
+        self.assert_file_eventually_contains(scaling_min_freq, "400000")
+
+        # Unlimited profiles go back to the original ceiling
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("balanced"))
+        self.assert_file_eventually_contains(scaling_max_freq, "4000000")
+        self.assert_file_eventually_contains(scaling_min_freq, "1114000")
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        self.assert_file_eventually_contains(scaling_max_freq, "1500000")
+        self.stop_daemon()
+        self.assert_file_eventually_contains(scaling_max_freq, "4000000")
+        self.assert_file_eventually_contains(scaling_min_freq, "400000")
+
     # pylint: disable=too-many-statements
     def test_amd_pstate_boost(self):
         """AMD P-State driver boost support"""
@@ -1329,6 +1801,279 @@ class Tests(dbusmock.DBusTestCase):
         self.assert_file_eventually_contains(scaling_governor, "powersave")
         self.assert_file_eventually_contains(boost, "0")
 
+    def test_power_budget_temperature(self):
+        """Settings are stepped down close to the temperature limit"""
+
+        policy_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/"
+        )
+        os.makedirs(policy_dir)
+        boost = os.path.join(policy_dir, "boost")
+        self.write_file_contents(boost, "1\n")
+        scaling_governor = os.path.join(policy_dir, "scaling_governor")
+        self.write_file_contents(scaling_governor, "powersave\n")
+        energy_prefs = os.path.join(policy_dir, "energy_performance_preference")
+        self.write_file_contents(energy_prefs, "performance\n")
+        pstate_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/amd_pstate"
+        )
+        os.makedirs(pstate_dir)
+        self.write_file_contents(os.path.join(pstate_dir, "status"), "active\n")
+
+        # desktop PM profile
+        acpi_dir = os.path.join(self.testbed.get_root_dir(), "sys/firmware/acpi/")
+        os.makedirs(acpi_dir)
+        self.write_file_contents(os.path.join(acpi_dir, "pm_profile"), "1\n")
+
+        zone_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/class/thermal/thermal_zone0"
+        )
+        os.makedirs(zone_dir)
+        self.write_file_contents(os.path.join(zone_dir, "type"), "x86_pkg_temp\n")
+        temp = os.path.join(zone_dir, "temp")
+        self.write_file_contents(temp, "50000\n")
+
+        # Zones that aren't the CPU's, or have a broken sensor, are ignored
+        for zone, zone_type, zone_temp in [
+            ("thermal_zone1", "iwlwifi_1", "95000"),
+            ("thermal_zone2", "acpitz", "-274000"),
+        ]:
+            other_dir = os.path.join(
+                self.testbed.get_root_dir(), "sys/class/thermal", zone
+            )
+            os.makedirs(other_dir)
+            self.write_file_contents(os.path.join(other_dir, "type"), zone_type + "\n")
+            self.write_file_contents(os.path.join(other_dir, "temp"), zone_temp + "\n")
+
+        config_dir = os.path.join(
+            self.testbed.get_root_dir(), "etc/power-profiles-daemon"
+        )
+        os.makedirs(config_dir)
+        self.write_file_contents(
+            os.path.join(config_dir, "power-profiles-daemon.conf"),
+            "[PowerBudget]\nTemperatureLimit=90\nSampleInterval=100\n",
+        )
+
+        self.start_daemon()
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("performance"))
+        self.assert_file_eventually_contains(energy_prefs, "performance")
+        self.assert_file_eventually_contains(boost, "1", keep_checking=500)
+        self.assert_file_eventually_contains(scaling_governor, "performance")
+        self.assertEqual(self.get_dbus_property("PerformanceDegraded"), "")
+
+        # Boost goes first, then the preference is lowered step by step,
+        # which the performance governor would refuse
+        self.write_file_contents(temp, "89000\n")
+        self.assert_file_eventually_contains(boost, "0")
+        self.assert_file_eventually_contains(energy_prefs, "balance_power")
+        self.assert_file_eventually_contains(scaling_governor, "powersave")
+        self.assertEqual(self.get_dbus_property("ActiveProfile"), "performance")
+        self.assertEqual(
+            self.get_dbus_property("PerformanceDegraded"), "high-operating-temperature"
+        )
+
+        # And everything stepped back up once cooled down
+        self.write_file_contents(temp, "40000\n")
+        self.assert_file_eventually_contains(energy_prefs, "performance", timeout=3000)
+        self.assert_file_eventually_contains(boost, "1")
+        self.assert_file_eventually_contains(scaling_governor, "performance")
+        self.assert_eventually(
+            lambda: self.get_dbus_property("PerformanceDegraded") == ""
+        )
+
+    def test_auto_mode(self):
+        """Automatic profile switching follows the CPU pressure"""
+
+        policy_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/"
+        )
+        os.makedirs(policy_dir)
+        self.write_file_contents(
+            os.path.join(policy_dir, "scaling_governor"), "powersave\n"
+        )
+        self.write_file_contents(
+            os.path.join(policy_dir, "energy_performance_preference"), "performance\n"
+        )
+
+        pstate_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/intel_pstate"
+        )
+        os.makedirs(pstate_dir)
+        self.write_file_contents(os.path.join(pstate_dir, "no_turbo"), "0\n")
+        self.write_file_contents(os.path.join(pstate_dir, "status"), "active\n")
+
+        config_dir = os.path.join(
+            self.testbed.get_root_dir(), "etc/power-profiles-daemon"
+        )
+        os.makedirs(config_dir)
+        self.write_file_contents(
+            os.path.join(config_dir, "power-profiles-daemon.conf"),
+            "[Auto]\nEnabled=true\nSampleInterval=50\n",
+        )
+
+        pressure_dir = os.path.join(self.testbed.get_root_dir(), "proc/pressure")
+        os.makedirs(pressure_dir)
+        pressure = os.path.join(pressure_dir, "cpu")
+
+        def set_pressure(avg10):
+            self.write_file_contents(
+                pressure,
+                f"some avg10={avg10:.2f} avg60=0.00 avg300=0.00 total=0\n"
+                "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n",
+            )
+
+        set_pressure(50)
+        self.start_daemon()
+        self.assert_dbus_property_eventually_is("ActiveProfile", "performance")
+
+        set_pressure(0)
+        self.assert_dbus_property_eventually_is("ActiveProfile", "power-saver")
+
+        # Holds win over the automatic mode
+        set_pressure(50)
+        self.call_dbus_method(
+            "HoldProfile",
+            GLib.Variant("(sss)", ("power-saver", "testReason", "testApplication")),
+        )
+        self.assert_dbus_property_eventually_is(
+            "ActiveProfile", "power-saver", keep_checking=500
+        )
+
+        # And so do user selections, other than balanced
+        set_pressure(0)
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("performance"))
+        self.assert_dbus_property_eventually_is(
+            "ActiveProfile", "performance", keep_checking=500
+        )
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("balanced"))
+        self.assert_dbus_property_eventually_is("ActiveProfile", "power-saver")
+        self.assertTrue(self.have_text_in_log("for reason 'auto'"))
+
+    def test_custom_profile(self):
+        """Custom profiles tweak their base profile"""
+
+        policy_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/"
+        )
+        os.makedirs(policy_dir)
+        self.write_file_contents(os.path.join(policy_dir, "boost"), "0\n")
+        self.write_file_contents(
+            os.path.join(policy_dir, "cpuinfo_min_freq"), "400000\n"
+        )
+        self.write_file_contents(
+            os.path.join(policy_dir, "cpuinfo_max_freq"), "4000000\n"
+        )
+        self.write_file_contents(
+            os.path.join(policy_dir, "scaling_min_freq"), "400000\n"
+        )
+        self.write_file_contents(
+            os.path.join(policy_dir, "scaling_governor"), "powersave\n"
+        )
+        self.write_file_contents(
+            os.path.join(policy_dir, "energy_performance_preference"), "performance\n"
+        )
+
+        pstate_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/amd_pstate"
+        )
+        os.makedirs(pstate_dir)
+        self.write_file_contents(os.path.join(pstate_dir, "status"), "active\n")
+
+        acpi_dir = os.path.join(self.testbed.get_root_dir(), "sys/firmware/acpi/")
+        os.makedirs(acpi_dir)
+        self.write_file_contents(os.path.join(acpi_dir, "pm_profile"), "1\n")
+
+        profiles_dir = os.path.join(
+            self.testbed.get_root_dir(), "etc/power-profiles-daemon/profiles.d"
+        )
+        os.makedirs(profiles_dir)
+        self.write_file_contents(
+            os.path.join(profiles_dir, "latency.conf"),
+            "[Profile]\nName=latency\nInherits=performance\n"
+            "MinFrequency=max\nBoost=false\n",
+        )
+        self.write_file_contents(
+            os.path.join(profiles_dir, "invalid.conf"),
+            "[Profile]\nName=performance\nInherits=balanced\n",
+        )
+
+        self.start_daemon()
+
+        custom_profiles = self.get_dbus_property("CustomProfiles")
+        self.assertEqual(len(custom_profiles), 1)
+        self.assertEqual(custom_profiles[0]["Profile"], "latency")
+        self.assertEqual(custom_profiles[0]["Inherits"], "performance")
+        self.assertEqual(self.get_dbus_property("ActiveCustomProfile"), "")
+        self.assertTrue(self.have_text_in_log("Ignoring custom profile"))
+
+        scaling_min_freq = os.path.join(policy_dir, "scaling_min_freq")
+        boost = os.path.join(policy_dir, "boost")
+
+        self.set_dbus_property(
+            "ActiveCustomProfile", GLib.Variant.new_string("latency")
+        )
+        self.assertEqual(self.get_dbus_property("ActiveCustomProfile"), "latency")
+        self.assertEqual(self.get_dbus_property("ActiveProfile"), "performance")
+        self.assert_file_eventually_contains(scaling_min_freq, "4000000")
+        self.assert_file_eventually_contains(boost, "0")
+
+        with self.assertRaises(gi.repository.GLib.GError):
+            self.set_dbus_property(
+                "ActiveCustomProfile", GLib.Variant.new_string("unknown")
+            )
+
+        # Going back to the base profile drops the tweaks
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("performance"))
+        self.assertEqual(self.get_dbus_property("ActiveCustomProfile"), "")
+        self.assert_file_eventually_contains(scaling_min_freq, "400000")
+        self.assert_file_eventually_contains(boost, "1")
+
+        # The custom profile survives restarts
+        self.set_dbus_property(
+            "ActiveCustomProfile", GLib.Variant.new_string("latency")
+        )
+        self.stop_daemon()
+        self.start_daemon()
+        self.assertEqual(self.get_dbus_property("ActiveCustomProfile"), "latency")
+        self.assert_file_eventually_contains(scaling_min_freq, "4000000")
+
+    def test_custom_profile_platform_profile(self):
+        """Custom platform_profile values aren't taken for external changes"""
+
+        acpi_dir = os.path.join(self.testbed.get_root_dir(), "sys/firmware/acpi/")
+        os.makedirs(acpi_dir)
+        platform_profile = os.path.join(acpi_dir, "platform_profile")
+        self.write_file_contents(platform_profile, "balanced\n")
+        self.write_file_contents(
+            os.path.join(acpi_dir, "platform_profile_choices"),
+            "quiet balanced performance max-power\n",
+        )
+
+        profiles_dir = os.path.join(
+            self.testbed.get_root_dir(), "etc/power-profiles-daemon/profiles.d"
+        )
+        os.makedirs(profiles_dir)
+        self.write_file_contents(
+            os.path.join(profiles_dir, "turbo.conf"),
+            "[Profile]\nName=turbo\nInherits=performance\nPlatformProfile=max-power\n",
+        )
+
+        self.start_daemon()
+
+        self.set_dbus_property("ActiveCustomProfile", GLib.Variant.new_string("turbo"))
+        self.assert_file_eventually_contains(
+            platform_profile, "max-power", keep_checking=1000
+        )
+        self.assertEqual(self.get_dbus_property("ActiveCustomProfile"), "turbo")
+        self.assertEqual(self.get_dbus_property("ActiveProfile"), "performance")
+
+        # Changes from elsewhere are still followed
+        self.write_file_contents(platform_profile, "balanced\n")
+        self.assert_eventually(
+            lambda: self.get_dbus_property("ActiveProfile") == "balanced"
+        )
+
     def test_amd_pstate_balance(self):
         """AMD P-State driver (balance)"""
 
@@ -1370,8 +2115,150 @@ class Tests(dbusmock.DBusTestCase):
         energy_prefs = os.path.join(dir1, "energy_performance_preference")
         self.assert_file_eventually_contains(energy_prefs, "balance_performance")
 
-        scaling_governor = os.path.join(dir1, "scaling_governor")
-        self.assert_file_eventually_contains(scaling_governor, "powersave")
+        scaling_governor = os.path.join(dir1, "scaling_governor")
+        self.assert_file_eventually_contains(scaling_governor, "powersave")
+
+    def test_amd_pstate_skip_unchanged_writes(self):
+        """AMD P-State driver doesn't rewrite unchanged attributes"""
+
+        dir1 = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/"
+        )
+        os.makedirs(dir1)
+        gov_path = os.path.join(dir1, "scaling_governor")
+        self.write_file_contents(gov_path, "performance\n")
+        energy_prefs = os.path.join(dir1, "energy_performance_preference")
+        self.write_file_contents(energy_prefs, "performance\n")
+        pstate_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/amd_pstate"
+        )
+        os.makedirs(pstate_dir)
+        self.write_file_contents(os.path.join(pstate_dir, "status"), "active\n")
+
+        # desktop PM profile
+        dir2 = os.path.join(self.testbed.get_root_dir(), "sys/firmware/acpi/")
+        os.makedirs(dir2)
+        self.write_file_contents(os.path.join(dir2, "pm_profile"), "1\n")
+
+        self.start_daemon()
+
+        self.assert_file_eventually_contains(energy_prefs, "balance_performance")
+        self.assert_file_eventually_contains(gov_path, "powersave")
+
+        # The governor is the same in balanced and power-saver
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        self.assert_file_eventually_contains(energy_prefs, "power")
+        self.assertTrue(
+            self.have_text_in_log(f"Not writing 'powersave' to '{gov_path}'")
+        )
+
+        # Changed values are still written
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("performance"))
+        self.assert_file_eventually_contains(gov_path, "performance")
+        self.assert_file_eventually_contains(energy_prefs, "performance")
+
+        # Values changed behind our back are rewritten on user changes
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("balanced"))
+        self.assert_file_eventually_contains(gov_path, "powersave")
+        self.write_file_contents(gov_path, "performance\n")
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        self.assert_file_eventually_contains(gov_path, "powersave")
+
+    def test_amd_pstate_scoped_hold(self):
+        """Holds scoped to the CPUs of a cgroup"""
+
+        prefs = []
+        for policy in range(4):
+            policy_dir = os.path.join(
+                self.testbed.get_root_dir(),
+                f"sys/devices/system/cpu/cpufreq/policy{policy}/",
+            )
+            os.makedirs(policy_dir)
+            self.write_file_contents(
+                os.path.join(policy_dir, "scaling_governor"), "powersave\n"
+            )
+            self.write_file_contents(
+                os.path.join(policy_dir, "related_cpus"), f"{policy}\n"
+            )
+            pref = os.path.join(policy_dir, "energy_performance_preference")
+            self.write_file_contents(pref, "performance\n")
+            prefs.append(pref)
+        pstate_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/amd_pstate"
+        )
+        os.makedirs(pstate_dir)
+        self.write_file_contents(os.path.join(pstate_dir, "status"), "active\n")
+
+        # desktop PM profile
+        acpi_dir = os.path.join(self.testbed.get_root_dir(), "sys/firmware/acpi/")
+        os.makedirs(acpi_dir)
+        self.write_file_contents(os.path.join(acpi_dir, "pm_profile"), "1\n")
+
+        # we are in a cgroup that can only run on the last 2 CPUs
+        proc_dir = os.path.join(self.testbed.get_root_dir(), f"proc/{os.getpid()}")
+        os.makedirs(proc_dir, exist_ok=True)
+        self.write_file_contents(
+            os.path.join(proc_dir, "cgroup"), "0::/test.slice/app.scope\n"
+        )
+        cgroup_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/fs/cgroup/test.slice"
+        )
+        os.makedirs(cgroup_dir, exist_ok=True)
+        self.write_file_contents(
+            os.path.join(cgroup_dir, "cpuset.cpus.effective"), "2-3\n"
+        )
+
+        self.start_daemon()
+        for pref in prefs:
+            self.assert_file_eventually_contains(pref, "balance_performance")
+
+        self.call_dbus_method(
+            "HoldProfileScoped",
+            GLib.Variant("(sssa{sv})", ("performance", "compiling", "testprofile", {})),
+        )
+        self.assertEqual(self.get_dbus_property("ActiveProfile"), "balanced")
+        holds = self.get_dbus_property("ActiveProfileHolds")
+        self.assertEqual(len(holds), 1)
+        self.assertEqual(holds[0]["Cpus"], [2, 3])
+        self.assert_file_eventually_contains(prefs[2], "performance")
+        self.assert_file_eventually_contains(prefs[3], "performance")
+        self.assert_file_eventually_contains(prefs[0], "balance_performance")
+        self.assert_file_eventually_contains(prefs[1], "balance_performance")
+
+        # Changing the active profile releases scoped holds too
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        self.assertEqual(self.get_dbus_property("ActiveProfileHolds"), [])
+        for pref in prefs:
+            self.assert_file_eventually_contains(pref, "power")
+
+        # Explicit CPU list, released on request
+        cookie = self.call_dbus_method(
+            "HoldProfileScoped",
+            GLib.Variant(
+                "(sssa{sv})",
+                (
+                    "performance",
+                    "",
+                    "testprofile",
+                    {"Cpus": GLib.Variant.new_string("0")},
+                ),
+            ),
+        )
+        self.assert_file_eventually_contains(prefs[0], "performance")
+        self.assert_file_eventually_contains(prefs[1], "power")
+        self.assertEqual(self.get_dbus_property("ActiveProfile"), "power-saver")
+        self.call_dbus_method("ReleaseProfile", GLib.Variant("(u)", cookie))
+        self.assert_file_eventually_contains(prefs[0], "power")
+        self.assertEqual(self.get_dbus_property("ActiveProfileHolds"), [])
+
+        with self.assertRaises(gi.repository.GLib.GError):
+            self.call_dbus_method(
+                "HoldProfileScoped",
+                GLib.Variant(
+                    "(sssa{sv})",
+                    ("performance", "", "", {"Cpus": GLib.Variant.new_string("x")}),
+                ),
+            )
 
     def test_amd_pstate_error(self):
         """AMD P-State driver in error state"""
@@ -1690,6 +2577,189 @@ class Tests(dbusmock.DBusTestCase):
         self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
         self.assert_sysfs_attr_eventually_is(card, amdgpu_dpm, "low")
 
+    def test_gpu_freq(self):
+        """i915 frequency range follows the profile"""
+        card = self.testbed.add_device(
+            "drm",
+            "card0",
+            None,
+            [
+                "gt_min_freq_mhz",
+                "300\n",
+                "gt_max_freq_mhz",
+                "1300\n",
+                "gt_boost_freq_mhz",
+                "1300\n",
+                "gt_RP0_freq_mhz",
+                "1300\n",
+                "gt_RP1_freq_mhz",
+                "700\n",
+                "gt_RPn_freq_mhz",
+                "300\n",
+            ],
+            ["DEVTYPE", "drm_minor"],
+        )
+
+        self.start_daemon()
+        self.assertIn("gpu_freq", self.get_dbus_property("Actions"))
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        self.assert_sysfs_attr_eventually_is(card, "gt_max_freq_mhz", "700")
+        self.assert_sysfs_attr_eventually_is(card, "gt_boost_freq_mhz", "700")
+        self.assert_sysfs_attr_eventually_is(card, "gt_min_freq_mhz", "300")
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("performance"))
+        self.assert_sysfs_attr_eventually_is(card, "gt_max_freq_mhz", "1300")
+        self.assert_sysfs_attr_eventually_is(card, "gt_boost_freq_mhz", "1300")
+        self.assert_sysfs_attr_eventually_is(card, "gt_min_freq_mhz", "700")
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("balanced"))
+        self.assert_sysfs_attr_eventually_is(card, "gt_max_freq_mhz", "1300")
+        self.assert_sysfs_attr_eventually_is(card, "gt_boost_freq_mhz", "1300")
+        self.assert_sysfs_attr_eventually_is(card, "gt_min_freq_mhz", "300")
+
+        # Stopping the daemon restores the original range
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        self.assert_sysfs_attr_eventually_is(card, "gt_max_freq_mhz", "700")
+        self.stop_daemon()
+        self.assert_sysfs_attr_eventually_is(card, "gt_max_freq_mhz", "1300")
+        self.assert_sysfs_attr_eventually_is(card, "gt_boost_freq_mhz", "1300")
+
+    def test_pcie_power(self):
+        """PCIe link and NVMe power states follow the profile"""
+        latency = "power/pm_qos_latency_tolerance_us"
+        root_port = self.testbed.add_device(
+            "pci", "0000:00:1c.0", None, ["power/control", "auto\n"], []
+        )
+        pci = self.testbed.add_device(
+            "pci", "0000:01:00.0", root_port, ["power/control", "on\n"], []
+        )
+        nvme = self.testbed.add_device("nvme", "nvme0", pci, [latency, "100000\n"], [])
+        # Not upstream of a drive, so left alone
+        other = self.testbed.add_device(
+            "pci", "0000:00:14.0", None, ["power/control", "on\n"], []
+        )
+        aspm_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/module/pcie_aspm/parameters"
+        )
+        os.makedirs(aspm_dir)
+        aspm_policy = os.path.join(aspm_dir, "policy")
+        self.write_file_contents(
+            aspm_policy, "[default] performance powersave powersupersave\n"
+        )
+
+        self.start_daemon()
+        self.assertIn("pcie_power", self.get_dbus_property("Actions"))
+
+        # Nothing changed until a profile asks for it
+        self.assert_sysfs_attr_eventually_is(nvme, latency, "100000")
+        self.assert_sysfs_attr_eventually_is(pci, "power/control", "on")
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        self.assert_file_eventually_contains(aspm_policy, "powersupersave")
+        self.assert_sysfs_attr_eventually_is(nvme, latency, "any")
+        self.assert_sysfs_attr_eventually_is(pci, "power/control", "auto")
+        self.assertTrue(
+            self.have_text_in_log(f"{root_port}/power/control already set to auto")
+        )
+        self.assert_sysfs_attr_eventually_is(
+            other, "power/control", "on", keep_checking=200
+        )
+
+        # Hotplugged drives get the current profile's settings
+        pci2 = self.testbed.add_device(
+            "pci", "0000:02:00.0", root_port, ["power/control", "on\n"], []
+        )
+        self.testbed.add_device("nvme", "nvme1", pci2, [latency, "100000\n"], [])
+        self.assert_sysfs_attr_eventually_is(pci2, "power/control", "auto")
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("performance"))
+        self.assert_file_eventually_contains(aspm_policy, "performance")
+        self.assert_sysfs_attr_eventually_is(nvme, latency, "0")
+        self.assert_sysfs_attr_eventually_is(pci, "power/control", "on")
+        self.assert_sysfs_attr_eventually_is(root_port, "power/control", "on")
+
+        # balanced goes back to the original values
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("balanced"))
+        self.assert_file_eventually_contains(aspm_policy, "default")
+        self.assert_sysfs_attr_eventually_is(nvme, latency, "100000")
+        self.assert_sysfs_attr_eventually_is(pci, "power/control", "on")
+        self.assert_sysfs_attr_eventually_is(pci2, "power/control", "on")
+        self.assert_sysfs_attr_eventually_is(root_port, "power/control", "auto")
+        self.assert_sysfs_attr_eventually_is(other, "power/control", "on")
+
+    def test_pcie_power_aspm_locked(self):
+        """The rest still applies when the firmware keeps ASPM control"""
+        latency = "power/pm_qos_latency_tolerance_us"
+        nvme = self.testbed.add_device("nvme", "nvme0", None, [latency, "100000\n"], [])
+        aspm_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/module/pcie_aspm/parameters"
+        )
+        os.makedirs(aspm_dir)
+        aspm_policy = os.path.join(aspm_dir, "policy")
+        self.write_file_contents(
+            aspm_policy, "[default] performance powersave powersupersave\n"
+        )
+        self.change_immutable(aspm_policy, True)
+
+        self.start_daemon()
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        self.assertEqual(self.get_dbus_property("ActiveProfile"), "power-saver")
+        self.assert_sysfs_attr_eventually_is(nvme, latency, "any")
+        self.assertTrue(self.have_text_in_log("ASPM policy can't be changed"))
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("performance"))
+        self.assertEqual(self.get_dbus_property("ActiveProfile"), "performance")
+        self.assert_sysfs_attr_eventually_is(nvme, latency, "0")
+        self.assert_file_eventually_contains(
+            aspm_policy, "[default] performance powersave powersupersave\n"
+        )
+
+    def test_cpu_topology(self):
+        """CPU topology is parsed from the first processor in cpuinfo"""
+        self.testbed.add_device(
+            "drm",
+            "card0",
+            None,
+            ["device/power_dpm_force_performance_level", "auto\n"],
+            ["DEVTYPE", "drm_minor"],
+        )
+
+        proc_dir = os.path.join(self.testbed.get_root_dir(), "proc/")
+        os.makedirs(proc_dir)
+        flags = " ".join(f"flag{i}" for i in range(200))
+        processor = (
+            "processor\t: {}\nvendor_id\t: AuthenticAMD\ncpu family\t: 25\n"
+            "model\t\t: 80\nflags\t\t: {}\nmodel name\t: vendor_id : GenuineIntel\n\n"
+        )
+        self.write_file_contents(
+            os.path.join(proc_dir, "cpuinfo"),
+            processor.format(0, flags) + processor.format(1, flags),
+        )
+
+        cpu_dir = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/")
+        for cpu in range(4):
+            topology_dir = os.path.join(cpu_dir, f"cpu{cpu}", "topology")
+            os.makedirs(topology_dir)
+            siblings = "0-1" if cpu < 2 else f"{cpu}"
+            self.write_file_contents(
+                os.path.join(topology_dir, "thread_siblings_list"), siblings + "\n"
+            )
+        for pmu, cpus in [("cpu_core", "0-1"), ("cpu_atom", "2-3")]:
+            pmu_dir = os.path.join(self.testbed.get_root_dir(), "sys/devices", pmu)
+            os.makedirs(pmu_dir)
+            self.write_file_contents(os.path.join(pmu_dir, "cpus"), cpus + "\n")
+
+        self.start_daemon()
+        self.assertIn("amdgpu_dpm", self.get_dbus_property("Actions"))
+        self.stop_daemon()
+
+        self.assertTrue(
+            self.have_text_in_log(
+                "CPU topology: vendor 'AuthenticAMD', family 25, model 80, 4 CPUs, 0 policies, hybrid"
+            )
+        )
+
     def test_amdgpu_panel_power(self):
         """Verify AMDGPU Panel power actions"""
         amdgpu_panel_power_savings = "amdgpu/panel_power_savings"
@@ -1771,6 +2841,103 @@ class Tests(dbusmock.DBusTestCase):
         # verify power saver didn't get updated for it
         self.assert_sysfs_attr_eventually_is(edp3, amdgpu_panel_power_savings, "0")
 
+    def test_battery_bands(self):
+        """Battery level changes are only forwarded when crossing a threshold"""
+        amdgpu_panel_power_savings = "amdgpu/panel_power_savings"
+        edp = self.testbed.add_device(
+            "drm",
+            "card1-eDP",
+            None,
+            ["status", "connected\n", amdgpu_panel_power_savings, "0"],
+            ["DEVTYPE", "drm_connector"],
+        )
+
+        self.create_amd_apu()
+
+        _, obj, _ = self.start_dbus_template(
+            "upower",
+            {"DaemonVersion": "0.99", "OnBattery": True},
+        )
+
+        def set_battery_level(percentage):
+            obj.SetDeviceProperties(
+                "/org/freedesktop/UPower/devices/DisplayDevice",
+                {"Percentage": dbus.Double(percentage, variant_level=1)},
+            )
+
+        set_battery_level(45)
+        self.start_daemon()
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("balanced"))
+        self.assert_sysfs_attr_eventually_is(edp, amdgpu_panel_power_savings, "0")
+
+        # same band, the action isn't told about it
+        set_battery_level(40)
+        set_battery_level(29)
+        self.assert_sysfs_attr_eventually_is(edp, amdgpu_panel_power_savings, "1")
+
+        # back on the threshold isn't enough to go up a band
+        set_battery_level(30)
+        set_battery_level(31.5)
+        self.assert_sysfs_attr_eventually_is(edp, amdgpu_panel_power_savings, "0")
+
+        self.stop_daemon()
+
+        self.assertTrue(self.have_text_in_log("(29.000000)"))
+        self.assertTrue(self.have_text_in_log("(31.500000)"))
+        self.assertFalse(self.have_text_in_log("(40.000000)"))
+        self.assertFalse(self.have_text_in_log("(30.000000)"))
+
+    def test_battery_config(self):
+        """Battery thresholds and hysteresis from the configuration file"""
+        amdgpu_panel_power_savings = "amdgpu/panel_power_savings"
+        edp = self.testbed.add_device(
+            "drm",
+            "card1-eDP",
+            None,
+            ["status", "connected\n", amdgpu_panel_power_savings, "0"],
+            ["DEVTYPE", "drm_connector"],
+        )
+
+        self.create_amd_apu()
+
+        config_dir = os.path.join(
+            self.testbed.get_root_dir(), "etc/power-profiles-daemon"
+        )
+        os.makedirs(config_dir)
+        self.write_file_contents(
+            os.path.join(config_dir, "power-profiles-daemon.conf"),
+            "[Battery]\nHysteresis=5\nThresholds.amdgpu_panel_power=15;25;40\n",
+        )
+
+        _, obj, _ = self.start_dbus_template(
+            "upower",
+            {"DaemonVersion": "0.99", "OnBattery": True},
+        )
+
+        def set_battery_level(percentage):
+            obj.SetDeviceProperties(
+                "/org/freedesktop/UPower/devices/DisplayDevice",
+                {"Percentage": dbus.Double(percentage, variant_level=1)},
+            )
+
+        set_battery_level(35)
+        self.start_daemon()
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("balanced"))
+        self.assert_sysfs_attr_eventually_is(edp, amdgpu_panel_power_savings, "0")
+
+        set_battery_level(24)
+        self.assert_sysfs_attr_eventually_is(edp, amdgpu_panel_power_savings, "1")
+
+        # within the hysteresis
+        set_battery_level(28)
+        set_battery_level(31)
+        self.assert_sysfs_attr_eventually_is(edp, amdgpu_panel_power_savings, "0")
+
+        self.stop_daemon()
+
+        self.assertTrue(self.have_text_in_log("(24.000000)"))
+        self.assertFalse(self.have_text_in_log("(28.000000)"))
+
     def test_trickle_charge_system(self):
         """Trickle power_supply charge type"""
 
@@ -1929,6 +3096,61 @@ class Tests(dbusmock.DBusTestCase):
             self.read_sysfs_file("sys/firmware/acpi/platform_profile"), b"quiet"
         )
 
+    def test_set_profile_back_to_back(self):
+        """Back-to-back profile switches settle on the last one"""
+        self.create_platform_profile()
+        self.start_daemon()
+        self.ensure_dbus_properties_proxies()
+
+        replies = []
+
+        def reply_cb(proxy, res):
+            replies.append(proxy.call_finish(res))
+
+        for profile in ["power-saver", "performance", "power-saver", "balanced"]:
+            self.props_proxy.call(
+                "Set",
+                GLib.Variant(
+                    "(ssv)",
+                    (self.PP, "ActiveProfile", GLib.Variant.new_string(profile)),
+                ),
+                Gio.DBusCallFlags.NO_AUTO_START,
+                -1,
+                None,
+                reply_cb,
+            )
+
+        self.assert_eventually(lambda: len(replies) == 4)
+        self.assertEqual(self.get_dbus_property("ActiveProfile"), "balanced")
+        self.assertEqual(
+            self.read_sysfs_file("sys/firmware/acpi/platform_profile"), b"balanced"
+        )
+
+    def test_properties_changed_coalesced(self):
+        """Property changes from one request are sent in a single signal"""
+        self.create_platform_profile()
+        self.start_daemon()
+
+        emissions = []
+
+        def properties_changed_cb(_, changed_properties, invalidated):
+            emissions.append(set(changed_properties.unpack().keys()))
+
+        self.addCleanup(
+            self.proxy.disconnect,
+            self.proxy.connect("g-properties-changed", properties_changed_cb),
+        )
+
+        self.call_dbus_method(
+            "HoldProfile",
+            GLib.Variant("(sss)", ("performance", "testReason", "testApplication")),
+        )
+        self.assert_eventually(
+            lambda: {"ActiveProfile", "ActiveProfileHolds"} in emissions
+        )
+        self.assertFalse({"ActiveProfile"} in emissions)
+        self.assertFalse({"ActiveProfileHolds"} in emissions)
+
     def test_hold_release_profile(self):
         self.create_platform_profile()
         self.start_daemon()
@@ -2449,6 +3671,71 @@ class Tests(dbusmock.DBusTestCase):
         upowerd_obj.Set("org.freedesktop.UPower", "OnBattery", True)
         self.assert_file_eventually_contains(energy_prefs, "balance_power")
 
+    def test_power_supply_udev(self):
+        """Power supplies tracked from udev instead of UPower"""
+
+        dir1 = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/"
+        )
+        os.makedirs(dir1)
+        self.write_file_contents(os.path.join(dir1, "scaling_governor"), "powersave\n")
+        energy_prefs = os.path.join(dir1, "energy_performance_preference")
+        self.write_file_contents(energy_prefs, "performance\n")
+
+        pstate_dir = os.path.join(
+            self.testbed.get_root_dir(), "sys/devices/system/cpu/intel_pstate"
+        )
+        os.makedirs(pstate_dir)
+        self.write_file_contents(os.path.join(pstate_dir, "status"), "active\n")
+
+        config_dir = os.path.join(
+            self.testbed.get_root_dir(), "etc/power-profiles-daemon"
+        )
+        os.makedirs(config_dir)
+        self.write_file_contents(
+            os.path.join(config_dir, "power-profiles-daemon.conf"),
+            "[PowerSupply]\nSource=udev\n",
+        )
+
+        ac = self.testbed.add_device(
+            "power_supply", "AC", None, ["type", "Mains", "online", "0"], []
+        )
+        for name, capacity, energy_now, energy_full in [
+            ("BAT0", "80", "40000000", "50000000"),
+            ("BAT1", "20", "30000000", "150000000"),
+        ]:
+            self.testbed.add_device(
+                "power_supply",
+                name,
+                None,
+                [
+                    "type",
+                    "Battery",
+                    "status",
+                    "Discharging",
+                    "capacity",
+                    capacity,
+                    "energy_now",
+                    energy_now,
+                    "energy_full",
+                    energy_full,
+                ],
+                [],
+            )
+
+        self.start_daemon()
+        self.assertTrue(self.have_text_in_log("tracking power supplies from udev"))
+        self.assertTrue(self.have_text_in_log("battery level is 35.000000"))
+        self.assert_file_eventually_contains(energy_prefs, "balance_power")
+
+        self.testbed.set_attribute(ac, "online", "1")
+        self.testbed.uevent(ac, "change")
+        self.assert_file_eventually_contains(energy_prefs, "balance_performance")
+
+        self.testbed.set_attribute(ac, "online", "0")
+        self.testbed.uevent(ac, "change")
+        self.assert_file_eventually_contains(energy_prefs, "balance_power")
+
     def test_intel_pstate_noturbo(self):
         """Intel P-State driver (balance)"""
 
@@ -2518,6 +3805,135 @@ class Tests(dbusmock.DBusTestCase):
         self.assertEqual(cmd.returncode, 0)
         self.assertEqual(cmd.stdout, b"power-saver\n")
 
+    def test_powerprofilesctl_stats_command(self):
+        """Check the Stats property and powerprofilesctl stats command"""
+
+        self.start_daemon()
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        self.assertEqual(self.get_dbus_property("ActiveProfile"), "power-saver")
+
+        stats = self.get_dbus_property("Stats")
+        timings = {timing["Name"]: timing for timing in stats["Timings"]}
+        self.assertIn("probe", timings)
+        self.assertEqual(timings["probe"]["Count"], 1)
+        self.assertGreaterEqual(timings["transition"]["Count"], 2)
+        self.assertLessEqual(
+            timings["transition"]["P50"], timings["transition"]["Max"]
+        )
+
+        tool_cmd = self.powerprofilesctl_command()
+        cmd = subprocess.run(tool_cmd + ["stats"], capture_output=True, check=True)
+        self.assertEqual(cmd.returncode, 0)
+        self.assertIn("transition:", cmd.stdout.decode("utf-8"))
+
+    def test_powerprofilesctl_trace_command(self):
+        """Check the GetTrace method and powerprofilesctl trace command"""
+
+        self.create_platform_profile()
+        self.start_daemon()
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        self.assertEqual(self.get_dbus_property("ActiveProfile"), "power-saver")
+
+        transitions = self.call_dbus_method("GetTrace", None).unpack()[0]
+        last = transitions[-1]
+        self.assertEqual(last["To"], "power-saver")
+        self.assertEqual(last["Reason"], "user")
+        self.assertEqual(last["Result"], "completed")
+        self.assertGreaterEqual(last["Writes"], 1)
+        self.assertTrue(last["SlowestWrite"].endswith("platform_profile"))
+        self.assertEqual(last["FailedWrites"], 0)
+
+        tool_cmd = self.powerprofilesctl_command()
+        cmd = subprocess.run(tool_cmd + ["trace"], capture_output=True, check=True)
+        self.assertEqual(cmd.returncode, 0)
+        self.assertIn("Result:   completed", cmd.stdout.decode("utf-8"))
+
+    def test_ppdctl_commands(self):
+        """Check the native client's commands match powerprofilesctl"""
+
+        self.start_daemon()
+
+        cmd = subprocess.run(
+            [self.ppdctl_path(), "get"], capture_output=True, check=True
+        )
+        self.assertEqual(cmd.stdout, b"balanced\n")
+
+        subprocess.run([self.ppdctl_path(), "set", "power-saver"], check=True)
+        self.assertEqual(self.get_dbus_property("ActiveProfile"), "power-saver")
+
+        for command in ["list", "list-holds", "stats", "trace", "version"]:
+            native = subprocess.run(
+                [self.ppdctl_path(), command], capture_output=True, check=True
+            )
+            python = subprocess.run(
+                self.powerprofilesctl_command() + [command],
+                capture_output=True,
+                check=True,
+            )
+            self.assertEqual(native.stdout, python.stdout)
+
+        with self.assertRaises(subprocess.CalledProcessError):
+            subprocess.run(
+                [self.ppdctl_path(), "list", "--invalid-argument"],
+                capture_output=True,
+                check=True,
+            )
+
+    def test_ppdctl_monitor(self):
+        """Check the native client streams property changes as JSON lines"""
+
+        self.start_daemon()
+
+        with subprocess.Popen(
+            [self.ppdctl_path(), "monitor"], stdout=subprocess.PIPE
+        ) as monitor:
+            state = json.loads(monitor.stdout.readline())
+            self.assertEqual(state["ActiveProfile"], "balanced")
+            self.assertIn("Profiles", state)
+
+            self.set_dbus_property(
+                "ActiveProfile", GLib.Variant.new_string("power-saver")
+            )
+            while True:
+                change = json.loads(monitor.stdout.readline())
+                if "ActiveProfile" in change:
+                    break
+            self.assertEqual(change["ActiveProfile"], "power-saver")
+
+            monitor.terminate()
+            self.assertEqual(monitor.wait(), 0)
+
+    def test_get_state(self):
+        """Check the GetState method returns all properties, once per change"""
+
+        self.start_daemon()
+
+        generation, state = self.call_dbus_method(
+            "GetState", GLib.Variant("(t)", (0,))
+        ).unpack()
+        self.assertGreater(generation, 0)
+        self.assertEqual(state["ActiveProfile"], "balanced")
+        self.assertEqual(state["Profiles"], self.get_dbus_property("Profiles"))
+        self.assertIn("ActiveProfileHolds", state)
+        self.assertIn("Actions", state)
+        self.assertIn("PerformanceDegraded", state)
+
+        # Nothing changed
+        unchanged, state = self.call_dbus_method(
+            "GetState", GLib.Variant("(t)", (generation,))
+        ).unpack()
+        self.assertEqual(unchanged, generation)
+        self.assertEqual(state, {})
+
+        self.set_dbus_property("ActiveProfile", GLib.Variant.new_string("power-saver"))
+        changed, state = self.call_dbus_method(
+            "GetState", GLib.Variant("(t)", (generation,))
+        ).unpack()
+        self.assertGreater(changed, generation)
+        self.assertEqual(state["ActiveProfile"], "power-saver")
+
     def test_powerprofilesctl_error(self):
         """Check that powerprofilesctl returns 1 rather than an exception on error"""
 